@@ -0,0 +1,391 @@
+/*
+ * NAME
+ *   bench - measure how fast smallsh launches and reaps commands
+ * SYNOPSIS
+ *   bench [-n commands] [-l fork|spawn|zygote] [path to smallsh]
+ * DESCRIPTION
+ *   Writes a script for each workload, runs smallsh on it once untraced to measure sustained commands per second, then once more
+ *   with SMALLSH_TRACE on to collect per-command launch latency. Launch latency runs from the start of the shell's dispatch phase
+ *   to the child's exec (fork and zygote launchers) or to posix_spawnp() returning (spawn launcher), and is reported as p50 and
+ *   p99. Every launcher is measured unless -l picks one. The workloads are trivial foreground commands, a burst of background jobs,
+ *   commands with input and output redirection, and commands with very long argument lists.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+
+
+#define LONG_ARGUMENT_COUNT 2000	// Arguments per command in the longargs workload
+
+char redirectInput[] = "/tmp/smallsh-bench-inXXXXXX";	// File the redirect workload reads from
+char redirectOutput[] = "/tmp/smallsh-bench-outXXXXXX";	// And the one it writes to
+
+
+struct workload {
+	char* name;
+	void (*writeCommand)(FILE* script);	// Writes one command line
+	int divisor;				// Run commands / divisor lines, for workloads where one line is expensive
+};
+
+
+
+// One line per workload, kept next to the table that uses them
+
+void writeTrueCommand(FILE* script) {
+	fprintf(script, "/bin/true\n");
+}
+
+void writeBackgroundCommand(FILE* script) {
+	fprintf(script, "/bin/true &\n");
+}
+
+void writeRedirectCommand(FILE* script) {
+	fprintf(script, "/bin/cat < %s > %s\n", redirectInput, redirectOutput);
+}
+
+void writeLongArgumentCommand(FILE* script) {
+
+	fprintf(script, "/bin/true");
+
+	for(int index = 0; index < LONG_ARGUMENT_COUNT; index++) {
+		fprintf(script, " argument%04d", index);
+	}
+
+	fprintf(script, "\n");
+}
+
+struct workload workloads[] = {
+	{"true", writeTrueCommand, 1},
+	{"background", writeBackgroundCommand, 1},
+	{"redirect", writeRedirectCommand, 1},
+	{"longargs", writeLongArgumentCommand, 10},
+	{NULL, NULL, 0}
+};
+
+
+
+/*
+ * NAME
+ *   compareLatency - qsort() comparison for unsigned long long values
+ * SYNOPSIS
+ *   compareLatency(const void* first, const void* second)
+ * DESCRIPTION
+ *   Sorts into ascending order. Used for both the latency samples and the dispatch timestamps.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int compareLatency(const void* first, const void* second) {
+
+	unsigned long long firstValue = *(const unsigned long long*)first;
+	unsigned long long secondValue = *(const unsigned long long*)second;
+
+	return (firstValue > secondValue) - (firstValue < secondValue);
+}
+
+
+
+/*
+ * NAME
+ *   runShell - run smallsh on a script and wait for it
+ * SYNOPSIS
+ *   runShell(char* smallshPath, char* scriptPath, char* launcher, char* tracePath)
+ * DESCRIPTION
+ *   stdout goes to /dev/null so the background pid messages don't flood the terminal. tracePath is passed as SMALLSH_TRACE when
+ *   it isn't NULL. Returns the wall time in seconds, or -1 if smallsh couldn't be run.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+double runShell(char* smallshPath, char* scriptPath, char* launcher, char* tracePath) {
+
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	pid_t childPID = fork();
+
+	if(childPID == -1) {
+		perror("Major problem creating child!\n");
+		exit(1);
+	}
+
+	else if(childPID == 0) {
+
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(devNull, 1);
+
+		setenv("SMALLSH_LAUNCHER", launcher, 1);
+
+		if(tracePath != NULL) {
+			setenv("SMALLSH_TRACE", tracePath, 1);
+		}
+
+		execl(smallshPath, smallshPath, scriptPath, (char*)NULL);
+		perror(smallshPath);
+		_exit(127);
+	}
+
+	int childExitMethod;
+	waitpid(childPID, &childExitMethod, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+	if(!WIFEXITED(childExitMethod) || WEXITSTATUS(childExitMethod) == 127) {
+		return -1;
+	}
+
+	return (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+}
+
+
+
+/*
+ * NAME
+ *   readLaunchLatencies - turn a smallsh trace into launch latency samples
+ * SYNOPSIS
+ *   readLaunchLatencies(char* tracePath, size_t* sampleCount)
+ * DESCRIPTION
+ *   Every dispatch line marks a command starting. Every child exec line (fork and zygote launchers), or the end of every spawn line (spawn
+ *   launcher), marks a command launched, and is matched with the latest dispatch that started before it. Returns a sorted malloc()ed
+ *   array of latencies in nanoseconds and sets sampleCount.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+unsigned long long* readLaunchLatencies(char* tracePath, size_t* sampleCount) {
+
+	FILE* trace = fopen(tracePath, "r");
+
+	size_t dispatchCount = 0, launchCount = 0, capacity = 1024;
+	unsigned long long* dispatchTimes = malloc(capacity * sizeof(unsigned long long));
+	unsigned long long* launchTimes = malloc(capacity * sizeof(unsigned long long));
+
+	if(trace == NULL || dispatchTimes == NULL || launchTimes == NULL) {
+		perror("Major problem reading the trace!\n");
+		exit(1);
+	}
+
+	char line[256];
+
+	while(fgets(line, sizeof(line), trace) != NULL) {
+
+		char phase[16];
+		int pid;
+		unsigned long long start, duration;
+
+		if(sscanf(line, "{\"phase\":\"%15[^\"]\",\"pid\":%d,\"start\":%llu,\"ns\":%llu}", phase, &pid, &start, &duration) != 4) {
+			continue;
+		}
+
+		if(dispatchCount == capacity || launchCount == capacity) {
+
+			capacity = capacity * 2;
+			dispatchTimes = realloc(dispatchTimes, capacity * sizeof(unsigned long long));
+			launchTimes = realloc(launchTimes, capacity * sizeof(unsigned long long));
+
+			if(dispatchTimes == NULL || launchTimes == NULL) {
+				perror("Major problem growing the sample arrays!\n");
+				exit(1);
+			}
+		}
+
+		if(strcmp(phase, "dispatch") == 0) {
+			dispatchTimes[dispatchCount++] = start;
+		}
+
+		else if(strcmp(phase, "exec") == 0) {
+			launchTimes[launchCount++] = start;
+		}
+
+		else if(strcmp(phase, "spawn") == 0) {
+			launchTimes[launchCount++] = start + duration;
+		}
+	}
+
+	fclose(trace);
+
+	qsort(dispatchTimes, dispatchCount, sizeof(unsigned long long), compareLatency);
+
+
+	// Binary search for the dispatch each launch belongs to, children's lines can land in the file out of order
+
+	size_t samples = 0;
+
+	for(size_t index = 0; index < launchCount; index++) {
+
+		size_t low = 0, high = dispatchCount;
+
+		while(low < high) {
+
+			size_t middle = (low + high) / 2;
+
+			if(dispatchTimes[middle] <= launchTimes[index]) {
+				low = middle + 1;
+			}
+
+			else {
+				high = middle;
+			}
+		}
+
+		if(low > 0) {
+			launchTimes[samples++] = launchTimes[index] - dispatchTimes[low - 1];
+		}
+	}
+
+	free(dispatchTimes);
+
+	qsort(launchTimes, samples, sizeof(unsigned long long), compareLatency);
+	*sampleCount = samples;
+
+	return launchTimes;
+}
+
+
+
+/*
+ * NAME
+ *   runWorkload - measure one workload with one launcher and print its line of results
+ * SYNOPSIS
+ *   runWorkload(char* smallshPath, struct workload* workload, char* launcher, int commandCount)
+ * DESCRIPTION
+ *   Writes the script, runs it untraced for throughput and traced for latency, prints the results and removes its temp files.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void runWorkload(char* smallshPath, struct workload* workload, char* launcher, int commandCount) {
+
+	char scriptPath[] = "/tmp/smallsh-bench-scriptXXXXXX";
+	char tracePath[] = "/tmp/smallsh-bench-traceXXXXXX";
+
+	int scriptFD = mkstemp(scriptPath);
+	int traceFD = mkstemp(tracePath);
+
+	if(scriptFD == -1 || traceFD == -1) {
+		perror("Major problem creating temp files!\n");
+		exit(1);
+	}
+
+	close(traceFD);		// smallsh opens it again by name
+
+	FILE* script = fdopen(scriptFD, "w");
+	int lineCount = commandCount / workload->divisor;
+
+	if(lineCount < 1) {
+		lineCount = 1;
+	}
+
+	for(int line = 0; line < lineCount; line++) {
+		workload->writeCommand(script);
+	}
+
+	fclose(script);
+
+
+	double seconds = runShell(smallshPath, scriptPath, launcher, NULL);
+
+	if(seconds < 0) {
+		printf("could not run %s\n", smallshPath);
+		fflush(stdout);
+		exit(1);
+	}
+
+	runShell(smallshPath, scriptPath, launcher, tracePath);
+
+	size_t sampleCount;
+	unsigned long long* latencies = readLaunchLatencies(tracePath, &sampleCount);
+
+	double p50 = 0, p99 = 0;
+
+	if(sampleCount > 0) {
+		p50 = latencies[(size_t)(0.50 * (sampleCount - 1))] / 1000.0;
+		p99 = latencies[(size_t)(0.99 * (sampleCount - 1))] / 1000.0;
+	}
+
+	printf("%-10s %-6s %7d cmds %10.0f cmds/s   p50 %8.1f us   p99 %8.1f us\n", workload->name, launcher, lineCount,
+			lineCount / seconds, p50, p99);
+	fflush(stdout);
+
+	free(latencies);
+	unlink(scriptPath);
+	unlink(tracePath);
+}
+
+
+
+int main(int argc, char* argv[]) {
+
+	char* smallshPath = "./smallsh";
+	char* onlyLauncher = NULL;
+	int commandCount = 2000;
+	int option;
+
+	while((option = getopt(argc, argv, "n:l:")) != -1) {
+
+		if(option == 'n') {
+			commandCount = atoi(optarg);
+		}
+
+		else if(option == 'l') {
+			onlyLauncher = optarg;
+		}
+
+		else {
+			fprintf(stderr, "usage: %s [-n commands] [-l fork|spawn|zygote] [path to smallsh]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind < argc) {
+		smallshPath = argv[optind];
+	}
+
+	if(commandCount < 1) {
+		commandCount = 1;
+	}
+
+
+	int inputFD = mkstemp(redirectInput);
+	int outputFD = mkstemp(redirectOutput);
+
+	if(inputFD == -1 || outputFD == -1) {
+		perror("Major problem creating temp files!\n");
+		exit(1);
+	}
+
+	if(write(inputFD, "smallsh benchmark input\n", 24) != 24) {
+		perror("Major problem writing the redirect input!\n");
+		exit(1);
+	}
+
+	close(inputFD);
+	close(outputFD);
+
+
+	char* launchers[] = {"fork", "spawn", "zygote", NULL};
+
+	for(int index = 0; workloads[index].name != NULL; index++) {
+
+		for(int launcher = 0; launchers[launcher] != NULL; launcher++) {
+
+			if(onlyLauncher == NULL || strcmp(onlyLauncher, launchers[launcher]) == 0) {
+				runWorkload(smallshPath, &workloads[index], launchers[launcher], commandCount);
+			}
+		}
+	}
+
+	unlink(redirectInput);
+	unlink(redirectOutput);
+
+	return 0;
+}
@@ -9,16 +9,19 @@
  * DESCRIPTION
  *   smallsh continues to prompt the user for input until they type exit. It also has cd and status command functionality
  *   built into the program. For all other shell commands, execvp() is used to invoke the pre-built functions. The program
- *   can expand any instance of $$ to the PID of the shell process. It can run commands in the background if & is the final
- *   argument sent at the command line. This background functionality can be turned on/off by sending a SIGTSTP signal
- *   (pressing Ctrl-Z). It can also terminate foreground children when a SIGINT signal is sent, but keep background children
- *   and itself active.
+ *   can expand any instance of $$ to the PID of the shell process, and understands quoting with '', "" and \. It can run
+ *   commands in the background if & is the final argument sent at the command line. This background functionality can be turned
+ *   on/off by sending a SIGTSTP signal (pressing Ctrl-Z). It can also terminate foreground children when a SIGINT signal is sent,
+ *   but keep background children and itself active. Commands can be joined into pipelines with |, and every stage of a pipeline
+ *   is tracked as one job.
  * AUTHOR
  *   Written by Michael Childress
 */
 
 
 
+#define _GNU_SOURCE		// Needed for Linux extensions like F_SETPIPE_SZ
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -26,648 +29,14711 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <spawn.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+
+
+// Global variables were needed so signal handling could properly check for exit status of the previous foreground command
+
+bool turnOffBackground = false;		// Global variable will be used by SIGTSTP handling to turn background mode on/off
+bool foregroundRunning = false;		// Set while the shell is waiting on a foreground child
+bool modeMessagePending = false;	// SIGTSTP arrived during a foreground child, print the message once it finishes
+int foreChildExitMethod = -5;
+int exitStatusCode;	// Will hold exit status code of terminated foreground child
+int termSignal;		// Will hold signal number that terminated foreground child
+bool noForegroundProcessesRun = true;	// Will get set to false once one foreground process is run. controls the activity of status command
+bool killedByExit = false;		// These bools are used by the status command to know whether to print the exit status or signal number
+bool killedBySignal = false;
+int builtinExitValue = -1;		// What $? says after a built in that leaves status alone, -1 once anything else has run
+bool userTypedExit = false;
+int shutdownSignal = 0;			// SIGHUP or SIGTERM, once one has told the shell to exit the same way exit does
+bool interactiveMode = false;		// Only true when reading commands from a terminal, controls the prompt
+pid_t lastBackgroundPID = 0;		// What $! expands to, 0 until a background job is started
+char shellPIDString[24];		// What $$ expands to, worked out once at startup
+size_t shellPIDLength = 0;
+int pipeBufferSize = 0;			// Size requested for every pipeline pipe with F_SETPIPE_SZ, 0 leaves the kernel default
+bool useSpawnLauncher = false;		// Launch commands with posix_spawnp() instead of fork() + execvp(), toggled by set -o spawn
+bool collectOutput = false;		// Background jobs write into pipes the shell reads instead of /dev/null, toggled by set -o collect
+int jobOutputFD = -1;			// Write end of that pipe while a background job is being launched, -1 otherwise
+int devNullFD = -1;			// Kept open for the spawn launcher so background jobs don't open /dev/null every time
+int signalFD = -1;			// SIGCHLD, SIGTSTP, SIGHUP and SIGTERM arrive here instead of through handlers, all stay blocked
+int zygoteFD = -1;			// Socket to the zygote launcher when SMALLSH_LAUNCHER=zygote, -1 when commands are started here
+sigset_t startupSignalMask;		// Signal mask from before the shell blocked anything, every child gets it back
+bool traceEnabled = false;		// Write a JSON line for every phase of running a command, toggled by set -o trace
+int traceFD = STDERR_FILENO;		// Where trace lines go, SMALLSH_TRACE picks a descriptor or a file
+bool jobControl = false;		// Interactive and in charge of the terminal, so every job gets its own process group and the terminal
+pid_t shellPGID = 0;			// Process group the terminal is handed back to after a foreground job
+struct termios shellTerminalModes;	// Terminal settings restored after a foreground job, in case it left the terminal in raw mode
+bool lineEditing = false;		// Prompt lines are read with the line editor, toggled by set -o edit, on by default at a terminal
+bool editorWaiting = false;		// The line editor is waiting for a key, so whatever gets printed meanwhile has to clear its line
+char* promptText = ": ";		// Prompt last shown, drawn again after a message interrupts the line being typed
+
+
+// Options that can be changed with the set builtin
+
+struct shellOption {
+	char* name;
+	bool* value;
+};
+
+struct shellOption shellOptions[] = {
+	{"spawn", &useSpawnLauncher},
+	{"collect", &collectOutput},
+	{"edit", &lineEditing},
+	{"trace", &traceEnabled},
+	{NULL, NULL}
+};
+
+
+
+// Input is read in big chunks into one buffer that is reused for every line
+
+#define READ_CHUNK_SIZE 65536
+
+
+// Every token of a line is written into this one buffer, which is reused for the next line
+
+struct tokenArena {
+	char* text;
+	size_t capacity;
+	size_t used;
+};
+
+struct tokenArena lexerArena = {NULL, 0, 0};
+struct tokenArena expansionArena = {NULL, 0, 0};	// Words of the command being run, once their $ expansions are filled in
+
+
+// The tokens of the current line. Grows as needed and is kept between lines, so the only limit on the number of arguments is the
+// kernel's ARG_MAX, and per-command work only touches as many slots as there are tokens.
+
+#define WORD_QUOTED 1		// Had quotes, so it's kept even if it expands to nothing
+#define WORD_ESCAPED 2		// Any of it was quoted, escaped or expanded, so it can't be a descriptor number or a reserved word
+#define WORD_EXPANDS 4		// Holds $ expansions that are only filled in when the command runs
+#define WORD_GLOB 8		// Holds an unquoted * ? or [ that's matched against file names when the command runs
+#define WORD_SUBSTITUTES 16	// Holds a $(command) or `command` that's run when the command runs, so the word is never globbed
+
+#define EXPANSION_MARK '\x01'	// Starts a $ expansion or a command kept in a word, marks an unquoted * ? or [, or escapes a literal \x01
+
+struct argumentVector {
+	char** items;			// NULL terminated once the lexer is done
+	bool* isOperator;		// Which tokens are unquoted operators like | & ; < >
+	unsigned char* wordFlags;	// WORD_ bits for each token
+	size_t* offsets;		// Where each token starts in the lexer arena while the line is being lexed
+	size_t count;
+	size_t capacity;
+};
+
+struct argumentVector commandArguments = {NULL, NULL, NULL, NULL, 0, 0};
+struct argumentVector commandWords = {NULL, NULL, NULL, NULL, 0, 0};	// The expanded words of the command being run
+long argumentByteLimit = 0;		// ARG_MAX, looked up once at startup
+
+
+// One redirection of a command, in the order the user wrote it. All of a line's redirections go in one array that's built once
+// by findRedirections() and reused for every line, and each stage points at its own run of it.
+
+#define REDIRECT_OPEN 0		// Open fileName with flags onto fd
+#define REDIRECT_DUP 1		// Make fd a copy of sourceFD, for N>&M and for heredoc bodies
+#define REDIRECT_CLOSE 2	// Close fd, for N>&- and N<&-
+
+struct redirection {
+	int fd;				// Descriptor the command sees
+	int kind;
+	int flags;			// open() flags for REDIRECT_OPEN
+	char* fileName;
+	int sourceFD;			// For REDIRECT_DUP
+	int savedFD;			// Shell's copy of fd while a built in runs, -1 if fd was closed, -2 if not applied
+};
+
+struct redirection* lineRedirections = NULL;
+size_t lineRedirectionCount = 0;
+size_t lineRedirectionCapacity = 0;
+
+
+// One command of a pipeline, with its redirection already pulled out of the arguments
+
+struct pipelineStage {
+	char** arguments;		// NULL terminated, ready for exec
+	size_t firstRedirection;	// Index into lineRedirections
+	size_t redirectionCount;
+};
+
+struct pipelineStage* pipelineStages = NULL;	// Reused for every pipeline, grows to fit the longest one
+size_t pipelineStageCapacity = 0;
+
+struct inputReader {
+	int fd;
+	char* buffer;
+	size_t capacity;
+	size_t start;		// First byte that hasn't been handed out as a line yet
+	size_t end;		// One past the last byte read
+	bool atEOF;
+};
+
+struct inputReader* shellInput = NULL;		// Where the main loop reads commands from, a string already in memory for -c
+int (*lineEditor)(struct inputReader* reader) = NULL;	// Set by main() at a terminal, editLine() comes after everything it completes
+void (*commandSubstituter)(char* command, struct tokenArena* output) = NULL;	// Set by main(), substituteCommand() runs whole lines
+
+int parallelJobsDone = 0;		// Jobs started by the parallel builtin that have been reaped
+int parallelJobsFailed = 0;		// How many of those didn't exit with 0
+
+
+
+// Metrics
+//
+// Counters and a histogram kept for the life of the shell, for SMALLSH_METRICS to export. They live in one MAP_SHARED block made
+// before any child exists, so children that fail to exec count themselves, the zygote's children included, and the metrics server
+// reads the same memory without asking the shell for anything. Every update is a relaxed atomic add, which is all that's needed
+// with several processes writing and no counter depending on another. With metrics off the block is never mapped and each update
+// is a test of one pointer.
+
+#define METRIC_COMMAND_LINES 0		// Lines read and run by the main loop
+#define METRIC_BUILTINS 1		// Commands the shell ran itself
+#define METRIC_EXTERNALS 2		// Processes launched, one per pipeline stage
+#define METRIC_FORK_FAILURES 3
+#define METRIC_EXEC_FAILURES 4
+#define METRIC_PATH_HITS 5		// Command path cache lookups
+#define METRIC_PATH_MISSES 6
+#define METRIC_BACKGROUND_JOBS 7	// Running now
+#define METRIC_BACKGROUND_PEAK 8	// Most running at once
+#define METRIC_REAPED 9			// Jobs reaped, the histogram's count
+#define METRIC_REAP_NANOSECONDS 10	// Its sum
+#define METRIC_REAP_BUCKETS 11		// First of REAP_BUCKET_COUNT + 1 buckets, the last one for anything slower
+#define REAP_BUCKET_COUNT 16
+#define METRIC_SLOTS (METRIC_REAP_BUCKETS + REAP_BUCKET_COUNT + 1)
+
+unsigned long long* metrics = NULL;		// The shared block, NULL when metrics are off
+pid_t metricsServerPID = 0;			// The process serving the socket, 0 if there isn't one
+
+unsigned long long reapBucketBounds[REAP_BUCKET_COUNT] = {		// Upper bounds in nanoseconds, 100us to 10s
+	100000ULL, 250000ULL, 500000ULL, 1000000ULL, 2500000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL, 100000000ULL,
+	250000000ULL, 500000000ULL, 1000000000ULL, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+
+
+/*
+ * NAME
+ *   countMetric - add to one of the shared counters
+ * SYNOPSIS
+ *   countMetric(int metric, unsigned long long amount)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline void countMetric(int metric, unsigned long long amount) {
+
+	if(metrics != NULL) {
+		__atomic_fetch_add(&metrics[metric], amount, __ATOMIC_RELAXED);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   countBackgroundJob - track how many background jobs are running
+ * SYNOPSIS
+ *   countBackgroundJob(bool started)
+ * DESCRIPTION
+ *   Only the shell starts and reaps jobs, so the peak can be kept with a plain compare.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline void countBackgroundJob(bool started) {
+
+	if(metrics == NULL) {
+		return;
+	}
+
+	if(!started) {
+		__atomic_fetch_sub(&metrics[METRIC_BACKGROUND_JOBS], 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	unsigned long long running = __atomic_add_fetch(&metrics[METRIC_BACKGROUND_JOBS], 1, __ATOMIC_RELAXED);
+
+	if(running > __atomic_load_n(&metrics[METRIC_BACKGROUND_PEAK], __ATOMIC_RELAXED)) {
+		__atomic_store_n(&metrics[METRIC_BACKGROUND_PEAK], running, __ATOMIC_RELAXED);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   countReapLatency - add a reaped job to the reap latency histogram
+ * SYNOPSIS
+ *   countReapLatency(struct timespec* startTime, struct timespec* endTime)
+ * DESCRIPTION
+ *   The latency is from launching the job to reaping its last process, which for a short command is the whole cost of running
+ *   it as the user sees it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline void countReapLatency(struct timespec* startTime, struct timespec* endTime) {
+
+	if(metrics == NULL) {
+		return;
+	}
+
+	unsigned long long nanoseconds = (unsigned long long)(endTime->tv_sec - startTime->tv_sec) * 1000000000ULL +
+			endTime->tv_nsec - startTime->tv_nsec;
+	int bucket = 0;
+
+	while(bucket < REAP_BUCKET_COUNT && nanoseconds > reapBucketBounds[bucket]) {
+		bucket++;
+	}
+
+	countMetric(METRIC_REAP_BUCKETS + bucket, 1);
+	countMetric(METRIC_REAP_NANOSECONDS, nanoseconds);
+	countMetric(METRIC_REAPED, 1);
+}
+
+
+
+// Job table
+//
+// Every child process the shell creates gets a slot in this table. Slots are found by PID through a chained hash index so
+// reapChildren() can mark a child finished in O(1). The first process of a pipeline leads the job: the other stages point back
+// to it, and once every stage has been reaped the leader's slot is pushed onto a queue so the main loop only ever looks at the
+// jobs that actually completed. The table doubles when it fills up, so there is no limit on the number of background jobs.
+// Reaping happens from the event loop rather than a signal handler, so the table never changes under the code using it.
+
+struct job {
+	pid_t pid;			// Process ID of the child
+	int exitMethod;			// Filled in by reapChildren()
+	bool inUse;
+	bool done;			// Set by reapChildren() once the child has been reaped
+	bool background;		// Background jobs get a "background pid is done" message, foreground ones are handled by the waiter
+	int nextInBucket;		// Next slot in the same hash bucket, -1 ends the chain
+	int leaderSlot;			// Slot of the first process of this job (itself for the leader)
+	int nextStage;			// Next process of the same job, -1 ends the list
+	struct rusage usage;		// Resources the child used, filled in by wait4() in reapChildren()
+	bool stopped;			// Stopped by a signal and not continued since
+
+	// Only kept up to date in the leader's slot
+	int runningStages;		// Processes of the job that haven't been reaped yet
+	int lastStage;			// Slot of the final pipeline stage, whose exit method is the job's
+	pid_t pgid;			// Process group shared by every stage
+	struct timespec startTime;	// When the job was launched
+	struct timespec endTime;	// When its last stage was reaped
+	bool timed;			// Started with the time keyword, print its resource usage when it's done
+	bool parallel;			// Started by the parallel builtin, which counts it instead of printing it
+	int stoppedStages;		// Processes of the job that are stopped, the whole job is stopped once every running one is
+	int jobNumber;			// The n in %n
+	char* commandText;		// Line the job was started from, for jobs and fg, NULL for parallel jobs
+	int remoteHost;			// Index in remoteHosts of the host an on or parallel --hosts job went to, -1 for a local job
+	bool countedBackground;		// Started in the background, so it's in the background jobs metric until it finishes
+
+	// Kept with the slot rather than the job, so a reused slot only allocates for a longer line than it has held before
+	char* commandBuffer;
+	size_t commandCapacity;
+};
+
+
+// Hosts that on and parallel --hosts have sent jobs to, with how busy each one is kept by
+
+struct remoteHost {
+	char* name;
+	int runningJobs;		// Started from this shell and not finished yet
+	unsigned long startedJobs;
+	bool connected;			// Its ssh ControlMaster is known to be up
+	time_t retryAfter;		// Couldn't be reached, so no job goes to it and ssh isn't tried again before this
+};
+
+struct remoteHost* remoteHosts = NULL;
+int remoteHostCount = 0;
+
+
+// What the zygote launcher sends back: the PID of a child it just started, or a wait4() status of one of its children
+
+struct zygoteEvent {
+	bool started;			// Reply to a launch request, pid is -1 if the fork failed
+	pid_t pid;
+	int exitMethod;			// Status events only
+	struct rusage usage;
+};
+
+struct zygoteEvent* heldZygoteEvents = NULL;	// Statuses that came in while a job was being launched, handled once it's in the table
+size_t heldZygoteEventCount = 0;
+size_t heldZygoteEventCapacity = 0;
+
+
+// Resources used by a whole job, every stage added together
+
+struct jobUsage {
+	double wallSeconds;
+	struct rusage usage;
+};
+
+struct jobUsage lastForegroundUsage;	// What status -v reports
+
+struct job* jobTable = NULL;
+int jobTableCapacity = 0;		// Always a power of two so the hash index can use a mask
+int* jobBuckets = NULL;			// Head slot of each hash chain, -1 if empty
+int* freeJobSlots = NULL;		// Stack of unused slots
+int freeJobCount = 0;
+int* doneQueue = NULL;			// Ring of slots reapChildren() has reaped but the main loop hasn't reported yet
+int doneHead = 0;
+int doneCount = 0;
+int activeJobCount = 0;
+int nextJobNumber = 1;		// Starts over from 1 whenever the table empties, like other shells
+
+
+// Background jobs that have been reported done are remembered until wait collects them, since a script can still wait for $!
+// after the done message has gone by and the job has left the table. A new job with the same PID or job number makes an entry
+// stale, so an entry never shadows a live job.
+
+#define REMEMBERED_JOB_COUNT 64
+
+struct rememberedJob {
+	pid_t pid;		// The job's leader, 0 for an empty entry
+	int jobNumber;
+	int exitValue;
+};
+
+struct rememberedJob rememberedJobs[REMEMBERED_JOB_COUNT];
+int nextRememberedJob = 0;		// The oldest entry, overwritten once the ring is full
+
+
+
+/*
+ * NAME
+ *   findJobSlot - look up the job table slot of a child process
+ * SYNOPSIS
+ *   findJobSlot(pid_t pid)
+ * DESCRIPTION
+ *   Walks the hash chain for pid and returns the slot holding it, or -1 if the shell doesn't know about that child.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int findJobSlot(pid_t pid) {
+
+	if(jobTableCapacity == 0) {
+		return -1;
+	}
+
+	int slot = jobBuckets[(unsigned int)pid & (jobTableCapacity - 1)];
+
+	while(slot != -1 && jobTable[slot].pid != pid) {
+		slot = jobTable[slot].nextInBucket;
+	}
+
+	return slot;
+}
+
+
+
+/*
+ * NAME
+ *   growJobTable - double the capacity of the job table
+ * SYNOPSIS
+ *   growJobTable()
+ * DESCRIPTION
+ *   Reallocates the table, hash index, free slot stack and done queue at twice their old size and rehashes every live job.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void growJobTable() {
+
+	int oldCapacity = jobTableCapacity;
+	int newCapacity = (oldCapacity == 0) ? 16 : oldCapacity * 2;
+
+	jobTable = realloc(jobTable, newCapacity * sizeof(struct job));
+	jobBuckets = realloc(jobBuckets, newCapacity * sizeof(int));
+	freeJobSlots = realloc(freeJobSlots, newCapacity * sizeof(int));
+
+	int* newDoneQueue = malloc(newCapacity * sizeof(int));
+
+	if(jobTable == NULL || jobBuckets == NULL || freeJobSlots == NULL || newDoneQueue == NULL) {
+		perror("Major problem growing the job table!\n");
+		exit(1);
+	}
+
+	for(int index = 0; index < doneCount; index++) {		// Unwrap the done ring into the new one
+		newDoneQueue[index] = doneQueue[(doneHead + index) % oldCapacity];
+	}
+
+	free(doneQueue);
+	doneQueue = newDoneQueue;
+	doneHead = 0;
+
+	for(int slot = oldCapacity; slot < newCapacity; slot++) {
+		jobTable[slot].inUse = false;
+		jobTable[slot].commandBuffer = NULL;
+		jobTable[slot].commandCapacity = 0;
+	}
+
+	for(int slot = newCapacity - 1; slot >= oldCapacity; slot--) {	// Lowest new slot ends up on top of the stack
+		freeJobSlots[freeJobCount] = slot;
+		freeJobCount++;
+	}
+
+	jobTableCapacity = newCapacity;
+
+	for(int bucket = 0; bucket < newCapacity; bucket++) {
+		jobBuckets[bucket] = -1;
+	}
+
+	for(int slot = 0; slot < oldCapacity; slot++) {		// Rehash the live jobs with the new mask
+
+		if(jobTable[slot].inUse) {
+			int bucket = (unsigned int)jobTable[slot].pid & (newCapacity - 1);
+			jobTable[slot].nextInBucket = jobBuckets[bucket];
+			jobBuckets[bucket] = slot;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   addJob - record a newly forked child in the job table
+ * SYNOPSIS
+ *   addJob(pid_t pid, bool isBackground, int leaderSlot)
+ * DESCRIPTION
+ *   Takes a slot off the free stack (growing the table if there isn't one) and links it into the hash index. Returns the slot.
+ *   A leaderSlot of -1 starts a new job with this child as its leader, otherwise the child is appended as the next pipeline stage
+ *   of that job. A child that has already exited is only reaped once the event loop next runs, so it's always recorded first.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int addJob(pid_t pid, bool isBackground, int leaderSlot) {
+
+	if(freeJobCount == 0) {
+		growJobTable();
+	}
+
+	freeJobCount--;
+	int slot = freeJobSlots[freeJobCount];
+
+	jobTable[slot].pid = pid;
+	jobTable[slot].exitMethod = 0;
+	jobTable[slot].inUse = true;
+	jobTable[slot].done = false;
+	jobTable[slot].background = isBackground;
+	jobTable[slot].nextStage = -1;
+	jobTable[slot].stopped = false;
+
+	if(leaderSlot == -1) {		// This child starts a new job
+
+		if(activeJobCount == 0) {
+			nextJobNumber = 1;
+		}
+
+		leaderSlot = slot;
+		jobTable[slot].runningStages = 0;
+		jobTable[slot].stoppedStages = 0;
+		jobTable[slot].jobNumber = nextJobNumber++;
+		jobTable[slot].commandText = NULL;
+		jobTable[slot].pgid = pid;
+		jobTable[slot].timed = false;
+		jobTable[slot].parallel = false;
+		jobTable[slot].remoteHost = -1;
+		jobTable[slot].countedBackground = isBackground;
+		clock_gettime(CLOCK_MONOTONIC, &jobTable[slot].startTime);
+
+		if(isBackground) {
+			countBackgroundJob(true);
+		}
+	}
+
+	else {
+		jobTable[jobTable[leaderSlot].lastStage].nextStage = slot;
+	}
+
+	jobTable[slot].leaderSlot = leaderSlot;
+	jobTable[leaderSlot].lastStage = slot;
+	jobTable[leaderSlot].runningStages++;
+
+	for(int index = 0; index < REMEMBERED_JOB_COUNT; index++) {		// Forget a finished job this one could be mistaken for
+
+		if(rememberedJobs[index].pid == pid || (leaderSlot == slot && rememberedJobs[index].jobNumber == jobTable[slot].jobNumber)) {
+			rememberedJobs[index].pid = 0;
+			rememberedJobs[index].jobNumber = 0;
+		}
+	}
+
+	int bucket = (unsigned int)pid & (jobTableCapacity - 1);
+	jobTable[slot].nextInBucket = jobBuckets[bucket];
+	jobBuckets[bucket] = slot;
+
+	activeJobCount++;
+
+	return slot;
+}
+
+
+
+/*
+ * NAME
+ *   removeJob - give a job table slot back to the free stack
+ * SYNOPSIS
+ *   removeJob(int slot)
+ * DESCRIPTION
+ *   Unlinks the slot from its hash chain, marks it unused and pushes it on the free stack. The slot keeps its command buffer,
+ *   which setJobCommand() reuses the next time the slot leads a job.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void removeJob(int slot) {
+
+	int* link = &jobBuckets[(unsigned int)jobTable[slot].pid & (jobTableCapacity - 1)];
+
+	while(*link != slot) {
+		link = &jobTable[*link].nextInBucket;
+	}
+
+	*link = jobTable[slot].nextInBucket;
+
+	jobTable[slot].inUse = false;
+	freeJobSlots[freeJobCount] = slot;
+	freeJobCount++;
+	activeJobCount--;
+}
+
+
+
+/*
+ * NAME
+ *   setJobCommand - remember the line a job was started from
+ * SYNOPSIS
+ *   setJobCommand(int leaderSlot, char* text)
+ * DESCRIPTION
+ *   Copies text into the leader slot's own buffer, which only grows, and points the job's commandText at it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void setJobCommand(int leaderSlot, char* text) {
+
+	struct job* leader = &jobTable[leaderSlot];
+	size_t length = strlen(text) + 1;
+
+	if(length > leader->commandCapacity) {
+
+		leader->commandCapacity = (length < 128) ? 128 : length;
+		free(leader->commandBuffer);
+		leader->commandBuffer = malloc(leader->commandCapacity);
+
+		if(leader->commandBuffer == NULL) {
+			perror("Major problem saving a job's command!\n");
+			exit(1);
+		}
+	}
+
+	memcpy(leader->commandBuffer, text, length);
+	leader->commandText = leader->commandBuffer;
+}
+
+
+
+/*
+ * NAME
+ *   jobStopped - check whether a whole job is stopped
+ * SYNOPSIS
+ *   jobStopped(int leaderSlot)
+ * DESCRIPTION
+ *   True once every stage of the job that hasn't exited yet is stopped, which is when the foreground waiter gives up on it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline bool jobStopped(int leaderSlot) {
+
+	return jobTable[leaderSlot].stoppedStages > 0 && jobTable[leaderSlot].stoppedStages == jobTable[leaderSlot].runningStages;
+}
+
+
+
+/*
+ * NAME
+ *   signalJob - send a signal to every process of a job
+ * SYNOPSIS
+ *   signalJob(int leaderSlot, int signalNumber)
+ * DESCRIPTION
+ *   One kill() of the job's process group. A foreground job run without job control shares the shell's process group, so its
+ *   stages that are still running are signalled one at a time instead of taking the shell down with them.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void signalJob(int leaderSlot, int signalNumber) {
+
+	if(jobTable[leaderSlot].pgid != getpgrp()) {
+		kill(-jobTable[leaderSlot].pgid, signalNumber);
+		return;
+	}
+
+	for(int slot = leaderSlot; slot != -1; slot = jobTable[slot].nextStage) {
+
+		if(!jobTable[slot].done) {
+			kill(jobTable[slot].pid, signalNumber);
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   continueJob - resume a stopped job
+ * SYNOPSIS
+ *   continueJob(int leaderSlot)
+ * DESCRIPTION
+ *   Sends SIGCONT and marks every stage running again straight away rather than waiting for reapChildren() to hear about it, so
+ *   a waiter that starts right after this doesn't see the job as still stopped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void continueJob(int leaderSlot) {
+
+	signalJob(leaderSlot, SIGCONT);
+
+	for(int slot = leaderSlot; slot != -1; slot = jobTable[slot].nextStage) {
+		jobTable[slot].stopped = false;
+	}
+
+	jobTable[leaderSlot].stoppedStages = 0;
+}
+
+
+
+/*
+ * NAME
+ *   collectJobUsage - add up the resources every stage of a finished job used
+ * SYNOPSIS
+ *   collectJobUsage(int leaderSlot, struct jobUsage* jobUsage)
+ * DESCRIPTION
+ *   Times, faults, block operations and context switches are summed across the stages, max RSS is the largest of any one stage, and
+ *   the wall time runs from launch until the last stage was reaped. The job must be done.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void collectJobUsage(int leaderSlot, struct jobUsage* jobUsage) {
+
+	struct rusage* total = &jobUsage->usage;
+	memset(total, 0, sizeof(struct rusage));
+
+	for(int slot = leaderSlot; slot != -1; slot = jobTable[slot].nextStage) {
+
+		struct rusage* stage = &jobTable[slot].usage;
+
+		timeradd(&total->ru_utime, &stage->ru_utime, &total->ru_utime);
+		timeradd(&total->ru_stime, &stage->ru_stime, &total->ru_stime);
+
+		if(stage->ru_maxrss > total->ru_maxrss) {
+			total->ru_maxrss = stage->ru_maxrss;
+		}
+
+		total->ru_minflt += stage->ru_minflt;
+		total->ru_majflt += stage->ru_majflt;
+		total->ru_inblock += stage->ru_inblock;
+		total->ru_oublock += stage->ru_oublock;
+		total->ru_nvcsw += stage->ru_nvcsw;
+		total->ru_nivcsw += stage->ru_nivcsw;
+	}
+
+	struct timespec* start = &jobTable[leaderSlot].startTime;
+	struct timespec* end = &jobTable[leaderSlot].endTime;
+	jobUsage->wallSeconds = (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+
+/*
+ * NAME
+ *   printJobUsage - print what a job cost
+ * SYNOPSIS
+ *   printJobUsage(struct jobUsage* jobUsage, bool verbose)
+ * DESCRIPTION
+ *   Prints wall, user and sys time, max RSS and context switches to stderr, the way the time keyword reports them, so the output
+ *   doesn't get mixed into the command's own stdout. verbose adds page faults and block I/O, which is what status -v shows.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void printJobUsage(struct jobUsage* jobUsage, bool verbose) {
+
+	struct rusage* usage = &jobUsage->usage;
+
+	fprintf(stderr, "real\t%.3fs\n", jobUsage->wallSeconds);
+	fprintf(stderr, "user\t%ld.%03lds\n", (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec / 1000);
+	fprintf(stderr, "sys\t%ld.%03lds\n", (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec / 1000);
+	fprintf(stderr, "maxrss\t%ld KB\n", usage->ru_maxrss);
+	fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", usage->ru_nvcsw, usage->ru_nivcsw);
+
+	if(verbose) {
+		fprintf(stderr, "faults\t%ld minor, %ld major\n", usage->ru_minflt, usage->ru_majflt);
+		fprintf(stderr, "blocks\t%ld in, %ld out\n", usage->ru_inblock, usage->ru_oublock);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   writeFully - write all of a buffer
+ * SYNOPSIS
+ *   writeFully(int fd, void* bytes, size_t length)
+ * DESCRIPTION
+ *   Goes round again after a short write or EINTR. Returns false once write() fails. Used for output like the trace and the job
+ *   log, which is never worth stopping the shell over and has nowhere else to be reported, so callers are free to ignore it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool writeFully(int fd, void* bytes, size_t length) {
+
+	char* next = bytes;
+
+	while(length > 0) {
+
+		ssize_t written = write(fd, next, length);
+
+		if(written == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if(written <= 0) {
+			return false;
+		}
+
+		next += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   traceClock - nanoseconds on the monotonic clock
+ * SYNOPSIS
+ *   traceClock()
+ * DESCRIPTION
+ *   Timestamps for the trace lines. Returns 0 without reading the clock when tracing is off so the untraced path stays free.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline unsigned long long traceClock() {
+
+	if(!traceEnabled) {
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+
+/*
+ * NAME
+ *   traceEvent - write one trace line for a phase that started at startTime
+ * SYNOPSIS
+ *   traceEvent(char* phase, unsigned long long startTime)
+ * DESCRIPTION
+ *   Writes {"phase":...,"pid":...,"start":...,"ns":...} and a newline to traceFD with a single write() so lines from the shell and
+ *   its children don't get mixed together. start is the CLOCK_MONOTONIC time in nanoseconds and ns is how long the phase took.
+ *   Also called in forked children, which is why it doesn't go through stdio.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void traceEvent(char* phase, unsigned long long startTime) {
+
+	if(!traceEnabled || startTime == 0) {		// Tracing was turned on partway through this phase
+		return;
+	}
+
+	char traceLine[160];
+	unsigned long long endTime = traceClock();
+
+	int lineLength = snprintf(traceLine, sizeof(traceLine), "{\"phase\":\"%s\",\"pid\":%d,\"start\":%llu,\"ns\":%llu}\n",
+			phase, (int)getpid(), startTime, endTime - startTime);
+
+	writeFully(traceFD, traceLine, lineLength);
+}
+
+
+
+// Child reaping
+
+/*
+ * NAME
+ *   recordChildStatus - update the job table for a child that exited, stopped or continued
+ * SYNOPSIS
+ *   recordChildStatus(pid_t pid, int childExitMethod, struct rusage* childUsage)
+ * DESCRIPTION
+ *   childExitMethod is a wait status with WUNTRACED and WCONTINUED reporting. A stop or continue only updates the stopped counts
+ *   job control works from. An exit has its exit method and resource usage stored in the job table, and once the last stage of a
+ *   job is gone the job's end time is recorded and its leader slot is pushed onto the done queue for the main loop to report.
+ *   Children the shell doesn't know about are ignored, apart from noting that the metrics server has gone.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void recordChildStatus(pid_t pid, int childExitMethod, struct rusage* childUsage) {
+
+	int slot = findJobSlot(pid);
+
+	if(slot == -1) {
+
+		// The metrics server died on its own, so its PID mustn't be signalled later
+
+		if(pid == metricsServerPID && !WIFSTOPPED(childExitMethod) && !WIFCONTINUED(childExitMethod)) {
+			metricsServerPID = 0;
+		}
+
+		return;
+	}
+
+	int leaderSlot = jobTable[slot].leaderSlot;
+
+	if(WIFSTOPPED(childExitMethod)) {
+
+		if(!jobTable[slot].stopped) {
+			jobTable[slot].stopped = true;
+			jobTable[slot].exitMethod = childExitMethod;		// What the foreground waiter reports if the whole job stops
+			jobTable[leaderSlot].stoppedStages++;
+		}
+	}
+
+	else if(WIFCONTINUED(childExitMethod)) {
+
+		if(jobTable[slot].stopped) {		// Not already marked running by continueJob()
+			jobTable[slot].stopped = false;
+			jobTable[leaderSlot].stoppedStages--;
+		}
+	}
+
+	else {
+		if(jobTable[slot].stopped) {		// Killed while it was stopped
+			jobTable[slot].stopped = false;
+			jobTable[leaderSlot].stoppedStages--;
+		}
+
+		jobTable[slot].exitMethod = childExitMethod;
+		jobTable[slot].usage = *childUsage;
+		jobTable[slot].done = true;
+
+		jobTable[leaderSlot].runningStages--;
+
+		if(jobTable[leaderSlot].runningStages == 0) {		// Whole job is finished
+			clock_gettime(CLOCK_MONOTONIC, &jobTable[leaderSlot].endTime);
+			countReapLatency(&jobTable[leaderSlot].startTime, &jobTable[leaderSlot].endTime);
+
+			if(jobTable[leaderSlot].countedBackground) {
+				countBackgroundJob(false);
+			}
+
+			if(jobTable[leaderSlot].remoteHost != -1) {		// Its host has room for another one
+				remoteHosts[jobTable[leaderSlot].remoteHost].runningJobs--;
+				jobTable[leaderSlot].remoteHost = -1;
+			}
+
+			doneQueue[(doneHead + doneCount) % jobTableCapacity] = leaderSlot;
+			doneCount++;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   reapChildren - collect every child that has finished
+ * SYNOPSIS
+ *   reapChildren()
+ * DESCRIPTION
+ *   Called from the event loop whenever the signal descriptor reports SIGCHLD. Reaps every child that has finished with
+ *   wait4(-1, WNOHANG), since several exits can arrive as one SIGCHLD, and hands each one to recordChildStatus(). WUNTRACED
+ *   and WCONTINUED also report children being stopped and continued. The work done here is proportional to the number of
+ *   children that finished.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void reapChildren() {
+
+	int childExitMethod;
+	struct rusage childUsage;
+	pid_t reapedPID;
+
+	while((reapedPID = wait4(-1, &childExitMethod, WNOHANG | WUNTRACED | WCONTINUED, &childUsage)) > 0) {
+		recordChildStatus(reapedPID, childExitMethod, &childUsage);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   readZygoteEvents - take in what the zygote has reported about the children it started
+ * SYNOPSIS
+ *   readZygoteEvents(bool waitForStart)
+ * DESCRIPTION
+ *   Reads one event at a time from the zygote's socket, so anything after the event that's wanted stays queued in the socket and
+ *   wakes the next poll(). Status events go through recordChildStatus() exactly like children the shell reaped itself. With
+ *   waitForStart it blocks until the reply to a launch request arrives and returns the new child's PID, or -1 if the zygote
+ *   couldn't fork. Statuses read on the way are held instead, since an earlier stage of the job being launched may already have
+ *   exited and its job mustn't look finished before the rest of it is in the table. Without waitForStart the held statuses are
+ *   handled first, and it returns once nothing is left to read. If the zygote has gone away its socket is closed and -1 is
+ *   returned, and every launch after that goes through the other launchers.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+pid_t readZygoteEvents(bool waitForStart) {
+
+	struct zygoteEvent event;
+
+	if(!waitForStart) {
+
+		for(size_t index = 0; index < heldZygoteEventCount; index++) {
+			recordChildStatus(heldZygoteEvents[index].pid, heldZygoteEvents[index].exitMethod, &heldZygoteEvents[index].usage);
+		}
+
+		heldZygoteEventCount = 0;
+	}
+
+	while(zygoteFD != -1) {
+
+		ssize_t bytesRead = recv(zygoteFD, &event, sizeof(event), waitForStart ? MSG_WAITALL : MSG_DONTWAIT);
+
+		if(bytesRead > 0 && bytesRead < (ssize_t)sizeof(event)) {		// The rest of a small write is always right behind it
+
+			ssize_t restRead = recv(zygoteFD, (char*)&event + bytesRead, sizeof(event) - bytesRead, MSG_WAITALL);
+			bytesRead = (restRead > 0) ? bytesRead + restRead : 0;
+		}
+
+		if(bytesRead == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if(bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return -1;
+		}
+
+		if(bytesRead != (ssize_t)sizeof(event)) {		// End of file or an error, the zygote is gone
+
+			printf("zygote launcher exited, starting commands from the shell\n");
+			fflush(stdout);
+			close(zygoteFD);
+			zygoteFD = -1;
+			return -1;
+		}
+
+		if(event.started) {
+
+			if(waitForStart) {
+				return event.pid;
+			}
+		}
+
+		else if(waitForStart) {
+
+			if(heldZygoteEventCount == heldZygoteEventCapacity) {
+
+				heldZygoteEventCapacity = (heldZygoteEventCapacity == 0) ? 16 : heldZygoteEventCapacity * 2;
+				heldZygoteEvents = realloc(heldZygoteEvents, heldZygoteEventCapacity * sizeof(struct zygoteEvent));
+
+				if(heldZygoteEvents == NULL) {
+					perror("Major problem growing the held zygote events!\n");
+					exit(1);
+				}
+			}
+
+			heldZygoteEvents[heldZygoteEventCount++] = event;
+		}
+
+		else {
+			recordChildStatus(event.pid, event.exitMethod, &event.usage);
+		}
+	}
+
+	return -1;
+}
+
+
+
+/*
+ * NAME
+ *   reportFinishedJobs - print and clean up background children reapChildren() has reaped
+ * SYNOPSIS
+ *   reportFinishedJobs()
+ * DESCRIPTION
+ *   Drains the done queue, printing the exit value or terminating signal of each finished background job and freeing the slots
+ *   of all of its stages. A background job's exit value is kept in rememberedJobs for wait. Foreground jobs are freed silently
+ *   since the foreground waiter already recorded their status, and jobs run by the parallel builtin are only counted. Returns how
+ *   many background jobs were reported.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int reportFinishedJobs() {
+
+	int reported = 0;
+
+	while(doneCount > 0) {
+
+		int slot = doneQueue[doneHead];
+		doneHead = (doneHead + 1) % jobTableCapacity;
+		doneCount--;
+
+		if(jobTable[slot].parallel) {
+
+			int parallelExitMethod = jobTable[jobTable[slot].lastStage].exitMethod;
+
+			parallelJobsDone++;
+
+			if(!WIFEXITED(parallelExitMethod) || WEXITSTATUS(parallelExitMethod) != 0) {
+				parallelJobsFailed++;
+			}
+		}
+
+		else if(jobTable[slot].background) {
+
+			int backgroundChildExitMethod = jobTable[jobTable[slot].lastStage].exitMethod;
+			reported++;
+
+			if(WIFEXITED(backgroundChildExitMethod) != 0) {
+				printf("background pid %d is done: exit value %d\n", (int)jobTable[slot].pid, WEXITSTATUS(backgroundChildExitMethod));
+				fflush(stdout);
+			}
+
+			if(WIFSIGNALED(backgroundChildExitMethod) != 0) {
+				printf("background pid %d is done: terminated by signal %d\n", (int)jobTable[slot].pid, WTERMSIG(backgroundChildExitMethod));
+				fflush(stdout);
+			}
+
+			struct rememberedJob* remembered = &rememberedJobs[nextRememberedJob];
+			nextRememberedJob = (nextRememberedJob + 1) % REMEMBERED_JOB_COUNT;
+
+			remembered->pid = jobTable[slot].pid;
+			remembered->jobNumber = jobTable[slot].jobNumber;
+			remembered->exitValue = WIFSIGNALED(backgroundChildExitMethod) ? 128 + WTERMSIG(backgroundChildExitMethod) : WEXITSTATUS(backgroundChildExitMethod);
+
+			if(jobTable[slot].timed) {		// Started with time ... &
+
+				struct jobUsage backgroundUsage;
+				collectJobUsage(slot, &backgroundUsage);
+				printJobUsage(&backgroundUsage, false);
+			}
+		}
+
+		while(slot != -1) {		// Free every stage of the job
+			int nextStage = jobTable[slot].nextStage;
+			removeJob(slot);
+			slot = nextStage;
+		}
+	}
+
+	return reported;
+}
+
+
+
+/*
+ * NAME
+ *   printModeMessage - tell the user whether foreground-only mode is on
+ * SYNOPSIS
+ *   printModeMessage()
+ * DESCRIPTION
+ *   Writes the message matching the current value of turnOffBackground.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void printModeMessage() {
+
+	if(turnOffBackground) {		// Background was just turned off
+
+		char* message = "\nEntering foreground-only mode (& is now ignored)\n";
+		write(STDOUT_FILENO, message, 50);
+	}
+
+	else {		// Background was just turned on again
+
+		char* message = "\nExiting foreground-only mode\n";
+		write(STDOUT_FILENO, message, 30);
+	}
+}
+
+
+
+// SIGTSTP handling
+
+/*
+ * NAME
+ *   toggleForegroundOnly - what the shell does when it receives SIGTSTP
+ * SYNOPSIS
+ *   toggleForegroundOnly()
+ * DESCRIPTION
+ *   Used when the parent process receives a SIGTSTP signal. It controls whether background commands are acknowledged.
+ *   The first time it is called, background command functionality is turned off and everything is treated as a foreground command.
+ *   When another SIGTSTP is sent, background command functionality is turned on again. The appropriate text messages are displayed to
+ *   the user as well. If a foreground child is running, the message is held until it finishes. Returns true if a message was printed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+
+bool toggleForegroundOnly() {
+
+	turnOffBackground = !turnOffBackground;
+
+	if(foregroundRunning) {		// Let the foreground waiter print the message once the child is done
+		modeMessagePending = true;
+		return false;
+	}
+
+	printModeMessage();
+	return true;
+}
+
+
+
+// Background output
+//
+// With set -o collect, or SMALLSH_JOB_LOG set, background jobs' stdout and stderr go into a pipe instead of /dev/null and the
+// terminal, unless the user redirected them. The read ends all go in one epoll set that the event loop polls, so thousands of
+// jobs still add only one descriptor to every poll(). Each job's output is kept in a ring of its last JOB_OUTPUT_RING bytes,
+// for jobs -o to print. The rings are numbered in the order the jobs started, not by job number, so a ring outlives its job
+// number being handed to a new job. It stays after the job is done until it's printed, or until JOB_OUTPUT_KEPT newer finished
+// jobs' rings are being kept. With SMALLSH_JOB_LOG every line also goes into one log, prefixed with the job number and PID. The log is written from a
+// buffer in JOB_LOG_BATCH sized pieces, whenever the shell is about to sleep waiting for input, at least every JOB_LOG_INTERVAL
+// milliseconds while a foreground job runs, and at exit.
+
+#define JOB_OUTPUT_RING 65536
+#define JOB_OUTPUT_KEPT 64
+#define JOB_LOG_BATCH 65536
+#define JOB_LOG_INTERVAL 1000
+
+struct jobOutput {
+	bool inUse;
+	unsigned long long serial;	// Order the jobs started in, the newest ring for a job number wins
+	int jobNumber;			// For %n and the log prefix
+	pid_t pid;			// Leader of the job, for the log prefix
+	int fd;				// Read end of the job's pipe, -1 once everything writing to it has gone
+	char* ring;			// Allocated when the first byte arrives
+	size_t head;			// Where the next byte goes
+	size_t held;			// Bytes in the ring, at most JOB_OUTPUT_RING
+	size_t dropped;			// Oldest bytes pushed out because the ring was full
+	bool midLine;			// The log has part of a line from this job, so the next byte doesn't get a prefix
+};
+
+struct jobOutput* jobOutputs = NULL;		// Free entries are reused, a live entry never moves
+int jobOutputCapacity = 0;
+unsigned long long jobOutputSerial = 0;
+int jobOutputEpollFD = -1;			// Every open read end, with its entry's index as the event data
+int jobLogFD = -1;				// SMALLSH_JOB_LOG, -1 if there's no log
+char jobLogBuffer[JOB_LOG_BATCH];
+size_t jobLogUsed = 0;
+struct timespec jobLogOldest;			// When the first byte still in the buffer arrived
+
+
+
+/*
+ * NAME
+ *   flushJobLog - write the buffered log lines out
+ * SYNOPSIS
+ *   flushJobLog()
+ * DESCRIPTION
+ *   One write() for everything buffered.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void flushJobLog() {
+
+	if(jobLogUsed > 0) {
+		writeFully(jobLogFD, jobLogBuffer, jobLogUsed);		// If it fails the output is still in the jobs' rings
+	}
+
+	jobLogUsed = 0;
+}
+
+
+
+/*
+ * NAME
+ *   appendJobLog - add bytes to the log buffer
+ * SYNOPSIS
+ *   appendJobLog(char* text, size_t length)
+ * DESCRIPTION
+ *   Flushes first if they don't fit. Anything bigger than the whole buffer is written straight through.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void appendJobLog(char* text, size_t length) {
+
+	if(length > JOB_LOG_BATCH - jobLogUsed) {
+		flushJobLog();
+	}
+
+	if(length > JOB_LOG_BATCH) {
+
+		writeFully(jobLogFD, text, length);
+		return;
+	}
+
+	if(jobLogUsed == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &jobLogOldest);
+	}
+
+	memcpy(jobLogBuffer + jobLogUsed, text, length);
+	jobLogUsed += length;
+}
+
+
+
+/*
+ * NAME
+ *   jobLogTimeLeft - how long the buffered log can wait
+ * SYNOPSIS
+ *   jobLogTimeLeft()
+ * DESCRIPTION
+ *   Milliseconds until the oldest buffered byte has waited JOB_LOG_INTERVAL, 0 if it's due now, or -1 when nothing is buffered.
+ *   waitForJob() sleeps no longer than this, so the log keeps up with background jobs while a long foreground job has the shell.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int jobLogTimeLeft() {
+
+	if(jobLogUsed == 0) {
+		return -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long waited = (now.tv_sec - jobLogOldest.tv_sec) * 1000L + (now.tv_nsec - jobLogOldest.tv_nsec) / 1000000L;
+
+	return (waited >= JOB_LOG_INTERVAL) ? 0 : (int)(JOB_LOG_INTERVAL - waited);
+}
+
+
+
+/*
+ * NAME
+ *   releaseJobOutput - forget a job's collected output
+ * SYNOPSIS
+ *   releaseJobOutput(int index)
+ * DESCRIPTION
+ *   Closes the pipe if it's still open, which also takes it out of the epoll set, and frees the ring.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void releaseJobOutput(int index) {
+
+	struct jobOutput* output = &jobOutputs[index];
+
+	if(output->fd != -1) {
+		close(output->fd);
+	}
+
+	free(output->ring);
+	memset(output, 0, sizeof(struct jobOutput));
+	output->fd = -1;
+}
+
+
+
+/*
+ * NAME
+ *   startJobOutput - start collecting what a background job writes
+ * SYNOPSIS
+ *   startJobOutput(int jobNumber, pid_t pid, int readFD)
+ * DESCRIPTION
+ *   Called by launchJob() once every stage is running with the write end of the pipe as its stdout and stderr. The job gets a
+ *   free entry, or a new one at the end of the table. Output held for an older job with the same number is kept, but if
+ *   JOB_OUTPUT_KEPT finished jobs' rings are already waiting, the oldest of them is dropped to make room.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void startJobOutput(int jobNumber, pid_t pid, int readFD) {
+
+	if(jobOutputEpollFD == -1) {
+
+		jobOutputEpollFD = epoll_create1(EPOLL_CLOEXEC);
+
+		if(jobOutputEpollFD == -1) {
+			perror("Major problem creating the job output poller!\n");
+			exit(1);
+		}
+	}
+
+	int freeIndex = -1;
+	int oldestFinished = -1;
+	int finishedCount = 0;
+
+	for(int index = 0; index < jobOutputCapacity; index++) {
+
+		if(!jobOutputs[index].inUse) {
+
+			if(freeIndex == -1) {
+				freeIndex = index;
+			}
+
+			continue;
+		}
+
+		if(jobOutputs[index].fd == -1) {		// Finished, only waiting to be printed
+
+			finishedCount++;
+
+			if(oldestFinished == -1 || jobOutputs[index].serial < jobOutputs[oldestFinished].serial) {
+				oldestFinished = index;
+			}
+		}
+	}
+
+	if(finishedCount >= JOB_OUTPUT_KEPT) {
+
+		releaseJobOutput(oldestFinished);
+
+		if(freeIndex == -1 || oldestFinished < freeIndex) {
+			freeIndex = oldestFinished;
+		}
+	}
+
+	if(freeIndex == -1) {
+
+		int oldCapacity = jobOutputCapacity;
+
+		jobOutputCapacity = (jobOutputCapacity == 0) ? 16 : jobOutputCapacity * 2;
+		jobOutputs = realloc(jobOutputs, jobOutputCapacity * sizeof(struct jobOutput));
+
+		if(jobOutputs == NULL) {
+			perror("Major problem growing the job output table!\n");
+			exit(1);
+		}
+
+		memset(jobOutputs + oldCapacity, 0, (jobOutputCapacity - oldCapacity) * sizeof(struct jobOutput));
+
+		for(int index = oldCapacity; index < jobOutputCapacity; index++) {
+			jobOutputs[index].fd = -1;
+		}
+
+		freeIndex = oldCapacity;
+	}
+
+	fcntl(readFD, F_SETFL, O_NONBLOCK);
+
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.u32 = (unsigned int)freeIndex;
+
+	if(epoll_ctl(jobOutputEpollFD, EPOLL_CTL_ADD, readFD, &event) == -1) {
+		perror("Major problem watching a job's output!\n");
+		exit(1);
+	}
+
+	jobOutputs[freeIndex].inUse = true;
+	jobOutputs[freeIndex].serial = ++jobOutputSerial;
+	jobOutputs[freeIndex].jobNumber = jobNumber;
+	jobOutputs[freeIndex].pid = pid;
+	jobOutputs[freeIndex].fd = readFD;
+}
+
+
+
+/*
+ * NAME
+ *   storeJobOutput - add bytes a job wrote to its ring and to the log
+ * SYNOPSIS
+ *   storeJobOutput(int index, char* text, size_t length)
+ * DESCRIPTION
+ *   The ring keeps the newest bytes, counting the ones it pushes out. Every line that starts in the log gets the job's prefix.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void storeJobOutput(int index, char* text, size_t length) {
+
+	struct jobOutput* output = &jobOutputs[index];
+
+	if(output->ring == NULL) {
+
+		output->ring = malloc(JOB_OUTPUT_RING);
+
+		if(output->ring == NULL) {
+			perror("Major problem allocating a job output ring!\n");
+			exit(1);
+		}
+	}
+
+	char* kept = text;		// Only the last JOB_OUTPUT_RING bytes can survive
+	size_t keptLength = length;
+
+	if(keptLength > JOB_OUTPUT_RING) {
+		kept = text + (keptLength - JOB_OUTPUT_RING);
+		keptLength = JOB_OUTPUT_RING;
+	}
+
+	size_t firstPart = JOB_OUTPUT_RING - output->head;		// Room before the ring wraps
+
+	if(firstPart > keptLength) {
+		firstPart = keptLength;
+	}
+
+	memcpy(output->ring + output->head, kept, firstPart);
+	memcpy(output->ring, kept + firstPart, keptLength - firstPart);
+	output->head = (output->head + keptLength) % JOB_OUTPUT_RING;
+
+	if(output->held + length > JOB_OUTPUT_RING) {
+		output->dropped += output->held + length - JOB_OUTPUT_RING;
+		output->held = JOB_OUTPUT_RING;
+	}
+
+	else {
+		output->held += length;
+	}
+
+
+	if(jobLogFD == -1) {
+		return;
+	}
+
+	char prefix[48];
+	int prefixLength = snprintf(prefix, sizeof(prefix), "[%d] %d ", output->jobNumber, (int)output->pid);
+	size_t position = 0;
+
+	while(position < length) {
+
+		char* lineEnd = memchr(text + position, '\n', length - position);
+		size_t lineLength = (lineEnd != NULL) ? (size_t)(lineEnd - (text + position)) + 1 : length - position;
+
+		if(!output->midLine) {
+			appendJobLog(prefix, prefixLength);
+		}
+
+		appendJobLog(text + position, lineLength);
+		output->midLine = (lineEnd == NULL);
+		position += lineLength;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   readJobOutput - collect whatever background jobs have written
+ * SYNOPSIS
+ *   readJobOutput()
+ * DESCRIPTION
+ *   Asks the epoll set which pipes are readable without waiting, and reads a bounded amount from each so one chatty job can't keep
+ *   the shell from everything else; epoll reports it again next time. A pipe at end of file has lost every writer, so it's closed
+ *   and a line left unfinished in the log is ended.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void readJobOutput() {
+
+	static char chunk[65536];
+	struct epoll_event events[64];
+	int eventCount;
+
+	if(jobOutputEpollFD == -1) {
+		return;
+	}
+
+	while((eventCount = epoll_wait(jobOutputEpollFD, events, 64, 0)) > 0) {
+
+		for(int event = 0; event < eventCount; event++) {
+
+			int index = (int)events[event].data.u32;
+			struct jobOutput* output = &jobOutputs[index];
+			ssize_t bytesRead = -1;
+
+			for(int reads = 0; reads < 16 && output->fd != -1; reads++) {
+
+				bytesRead = read(output->fd, chunk, sizeof(chunk));
+
+				if(bytesRead <= 0) {
+					break;
+				}
+
+				storeJobOutput(index, chunk, bytesRead);
+			}
+
+			if(bytesRead == 0 || (bytesRead == -1 && errno != EAGAIN && errno != EINTR)) {
+
+				close(output->fd);
+				output->fd = -1;
+
+				if(output->midLine) {
+					appendJobLog("\n", 1);
+					output->midLine = false;
+				}
+			}
+		}
+
+		if(eventCount < 64) {		// Everything that was ready has had its turn
+			break;
+		}
+	}
+}
+
+
+
+// Cached command output
+//
+// A cached command that misses has its stdout sent into a pipe, and whatever is waiting copies each chunk to where the output was
+// going and to the entry being stored as it arrives, so the output of a slow command shows up as it's written instead of all at
+// the end. A command that gets stopped keeps its pipe, and the copying carries on from the prompt until the command finishes.
+
+int cacheTeeFD = -1;			// Read end of the pipe, -1 when no cached command is writing
+int cacheTeeOutputFD = -1;		// The shell's copy of where the command's stdout was going, -1 if it was closed
+int cacheTeeCaptureFD = -1;		// The entry being stored, left at -1 once it won't be stored
+
+
+
+/*
+ * NAME
+ *   closeCacheTee - stop copying a cached command's output
+ * SYNOPSIS
+ *   closeCacheTee()
+ * DESCRIPTION
+ *   Closes the pipe and the shell's copy of the command's stdout. The entry belongs to runCachedJob() and is left alone.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void closeCacheTee() {
+
+	close(cacheTeeFD);
+	cacheTeeFD = -1;
+
+	if(cacheTeeOutputFD != -1) {
+		close(cacheTeeOutputFD);
+		cacheTeeOutputFD = -1;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   pumpCacheTee - copy what a cached command has written so far
+ * SYNOPSIS
+ *   pumpCacheTee(bool untilEmpty)
+ * DESCRIPTION
+ *   Reads a bounded amount from the pipe, like readJobOutput() does, unless untilEmpty asks for everything that's there, and
+ *   writes each chunk to the command's stdout and to the entry. If the entry can't be written it's given up on, and the output
+ *   still goes where it was going. The pipe is closed once everything writing to it has gone.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void pumpCacheTee(bool untilEmpty) {
+
+	static char chunk[65536];
+	ssize_t bytesRead = -1;
+
+	if(cacheTeeFD == -1) {
+		return;
+	}
+
+	fflush(stdout);		// Keep anything the shell printed before the output in order
+
+	for(int reads = 0; reads < 16 || untilEmpty; reads++) {
+
+		bytesRead = read(cacheTeeFD, chunk, sizeof(chunk));
+
+		if(bytesRead <= 0) {
+			break;
+		}
+
+		if(cacheTeeCaptureFD != -1 && write(cacheTeeCaptureFD, chunk, bytesRead) != bytesRead) {
+			cacheTeeCaptureFD = -1;
+		}
+
+		if(cacheTeeOutputFD != -1 && write(cacheTeeOutputFD, chunk, bytesRead) != bytesRead) {		// Nobody is reading it any more
+			close(cacheTeeOutputFD);
+			cacheTeeOutputFD = -1;
+		}
+	}
+
+	if(bytesRead == 0 || (bytesRead == -1 && errno != EAGAIN && errno != EINTR)) {
+		closeCacheTee();
+	}
+}
+
+
+
+// Event loop
+//
+// SIGCHLD and SIGTSTP are blocked for the life of the shell and read from a signalfd instead, so nothing ever runs in signal
+// context. Everything that waits (reading input, waiting on a foreground job, the parallel builtin) sleeps in poll() on the
+// signal descriptor, and reading input polls the input descriptor alongside it. The shell uses no CPU while idle, and finished
+// background jobs are reported the moment they're reaped instead of after the next line is entered. SIGINT stays ignored rather
+// than going through the descriptor because children inherit that disposition, which is what keeps ^C away from background jobs.
+// With the zygote launcher its socket is polled as well, since the children it starts report their exits through it instead of
+// through SIGCHLD, and so is the epoll set of collected background output, so a chatty job never blocks on a full pipe, and the
+// pipe of a cached command whose output is being stored.
+
+/*
+ * NAME
+ *   handleSignals - act on every signal waiting on the signal descriptor
+ * SYNOPSIS
+ *   handleSignals()
+ * DESCRIPTION
+ *   Reads the descriptor until it's empty. SIGTSTP toggles foreground-only mode and SIGCHLD reaps children, once for however many
+ *   SIGCHLDs were queued. SIGHUP or SIGTERM ends the read loop as if exit had been typed, so the jobs are shut down the same way
+ *   instead of being left behind by a shell that died. Events waiting on the zygote's socket, collected background output and a
+ *   cached command's output are read as well. Returns how many lines were printed at the prompt, so the caller knows to show the
+ *   prompt again.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int handleSignals() {
+
+	struct signalfd_siginfo signalInfo[16];
+	bool childExited = false;
+	int printed = 0;
+	ssize_t bytesRead;
+
+	while((bytesRead = read(signalFD, signalInfo, sizeof(signalInfo))) > 0) {
+
+		for(size_t index = 0; index < bytesRead / sizeof(struct signalfd_siginfo); index++) {
+
+			if(signalInfo[index].ssi_signo == SIGCHLD) {
+				childExited = true;
+			}
+
+			else if(signalInfo[index].ssi_signo == SIGTSTP && toggleForegroundOnly()) {
+				printed++;
+			}
+
+			else if(signalInfo[index].ssi_signo == SIGHUP || signalInfo[index].ssi_signo == SIGTERM) {
+				shutdownSignal = signalInfo[index].ssi_signo;
+				userTypedExit = true;		// Also stops any loop that's running
+			}
+		}
+	}
+
+	if(childExited) {
+		reapChildren();
+	}
+
+	if(zygoteFD != -1 || heldZygoteEventCount > 0) {
+		readZygoteEvents(false);
+	}
+
+	readJobOutput();
+	pumpCacheTee(false);
+
+	return printed;
+}
+
+
+
+/*
+ * NAME
+ *   waitForSignals - sleep until a signal arrives and handle it
+ * SYNOPSIS
+ *   waitForSignals(int milliseconds)
+ * DESCRIPTION
+ *   What the foreground waiter and the parallel builtin sleep in. Returns once handleSignals() has run at least once, or after
+ *   milliseconds with nothing to handle. -1 waits for as long as it takes.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void waitForSignals(int milliseconds) {
+
+	struct pollfd pollFDs[4] = {{signalFD, POLLIN, 0}, {zygoteFD, POLLIN, 0}, {jobOutputEpollFD, POLLIN, 0}, {cacheTeeFD, POLLIN, 0}};	// poll() skips -1
+
+	while(poll(pollFDs, 4, (heldZygoteEventCount > 0) ? 0 : milliseconds) == -1) {		// Held statuses are already waiting
+
+		if(errno != EINTR) {
+			perror("Major problem waiting for signals!\n");
+			exit(1);
+		}
+	}
+
+	handleSignals();
+}
+
+
+
+/*
+ * NAME
+ *   showPrompt - print a prompt and remember it
+ * SYNOPSIS
+ *   showPrompt(char* prompt)
+ * DESCRIPTION
+ *   ": " before a command, "> " before the rest of one. The line editor and waitForInput() draw the same prompt again after a
+ *   message has been printed over it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void showPrompt(char* prompt) {
+
+	promptText = prompt;
+	printf("%s", prompt);
+	fflush(stdout);
+}
+
+
+
+/*
+ * NAME
+ *   waitForInput - sleep until inputFD can be read, handling signals in the meantime
+ * SYNOPSIS
+ *   waitForInput(int inputFD)
+ * DESCRIPTION
+ *   Called by readInputLine() before every read() so the shell never blocks on input with signals piling up. Background jobs
+ *   that finish while the user is typing are reported straight away, and the prompt is shown again after any message. The job
+ *   log is flushed when there's nothing to read yet, right before the shell would go to sleep. When the line editor is waiting,
+ *   its line is cleared before anything can be printed and the editor draws the prompt and the line again itself, which is
+ *   what a true return asks for. Also returns once SIGHUP or SIGTERM has set shutdownSignal, with nothing to read.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool waitForInput(int inputFD) {
+
+	struct pollfd pollFDs[5] = {{inputFD, POLLIN, 0}, {signalFD, POLLIN, 0}, {zygoteFD, POLLIN, 0}, {jobOutputEpollFD, POLLIN, 0},
+			{cacheTeeFD, POLLIN, 0}};
+	bool lineCleared = false;
+
+	while(1) {
+
+		pollFDs[2].fd = zygoteFD;		// In case the zygote went away since the last poll
+		pollFDs[3].fd = jobOutputEpollFD;	// Or the first background output pipe was made
+		pollFDs[4].fd = cacheTeeFD;		// Or a stopped cached command finished
+
+		bool flushFirst = (jobLogUsed > 0);		// Only wait once the log is written out
+		int ready = poll(pollFDs, 5, (heldZygoteEventCount > 0 || flushFirst) ? 0 : -1);	// Held statuses are already waiting
+
+		if(ready == -1) {
+
+			if(errno == EINTR) {
+				continue;
+			}
+
+			perror("Major problem waiting for input!\n");
+			exit(1);
+		}
+
+		if(ready == 0 && flushFirst) {
+			flushJobLog();
+		}
+
+		if((pollFDs[1].revents & POLLIN) || pollFDs[2].revents != 0 || pollFDs[3].revents != 0 || pollFDs[4].revents != 0 ||
+				heldZygoteEventCount > 0) {
+
+			if(editorWaiting && !lineCleared && ((pollFDs[1].revents & POLLIN) || pollFDs[2].revents != 0 || pollFDs[4].revents != 0 ||
+					heldZygoteEventCount > 0)) {		// Collected output alone never prints anything, a cached command's can
+
+				printf("\r\x1b[K");		// Messages go where the line was, it's drawn again below them
+				fflush(stdout);
+				lineCleared = true;
+			}
+
+			int printed = handleSignals();
+
+			if(!foregroundRunning) {		// Not in the middle of the parallel builtin
+				printed = printed + reportFinishedJobs();
+			}
+
+			if(printed > 0 && interactiveMode && !foregroundRunning && !editorWaiting) {
+				showPrompt(promptText);
+			}
+
+			if(lineCleared || shutdownSignal != 0) {	// The editor draws its line again right away, then comes back to wait
+				return lineCleared;
+			}
+		}
+
+		if(pollFDs[0].revents != 0) {		// Data, end of file or an error, read() will tell which
+			return lineCleared;
+		}
+	}
+}
+
+
+
+// Shell variables
+//
+// Every variable lives in a chained hash table keyed by name, filled from the environment at startup, so $NAME and the shell's
+// own lookups of PATH and HOME are one hash and usually one strcmp(). Exported variables keep a ready made "NAME=value" string,
+// and the environment array children get is only rebuilt from those, by prepareEnvironment() right before a launch, when an
+// exported variable has changed since the last one. Launching the same way a thousand times builds it once. A string the current
+// environ still points at is only freed once environ has moved on, so getenv() in the shell or in libc never reads freed memory.
+
+struct shellVariable {
+	char* name;
+	char* value;
+	size_t valueCapacity;			// Bytes allocated for value, so setting a shorter one doesn't allocate
+	char* environmentEntry;			// "NAME=value" for exported variables, NULL otherwise
+	bool entryInEnvironment;		// environmentEntry is in the array environ points at now
+	struct shellVariable* next;		// Next variable in the same bucket
+};
+
+struct shellVariable** variableBuckets = NULL;
+int variableBucketCount = 0;			// Always a power of two
+int variableCount = 0;
+int exportedCount = 0;
+char** childEnvironment = NULL;			// What environ points at once the shell has built it
+bool environmentChanged = true;			// An exported variable changed since childEnvironment was built
+char** retiredEntries = NULL;			// Replaced NAME=value strings environ still has, freed once it's rebuilt
+int retiredEntryCount = 0;
+int retiredEntryCapacity = 0;
+
+char* shellName = "smallsh";			// What $0 expands to, the script's name when running one
+char** positionalParameters = NULL;		// $1 and up, the script's arguments or those of the function being run
+int positionalCount = 0;			// $#
+
+
+
+/*
+ * NAME
+ *   hashCommandName - hash a name for the shell's hash tables
+ * SYNOPSIS
+ *   hashCommandName(char* name)
+ * DESCRIPTION
+ *   FNV-1a over the bytes of the name. Used for variables, the command path cache and the built in index.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+unsigned int hashCommandName(char* name) {
+
+	unsigned int hash = 2166136261u;
+
+	for(unsigned char* character = (unsigned char*)name; *character != '\0'; character++) {
+		hash = (hash ^ *character) * 16777619u;
+	}
+
+	return hash;
+}
+
+
+
+/*
+ * NAME
+ *   findVariable - look up a shell variable
+ * SYNOPSIS
+ *   findVariable(char* name)
+ * DESCRIPTION
+ *   Returns the variable called name, or NULL if it isn't set.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct shellVariable* findVariable(char* name) {
+
+	if(variableBucketCount == 0) {
+		return NULL;
+	}
+
+	struct shellVariable* variable = variableBuckets[hashCommandName(name) & (variableBucketCount - 1)];
+
+	while(variable != NULL && strcmp(variable->name, name) != 0) {
+		variable = variable->next;
+	}
+
+	return variable;
+}
+
+
+
+/*
+ * NAME
+ *   variableValue - the value of a shell variable
+ * SYNOPSIS
+ *   variableValue(char* name)
+ * DESCRIPTION
+ *   What the shell uses instead of getenv(), since environ is only brought up to date when something is launched. Returns NULL if
+ *   the variable isn't set.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* variableValue(char* name) {
+
+	struct shellVariable* variable = findVariable(name);
+
+	return (variable != NULL) ? variable->value : NULL;
+}
+
+
+
+/*
+ * NAME
+ *   retireEnvironmentEntry - let go of a variable's NAME=value string
+ * SYNOPSIS
+ *   retireEnvironmentEntry(struct shellVariable* variable)
+ * DESCRIPTION
+ *   Frees the string straight away if environ doesn't have it, otherwise keeps it for prepareEnvironment() to free once environ
+ *   points at the new array. At most one string per variable waits like this.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void retireEnvironmentEntry(struct shellVariable* variable) {
+
+	if(!variable->entryInEnvironment) {
+		free(variable->environmentEntry);
+	}
+
+	else {
+
+		if(retiredEntryCount == retiredEntryCapacity) {
+
+			retiredEntryCapacity = (retiredEntryCapacity == 0) ? 16 : retiredEntryCapacity * 2;
+			retiredEntries = realloc(retiredEntries, retiredEntryCapacity * sizeof(char*));
+
+			if(retiredEntries == NULL) {
+				perror("Major problem keeping an environment entry!\n");
+				exit(1);
+			}
+		}
+
+		retiredEntries[retiredEntryCount++] = variable->environmentEntry;
+	}
+
+	variable->environmentEntry = NULL;
+	variable->entryInEnvironment = false;
+}
+
+
+
+/*
+ * NAME
+ *   updateEnvironmentEntry - rebuild the NAME=value string of a variable
+ * SYNOPSIS
+ *   updateEnvironmentEntry(struct shellVariable* variable)
+ * DESCRIPTION
+ *   Called whenever an exported variable's value changes, and marks the environment for rebuilding.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void updateEnvironmentEntry(struct shellVariable* variable) {
+
+	size_t nameLength = strlen(variable->name);
+	size_t valueLength = strlen(variable->value);
+
+	retireEnvironmentEntry(variable);
+	variable->environmentEntry = malloc(nameLength + valueLength + 2);
+
+	if(variable->environmentEntry == NULL) {
+		perror("Major problem exporting a variable!\n");
+		exit(1);
+	}
+
+	memcpy(variable->environmentEntry, variable->name, nameLength);
+	variable->environmentEntry[nameLength] = '=';
+	memcpy(variable->environmentEntry + nameLength + 1, variable->value, valueLength + 1);
+
+	environmentChanged = true;
+}
+
+
+
+/*
+ * NAME
+ *   setVariable - set a shell variable, creating it if needed
+ * SYNOPSIS
+ *   setVariable(char* name, char* value, bool exportIt)
+ * DESCRIPTION
+ *   Copies name and value. A variable that's already exported stays exported, and exportIt exports it. The bucket array doubles
+ *   once there are more variables than buckets so chains stay short. Returns the variable.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct shellVariable* setVariable(char* name, char* value, bool exportIt) {
+
+	struct shellVariable* variable = findVariable(name);
+
+	if(variable == NULL) {
+
+		if(variableCount >= variableBucketCount) {		// Grow and rehash
+
+			int newBucketCount = (variableBucketCount == 0) ? 64 : variableBucketCount * 2;
+			struct shellVariable** newBuckets = calloc(newBucketCount, sizeof(struct shellVariable*));
+
+			if(newBuckets == NULL) {
+				perror("Major problem growing the variable table!\n");
+				exit(1);
+			}
+
+			for(int bucket = 0; bucket < variableBucketCount; bucket++) {
+
+				struct shellVariable* moving = variableBuckets[bucket];
+
+				while(moving != NULL) {
+					struct shellVariable* next = moving->next;
+					int newBucket = hashCommandName(moving->name) & (newBucketCount - 1);
+					moving->next = newBuckets[newBucket];
+					newBuckets[newBucket] = moving;
+					moving = next;
+				}
+			}
+
+			free(variableBuckets);
+			variableBuckets = newBuckets;
+			variableBucketCount = newBucketCount;
+		}
+
+		variable = malloc(sizeof(struct shellVariable));
+
+		if(variable == NULL) {
+			perror("Major problem adding a variable!\n");
+			exit(1);
+		}
+
+		variable->name = strdup(name);
+		variable->value = NULL;
+		variable->valueCapacity = 0;
+		variable->environmentEntry = NULL;
+		variable->entryInEnvironment = false;
+
+		int bucket = hashCommandName(name) & (variableBucketCount - 1);
+		variable->next = variableBuckets[bucket];
+		variableBuckets[bucket] = variable;
+		variableCount++;
+	}
+
+	if(value == NULL && variable->value == NULL) {		// export NAME of a variable that was never set
+		value = "";
+	}
+
+	if(value != NULL) {
+
+		size_t valueLength = strlen(value) + 1;
+
+		if(valueLength > variable->valueCapacity) {		// A loop variable keeps reusing the same buffer
+
+			char* newValue = malloc(valueLength);
+
+			if(newValue == NULL) {
+				perror("Major problem setting a variable!\n");
+				exit(1);
+			}
+
+			memcpy(newValue, value, valueLength);		// value may be the old buffer
+			free(variable->value);
+			variable->value = newValue;
+			variable->valueCapacity = valueLength;
+		}
+
+		else {
+			memmove(variable->value, value, valueLength);
+		}
+	}
+
+	if(exportIt && variable->environmentEntry == NULL) {
+		exportedCount++;
+	}
+
+	if(exportIt || variable->environmentEntry != NULL) {
+		updateEnvironmentEntry(variable);
+	}
+
+	return variable;
+}
+
+
+
+/*
+ * NAME
+ *   unsetVariable - remove a shell variable
+ * SYNOPSIS
+ *   unsetVariable(char* name)
+ * DESCRIPTION
+ *   Unlinks and frees the variable if it exists. Removing an exported one marks the environment for rebuilding.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void unsetVariable(char* name) {
+
+	if(variableBucketCount == 0) {
+		return;
+	}
+
+	struct shellVariable** link = &variableBuckets[hashCommandName(name) & (variableBucketCount - 1)];
+
+	while(*link != NULL && strcmp((*link)->name, name) != 0) {
+		link = &(*link)->next;
+	}
+
+	struct shellVariable* variable = *link;
+
+	if(variable == NULL) {
+		return;
+	}
+
+	*link = variable->next;
+
+	if(variable->environmentEntry != NULL) {
+		exportedCount--;
+		environmentChanged = true;
+	}
+
+	retireEnvironmentEntry(variable);
+	free(variable->name);
+	free(variable->value);
+	free(variable);
+	variableCount--;
+}
+
+
+
+/*
+ * NAME
+ *   importEnvironment - create an exported variable for everything in the environment
+ * SYNOPSIS
+ *   importEnvironment()
+ * DESCRIPTION
+ *   Called once from main() before anything reads a variable.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void importEnvironment() {
+
+	for(char** entry = environ; *entry != NULL; entry++) {
+
+		char* equals = strchr(*entry, '=');
+
+		if(equals == NULL) {
+			continue;
+		}
+
+		char name[equals - *entry + 1];
+		memcpy(name, *entry, equals - *entry);
+		name[equals - *entry] = '\0';
+
+		setVariable(name, equals + 1, true);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   prepareEnvironment - bring environ up to date before launching
+ * SYNOPSIS
+ *   prepareEnvironment()
+ * DESCRIPTION
+ *   Does nothing unless an exported variable changed since the last call. Otherwise collects the NAME=value strings of the
+ *   exported variables into childEnvironment and points environ at it, which is what exec and posix_spawn() pass on. The strings
+ *   the old array held are freed after that.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void prepareEnvironment() {
+
+	if(!environmentChanged) {
+		return;
+	}
+
+	childEnvironment = realloc(childEnvironment, (exportedCount + 1) * sizeof(char*));
+
+	if(childEnvironment == NULL) {
+		perror("Major problem building the environment!\n");
+		exit(1);
+	}
+
+	int entryCount = 0;
+
+	for(int bucket = 0; bucket < variableBucketCount; bucket++) {
+
+		for(struct shellVariable* variable = variableBuckets[bucket]; variable != NULL; variable = variable->next) {
+
+			if(variable->environmentEntry != NULL) {
+				childEnvironment[entryCount] = variable->environmentEntry;
+				variable->entryInEnvironment = true;
+				entryCount++;
+			}
+		}
+	}
+
+	childEnvironment[entryCount] = NULL;
+	environ = childEnvironment;
+	environmentChanged = false;
+
+	for(int index = 0; index < retiredEntryCount; index++) {		// Nothing points at these anymore
+		free(retiredEntries[index]);
+	}
+
+	retiredEntryCount = 0;
+}
+
+
+
+/*
+ * NAME
+ *   isVariableName - check a name can be a variable
+ * SYNOPSIS
+ *   isVariableName(char* name, size_t length)
+ * DESCRIPTION
+ *   True if the first length bytes of name are a letter or underscore followed by letters, digits and underscores.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool isVariableName(char* name, size_t length) {
+
+	if(length == 0 || (name[0] >= '0' && name[0] <= '9')) {
+		return false;
+	}
+
+	for(size_t index = 0; index < length; index++) {
+
+		char character = name[index];
+
+		if(!((character >= 'a' && character <= 'z') || (character >= 'A' && character <= 'Z') || (character >= '0' && character <= '9') || character == '_')) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   lastExitValue - what $? expands to
+ * SYNOPSIS
+ *   lastExitValue()
+ * DESCRIPTION
+ *   The exit value status would report, or 128 plus the signal number if the last foreground command was killed. 0 before any
+ *   foreground command has run. A built in like cd or fg that status doesn't report on still sets it, through builtinExitValue.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int lastExitValue() {
+
+	if(builtinExitValue != -1) {
+		return builtinExitValue;
+	}
+
+	if(noForegroundProcessesRun) {
+		return 0;
+	}
+
+	return killedBySignal ? 128 + termSignal : exitStatusCode;
+}
+
+
+
+// PATH index
+//
+// Every name in every PATH directory, for completing commands at the prompt. Each directory keeps its own sorted list, so all the
+// names starting with a prefix are found with one binary search per directory. Scripts never build it: it's read the first time
+// the line editor is left waiting at a prompt, so not even the first Tab pays for reading PATH. After that every Tab stat()s the
+// directories and only rereads one whose mtime (or, for a relative entry, the directory it names) changed, so installing one
+// program rereads one directory. Entries are taken from readdir() without a stat() each, so a PATH directory with tens of
+// thousands of programs costs one pass over it. Once built, the index also answers misses in the command path cache without
+// trying every PATH directory.
+
+struct pathDirectory {
+	char* path;			// One PATH entry, "" for the current directory
+	bool read;			// Names are from the directory with this identity and mtime
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	char* nameText;			// Every name, each with its '\0'
+	size_t textUsed;
+	size_t textCapacity;
+	char** names;			// Sorted with strcmp(), pointing into nameText
+	size_t nameCount;
+	size_t nameCapacity;
+};
+
+struct pathDirectory* pathDirectories = NULL;
+int pathDirectoryCount = 0;
+char* indexedPATH = NULL;		// Value of PATH the directory list was made from
+
+
+
+/*
+ * NAME
+ *   compareNames - qsort() comparison for an array of strings
+ * SYNOPSIS
+ *   compareNames(const void* first, const void* second)
+ * DESCRIPTION
+ *   Sorts with strcmp(), which is also the order the binary searches over the index expect.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int compareNames(const void* first, const void* second) {
+
+	return strcmp(*(char**)first, *(char**)second);
+}
+
+
+
+/*
+ * NAME
+ *   readPathDirectory - read the names in one PATH directory into the index
+ * SYNOPSIS
+ *   readPathDirectory(struct pathDirectory* directory)
+ * DESCRIPTION
+ *   Replaces whatever the directory had before. Subdirectories are left out when readdir() says what they are, anything else
+ *   could be a program. The names end up sorted.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void readPathDirectory(struct pathDirectory* directory) {
+
+	directory->textUsed = 0;
+	directory->nameCount = 0;
+
+	DIR* stream = opendir((directory->path[0] == '\0') ? "." : directory->path);
+
+	if(stream == NULL) {
+		return;
+	}
+
+	struct dirent* entry;
+
+	while((entry = readdir(stream)) != NULL) {
+
+		if(entry->d_type == DT_DIR || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		size_t length = strlen(entry->d_name) + 1;
+
+		if(length > directory->textCapacity - directory->textUsed) {
+
+			while(length > directory->textCapacity - directory->textUsed) {
+				directory->textCapacity = (directory->textCapacity == 0) ? 4096 : directory->textCapacity * 2;
+			}
+
+			directory->nameText = realloc(directory->nameText, directory->textCapacity);
+
+			if(directory->nameText == NULL) {
+				perror("Major problem growing the PATH index!\n");
+				exit(1);
+			}
+		}
+
+		memcpy(directory->nameText + directory->textUsed, entry->d_name, length);
+		directory->textUsed += length;
+		directory->nameCount++;
+	}
+
+	closedir(stream);
+
+	if(directory->nameCount > directory->nameCapacity) {
+
+		directory->nameCapacity = directory->nameCount;
+		directory->names = realloc(directory->names, directory->nameCapacity * sizeof(char*));
+
+		if(directory->names == NULL) {
+			perror("Major problem growing the PATH index!\n");
+			exit(1);
+		}
+	}
+
+	char* name = directory->nameText;		// Only now, the text has stopped moving
+
+	for(size_t index = 0; index < directory->nameCount; index++) {
+		directory->names[index] = name;
+		name = name + strlen(name) + 1;
+	}
+
+	qsort(directory->names, directory->nameCount, sizeof(char*), compareNames);
+}
+
+
+
+/*
+ * NAME
+ *   pathDirectoryUnchanged - check a PATH directory against what the index read
+ * SYNOPSIS
+ *   pathDirectoryUnchanged(struct pathDirectory* directory, struct stat* directoryInfo)
+ * DESCRIPTION
+ *   directoryInfo is from a fresh stat() of the directory. True when the directory has been read and is still the same one with
+ *   the same mtime, so no name has been added or taken away since.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool pathDirectoryUnchanged(struct pathDirectory* directory, struct stat* directoryInfo) {
+
+	return directory->read && directory->device == directoryInfo->st_dev && directory->inode == directoryInfo->st_ino &&
+			directory->modified.tv_sec == directoryInfo->st_mtim.tv_sec &&
+			directory->modified.tv_nsec == directoryInfo->st_mtim.tv_nsec;
+}
+
+
+
+/*
+ * NAME
+ *   refreshPathIndex - bring the PATH index up to date
+ * SYNOPSIS
+ *   refreshPathIndex()
+ * DESCRIPTION
+ *   Makes a new directory list when PATH has changed, then stat()s every directory and rereads the ones that are new or whose
+ *   identity or mtime changed since they were read. A directory that's gone has no names until it comes back.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void refreshPathIndex() {
+
+	char* PATH = variableValue("PATH");
+
+	if(PATH == NULL) {
+		PATH = "/bin:/usr/bin";		// Same default searchPATH() uses
+	}
+
+	if(indexedPATH == NULL || strcmp(indexedPATH, PATH) != 0) {
+
+		for(int index = 0; index < pathDirectoryCount; index++) {
+			free(pathDirectories[index].path);
+			free(pathDirectories[index].nameText);
+			free(pathDirectories[index].names);
+		}
+
+		pathDirectoryCount = 1;
+
+		for(char* separator = strchr(PATH, ':'); separator != NULL; separator = strchr(separator + 1, ':')) {
+			pathDirectoryCount++;
+		}
+
+		free(pathDirectories);
+		pathDirectories = calloc(pathDirectoryCount, sizeof(struct pathDirectory));
+
+		if(pathDirectories == NULL) {
+			perror("Major problem allocating the PATH index!\n");
+			exit(1);
+		}
+
+		char* directory = PATH;
+
+		for(int index = 0; index < pathDirectoryCount; index++) {
+
+			char* separator = strchr(directory, ':');
+			size_t directoryLength = (separator != NULL) ? (size_t)(separator - directory) : strlen(directory);
+
+			pathDirectories[index].path = strndup(directory, directoryLength);
+			directory = directory + directoryLength + 1;
+		}
+
+		free(indexedPATH);
+		indexedPATH = strdup(PATH);
+	}
+
+	for(int index = 0; index < pathDirectoryCount; index++) {
+
+		struct pathDirectory* directory = &pathDirectories[index];
+		struct stat directoryInfo;
+
+		if(stat((directory->path[0] == '\0') ? "." : directory->path, &directoryInfo) == -1) {
+
+			directory->read = false;
+			directory->nameCount = 0;
+			continue;
+		}
+
+		if(pathDirectoryUnchanged(directory, &directoryInfo)) {
+			continue;
+		}
+
+		readPathDirectory(directory);
+		directory->read = true;
+		directory->device = directoryInfo.st_dev;
+		directory->inode = directoryInfo.st_ino;
+		directory->modified = directoryInfo.st_mtim;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   firstIndexedName - binary search one PATH directory for a prefix
+ * SYNOPSIS
+ *   firstIndexedName(struct pathDirectory* directory, char* prefix)
+ * DESCRIPTION
+ *   Returns the position of the first name that sorts at or after prefix, so every name starting with prefix follows from
+ *   there. Returns nameCount when there's none.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t firstIndexedName(struct pathDirectory* directory, char* prefix) {
+
+	size_t low = 0;
+	size_t high = directory->nameCount;
+
+	while(low < high) {
+
+		size_t middle = low + (high - low) / 2;
+
+		if(strcmp(directory->names[middle], prefix) < 0) {
+			low = middle + 1;
+		}
+
+		else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+
+
+/*
+ * NAME
+ *   findIndexedCommand - resolve a command through the PATH index
+ * SYNOPSIS
+ *   findIndexedCommand(char* name, char* foundPath, size_t foundPathSize)
+ * DESCRIPTION
+ *   Checks the directories the index lists name in, in PATH order, and copies the first one that still holds an executable
+ *   regular file of that name into foundPath. Only used once the index has been built for the current PATH. Every directory up
+ *   to the one it's found in is stat()ed first, and if any of them has changed since it was read the index can't be trusted
+ *   to know PATH order, so it gives up. Returns false when the index doesn't know the command or has given up, and the caller
+ *   searches PATH as usual, so a program installed since the last Tab is still found, even ahead of one the index knows.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool findIndexedCommand(char* name, char* foundPath, size_t foundPathSize) {
+
+	char* PATH = variableValue("PATH");
+
+	if(indexedPATH == NULL || strcmp(indexedPATH, (PATH != NULL) ? PATH : "/bin:/usr/bin") != 0) {
+		return false;
+	}
+
+	for(int index = 0; index < pathDirectoryCount; index++) {
+
+		struct pathDirectory* directory = &pathDirectories[index];
+		size_t position = firstIndexedName(directory, name);
+		struct stat fileInfo;
+		struct stat directoryInfo;
+
+		if(stat((directory->path[0] == '\0') ? "." : directory->path, &directoryInfo) == -1) {
+
+			if(directory->read) {		// Gone since it was read, so whatever it held is too
+				return false;
+			}
+
+			continue;
+		}
+
+		if(!pathDirectoryUnchanged(directory, &directoryInfo)) {		// It may now have name ahead of the later directories
+			return false;
+		}
+
+		if(position == directory->nameCount || strcmp(directory->names[position], name) != 0) {
+			continue;
+		}
+
+		if(directory->path[0] == '\0') {
+			snprintf(foundPath, foundPathSize, "%s", name);
+		}
+
+		else {
+			snprintf(foundPath, foundPathSize, "%s/%s", directory->path, name);
+		}
+
+		if(stat(foundPath, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) && access(foundPath, X_OK) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+// Command path cache
+//
+// Remembers where on PATH each command was found so launching it again is a single execv() of the absolute path instead of execvp()
+// trying every PATH directory. Entries are chained in a hash table keyed by command name. The whole table is thrown away when PATH
+// changes, and the hash builtin can list, clear and pre-seed it. A child whose cached path has gone away can't fix the shell's
+// copy, so it bumps a counter in a small MAP_SHARED block and the shell drops the missing entries on its next lookup.
+
+struct hashedCommand {
+	char* name;
+	char* path;				// Absolute path the name resolved to
+	unsigned long hits;			// Times this entry saved a PATH search
+	struct hashedCommand* next;		// Next entry in the same bucket
+};
+
+struct hashedCommand** commandBuckets = NULL;
+int commandBucketCount = 0;			// Always a power of two
+int hashedCommandCount = 0;
+unsigned long commandHashHits = 0;
+unsigned long commandHashMisses = 0;
+char* hashedPATH = NULL;			// Value of PATH the entries were resolved against
+unsigned long long* stalePathReports = NULL;	// Shared with every child, NULL if it couldn't be mapped
+unsigned long long stalePathsSeen = 0;		// Reports the entries have already been checked against
+
+
+
+/*
+ * NAME
+ *   forgetHashedCommands - empty the command path cache
+ * SYNOPSIS
+ *   forgetHashedCommands()
+ * DESCRIPTION
+ *   Frees every entry and resets the hit/miss counters. Used by hash -r and whenever PATH changes.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void forgetHashedCommands() {
+
+	for(int bucket = 0; bucket < commandBucketCount; bucket++) {
+
+		struct hashedCommand* entry = commandBuckets[bucket];
+
+		while(entry != NULL) {
+			struct hashedCommand* next = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+
+		commandBuckets[bucket] = NULL;
+	}
+
+	hashedCommandCount = 0;
+	commandHashHits = 0;
+	commandHashMisses = 0;
+}
+
+
+
+/*
+ * NAME
+ *   dropMissingHashedCommands - forget the cached paths that no longer exist
+ * SYNOPSIS
+ *   dropMissingHashedCommands()
+ * DESCRIPTION
+ *   Frees every entry whose file can't be executed any more, so the next launch of it searches PATH again. Only run after a
+ *   child has reported a cached path failing, so the cost of checking each entry is rare.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void dropMissingHashedCommands() {
+
+	for(int bucket = 0; bucket < commandBucketCount; bucket++) {
+
+		struct hashedCommand** link = &commandBuckets[bucket];
+
+		while(*link != NULL) {
+
+			struct hashedCommand* entry = *link;
+
+			if(access(entry->path, X_OK) == 0) {
+				link = &entry->next;
+				continue;
+			}
+
+			*link = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			hashedCommandCount--;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   findHashedCommand - look up a command in the path cache
+ * SYNOPSIS
+ *   findHashedCommand(char* name)
+ * DESCRIPTION
+ *   Returns the cache entry for name, or NULL if it hasn't been resolved yet. If PATH has changed since the entries were resolved
+ *   the cache is emptied first, and if a child has reported a cached path missing since the last lookup the missing ones are
+ *   dropped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct hashedCommand* findHashedCommand(char* name) {
+
+	char* currentPATH = variableValue("PATH");
+
+	if(currentPATH == NULL) {
+		currentPATH = "";
+	}
+
+	if(hashedPATH == NULL || strcmp(hashedPATH, currentPATH) != 0) {		// Entries were resolved against a different PATH
+
+		forgetHashedCommands();
+		free(hashedPATH);
+		hashedPATH = strdup(currentPATH);
+	}
+
+	if(stalePathReports != NULL && __atomic_load_n(stalePathReports, __ATOMIC_RELAXED) != stalePathsSeen) {
+
+		stalePathsSeen = __atomic_load_n(stalePathReports, __ATOMIC_RELAXED);
+		dropMissingHashedCommands();
+	}
+
+	if(commandBucketCount == 0) {
+		return NULL;
+	}
+
+	struct hashedCommand* entry = commandBuckets[hashCommandName(name) & (commandBucketCount - 1)];
+
+	while(entry != NULL && strcmp(entry->name, name) != 0) {
+		entry = entry->next;
+	}
+
+	return entry;
+}
+
+
+
+/*
+ * NAME
+ *   addHashedCommand - store the resolved path of a command in the cache
+ * SYNOPSIS
+ *   addHashedCommand(char* name, char* path)
+ * DESCRIPTION
+ *   Replaces any existing entry for name. The bucket array doubles once there are more entries than buckets so chains stay short.
+ *   Returns the entry.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct hashedCommand* addHashedCommand(char* name, char* path) {
+
+	struct hashedCommand* entry = findHashedCommand(name);
+
+	if(entry != NULL) {
+		free(entry->path);
+		entry->path = strdup(path);
+		return entry;
+	}
+
+	if(hashedCommandCount >= commandBucketCount) {		// Grow and rehash
+
+		int newBucketCount = (commandBucketCount == 0) ? 64 : commandBucketCount * 2;
+		struct hashedCommand** newBuckets = calloc(newBucketCount, sizeof(struct hashedCommand*));
+
+		if(newBuckets == NULL) {
+			perror("Major problem growing the command hash!\n");
+			exit(1);
+		}
+
+		for(int bucket = 0; bucket < commandBucketCount; bucket++) {
+
+			struct hashedCommand* moving = commandBuckets[bucket];
+
+			while(moving != NULL) {
+				struct hashedCommand* next = moving->next;
+				int newBucket = hashCommandName(moving->name) & (newBucketCount - 1);
+				moving->next = newBuckets[newBucket];
+				newBuckets[newBucket] = moving;
+				moving = next;
+			}
+		}
+
+		free(commandBuckets);
+		commandBuckets = newBuckets;
+		commandBucketCount = newBucketCount;
+	}
+
+	entry = malloc(sizeof(struct hashedCommand));
+	entry->name = strdup(name);
+	entry->path = strdup(path);
+	entry->hits = 0;
+
+	int bucket = hashCommandName(name) & (commandBucketCount - 1);
+	entry->next = commandBuckets[bucket];
+	commandBuckets[bucket] = entry;
+	hashedCommandCount++;
+
+	return entry;
+}
+
+
+
+/*
+ * NAME
+ *   removeHashedCommand - drop one command from the path cache
+ * SYNOPSIS
+ *   removeHashedCommand(char* name)
+ * DESCRIPTION
+ *   Used when the cached path turns out not to exist any more, and by hash -d. Returns true if there was an entry to remove.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool removeHashedCommand(char* name) {
+
+	if(commandBucketCount == 0) {
+		return false;
+	}
+
+	struct hashedCommand** link = &commandBuckets[hashCommandName(name) & (commandBucketCount - 1)];
+
+	while(*link != NULL) {
+
+		if(strcmp((*link)->name, name) == 0) {
+
+			struct hashedCommand* entry = *link;
+			*link = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			hashedCommandCount--;
+			return true;
+		}
+
+		link = &(*link)->next;
+	}
+
+	return false;
+}
+
+
+
+/*
+ * NAME
+ *   searchPATH - find an executable by walking the PATH directories
+ * SYNOPSIS
+ *   searchPATH(char* name, char* foundPath, size_t foundPathSize)
+ * DESCRIPTION
+ *   Tries each PATH directory in order, the same way execvp() would, and copies the first executable regular file it finds into
+ *   foundPath. An empty PATH entry means the current directory. Returns true if the command was found.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool searchPATH(char* name, char* foundPath, size_t foundPathSize) {
+
+	char* PATH = variableValue("PATH");
+
+	if(PATH == NULL) {
+		PATH = "/bin:/usr/bin";		// Same default execvp() uses
+	}
+
+	char* directory = PATH;
+
+	while(1) {
+
+		char* separator = strchr(directory, ':');
+		int directoryLength = (separator != NULL) ? (int)(separator - directory) : (int)strlen(directory);
+		struct stat fileInfo;
+
+		if(directoryLength == 0) {
+			snprintf(foundPath, foundPathSize, "%s", name);
+		}
+
+		else {
+			snprintf(foundPath, foundPathSize, "%.*s/%s", directoryLength, directory, name);
+		}
+
+		if(stat(foundPath, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) && access(foundPath, X_OK) == 0) {
+			return true;
+		}
+
+		if(separator == NULL) {
+			return false;
+		}
+
+		directory = separator + 1;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   lookupCommandPath - resolve a command name to an absolute path using the cache
+ * SYNOPSIS
+ *   lookupCommandPath(char* name)
+ * DESCRIPTION
+ *   Returns the cached path for name, asking the PATH index or searching PATH and caching the result on a miss. Returns NULL
+ *   when name has a / in it (it is already a path) or isn't on PATH, in which case the launcher falls back to execvp() so the
+ *   usual error is printed. The string belongs to the cache.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* lookupCommandPath(char* name) {
+
+	char foundPath[4096];
+
+	if(strchr(name, '/') != NULL) {
+		return NULL;
+	}
+
+	struct hashedCommand* entry = findHashedCommand(name);
+
+	if(entry != NULL) {
+		entry->hits++;
+		commandHashHits++;
+		countMetric(METRIC_PATH_HITS, 1);
+		return entry->path;
+	}
+
+	commandHashMisses++;
+	countMetric(METRIC_PATH_MISSES, 1);
+
+	if(!findIndexedCommand(name, foundPath, sizeof(foundPath)) && !searchPATH(name, foundPath, sizeof(foundPath))) {
+		return NULL;
+	}
+
+	return addHashedCommand(name, foundPath)->path;
+}
+
+
+
+/*
+ * NAME
+ *   hashCommands - the hash builtin
+ * SYNOPSIS
+ *   hashCommands(char** argumentArray)
+ * DESCRIPTION
+ *   With no arguments lists the cached commands with their hit counts, followed by the cache's total hits and misses. "hash -r"
+ *   empties the cache, "hash -d name" forgets one command, "hash -p path name" caches name as path, and "hash name..." resolves each
+ *   name now so later launches hit the cache. Returns 1 if a name couldn't be found, otherwise 0.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int hashCommands(char** argumentArray) {
+
+	char foundPath[4096];
+	int exitStatus = 0;
+
+	if(argumentArray[1] == NULL) {
+
+		findHashedCommand("");		// Drops stale entries if PATH changed
+
+		if(hashedCommandCount > 0) {
+			printf("hits\tcommand\n");
+		}
+
+		for(int bucket = 0; bucket < commandBucketCount; bucket++) {
+
+			for(struct hashedCommand* entry = commandBuckets[bucket]; entry != NULL; entry = entry->next) {
+				printf("%4lu\t%s\n", entry->hits, entry->path);
+			}
+		}
+
+		printf("hash: %lu hits, %lu misses\n", commandHashHits, commandHashMisses);
+		fflush(stdout);
+	}
+
+	else if(strcmp(argumentArray[1], "-r") == 0) {
+		forgetHashedCommands();
+	}
+
+	else if(strcmp(argumentArray[1], "-d") == 0) {
+
+		for(int index = 2; argumentArray[index] != NULL; index++) {
+
+			if(!removeHashedCommand(argumentArray[index])) {
+				printf("hash: %s: not found\n", argumentArray[index]);
+				fflush(stdout);
+				exitStatus = 1;
+			}
+		}
+	}
+
+	else if(strcmp(argumentArray[1], "-p") == 0) {
+
+		if(argumentArray[2] == NULL || argumentArray[3] == NULL) {
+			printf("usage: hash -p path name\n");
+			fflush(stdout);
+			return 1;
+		}
+
+		findHashedCommand("");
+		addHashedCommand(argumentArray[3], argumentArray[2]);
+	}
+
+	else {
+
+		for(int index = 1; argumentArray[index] != NULL; index++) {
+
+			if(strchr(argumentArray[index], '/') != NULL) {
+				continue;		// Paths don't need hashing
+			}
+
+			findHashedCommand("");
+
+			if(searchPATH(argumentArray[index], foundPath, sizeof(foundPath))) {
+				addHashedCommand(argumentArray[index], foundPath);
+			}
+
+			else {
+				printf("hash: %s: not found\n", argumentArray[index]);
+				fflush(stdout);
+				exitStatus = 1;
+			}
+		}
+	}
+
+	return exitStatus;
+}
+
+
+
+/*
+ * NAME
+ *   stageRedirects - check whether a stage redirects a descriptor
+ * SYNOPSIS
+ *   stageRedirects(struct pipelineStage* stage, int fd)
+ * DESCRIPTION
+ *   Returns true if any of the stage's redirections changes fd, which is how the launchers know not to point a background job's
+ *   stdin or stdout at /dev/null.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool stageRedirects(struct pipelineStage* stage, int fd) {
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		if(lineRedirections[stage->firstRedirection + index].fd == fd) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+/*
+ * NAME
+ *   applyRedirections - carry out a stage's redirections in this process
+ * SYNOPSIS
+ *   applyRedirections(struct pipelineStage* stage, bool saveOriginals)
+ * DESCRIPTION
+ *   Works through the stage's redirections in order. Files are opened close-on-exec, and when open() happens to return the very
+ *   descriptor wanted the flag is just cleared instead of paying for a dup2() and a close(); copies where the source already is the
+ *   target are skipped the same way. A forked child calls this with saveOriginals false and leaves the opened descriptors for exec
+ *   to close. Built ins run in the shell itself, so with saveOriginals true each target is copied out of the way for
+ *   restoreRedirections() before its file is opened, and the opened files are closed once they're in place. Returns false after
+ *   printing an error if a file can't be opened or a descriptor to copy isn't open.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool applyRedirections(struct pipelineStage* stage, bool saveOriginals) {
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+		int fileFD = -1;
+
+		if(redirection->kind == REDIRECT_DUP && fcntl(redirection->sourceFD, F_GETFD) == -1) {		// Before the copy can land there
+			printf("%d: bad file descriptor\n", redirection->sourceFD);
+			fflush(stdout);
+			return false;
+		}
+
+		if(saveOriginals) {		// Before the open, which lands on fd itself if it's closed. -1 means restoring it is a close()
+			redirection->savedFD = fcntl(redirection->fd, F_DUPFD_CLOEXEC, 10);
+		}
+
+		if(redirection->kind == REDIRECT_OPEN) {
+
+			fileFD = open(redirection->fileName, redirection->flags | O_CLOEXEC, 0777);
+
+			if(fileFD == -1) {
+
+				if(saveOriginals && redirection->savedFD >= 0) {		// Nothing changed, so there's nothing to restore
+					close(redirection->savedFD);
+				}
+
+				redirection->savedFD = -2;
+
+				printf("cannot open %s for %s\n", redirection->fileName, ((redirection->flags & O_ACCMODE) == O_RDONLY) ? "input" : "output");
+				fflush(stdout);
+				return false;
+			}
+		}
+
+		if(redirection->kind == REDIRECT_OPEN) {
+
+			if(fileFD == redirection->fd) {		// Landed right where it belongs, it just has to survive exec
+				fcntl(fileFD, F_SETFD, 0);
+			}
+
+			else {
+				dup2(fileFD, redirection->fd);
+
+				if(saveOriginals) {
+					close(fileFD);
+				}
+			}
+		}
+
+		else if(redirection->kind == REDIRECT_DUP) {
+
+			if(redirection->sourceFD != redirection->fd) {
+				dup2(redirection->sourceFD, redirection->fd);
+			}
+		}
+
+		else {
+			close(redirection->fd);
+		}
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   restoreRedirections - put the shell's descriptors back after a built in
+ * SYNOPSIS
+ *   restoreRedirections(struct pipelineStage* stage)
+ * DESCRIPTION
+ *   Undoes applyRedirections() in reverse order, so a descriptor redirected more than once ends up with the copy saved before the
+ *   first change. Redirections that were never applied are skipped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void restoreRedirections(struct pipelineStage* stage) {
+
+	for(size_t index = stage->redirectionCount; index > 0; index--) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index - 1];
+
+		if(redirection->savedFD == -2) {
+			continue;
+		}
+
+		if(redirection->savedFD == -1) {
+			close(redirection->fd);
+		}
+
+		else {
+			dup2(redirection->savedFD, redirection->fd);
+			close(redirection->savedFD);
+		}
+
+		redirection->savedFD = -2;
+	}
+}
+
+
+
+// Resource limits
+//
+// A command line starting with limit, like "limit cpu=60 as=2G nofile=256 nproc=64 cgroup=batch sort big.txt &", runs its
+// command with those rlimits and inside that cgroup v2 directory. The settings only last for the line, and apply to every job it
+// launches, so "limit nproc=32 parallel -j 8 jobs.txt" limits each worker the parallel builtin starts. The limits are set in the
+// child right before exec, so a limited command always goes through fork() even with the spawn launcher.
+
+struct limitOption {
+	char* name;
+	int resource;
+};
+
+struct limitOption limitOptions[] = {
+	{"cpu", RLIMIT_CPU},		// Seconds of CPU time
+	{"as", RLIMIT_AS},		// Bytes of address space
+	{"nofile", RLIMIT_NOFILE},	// Open descriptors
+	{"nproc", RLIMIT_NPROC},	// Processes for the user
+	{NULL, 0}
+};
+
+#define LIMIT_OPTION_COUNT 4
+
+bool launchLimitsActive = false;		// The line being run started with limit
+bool launchLimitSet[LIMIT_OPTION_COUNT];
+rlim_t launchLimitValues[LIMIT_OPTION_COUNT];
+int launchCgroupFD = -1;			// cgroup.procs of the cgroup to join, -1 to stay where the shell is
+
+
+
+/*
+ * NAME
+ *   clearLaunchLimits - forget the limits of the previous line
+ * SYNOPSIS
+ *   clearLaunchLimits()
+ * DESCRIPTION
+ *   Called at the start of every line so limits never carry over to the next command.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void clearLaunchLimits() {
+
+	if(!launchLimitsActive) {
+		return;
+	}
+
+	for(int option = 0; option < LIMIT_OPTION_COUNT; option++) {
+		launchLimitSet[option] = false;
+	}
+
+	if(launchCgroupFD != -1) {
+		close(launchCgroupFD);
+		launchCgroupFD = -1;
+	}
+
+	launchLimitsActive = false;
+}
+
+
+
+/*
+ * NAME
+ *   parseLimitValue - read the number on the right of a limit setting
+ * SYNOPSIS
+ *   parseLimitValue(char* text, rlim_t* value)
+ * DESCRIPTION
+ *   Accepts a number with an optional K, M, G or T suffix (powers of 1024), or "unlimited". Returns false if text is neither, or
+ *   if the suffix makes the number too big to hold.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool parseLimitValue(char* text, rlim_t* value) {
+
+	if(strcmp(text, "unlimited") == 0) {
+		*value = RLIM_INFINITY;
+		return true;
+	}
+
+	char* numberEnd;
+	errno = 0;
+	unsigned long long number = strtoull(text, &numberEnd, 10);
+
+	if(numberEnd == text || errno != 0 || text[0] == '-') {
+		return false;
+	}
+
+	char* suffixes = "KkMmGgTt";
+	char* suffix = (*numberEnd != '\0') ? strchr(suffixes, *numberEnd) : NULL;
+	int shift = 0;
+
+	if(suffix != NULL) {		// Each pair of letters is another factor of 1024
+		shift = 10 * (int)((suffix - suffixes) / 2 + 1);
+		numberEnd++;
+	}
+
+	if(number > (~0ULL >> shift)) {		// The suffix would push it past what a limit can hold
+		return false;
+	}
+
+	number = number << shift;
+	*value = (rlim_t)number;
+	return (*numberEnd == '\0');
+}
+
+
+
+/*
+ * NAME
+ *   parseLaunchLimits - read the settings after the limit keyword
+ * SYNOPSIS
+ *   parseLaunchLimits(char** argumentArray, bool* isOperator, int tokenCount)
+ * DESCRIPTION
+ *   Takes name=value words from the front of argumentArray until the first one that isn't a setting, which is where the command
+ *   starts. The names are the ones in limitOptions plus cgroup, whose value is a cgroup v2 directory, taken relative to
+ *   /sys/fs/cgroup unless it starts with a /. The cgroup's cgroup.procs is opened here so a bad cgroup is reported once, before
+ *   anything is launched. Returns how many words were settings, or -1 after printing an error.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int parseLaunchLimits(char** argumentArray, bool* isOperator, int tokenCount) {
+
+	int consumed = 0;
+
+	launchLimitsActive = true;
+
+	while(consumed < tokenCount && !isOperator[consumed] && strchr(argumentArray[consumed], '=') != NULL) {
+
+		char* setting = argumentArray[consumed];
+		char* value = strchr(setting, '=') + 1;
+		size_t nameLength = value - 1 - setting;
+
+		if(nameLength == 6 && strncmp(setting, "cgroup", 6) == 0) {
+
+			char procsPath[4096];
+			snprintf(procsPath, sizeof(procsPath), "%s%s/cgroup.procs", (value[0] == '/') ? "" : "/sys/fs/cgroup/", value);
+
+			if(launchCgroupFD != -1) {		// The last one given wins
+				close(launchCgroupFD);
+			}
+
+			launchCgroupFD = open(procsPath, O_WRONLY | O_CLOEXEC);
+
+			if(launchCgroupFD == -1) {
+				printf("limit: cannot use cgroup %s: %s\n", value, strerror(errno));
+				fflush(stdout);
+				return -1;
+			}
+		}
+
+		else {
+
+			int option = 0;
+
+			while(limitOptions[option].name != NULL && (strlen(limitOptions[option].name) != nameLength ||
+					strncmp(limitOptions[option].name, setting, nameLength) != 0)) {
+				option++;
+			}
+
+			if(limitOptions[option].name == NULL) {
+				printf("limit: unknown limit %.*s\n", (int)nameLength, setting);
+				fflush(stdout);
+				return -1;
+			}
+
+			if(!parseLimitValue(value, &launchLimitValues[option])) {
+				printf("limit: bad value for %s: %s\n", limitOptions[option].name, value);
+				fflush(stdout);
+				return -1;
+			}
+
+			launchLimitSet[option] = true;
+		}
+
+		consumed++;
+	}
+
+	return consumed;
+}
+
+
+
+/*
+ * NAME
+ *   applyLaunchLimits - put the child into its cgroup and set its rlimits
+ * SYNOPSIS
+ *   applyLaunchLimits()
+ * DESCRIPTION
+ *   Called in the child just before exec. Joining the cgroup is one write() of the child's PID to the cgroup.procs the shell
+ *   already opened, and each limit is one setrlimit() with the soft and hard limit both set so the command can't raise it again.
+ *   Prints an error and returns false if any of it fails, and the command isn't run.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool applyLaunchLimits() {
+
+	if(!launchLimitsActive) {
+		return true;
+	}
+
+	if(launchCgroupFD != -1) {
+
+		char pidText[24];
+		int pidLength = snprintf(pidText, sizeof(pidText), "%d", (int)getpid());
+
+		if(write(launchCgroupFD, pidText, pidLength) != pidLength) {
+			printf("limit: cannot join cgroup: %s\n", strerror(errno));
+			fflush(stdout);
+			return false;
+		}
+	}
+
+	for(int option = 0; option < LIMIT_OPTION_COUNT; option++) {
+
+		struct rlimit newLimit = {launchLimitValues[option], launchLimitValues[option]};
+
+		if(launchLimitSet[option] && setrlimit(limitOptions[option].resource, &newLimit) == -1) {
+			printf("limit: cannot set %s: %s\n", limitOptions[option].name, strerror(errno));
+			fflush(stdout);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   setUpChild - give a freshly forked child the process group and signal handling of a job
+ * SYNOPSIS
+ *   setUpChild(bool isBackground, pid_t leaderPID)
+ * DESCRIPTION
+ *   Background jobs, and every job under job control, join the process group of leaderPID (0 makes the child a new leader), and
+ *   a foreground job under job control takes the terminal. SIGINT goes back to default for foreground jobs, the stop signals do
+ *   with job control and SIGTSTP is ignored without it, and the signal mask from before the shell blocked anything is restored.
+ *   Used by the fork launcher and by the zygote.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void setUpChild(bool isBackground, pid_t leaderPID) {
+
+	if(isBackground || jobControl) {
+		setpgid(0, leaderPID);		// 0 for the first stage makes it the group leader
+	}
+
+	if(jobControl && !isBackground) {
+		tcsetpgrp(STDIN_FILENO, getpgrp());	// Take the terminal, SIGTTOU is still ignored from the shell
+	}
+
+	struct sigaction childAction = {0};
+
+	childAction.sa_handler = SIG_DFL;
+
+	if(!isBackground) {
+		sigaction(SIGINT, &childAction, NULL);		// Foreground process must be terminated by SIGINT
+	}
+
+	if(jobControl) {		// ^Z stops the job, and reading or writing the terminal from the background stops it too
+		sigaction(SIGTTOU, &childAction, NULL);
+		sigaction(SIGTTIN, &childAction, NULL);
+	}
+
+	childAction.sa_handler = jobControl ? SIG_DFL : SIG_IGN;		// Without job control children ignore SIGTSTP
+	sigaction(SIGTSTP, &childAction, NULL);
+
+	sigprocmask(SIG_SETMASK, &startupSignalMask, NULL);	// Unblock what the shell reads from its signal descriptor
+}
+
+
+
+/*
+ * NAME
+ *   tryToRunCommand - attempts to run user entered command using execvp()
+ * SYNOPSIS
+ *   tryToRunCommand(struct pipelineStage* stage, char* commandPath, bool nullInput, bool nullOutput)
+ * DESCRIPTION
+ *   This function is called by the child process immediately after it's created to try and run execvp() on the user entered
+ *   command. The stage's redirection list was already built by the shell, so this hands it to applyRedirections() to carry out
+ *   in order. nullInput/nullOutput send stdin/stdout to /dev/null when the user didn't redirect them, which is how background
+ *   jobs are kept off the terminal. Any limits from a limit prefix are applied last. If the shell already knows where the
+ *   command lives, commandPath is run directly with execv(), otherwise (or if that path has gone away, which is reported so
+ *   the shell forgets it) execvp() is called. If this fails, the function prints an error message and returns -1.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+// This gets called by the child process immediately after it's created to try and run exec()
+
+int tryToRunCommand(struct pipelineStage* stage, char* commandPath, bool nullInput, bool nullOutput) {
+
+	unsigned long long redirectStart = traceClock();
+
+	int devNullIn;		// File descriptor for /dev/null if we have to open that for a background process
+	int devNullOut;
+
+
+	if(!applyRedirections(stage, false)) {
+		return -1;
+	}
+
+
+	// Make sure background process does not point to terminal if not redirected by user
+
+	if(nullInput && !stageRedirects(stage, 0)) {		// Get stdin from /dev/null so command isn't waiting on terminal input
+
+		devNullIn = open("/dev/null", O_RDONLY | O_CLOEXEC);		// Only the dup2() copy should survive exec
+		if(devNullIn == -1) {printf("cannot open /dev/null for input\n"); fflush(stdout); return -1;}
+		dup2(devNullIn, 0);
+
+	}
+
+	if(nullOutput && !stageRedirects(stage, 1)) {		// Send stdout to /dev/null so it doesn't appear on the terminal
+
+		devNullOut = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if(devNullOut == -1) {printf("cannot open /dev/null for output\n"); fflush(stdout); return -1;}
+		dup2(devNullOut, 1);
+	}
+
+	traceEvent("redirect", redirectStart);
+
+	if(!applyLaunchLimits()) {		// Set by a limit prefix on the line, last so a low nofile doesn't stop the redirection
+		return -1;
+	}
+
+	traceEvent("exec", traceClock());		// Last thing before the program replaces us, so ns is always 0
+
+
+	if(commandPath != NULL) {		// Skip the PATH search, fall through to it if the file moved
+
+		execv(commandPath, stage->arguments);
+
+		if(errno == ENOENT && stalePathReports != NULL) {		// Have the shell drop the entry, this is only our copy
+			__atomic_fetch_add(stalePathReports, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	execvp(stage->arguments[0], stage->arguments);
+
+	// If this line gets reached, then the exec process failed
+
+	countMetric(METRIC_EXEC_FAILURES, 1);		// The block is shared, so the shell sees this
+	printf("%s: no such file or directory\n", stage->arguments[0]);
+	fflush(stdout);
+	return -1;
+
+}
+
+
+
+/*
+ * NAME
+ *   arenaPut - append one character to a token arena
+ * SYNOPSIS
+ *   arenaPut(struct tokenArena* arena, char character)
+ * DESCRIPTION
+ *   Doubles the arena when it's full. Arenas are kept between lines, so once one has grown to fit the longest line seen no more
+ *   allocation happens.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline void arenaPut(struct tokenArena* arena, char character) {
+
+	if(arena->used == arena->capacity) {
+
+		arena->capacity = (arena->capacity == 0) ? 4096 : arena->capacity * 2;
+		arena->text = realloc(arena->text, arena->capacity);
+
+		if(arena->text == NULL) {
+			perror("Major problem growing a token arena!\n");
+			exit(1);
+		}
+	}
+
+	arena->text[arena->used] = character;
+	arena->used++;
+}
+
+
+
+/*
+ * NAME
+ *   arenaPutString - append a string to a token arena
+ * SYNOPSIS
+ *   arenaPutString(struct tokenArena* arena, char* text, size_t length)
+ * DESCRIPTION
+ *   Used for operators and for expansions like $$ that replace a few input characters with a longer value, and for building the
+ *   zygote's launch requests.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void arenaPutString(struct tokenArena* arena, char* text, size_t length) {
+
+	if(length == 0) {		// text can be NULL then, and an empty arena has no text for memcpy() either
+		return;
+	}
+
+	if(length > arena->capacity - arena->used) {		// Grow once for the whole string, then copy it in one go
+
+		while(length > arena->capacity - arena->used) {
+			arena->capacity = (arena->capacity == 0) ? 4096 : arena->capacity * 2;
+		}
+
+		arena->text = realloc(arena->text, arena->capacity);
+
+		if(arena->text == NULL) {
+			perror("Major problem growing a token arena!\n");
+			exit(1);
+		}
+	}
+
+	memcpy(arena->text + arena->used, text, length);
+	arena->used += length;
+}
+
+
+
+/*
+ * NAME
+ *   arenaReserve - make room at the end of a token arena
+ * SYNOPSIS
+ *   arenaReserve(struct tokenArena* arena, size_t length)
+ * DESCRIPTION
+ *   For text that's read straight into the arena, like the output of a command substitution, so it's never copied on the way.
+ *   The arena holds at least length more bytes afterwards, used is left alone.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void arenaReserve(struct tokenArena* arena, size_t length) {
+
+	if(length <= arena->capacity - arena->used) {
+		return;
+	}
+
+	while(length > arena->capacity - arena->used) {
+		arena->capacity = (arena->capacity == 0) ? 4096 : arena->capacity * 2;
+	}
+
+	arena->text = realloc(arena->text, arena->capacity);
+
+	if(arena->text == NULL) {
+		perror("Major problem growing a token arena!\n");
+		exit(1);
+	}
+}
+
+
+
+// Line arena
+//
+// Scratch memory for what only lives while a line runs: the words a for loop walks over, a function call's $1 and up, and the
+// redirections a function call or compound command puts on the shell. The input line, its tokens, their expansions and the
+// redirection list already live in buffers that are reused for every line, so with this nothing on the way from reading a line to
+// running it touches the heap once the buffers have grown to fit. Allocation bumps a pointer through a list of chunks that are
+// never freed or moved, so everything handed out stays put. Whatever allocates takes a mark first and releases back to it when
+// it's done, and since those lifetimes nest like the tree walk, runCommandLine() releasing its own mark resets the whole arena in
+// O(1). How much the arena held at most during each line is written to the trace.
+
+#define LINE_CHUNK_SIZE 65536
+
+struct lineChunk {
+	struct lineChunk* next;
+	size_t capacity;
+	size_t used;
+	char data[];
+};
+
+struct lineMark {
+	struct lineChunk* chunk;		// NULL for an arena that hasn't handed anything out yet
+	size_t used;
+	size_t inUse;
+};
+
+struct lineChunk* firstLineChunk = NULL;
+struct lineChunk* currentLineChunk = NULL;
+size_t lineArenaInUse = 0;		// Bytes handed out and not released yet, including alignment padding
+size_t lineArenaHighWater = 0;		// The most lineArenaInUse has been since the line started
+size_t lineArenaPeak = 0;		// And since the shell started
+size_t lineArenaReserved = 0;		// Bytes in all the chunks together
+
+
+
+/*
+ * NAME
+ *   lineAllocate - hand out memory that lasts until the current mark is released
+ * SYNOPSIS
+ *   lineAllocate(size_t size)
+ * DESCRIPTION
+ *   Rounds size up to 16 so anything can be stored there. Moves on to the next chunk when the current one is full, and only
+ *   mallocs a new chunk, big enough for size, when there's no next chunk that fits.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void* lineAllocate(size_t size) {
+
+	size = (size + 15) & ~(size_t)15;
+
+	if(currentLineChunk == NULL || size > currentLineChunk->capacity - currentLineChunk->used) {
+
+		struct lineChunk* nextChunk = (currentLineChunk == NULL) ? firstLineChunk : currentLineChunk->next;
+
+		if(nextChunk == NULL || size > nextChunk->capacity) {
+
+			size_t capacity = (size > LINE_CHUNK_SIZE) ? size : LINE_CHUNK_SIZE;
+			struct lineChunk* newChunk = malloc(sizeof(struct lineChunk) + capacity);
+
+			if(newChunk == NULL) {
+				perror("Major problem growing the line arena!\n");
+				exit(1);
+			}
+
+			newChunk->capacity = capacity;
+			newChunk->next = nextChunk;		// A chunk that was too small stays for later
+			lineArenaReserved += capacity;
+
+			if(currentLineChunk == NULL) {
+				firstLineChunk = newChunk;
+			}
+
+			else {
+				currentLineChunk->next = newChunk;
+			}
+
+			nextChunk = newChunk;
+		}
+
+		nextChunk->used = 0;
+		currentLineChunk = nextChunk;
+	}
+
+	void* memory = currentLineChunk->data + currentLineChunk->used;
+	currentLineChunk->used += size;
+	lineArenaInUse += size;
+
+	if(lineArenaInUse > lineArenaHighWater) {
+		lineArenaHighWater = lineArenaInUse;
+	}
+
+	return memory;
+}
+
+
+
+/*
+ * NAME
+ *   lineArenaMark - remember where the line arena is
+ * SYNOPSIS
+ *   lineArenaMark()
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline struct lineMark lineArenaMark() {
+
+	struct lineMark mark = {currentLineChunk, (currentLineChunk != NULL) ? currentLineChunk->used : 0, lineArenaInUse};
+	return mark;
+}
+
+
+
+/*
+ * NAME
+ *   lineArenaRelease - give back everything allocated since a mark
+ * SYNOPSIS
+ *   lineArenaRelease(struct lineMark mark)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline void lineArenaRelease(struct lineMark mark) {
+
+	currentLineChunk = mark.chunk;
+
+	if(currentLineChunk != NULL) {
+		currentLineChunk->used = mark.used;
+	}
+
+	lineArenaInUse = mark.inUse;
+}
+
+
+
+/*
+ * NAME
+ *   traceLineArena - write the line's arena use to the trace
+ * SYNOPSIS
+ *   traceLineArena()
+ * DESCRIPTION
+ *   Writes {"phase":"arena","pid":...,"line":...,"peak":...,"reserved":...,"tokens":...}: the line arena's high-water mark for
+ *   this line and since startup, how much its chunks hold, and the bytes of the line's tokens and expanded words. Then starts the
+ *   next line's high-water mark from what's still in use.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void traceLineArena() {
+
+	if(lineArenaHighWater > lineArenaPeak) {
+		lineArenaPeak = lineArenaHighWater;
+	}
+
+	if(traceEnabled) {
+
+		char traceLine[160];
+
+		int lineLength = snprintf(traceLine, sizeof(traceLine), "{\"phase\":\"arena\",\"pid\":%d,\"line\":%zu,\"peak\":%zu,\"reserved\":%zu,\"tokens\":%zu}\n",
+				(int)getpid(), lineArenaHighWater, lineArenaPeak, lineArenaReserved, lexerArena.used + expansionArena.used);
+
+		writeFully(traceFD, traceLine, lineLength);
+	}
+
+	lineArenaHighWater = lineArenaInUse;
+}
+
+
+
+/*
+ * NAME
+ *   reserveArguments - make sure the argument vector has room for more tokens
+ * SYNOPSIS
+ *   reserveArguments(struct argumentVector* arguments, size_t needed)
+ * DESCRIPTION
+ *   Doubles the vector's arrays until they can hold needed entries.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void reserveArguments(struct argumentVector* arguments, size_t needed) {
+
+	if(needed <= arguments->capacity) {
+		return;
+	}
+
+	size_t newCapacity = (arguments->capacity == 0) ? 64 : arguments->capacity;
+
+	while(newCapacity < needed) {
+		newCapacity = newCapacity * 2;
+	}
+
+	arguments->items = realloc(arguments->items, newCapacity * sizeof(char*));
+	arguments->isOperator = realloc(arguments->isOperator, newCapacity * sizeof(bool));
+	arguments->wordFlags = realloc(arguments->wordFlags, newCapacity);
+	arguments->offsets = realloc(arguments->offsets, newCapacity * sizeof(size_t));
+
+	if(arguments->items == NULL || arguments->isOperator == NULL || arguments->wordFlags == NULL || arguments->offsets == NULL) {
+		perror("Major problem growing the argument vector!\n");
+		exit(1);
+	}
+
+	arguments->capacity = newCapacity;
+}
+
+
+
+/*
+ * NAME
+ *   operatorLength - how much of the line the operator at text takes up
+ * SYNOPSIS
+ *   operatorLength(char* text)
+ * DESCRIPTION
+ *   Called by the lexer at an unquoted | & ; < or >. Returns the length of the longest operator text starts with, so <<< wins over
+ *   << and <, and && and &> win over a plain &.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int operatorLength(char* text) {
+
+	static char* operators[] = {"<<<", "&>>", "&&", "||", "<<", "<&", ">>", ">&", "&>", "<", ">", "&", "|", ";"};		// Longest first
+
+	for(size_t index = 0; index < sizeof(operators) / sizeof(operators[0]); index++) {
+
+		size_t length = strlen(operators[index]);
+
+		if(strncmp(text, operators[index], length) == 0) {
+			return (int)length;
+		}
+	}
+
+	return 1;
+}
+
+
+
+/*
+ * NAME
+ *   positionalValue - the value of $0, $1 and so on
+ * SYNOPSIS
+ *   positionalValue(long index)
+ * DESCRIPTION
+ *   $0 is the shell's or the script's name and the rest are the script's or the running function's arguments. Returns NULL past
+ *   the last one.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* positionalValue(long index) {
+
+	if(index == 0) {
+		return shellName;
+	}
+
+	return (index <= positionalCount) ? positionalParameters[index - 1] : NULL;
+}
+
+
+
+/*
+ * NAME
+ *   expandVariable - expand the $ at position into an arena
+ * SYNOPSIS
+ *   expandVariable(char* position, struct tokenArena* arena)
+ * DESCRIPTION
+ *   Handles $$ (the shell's PID), $? (the last exit value, as status reports it), $! (the PID of the last background job), $0 to
+ *   $9, ${N}, $# and $@ or $* (the positional parameters joined by spaces), $NAME and ${NAME}. An unset variable expands to nothing.
+ *   Returns how many characters of the text were used, or 0 if the $ doesn't start an expansion and should be kept as it is. With
+ *   a NULL arena nothing is looked up, which is how the lexer measures an expansion it's going to keep for later.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t expandVariable(char* position, struct tokenArena* arena) {
+
+	bool braced = (position[1] == '{');
+	char* nameStart = position + 1 + braced;
+	size_t nameLength = 0;
+
+	if(!braced && position[1] != '\0' && strchr("$?!#@*0123456789", position[1]) != NULL) {
+		nameLength = 1;		// One character special or positional parameter
+	}
+
+	else {
+
+		while(nameStart[nameLength] == '_' || (nameStart[nameLength] >= 'a' && nameStart[nameLength] <= 'z') ||
+				(nameStart[nameLength] >= 'A' && nameStart[nameLength] <= 'Z') || (nameStart[nameLength] >= '0' && nameStart[nameLength] <= '9')) {
+			nameLength++;
+		}
+
+		bool positional = (nameLength > 0 && strspn(nameStart, "0123456789") >= nameLength);		// ${10}
+
+		if((!positional && !isVariableName(nameStart, nameLength)) || (braced && nameStart[nameLength] != '}')) {
+			return 0;
+		}
+	}
+
+	size_t length = 1 + braced + nameLength + braced;
+
+	if(arena == NULL) {
+		return length;
+	}
+
+	char name[nameLength + 1];
+	memcpy(name, nameStart, nameLength);
+	name[nameLength] = '\0';
+
+	char number[24];
+	char* value = number;
+
+	if(name[0] == '$') {
+		value = shellPIDString;
+	}
+
+	else if(name[0] == '?') {
+		snprintf(number, sizeof(number), "%d", lastExitValue());
+	}
+
+	else if(name[0] == '!') {
+		value = (lastBackgroundPID != 0) ? number : NULL;
+		snprintf(number, sizeof(number), "%d", (int)lastBackgroundPID);
+	}
+
+	else if(name[0] == '#') {
+		snprintf(number, sizeof(number), "%d", positionalCount);
+	}
+
+	else if(name[0] == '@' || name[0] == '*') {
+
+		for(int index = 0; index < positionalCount; index++) {
+
+			if(index > 0) {
+				arenaPut(arena, ' ');
+			}
+
+			arenaPutString(arena, positionalParameters[index], strlen(positionalParameters[index]));
+		}
+
+		value = NULL;
+	}
+
+	else if(name[0] >= '0' && name[0] <= '9') {
+		value = positionalValue(atol(name));
+	}
+
+	else {
+		value = variableValue(name);
+	}
+
+	if(value != NULL) {
+		arenaPutString(arena, value, strlen(value));
+	}
+
+	return length;
+}
+
+
+
+/*
+ * NAME
+ *   lexLiteral - add one character of a word that doesn't start an expansion
+ * SYNOPSIS
+ *   lexLiteral(struct tokenArena* arena, unsigned char* flags, char character)
+ * DESCRIPTION
+ *   A \x01 from the input is doubled so the expansion pass knows it isn't a mark.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline void lexLiteral(struct tokenArena* arena, unsigned char* flags, char character) {
+
+	if(character == EXPANSION_MARK) {
+		arenaPut(arena, EXPANSION_MARK);
+		*flags = *flags | WORD_EXPANDS;
+	}
+
+	arenaPut(arena, character);
+}
+
+
+
+/*
+ * NAME
+ *   substitutionLength - how much of the line a $(command) or `command` takes up
+ * SYNOPSIS
+ *   substitutionLength(char* position)
+ * DESCRIPTION
+ *   position is at the $ or the opening backquote. A $( runs to the ) that balances it, skipping quoted and escaped text and any
+ *   $( inside a double quoted string, and a backquote runs to the next one that isn't escaped. Returns the length including both
+ *   ends, or 0 if the command never ends.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t substitutionLength(char* position) {
+
+	if(position[0] == '`') {
+
+		for(size_t index = 1; position[index] != '\0'; index++) {
+
+			if(position[index] == '\\' && position[index + 1] != '\0') {
+				index++;
+			}
+
+			else if(position[index] == '`') {
+				return index + 1;
+			}
+		}
+
+		return 0;
+	}
+
+	int depth = 0;
+	char quote = '\0';
+
+	for(size_t index = 1; position[index] != '\0'; index++) {
+
+		char character = position[index];
+
+		if(quote == '\'') {
+
+			if(character == '\'') {
+				quote = '\0';
+			}
+
+			continue;
+		}
+
+		if(character == '\\' && position[index + 1] != '\0') {
+			index++;
+		}
+
+		else if(quote == '"' && character == '$' && position[index + 1] == '(') {		// "$(...)" inside the command
+
+			size_t innerLength = substitutionLength(position + index);
+
+			if(innerLength == 0) {
+				return 0;
+			}
+
+			index = index + innerLength - 1;
+		}
+
+		else if(character == '"' || (quote == '\0' && character == '\'')) {
+			quote = (quote == character) ? '\0' : character;
+		}
+
+		else if(quote == '\0' && character == '(') {
+			depth++;
+		}
+
+		else if(quote == '\0' && character == ')' && --depth == 0) {
+			return index + 1;
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   lexSubstitution - keep a $(command) or `command` in a word for expandWords()
+ * SYNOPSIS
+ *   lexSubstitution(struct tokenArena* arena, char* position, size_t length, char kind)
+ * DESCRIPTION
+ *   Writes an EXPANSION_MARK and kind, '(' for a command whose output is split into words and '"' for one whose output stays in
+ *   the word, then the command and an EXPANSION_MARK with a ) to end it. A \x01 in the command is doubled, so the end can't be
+ *   mistaken. Inside backquotes \`, \\ and \$ lose their backslash, the way other shells read them.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void lexSubstitution(struct tokenArena* arena, char* position, size_t length, char kind) {
+
+	bool backquoted = (position[0] == '`');
+	char* end = position + length - 1;
+
+	arenaPut(arena, EXPANSION_MARK);
+	arenaPut(arena, kind);
+
+	for(char* command = position + (backquoted ? 1 : 2); command < end; command++) {
+
+		if(backquoted && command[0] == '\\' && (command[1] == '`' || command[1] == '\\' || command[1] == '$')) {
+			command++;
+		}
+
+		if(*command == EXPANSION_MARK) {
+			arenaPut(arena, EXPANSION_MARK);
+		}
+
+		arenaPut(arena, *command);
+	}
+
+	arenaPut(arena, EXPANSION_MARK);
+	arenaPut(arena, ')');
+}
+
+
+
+/*
+ * NAME
+ *   lexCommandLine - split a line of input into words and operators in one pass
+ * SYNOPSIS
+ *   lexCommandLine(char* line, struct argumentVector* arguments, struct tokenArena* arena, bool appendLine)
+ * DESCRIPTION
+ *   Walks the line once, writing each finished token into arena and adding it to the argument vector, so the cost is linear in
+ *   the length of the line and there's no limit on how long it can be or how many tokens it has. Spaces and tabs separate words.
+ *   Single quotes keep everything literally, double quotes keep spaces but still expand $, and a backslash escapes the next
+ *   character. Outside single quotes a $$, $?, $!, $N, $#, $@, $NAME or ${NAME} is kept in the word behind an EXPANSION_MARK and
+ *   WORD_EXPANDS is set, so expandWords() can fill it in each time the command runs without lexing the line again. Expanded
+ *   values aren't split into words, and an unquoted word that expands to nothing is dropped then. An unquoted *, ? or [ is
+ *   marked the same way, with WORD_GLOB, so only those become wildcards when the word is matched against file names. A
+ *   $(command) or `command` is kept whole behind a mark as well, with WORD_SUBSTITUTES, to be run each time the word is
+ *   expanded, and its output is split into words unless it's inside double quotes or a NAME= word. $(( is left alone. Unquoted |
+ *   & ; < > start operator tokens, which take the longest match from operatorLength() and have isOperator set, so a quoted ">"
+ *   is just a word. An unquoted number right before < or > becomes part of the operator, so 2>file lexes as "2>" and "file"
+ *   while 'x2'>file and "2">file keep the 2 as an argument. An unquoted # at the start of a word makes the rest of the line a
+ *   comment. With appendLine the tokens are added after the ones already in the vector, behind a "\n" operator for the line
+ *   break unless the last line ended in | && or ||, which is how a command spread over several lines is collected. The vector's
+ *   items are NULL terminated. Returns the number of tokens in the vector, or -1 if a quote or a command was left open.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int lexCommandLine(char* line, struct argumentVector* arguments, struct tokenArena* arena, bool appendLine) {
+
+	bool inWord = false;
+	size_t expansionLength;
+	char quote = '\0';		// Quote character we're inside of, or '\0'
+	char* position = line;
+
+	if(!appendLine) {
+		arena->used = 0;
+		arguments->count = 0;
+	}
+
+	size_t tokenCount = arguments->count;
+
+	if(tokenCount > 0 && !(arguments->isOperator[tokenCount - 1] && (strcmp(arguments->items[tokenCount - 1], "|\0") == 0 ||
+			strcmp(arguments->items[tokenCount - 1], "&&\0") == 0 || strcmp(arguments->items[tokenCount - 1], "||\0") == 0))) {
+
+		reserveArguments(arguments, tokenCount + 2);
+
+		arguments->offsets[tokenCount] = arena->used;
+		arguments->isOperator[tokenCount] = true;
+		arguments->wordFlags[tokenCount] = 0;
+		arenaPutString(arena, "\n", 2);		// The line break ends the command like a ;
+		tokenCount++;
+	}
+
+	unsigned char* flags = NULL;		// WORD_ bits of the word being read
+
+	while(1) {
+
+		char character = *position;
+
+		if(quote == '\'') {		// Everything is literal up to the closing quote
+
+			if(character == '\0') {
+				break;
+			}
+
+			if(character == '\'') {
+				quote = '\0';
+			}
+
+			else {
+				lexLiteral(arena, flags, character);
+			}
+
+			position++;
+			continue;
+		}
+
+		if(quote == '"') {
+
+			if(character == '\0') {
+				break;
+			}
+
+			if(character == '"') {
+				quote = '\0';
+			}
+
+			else if(character == '\\' && (position[1] == '$' || position[1] == '"' || position[1] == '\\' || position[1] == '`')) {
+				lexLiteral(arena, flags, position[1]);
+				position++;
+			}
+
+			else if((character == '$' && position[1] == '(' && position[2] != '(') || character == '`') {
+
+				if((expansionLength = substitutionLength(position)) == 0) {
+					break;		// Reported as the open quote
+				}
+
+				lexSubstitution(arena, position, expansionLength, '"');
+				*flags = *flags | WORD_EXPANDS | WORD_SUBSTITUTES;
+				position = position + expansionLength - 1;
+			}
+
+			else if(character == '$' && (expansionLength = expandVariable(position, NULL)) > 0) {
+				arenaPut(arena, EXPANSION_MARK);
+				arenaPutString(arena, position, expansionLength);
+				*flags = *flags | WORD_EXPANDS;
+				position = position + expansionLength - 1;
+			}
+
+			else {
+				lexLiteral(arena, flags, character);
+			}
+
+			position++;
+			continue;
+		}
+
+
+		// Not inside quotes
+
+		if(character == '\0' || character == ' ' || character == '\t' || character == '\r' || character == '\n') {
+
+			if(inWord && (arena->used > arguments->offsets[tokenCount] || (*flags & WORD_QUOTED))) {	// End the current word
+				arenaPut(arena, '\0');
+				tokenCount++;
+			}
+
+			inWord = false;
+
+			if(character == '\0') {
+				break;
+			}
+
+			position++;
+			continue;
+		}
+
+		if(character == '#' && !inWord) {	// Comment runs to the end of the line
+			break;
+		}
+
+		bool operatorCharacter = (character == '|' || character == '&' || character == ';' || character == '<' || character == '>');
+		bool descriptorPrefix = false;		// An unquoted number right before < or >, like the 2 in 2>errors
+
+		if(inWord && !(*flags & WORD_ESCAPED) && (character == '<' || character == '>')) {
+
+			descriptorPrefix = true;
+
+			for(size_t offset = arguments->offsets[tokenCount]; offset < arena->used; offset++) {
+
+				if(arena->text[offset] < '0' || arena->text[offset] > '9') {
+					descriptorPrefix = false;
+				}
+			}
+		}
+
+		if(inWord && operatorCharacter && !descriptorPrefix) {	// Operator ends the word
+
+			if(arena->used > arguments->offsets[tokenCount] || (*flags & WORD_QUOTED)) {
+				arenaPut(arena, '\0');
+				tokenCount++;
+			}
+
+			inWord = false;
+		}
+
+		if(!inWord) {
+
+			reserveArguments(arguments, tokenCount + 2);	// Room for this token and the NULL at the end
+
+			arguments->offsets[tokenCount] = arena->used;	// Offsets, not pointers, since the arena can move while it grows
+			arguments->isOperator[tokenCount] = false;
+			arguments->wordFlags[tokenCount] = 0;
+			flags = &arguments->wordFlags[tokenCount];
+			inWord = true;
+		}
+
+		if(operatorCharacter) {		// Longest operator that matches, with the descriptor prefix already in the token
+
+			int length = operatorLength(position);
+
+			arenaPutString(arena, position, length);
+			arenaPut(arena, '\0');
+			arguments->isOperator[tokenCount] = true;
+			tokenCount++;
+			inWord = false;
+			position = position + length - 1;
+		}
+
+		else if(character == '\'' || character == '"') {
+			quote = character;
+			*flags = *flags | WORD_QUOTED | WORD_ESCAPED;
+		}
+
+		else if(character == '\\' && position[1] != '\0') {
+			lexLiteral(arena, flags, position[1]);
+			position++;
+			*flags = *flags | WORD_ESCAPED;
+		}
+
+		else if(character == '$' && (expansionLength = expandVariable(position, NULL)) > 0) {	// Kept for expandWords()
+			arenaPut(arena, EXPANSION_MARK);
+			arenaPutString(arena, position, expansionLength);
+			position = position + expansionLength - 1;
+			*flags = *flags | WORD_EXPANDS | WORD_ESCAPED;		// Digits from an expansion aren't a descriptor either
+		}
+
+		else if((character == '$' && position[1] == '(' && position[2] != '(') || character == '`') {	// $(( is arithmetic
+
+			if((expansionLength = substitutionLength(position)) == 0) {
+				printf("syntax error: unterminated %s\n", (character == '`') ? "`" : "$(");
+				fflush(stdout);
+				return -1;
+			}
+
+			char* wordText = arena->text + arguments->offsets[tokenCount];
+			char* equals = memchr(wordText, '=', arena->used - arguments->offsets[tokenCount]);
+
+			bool assignment = (equals != NULL && isVariableName(wordText, equals - wordText));	// NAME=$(...) isn't split
+
+			lexSubstitution(arena, position, expansionLength, assignment ? '"' : '(');
+			position = position + expansionLength - 1;
+			*flags = *flags | WORD_EXPANDS | WORD_ESCAPED | WORD_SUBSTITUTES;
+		}
+
+		else if(character == '*' || character == '?' || character == '[') {		// Only these can be wildcards
+			arenaPut(arena, EXPANSION_MARK);
+			arenaPut(arena, character);
+			*flags = *flags | WORD_EXPANDS | WORD_GLOB;
+		}
+
+		else {
+			lexLiteral(arena, flags, character);
+		}
+
+		position++;
+	}
+
+	if(quote != '\0') {
+		printf("syntax error: unterminated %c quote\n", quote);
+		fflush(stdout);
+		return -1;
+	}
+
+	reserveArguments(arguments, tokenCount + 1);
+
+	for(size_t index = 0; index < tokenCount; index++) {
+		arguments->items[index] = arena->text + arguments->offsets[index];
+	}
+
+	arguments->items[tokenCount] = NULL;
+	arguments->count = tokenCount;
+
+	return (int)tokenCount;
+}
+
+
+
+// Heredocs and here-strings
+//
+// The body of every << is read while its line is parsed, before anything runs, and kept with the syntax tree, so a heredoc in a
+// loop or a function feeds the same text every time it runs. Right before a command runs, each of its bodies and the word after
+// each <<< is staged in a descriptor the command's stdin can be dup2()ed to. A small body fits in one write() to a pipe, made
+// straight from the tree. A bigger one goes into a memfd the first time it runs and stays there for as long as the tree does,
+// so every later run only opens the memfd again. Nothing touches the disk. Bodies are taken literally, there's no $ expansion
+// inside them even when the word after << isn't quoted.
+
+#define HEREDOC_PIPE_LIMIT 4096		// PIPE_BUF, a body this small is written to a pipe in one go and can never block
+
+struct heredoc {
+	char* operatorToken;		// The << or <<< token, which stays the same however the words around it move
+	int fd;				// Read end of the pipe or the memfd, positioned at the start of the body
+};
+
+struct heredoc* heredocs = NULL;	// Bodies staged for the line being run
+size_t heredocCount = 0;
+size_t heredocCapacity = 0;
+
+
+
+/*
+ * NAME
+ *   findHeredoc - the staged body for a << or <<< operator
+ * SYNOPSIS
+ *   findHeredoc(char* operatorToken)
+ * DESCRIPTION
+ *   Returns the descriptor holding the body of the operator token, or -1 if there isn't one.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int findHeredoc(char* operatorToken) {
+
+	for(size_t index = 0; index < heredocCount; index++) {
+
+		if(heredocs[index].operatorToken == operatorToken) {
+			return heredocs[index].fd;
+		}
+	}
+
+	return -1;
+}
+
+
+
+/*
+ * NAME
+ *   addRedirection - append one redirection to the line's list
+ * SYNOPSIS
+ *   addRedirection(int fd, int kind, int flags, char* fileName, int sourceFD)
+ * DESCRIPTION
+ *   Grows lineRedirections if it's full and adds the redirection to the end of it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void addRedirection(int fd, int kind, int flags, char* fileName, int sourceFD) {
+
+	if(lineRedirectionCount == lineRedirectionCapacity) {
+
+		size_t newCapacity = (lineRedirectionCapacity == 0) ? 8 : lineRedirectionCapacity * 2;
+
+		lineRedirections = realloc(lineRedirections, newCapacity * sizeof(struct redirection));
+		if(lineRedirections == NULL) {
+			perror("Major problem growing the redirection list!\n");
+			exit(1);
+		}
+
+		lineRedirectionCapacity = newCapacity;
+	}
+
+	struct redirection* redirection = &lineRedirections[lineRedirectionCount++];
+
+	redirection->fd = fd;
+	redirection->kind = kind;
+	redirection->flags = flags;
+	redirection->fileName = fileName;
+	redirection->sourceFD = sourceFD;
+	redirection->savedFD = -2;
+}
+
+
+
+/*
+ * NAME
+ *   skipDescriptor - the operator part of a redirection token
+ * SYNOPSIS
+ *   skipDescriptor(char* token)
+ * DESCRIPTION
+ *   Returns token past any descriptor number the lexer folded into it, so "2>>" gives ">>" and ">" gives ">".
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* skipDescriptor(char* token) {
+
+	while(*token >= '0' && *token <= '9') {
+		token++;
+	}
+
+	return token;
+}
+
+
+
+/*
+ * NAME
+ *   isDescriptorNumber - check a word is a plain descriptor number
+ * SYNOPSIS
+ *   isDescriptorNumber(char* word)
+ * DESCRIPTION
+ *   Returns true if word is made of nothing but digits and is short enough to be a descriptor, as the M in N>&M has to be.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool isDescriptorNumber(char* word) {
+
+	if(*word == '\0' || strlen(word) > 9) {
+		return false;
+	}
+
+	return (*skipDescriptor(word) == '\0');
+}
+
+
+
+/*
+ * NAME
+ *   findRedirections - pull the redirections out of a pipeline stage
+ * SYNOPSIS
+ *   findRedirections(char** argumentArray, bool* isOperator, int firstIndex, int lastIndex, struct pipelineStage* stage)
+ * DESCRIPTION
+ *   Scans the stage running from firstIndex to lastIndex for redirection operators anywhere among its words and adds each one to
+ *   lineRedirections in the order written, so later redirections of the same descriptor win just as they do when applied. The
+ *   operators understood are [N]< [N]> [N]>> file, [N]>&M and [N]<&M to copy a descriptor, [N]>&- to close one, &> and &>> file
+ *   (and >& file) for stdout and stderr together, and [N]<< and [N]<<< whose body expandWords() already staged. Without N, < forms
+ *   mean stdin and > forms stdout. The redirection tokens are squeezed out of the array in place so stage->arguments is ready for
+ *   exec. Only tokens the lexer marked as operators count, so a quoted ">" is passed through as an argument. Prints an error and
+ *   returns false if an operator has no word after it. A stage left with no words is allowed for the redirections on a compound
+ *   command, splitPipeline() is what reports one in a pipeline.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool findRedirections(char** argumentArray, bool* isOperator, int firstIndex, int lastIndex, struct pipelineStage* stage) {
+
+	int keptIndex = firstIndex;		// Where the next real argument goes
+
+	stage->arguments = argumentArray + firstIndex;
+	stage->firstRedirection = lineRedirectionCount;
+
+	for(int index = firstIndex; index <= lastIndex; index++) {
+
+		char* token = argumentArray[index];
+		char* operator = isOperator[index] ? skipDescriptor(token) : token;
+
+		bool isRedirection = isOperator[index] && (operator[0] == '<' || operator[0] == '>' || strncmp(operator, "&>", 2) == 0);
+
+		if(!isRedirection) {
+			argumentArray[keptIndex] = token;
+			isOperator[keptIndex] = isOperator[index];
+			keptIndex++;
+			continue;
+		}
+
+		if(index == lastIndex || isOperator[index + 1]) {
+			printf("syntax error near %s\n", token);
+			fflush(stdout);
+			return false;
+		}
+
+		char* word = argumentArray[index + 1];
+		bool hasDescriptor = (operator != token);
+		int fd = hasDescriptor ? atoi(token) : ((operator[0] == '<') ? 0 : 1);
+
+		if(strcmp(operator, "<<") == 0 || strcmp(operator, "<<<") == 0) {
+			addRedirection(fd, REDIRECT_DUP, 0, NULL, findHeredoc(token));
+		}
+
+		else if((strcmp(operator, "<&") == 0 || strcmp(operator, ">&") == 0) && strcmp(word, "-") == 0) {
+			addRedirection(fd, REDIRECT_CLOSE, 0, NULL, -1);
+		}
+
+		else if((strcmp(operator, "<&") == 0 || strcmp(operator, ">&") == 0) && isDescriptorNumber(word)) {
+			addRedirection(fd, REDIRECT_DUP, 0, NULL, atoi(word));
+		}
+
+		else if(strcmp(operator, "&>") == 0 || strcmp(operator, "&>>") == 0 || (strcmp(operator, ">&") == 0 && !hasDescriptor)) {
+
+			int appendFlag = (strcmp(operator, "&>>") == 0) ? O_APPEND : O_TRUNC;
+
+			addRedirection(1, REDIRECT_OPEN, O_WRONLY | O_CREAT | appendFlag, word, -1);
+			addRedirection(2, REDIRECT_DUP, 0, NULL, 1);
+		}
+
+		else if(strcmp(operator, "<") == 0) {
+			addRedirection(fd, REDIRECT_OPEN, O_RDONLY, word, -1);
+		}
+
+		else if(strcmp(operator, ">") == 0) {
+			addRedirection(fd, REDIRECT_OPEN, O_WRONLY | O_CREAT | O_TRUNC, word, -1);
+		}
+
+		else if(strcmp(operator, ">>") == 0) {
+			addRedirection(fd, REDIRECT_OPEN, O_WRONLY | O_CREAT | O_APPEND, word, -1);
+		}
+
+		else {		// N<&word or N>&word where word isn't a descriptor
+			printf("%s: ambiguous redirect\n", word);
+			fflush(stdout);
+			return false;
+		}
+
+		index++;		// Skip the file name or descriptor too
+	}
+
+	argumentArray[keptIndex] = NULL;
+	stage->redirectionCount = lineRedirectionCount - stage->firstRedirection;
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   spawnStage - launch one pipeline stage with posix_spawnp()
+ * SYNOPSIS
+ *   spawnStage(struct pipelineStage* stage, int stdinFD, int stdoutFD, bool nullInput, bool nullOutput, bool isBackground, pid_t leaderPID)
+ * DESCRIPTION
+ *   The spawn launcher's version of forking a child and calling tryToRunCommand(). stdinFD/stdoutFD are pipe ends from the
+ *   neighbouring stages (-1 if none). Redirection files are opened here in the shell and the stage's redirection list becomes
+ *   file actions in the order it was written. The signal setup the fork path does by hand is done with spawn attributes:
+ *   SIGINT goes back to default for foreground jobs, the startup signal mask is restored with SIGTSTP kept blocked in place of
+ *   the fork path's ignore, and background jobs join the process group of leaderPID (0 makes the child a new leader). With job
+ *   control every job gets a process group, the stop signals go back to default, and a foreground job's first stage is handed
+ *   the terminal by a file action. Returns the child's PID. If the command can't be started the error is printed and a child
+ *   that just exits with status 1 is forked instead, so the job looks exactly like a fork launch whose exec failed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+pid_t spawnStage(struct pipelineStage* stage, int stdinFD, int stdoutFD, bool nullInput, bool nullOutput, bool isBackground, pid_t leaderPID) {
+
+	char** argumentArray = stage->arguments;
+	int openedFDs[stage->redirectionCount + 1];		// Files opened for the child, -1 for redirections that aren't files
+	int spawnResult = 0;
+	pid_t childPID = -1;
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+
+		openedFDs[index] = -1;
+
+		if(spawnResult == 0 && redirection->kind == REDIRECT_OPEN) {
+
+			openedFDs[index] = open(redirection->fileName, redirection->flags | O_CLOEXEC, 0777);
+
+			if(openedFDs[index] == -1) {
+				printf("cannot open %s for %s\n", redirection->fileName, ((redirection->flags & O_ACCMODE) == O_RDONLY) ? "input" : "output");
+				fflush(stdout);
+				spawnResult = -1;
+			}
+		}
+	}
+
+	if(spawnResult == 0 && (nullInput || nullOutput) && devNullFD == -1) {
+
+		devNullFD = open("/dev/null", O_RDWR | O_CLOEXEC);
+		if(devNullFD == -1) {printf("cannot open /dev/null\n"); fflush(stdout); spawnResult = -1;}
+	}
+
+
+	if(spawnResult == 0) {
+
+		posix_spawn_file_actions_t fileActions;
+		posix_spawn_file_actions_init(&fileActions);
+
+		// Later actions win, so pipes go first and the user's redirection can override them
+
+		if(stdinFD != -1) {
+			posix_spawn_file_actions_adddup2(&fileActions, stdinFD, 0);
+		}
+
+		if(stdoutFD != -1) {
+			posix_spawn_file_actions_adddup2(&fileActions, stdoutFD, 1);
+		}
+
+		if(jobOutputFD != -1) {		// Background output the shell collects
+			posix_spawn_file_actions_adddup2(&fileActions, jobOutputFD, 2);
+		}
+
+		if(nullInput && !stageRedirects(stage, 0)) {
+			posix_spawn_file_actions_adddup2(&fileActions, devNullFD, 0);
+		}
+
+		if(nullOutput && !stageRedirects(stage, 1)) {
+			posix_spawn_file_actions_adddup2(&fileActions, devNullFD, 1);
+		}
+
+		for(size_t index = 0; index < stage->redirectionCount; index++) {		// In the order written
+
+			struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+
+			if(redirection->kind == REDIRECT_OPEN) {
+				posix_spawn_file_actions_adddup2(&fileActions, openedFDs[index], redirection->fd);
+			}
+
+			else if(redirection->kind == REDIRECT_DUP && redirection->sourceFD != redirection->fd) {
+				posix_spawn_file_actions_adddup2(&fileActions, redirection->sourceFD, redirection->fd);
+			}
+
+			else if(redirection->kind == REDIRECT_CLOSE) {
+				posix_spawn_file_actions_addclose(&fileActions, redirection->fd);
+			}
+		}
+
+
+		posix_spawnattr_t spawnAttributes;
+		posix_spawnattr_init(&spawnAttributes);
+
+		short spawnFlags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+		sigset_t defaultSignals;
+		sigemptyset(&defaultSignals);
+
+		if(!isBackground) {
+			sigaddset(&defaultSignals, SIGINT);		// Foreground process must be terminated by SIGINT
+		}
+
+		if(jobControl) {		// Same as the fork path, stopping is back to normal for the job
+			sigaddset(&defaultSignals, SIGTSTP);
+			sigaddset(&defaultSignals, SIGTTOU);
+			sigaddset(&defaultSignals, SIGTTIN);
+		}
+
+		// The shell's SIGCHLD and SIGTSTP stay blocked, the child's don't. Without job control the child keeps SIGTSTP blocked
+		// instead, a blocked signal stays blocked across exec so it never stops on a Ctrl-Z meant for the shell.
+
+		sigset_t childMask = startupSignalMask;
+
+		if(!jobControl) {
+			sigaddset(&childMask, SIGTSTP);
+		}
+
+		posix_spawnattr_setsigdefault(&spawnAttributes, &defaultSignals);
+		posix_spawnattr_setsigmask(&spawnAttributes, &childMask);
+
+		if(isBackground || jobControl) {
+			spawnFlags |= POSIX_SPAWN_SETPGROUP;
+			posix_spawnattr_setpgroup(&spawnAttributes, leaderPID);
+		}
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+		if(jobControl && !isBackground && leaderPID == 0) {		// Take the terminal before exec, like the fork path
+			posix_spawn_file_actions_addtcsetpgrp_np(&fileActions, STDIN_FILENO);
+		}
+#endif
+
+		posix_spawnattr_setflags(&spawnAttributes, spawnFlags);
+
+
+		char* commandPath = lookupCommandPath(argumentArray[0]);
+
+		if(commandPath != NULL) {
+
+			spawnResult = posix_spawn(&childPID, commandPath, &fileActions, &spawnAttributes, argumentArray, environ);
+
+			if(spawnResult == ENOENT) {		// Cached path has gone away, forget it and search PATH again
+				removeHashedCommand(argumentArray[0]);
+				commandPath = NULL;
+			}
+		}
+
+		if(commandPath == NULL) {
+			spawnResult = posix_spawnp(&childPID, argumentArray[0], &fileActions, &spawnAttributes, argumentArray, environ);
+		}
+
+		posix_spawnattr_destroy(&spawnAttributes);
+		posix_spawn_file_actions_destroy(&fileActions);
+
+		if(spawnResult == EBADF) {		// A N>&M whose M isn't open
+			printf("%s: bad file descriptor\n", argumentArray[0]);
+			fflush(stdout);
+		}
+
+		else if(spawnResult != 0) {
+			countMetric(METRIC_EXEC_FAILURES, 1);
+			printf("%s: no such file or directory\n", argumentArray[0]);
+			fflush(stdout);
+		}
+	}
+
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {		// The child has its own copies now
+
+		if(openedFDs[index] != -1) {
+			close(openedFDs[index]);
+		}
+	}
+
+	if(spawnResult != 0) {		// Fall back to a fork that fails the same way the fork launcher's child would
+
+		childPID = fork();
+
+		if(childPID == -1) {
+			countMetric(METRIC_FORK_FAILURES, 1);
+			perror("Major problem creating child!\n");
+			exit(1);
+		}
+
+		else if(childPID == 0) {
+			_exit(1);
+		}
+
+		if(isBackground || jobControl) {
+			setpgid(childPID, leaderPID == 0 ? childPID : leaderPID);
+		}
+	}
+
+	return childPID;
+}
+
+
+
+// Zygote launcher
+//
+// With SMALLSH_LAUNCHER=zygote a helper process is forked at startup, before the shell has built up any history, caches or
+// variables, and every command is started by it instead of by the shell, so launching stays cheap however big the shell's heap
+// grows. Each stage goes to the helper as one message on a Unix socket: a fixed header, then the stage's redirections and its
+// strings (redirection file names, the cached command path, the arguments and the environment). The descriptors the child starts
+// with are passed alongside with SCM_RIGHTS: the pipe ends or the shell's own 0, 1 and 2, anything a N>&M copies from, and the
+// working directory. The helper forks, replies with the new PID, and sends every wait4() status of its children back on the same
+// socket, where readZygoteEvents() feeds them to the job table. Commands with a limit prefix still go through fork(), since the
+// limits are only known to the shell.
+
+#define ZYGOTE_MAX_FDS 32		// Descriptors one launch request can pass
+#define ZYGOTE_WORKING_DIRECTORY -1	// Placement of the passed descriptor the child fchdir()s to
+
+struct zygoteRequest {
+	size_t payloadLength;		// Bytes after the header: the redirections, then NUL terminated strings
+	int argumentCount;
+	int environmentCount;
+	int redirectionCount;
+	int placedFDs[ZYGOTE_MAX_FDS];	// Descriptor each passed one becomes in the child, in the order they were sent
+	bool hasCommandPath;
+	bool nullInput;
+	bool nullOutput;
+	bool isBackground;
+	bool traceEnabled;
+	pid_t leaderPID;
+	unsigned long long launchStart;	// For the child's fork trace line
+};
+
+
+
+/*
+ * NAME
+ *   serveLaunchRequest - start one pipeline stage for the shell, in the zygote
+ * SYNOPSIS
+ *   serveLaunchRequest(int socketFD)
+ * DESCRIPTION
+ *   Reads a request and its descriptors from the socket, rebuilds the stage from the payload and forks. The child gets the job's
+ *   process group and signal handling from setUpChild() while it still has the zygote's descriptors, the same ones the shell
+ *   started with, so a foreground job takes the terminal just like a forked one. Then it moves the passed descriptors into place,
+ *   changes to the shell's working directory, and goes through tryToRunCommand() like a child of the fork launcher. The zygote
+ *   sets the child's process group too, so there's no race with the child, and replies with the PID. Returns false once the shell
+ *   has closed its end.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool serveLaunchRequest(int socketFD) {
+
+	static struct tokenArena payload = {NULL, 0, 0};
+	static char** pointers = NULL;		// Arguments then environment, each NULL terminated
+	static size_t pointerCapacity = 0;
+
+	struct zygoteRequest request;
+	char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+	struct iovec headerVector = {&request, sizeof(request)};
+	struct msghdr message = {0};
+
+	message.msg_iov = &headerVector;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if(recvmsg(socketFD, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(request)) {
+		return false;
+	}
+
+	int passedFDs[ZYGOTE_MAX_FDS];
+	int fdCount = 0;
+	struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&message);
+
+	if(controlHeader != NULL && controlHeader->cmsg_level == SOL_SOCKET && controlHeader->cmsg_type == SCM_RIGHTS) {
+		fdCount = (controlHeader->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(passedFDs, CMSG_DATA(controlHeader), fdCount * sizeof(int));
+	}
+
+	if(payload.capacity < request.payloadLength + 1) {
+
+		payload.capacity = request.payloadLength + 1;
+		payload.text = realloc(payload.text, payload.capacity);
+
+		if(payload.text == NULL) {
+			perror("Major problem growing the zygote's request buffer!\n");
+			exit(1);
+		}
+	}
+
+	if(request.payloadLength > 0 && recv(socketFD, payload.text, request.payloadLength, MSG_WAITALL) != (ssize_t)request.payloadLength) {
+		return false;
+	}
+
+
+	// Point everything back into the payload
+
+	size_t pointerCount = request.argumentCount + request.environmentCount + 2;
+
+	if(pointerCapacity < pointerCount) {
+
+		pointerCapacity = pointerCount * 2;
+		pointers = realloc(pointers, pointerCapacity * sizeof(char*));
+
+		if(pointers == NULL) {
+			perror("Major problem growing the zygote's argument array!\n");
+			exit(1);
+		}
+	}
+
+	lineRedirections = (struct redirection*)payload.text;		// This process has no lines of its own
+	char* cursor = payload.text + request.redirectionCount * sizeof(struct redirection);
+
+	for(int index = 0; index < request.redirectionCount; index++) {
+
+		if(lineRedirections[index].kind == REDIRECT_OPEN) {
+			lineRedirections[index].fileName = cursor;
+			cursor += strlen(cursor) + 1;
+		}
+	}
+
+	char* commandPath = NULL;
+
+	if(request.hasCommandPath) {
+		commandPath = cursor;
+		cursor += strlen(cursor) + 1;
+	}
+
+	for(size_t index = 0; index < pointerCount; index++) {
+
+		if(index == (size_t)request.argumentCount || index == pointerCount - 1) {
+			pointers[index] = NULL;
+		}
+
+		else {
+			pointers[index] = cursor;
+			cursor += strlen(cursor) + 1;
+		}
+	}
+
+	struct pipelineStage stage = {pointers, 0, request.redirectionCount};
+
+
+	pid_t childPID = fork();
+
+	if(childPID == -1) {
+		countMetric(METRIC_FORK_FAILURES, 1);		// The shell falls back to launching the stage itself
+	}
+
+	else if(childPID == 0) {
+
+		traceEnabled = request.traceEnabled;
+		traceEvent("fork", request.launchStart);
+
+		setUpChild(request.isBackground, request.leaderPID);
+
+		// Copy everything above the highest target first, so putting one in place never closes another that's still waiting
+
+		int highestTarget = 2;
+
+		for(int index = 0; index < fdCount; index++) {
+
+			if(request.placedFDs[index] > highestTarget) {
+				highestTarget = request.placedFDs[index];
+			}
+		}
+
+		bool placed[3] = {false, false, false};
+		bool inWorkingDirectory = true;
+
+		for(int index = 0; index < fdCount; index++) {
+
+			int movedFD = fcntl(passedFDs[index], F_DUPFD_CLOEXEC, highestTarget + 1);
+
+			if(request.placedFDs[index] == ZYGOTE_WORKING_DIRECTORY) {
+				inWorkingDirectory = (fchdir(movedFD) == 0);
+			}
+
+			else {
+				dup2(movedFD, request.placedFDs[index]);
+
+				if(request.placedFDs[index] < 3) {
+					placed[request.placedFDs[index]] = true;
+				}
+			}
+		}
+
+		for(int fd = 0; fd < 3; fd++) {		// Closed in the shell, so closed in the command too
+
+			if(!placed[fd]) {
+				close(fd);
+			}
+		}
+
+		if(!inWorkingDirectory) {		// Running in the zygote's directory instead could touch the wrong files
+			printf("%s: cannot enter the working directory\n", pointers[0]);
+			fflush(stdout);
+			exit(1);
+		}
+
+		environ = pointers + request.argumentCount + 1;
+
+		tryToRunCommand(&stage, commandPath, request.nullInput, request.nullOutput);
+		exit(1);	// Only reached if there was a problem
+	}
+
+	if(childPID != -1 && (request.isBackground || jobControl)) {
+		setpgid(childPID, request.leaderPID == 0 ? childPID : request.leaderPID);
+	}
+
+	for(int index = 0; index < fdCount; index++) {		// The child has its own copies now
+		close(passedFDs[index]);
+	}
+
+	struct zygoteEvent started = {0};
+	started.started = true;
+	started.pid = childPID;
+
+	return send(socketFD, &started, sizeof(started), MSG_NOSIGNAL) == (ssize_t)sizeof(started);
+}
+
+
+
+/*
+ * NAME
+ *   runZygote - the zygote's main loop
+ * SYNOPSIS
+ *   runZygote(int socketFD)
+ * DESCRIPTION
+ *   Sleeps in poll() on the socket and on a signal descriptor of its own for SIGCHLD. Launch requests go to serveLaunchRequest(),
+ *   and every child that exits, stops or continues is sent to the shell as a status event. SIGINT is still ignored and SIGTSTP
+ *   still blocked from the shell, so keys typed at the terminal never reach it. Exits once the shell has gone away.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void runZygote(int socketFD) {
+
+	sigset_t childSignals;
+	sigemptyset(&childSignals);
+	sigaddset(&childSignals, SIGCHLD);
+
+	close(signalFD);		// The shell's, opened for SIGTSTP too
+	signalFD = signalfd(-1, &childSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if(signalFD == -1) {
+		_exit(1);
+	}
+
+	struct pollfd pollFDs[2] = {{socketFD, POLLIN, 0}, {signalFD, POLLIN, 0}};
+
+	while(1) {
+
+		if(poll(pollFDs, 2, -1) == -1) {
+
+			if(errno == EINTR) {
+				continue;
+			}
+
+			_exit(1);
+		}
+
+		if(pollFDs[1].revents & POLLIN) {
+
+			struct signalfd_siginfo signalInfo[16];
+
+			while(read(signalFD, signalInfo, sizeof(signalInfo)) > 0) {
+				// Only needed to clear the descriptor, wait4() finds out what happened
+			}
+
+			struct zygoteEvent event = {0};
+
+			while((event.pid = wait4(-1, &event.exitMethod, WNOHANG | WUNTRACED | WCONTINUED, &event.usage)) > 0) {
+
+				if(send(socketFD, &event, sizeof(event), MSG_NOSIGNAL) != (ssize_t)sizeof(event)) {
+					_exit(0);
+				}
+			}
+		}
+
+		if(pollFDs[0].revents != 0 && !serveLaunchRequest(socketFD)) {
+			_exit(0);
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   startZygote - fork the zygote launcher
+ * SYNOPSIS
+ *   startZygote()
+ * DESCRIPTION
+ *   Called once from main() after the signal handling and terminal are set up, so the zygote and its children inherit them, but
+ *   before the first line is read. Sets zygoteFD to the shell's end of the socket. The shell becomes a child subreaper first, so
+ *   if the zygote ever dies the commands it started are handed to the shell and reaped like its own. If the socket or the fork
+ *   can't be made the shell just keeps launching commands itself.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void startZygote() {
+
+	int socketFDs[2];
+
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socketFDs) == -1) {
+		printf("cannot start the zygote launcher\n");
+		fflush(stdout);
+		return;
+	}
+
+	pid_t zygotePID = fork();
+
+	if(zygotePID == -1) {
+		printf("cannot start the zygote launcher\n");
+		fflush(stdout);
+		close(socketFDs[0]);
+		close(socketFDs[1]);
+		return;
+	}
+
+	else if(zygotePID == 0) {
+		close(socketFDs[0]);
+		runZygote(socketFDs[1]);
+	}
+
+	close(socketFDs[1]);
+	zygoteFD = socketFDs[0];
+}
+
+
+
+/*
+ * NAME
+ *   passDescriptor - add a descriptor to a launch request
+ * SYNOPSIS
+ *   passDescriptor(struct zygoteRequest* request, int* passedFDs, int* fdCount, int fd, int placement)
+ * DESCRIPTION
+ *   Queues fd to become placement in the child. Descriptors that aren't open are skipped, so they stay closed in the child, and so
+ *   are ones already queued for the same placement or that don't fit in the request.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void passDescriptor(struct zygoteRequest* request, int* passedFDs, int* fdCount, int fd, int placement) {
+
+	if(fd < 0 || *fdCount == ZYGOTE_MAX_FDS || fcntl(fd, F_GETFD) == -1) {
+		return;
+	}
+
+	for(int index = 0; index < *fdCount; index++) {
+
+		if(request->placedFDs[index] == placement) {
+			return;
+		}
+	}
+
+	passedFDs[*fdCount] = fd;
+	request->placedFDs[*fdCount] = placement;
+	(*fdCount)++;
+}
+
+
+
+/*
+ * NAME
+ *   zygoteStage - launch one pipeline stage through the zygote
+ * SYNOPSIS
+ *   zygoteStage(struct pipelineStage* stage, int stdinFD, int stdoutFD, bool nullInput, bool nullOutput, bool isBackground, pid_t leaderPID, unsigned long long launchStart)
+ * DESCRIPTION
+ *   The zygote launcher's version of forking a child and calling tryToRunCommand(), taking the same arguments as spawnStage().
+ *   Sends the request and waits for the reply, handling any status events that were already on their way. Returns the child's
+ *   PID, or -1 if the zygote couldn't start it or has gone away, in which case the caller launches the stage itself.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+pid_t zygoteStage(struct pipelineStage* stage, int stdinFD, int stdoutFD, bool nullInput, bool nullOutput, bool isBackground, pid_t leaderPID,
+		unsigned long long launchStart) {
+
+	static struct tokenArena message = {NULL, 0, 0};
+
+	struct zygoteRequest request = {0};
+	int passedFDs[ZYGOTE_MAX_FDS];
+	int fdCount = 0;
+
+	message.used = 0;
+
+	int workingDirectoryFD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	passDescriptor(&request, passedFDs, &fdCount, workingDirectoryFD, ZYGOTE_WORKING_DIRECTORY);
+	passDescriptor(&request, passedFDs, &fdCount, (stdinFD != -1) ? stdinFD : 0, 0);
+	passDescriptor(&request, passedFDs, &fdCount, (stdoutFD != -1) ? stdoutFD : 1, 1);
+	passDescriptor(&request, passedFDs, &fdCount, jobOutputFD, 2);		// Background output the shell collects, when there is any
+	passDescriptor(&request, passedFDs, &fdCount, 2, 2);
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+
+		arenaPutString(&message, (char*)redirection, sizeof(struct redirection));
+
+		if(redirection->kind == REDIRECT_DUP && redirection->sourceFD > 2) {		// A heredoc, or a descriptor the shell has open
+			passDescriptor(&request, passedFDs, &fdCount, redirection->sourceFD, redirection->sourceFD);
+		}
+	}
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+
+		if(redirection->kind == REDIRECT_OPEN) {
+			arenaPutString(&message, redirection->fileName, strlen(redirection->fileName) + 1);
+		}
+	}
+
+	char* commandPath = lookupCommandPath(stage->arguments[0]);		// Resolved in the shell so the cache remembers it
+
+	if(commandPath != NULL) {
+		arenaPutString(&message, commandPath, strlen(commandPath) + 1);
+		request.hasCommandPath = true;
+	}
+
+	for(char** argument = stage->arguments; *argument != NULL; argument++) {
+		arenaPutString(&message, *argument, strlen(*argument) + 1);
+		request.argumentCount++;
+	}
+
+	for(char** variable = environ; *variable != NULL; variable++) {
+		arenaPutString(&message, *variable, strlen(*variable) + 1);
+		request.environmentCount++;
+	}
+
+	request.payloadLength = message.used;
+	request.redirectionCount = stage->redirectionCount;
+	request.nullInput = nullInput;
+	request.nullOutput = nullOutput;
+	request.isBackground = isBackground;
+	request.traceEnabled = traceEnabled;
+	request.leaderPID = leaderPID;
+	request.launchStart = launchStart;
+
+
+	// The descriptors ride on the first bytes, anything a short write leaves over is plain data
+
+	char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)] = {0};
+	struct iovec vectors[2] = {{&request, sizeof(request)}, {message.text, message.used}};
+	struct msghdr header = {0};
+
+	header.msg_iov = vectors;
+	header.msg_iovlen = 2;
+
+	if(fdCount > 0) {
+
+		header.msg_control = control;
+		header.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+		struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&header);
+		controlHeader->cmsg_level = SOL_SOCKET;
+		controlHeader->cmsg_type = SCM_RIGHTS;
+		controlHeader->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+		memcpy(CMSG_DATA(controlHeader), passedFDs, sizeof(int) * fdCount);
+	}
+
+	size_t totalLength = sizeof(request) + message.used;
+	size_t sentLength = 0;
+	ssize_t sent = sendmsg(zygoteFD, &header, MSG_NOSIGNAL);
+
+	while(sent > 0) {
+
+		sentLength += sent;
+
+		if(sentLength == totalLength) {
+			break;
+		}
+
+		if(sentLength < sizeof(request)) {
+			sent = send(zygoteFD, (char*)&request + sentLength, sizeof(request) - sentLength, MSG_NOSIGNAL);
+		}
+
+		else {
+			sent = send(zygoteFD, message.text + (sentLength - sizeof(request)), totalLength - sentLength, MSG_NOSIGNAL);
+		}
+	}
+
+	if(workingDirectoryFD != -1) {
+		close(workingDirectoryFD);
+	}
+
+	if(sentLength != totalLength) {		// Let the reader notice the zygote is gone and say so
+		return readZygoteEvents(false);
+	}
+
+	return readZygoteEvents(true);
+}
+
+
+
+/*
+ * NAME
+ *   launchJob - fork every stage of a pipeline and record them as one job
+ * SYNOPSIS
+ *   launchJob(struct pipelineStage* stages, int stageCount, bool isBackground, bool nullOutput)
+ * DESCRIPTION
+ *   stages holds the arguments and redirection of each |-separated stage, in order. A child is forked for every stage and
+ *   connected to its neighbours with pipe() so data goes straight from one command to the next. The first stage's stdin and
+ *   last stage's stdout are left alone for redirection, or sent to /dev/null for background jobs (stdout only when nullOutput
+ *   is set).
+ *   Background pipelines get a process group of their own, led by the first stage. Without job control foreground pipelines
+ *   stay in the shell's group so the terminal's SIGINT reaches them; with it they get their own group too and the first stage
+ *   takes the terminal, so ^C and ^Z go to the job rather than the shell. If SMALLSH_PIPESIZE is set, every pipe is resized
+ *   with F_SETPIPE_SZ. When the spawn launcher is selected each stage goes through spawnStage() instead of fork(), and with
+ *   the zygote running each stage goes through zygoteStage(). With set -o collect a background job that would have had its
+ *   stdout sent to /dev/null writes its stdout and every stage's stderr into a pipe the shell collects instead. Returns the
+ *   job table slot of the job's leader.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int launchJob(struct pipelineStage* stages, int stageCount, bool isBackground, bool nullOutput) {
+
+	prepareEnvironment();		// Only does anything after an export or unset
+
+	int leaderSlot = -1;
+	pid_t leaderPID = 0;
+	int previousReadEnd = -1;		// Read end of the pipe coming from the previous stage
+	int pipeFDs[2];
+	int outputFDs[2] = {-1, -1};		// Pipe collecting a background job's stdout and stderr
+
+	if(isBackground && nullOutput && collectOutput) {
+
+		if(pipe2(outputFDs, O_CLOEXEC) == -1) {
+			perror("Major problem creating pipe!\n");
+			exit(1);
+		}
+
+		if(pipeBufferSize > 0) {
+			fcntl(outputFDs[1], F_SETPIPE_SZ, pipeBufferSize);
+		}
+
+		jobOutputFD = outputFDs[1];		// Every launcher puts it on stderr of each stage
+		nullOutput = false;
+	}
+
+	for(int stage = 0; stage < stageCount; stage++) {
+
+		bool lastStage = (stage == stageCount - 1);
+
+		if(!lastStage) {
+
+			if(pipe2(pipeFDs, O_CLOEXEC) == -1) {		// Close-on-exec so spawned stages don't inherit the other ends
+				perror("Major problem creating pipe!\n");
+				exit(1);
+			}
+
+			if(pipeBufferSize > 0) {
+				fcntl(pipeFDs[1], F_SETPIPE_SZ, pipeBufferSize);
+			}
+		}
+
+		pid_t childPID = -1;
+		char* commandPath = NULL;
+		char* launcherName = "fork";		// Which launcher started the stage, for the trace
+		unsigned long long launchStart = traceClock();
+
+		if(zygoteFD != -1 && !launchLimitsActive) {		// Limits are set in the child, which only the shell knows about
+			childPID = zygoteStage(&stages[stage], previousReadEnd, lastStage ? jobOutputFD : pipeFDs[1],
+					isBackground && stage == 0, nullOutput && lastStage, isBackground, leaderPID, launchStart);
+			launcherName = "zygote";
+		}
+
+		if(childPID == -1 && useSpawnLauncher && !launchLimitsActive) {		// posix_spawn() can't set limits either
+			childPID = spawnStage(&stages[stage], previousReadEnd, lastStage ? jobOutputFD : pipeFDs[1],
+					isBackground && stage == 0, nullOutput && lastStage, isBackground, leaderPID);
+			launcherName = "spawn";
+		}
+
+		else if(childPID == -1) {		// The zygote may have just gone away, so this is the fallback for every launcher
+			commandPath = lookupCommandPath(stages[stage].arguments[0]);	// Resolved in the shell so the cache remembers it
+			childPID = fork();
+			launcherName = "fork";
+		}
+
+		if(childPID == -1) {
+			countMetric(METRIC_FORK_FAILURES, 1);
+			perror("Major problem creating child!\n");
+			exit(1);
+		}
+
+		else if(childPID == 0) {	// We are in the child process
+
+			traceEvent("fork", launchStart);	// How long until the child was running, tagged with its own pid
+
+			setUpChild(isBackground, leaderPID);
+
+			if(previousReadEnd != -1) {		// Read from the previous stage
+				dup2(previousReadEnd, 0);
+				close(previousReadEnd);
+			}
+
+			if(!lastStage) {			// Write to the next stage
+				dup2(pipeFDs[1], 1);
+				close(pipeFDs[0]);
+				close(pipeFDs[1]);
+			}
+
+			else if(jobOutputFD != -1) {		// Collected by the shell
+				dup2(jobOutputFD, 1);
+			}
+
+			if(jobOutputFD != -1) {
+				dup2(jobOutputFD, 2);
+			}
+
+			tryToRunCommand(&stages[stage], commandPath, isBackground && stage == 0, nullOutput && lastStage);
+			exit(1);	// Only reached if there was a problem
+		}
+
+		bool spawned = (strcmp(launcherName, "fork") != 0);		// Started by another process, or already in its group
+
+		countMetric(METRIC_EXTERNALS, 1);
+
+		traceEvent(launcherName, launchStart);	// How long until fork() returned in the parent, or the zygote replied
+
+		if((isBackground || jobControl) && !spawned) {
+			setpgid(childPID, leaderPID == 0 ? childPID : leaderPID);	// Parent sets it too so there's no race with the child
+		}
+
+		if(stage == 0) {
+			leaderPID = childPID;
+		}
+
+		if(leaderSlot == -1) {
+			leaderSlot = addJob(childPID, isBackground, -1);
+		}
+
+		else {
+			addJob(childPID, isBackground, leaderSlot);
+		}
+
+		if(!isBackground && !jobControl) {
+			jobTable[leaderSlot].pgid = getpgrp();
+		}
+
+		if(previousReadEnd != -1) {		// The children have their copies, the shell doesn't need these ends
+			close(previousReadEnd);
+		}
+
+		if(!lastStage) {
+			close(pipeFDs[1]);
+			previousReadEnd = pipeFDs[0];
+		}
+	}
+
+	if(outputFDs[0] != -1) {		// Only the job holds the write end now, so the pipe ends when it does
+		close(outputFDs[1]);
+		jobOutputFD = -1;
+		startJobOutput(jobTable[leaderSlot].jobNumber, leaderPID, outputFDs[0]);
+	}
+
+	return leaderSlot;
+}
+
+
+
+/*
+ * NAME
+ *   waitForJob - wait for every stage of a foreground job to finish
+ * SYNOPSIS
+ *   waitForJob(int leaderSlot)
+ * DESCRIPTION
+ *   Sleeps in waitForSignals() until reapChildren() has reaped every stage of the job, then returns the exit method of the
+ *   last stage. What the job used is saved in lastForegroundUsage. The job's slots are freed by the next call to
+ *   reportFinishedJobs(). The job log is written out whenever its oldest line has waited JOB_LOG_INTERVAL. With job control
+ *   the job holds the terminal while it runs and the shell takes it back afterwards. If the whole job is stopped instead, the
+ *   wait stops too: the job becomes a background job in the table and the stop status is returned. A SIGTSTP that came in
+ *   while the job was running has its message printed here. If SIGHUP or SIGTERM tells the shell to exit meanwhile, the job is
+ *   sent the same signal and the wait ends there, leaving the job in the table for shutDownJobs() to give the grace period and
+ *   then SIGKILL like every other job.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int waitForJob(int leaderSlot) {
+
+	foregroundRunning = true;		// In case SIGTSTP handling needs to hold its message
+
+	if(jobControl) {		// Already done by the child, this covers fg and a child that hasn't got that far yet
+		tcsetpgrp(STDIN_FILENO, jobTable[leaderSlot].pgid);
+	}
+
+	while(jobTable[leaderSlot].runningStages > 0 && !jobStopped(leaderSlot)) {		// Parent waits here until the children are reaped
+
+		int flushIn = jobLogTimeLeft();
+
+		if(flushIn == 0) {		// Background output has waited long enough
+			flushJobLog();
+			flushIn = -1;
+		}
+
+		waitForSignals(flushIn);
+
+		if(shutdownSignal != 0) {		// The shell is on its way out, so is the job it's waiting for
+			signalJob(leaderSlot, shutdownSignal);
+			break;
+		}
+	}
+
+	if(jobControl) {		// Take the terminal back, the way the shell left it
+		tcsetpgrp(STDIN_FILENO, shellPGID);
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &shellTerminalModes);
+	}
+
+	int exitMethod = jobTable[jobTable[leaderSlot].lastStage].exitMethod;
+
+	if(jobTable[leaderSlot].runningStages > 0) {		// Stopped, or being shut down, it carries on as a background job
+
+		for(int slot = leaderSlot; slot != -1; slot = jobTable[slot].nextStage) {
+
+			if(jobTable[slot].stopped) {
+				exitMethod = jobTable[slot].exitMethod;
+			}
+		}
+
+		jobTable[leaderSlot].background = true;
+	}
+
+	else {
+		collectJobUsage(leaderSlot, &lastForegroundUsage);
+	}
+
+	foregroundRunning = false;
+
+	if(modeMessagePending) {		// SIGTSTP came in while the job was running
+		modeMessagePending = false;
+		printModeMessage();
+	}
+
+	return exitMethod;
+}
+
+
+
+/*
+ * NAME
+ *   printJobLine - print one job the way jobs lists it
+ * SYNOPSIS
+ *   printJobLine(int leaderSlot)
+ * DESCRIPTION
+ *   Prints "[n] pid state command", where state is Running or Stopped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void printJobLine(int leaderSlot) {
+
+	char* commandText = jobTable[leaderSlot].commandText;
+
+	printf("[%d] %d %s\t%s\n", jobTable[leaderSlot].jobNumber, (int)jobTable[leaderSlot].pid,
+			jobStopped(leaderSlot) ? "Stopped" : "Running", (commandText != NULL) ? commandText : "");
+	fflush(stdout);
+}
+
+
+
+/*
+ * NAME
+ *   recordForegroundStatus - remember how a foreground job ended for the status command
+ * SYNOPSIS
+ *   recordForegroundStatus(int leaderSlot, int exitMethod)
+ * DESCRIPTION
+ *   Takes the exit method waitForJob() returned. A job killed by a signal has the signal printed, and a job that was stopped is
+ *   shown the way jobs would list it and gets an exit value of 128 plus the stop signal, as in other shells.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void recordForegroundStatus(int leaderSlot, int exitMethod) {
+
+	foreChildExitMethod = exitMethod;
+	noForegroundProcessesRun = false;
+	builtinExitValue = -1;
+
+	if(WIFSTOPPED(exitMethod)) {
+		printf("\n");		// The terminal's ^Z is still on the line
+		printJobLine(leaderSlot);
+		exitStatusCode = 128 + WSTOPSIG(exitMethod);
+		killedBySignal = false;
+		killedByExit = true;
+	}
+
+	if(WIFSIGNALED(exitMethod) != 0) {		// A signal killed the child
+		termSignal = WTERMSIG(exitMethod);
+		printf("terminated by signal %d\n", termSignal);
+		fflush(stdout);
+		killedBySignal = true;
+		killedByExit = false;
+	}
+
+	if(WIFEXITED(exitMethod) != 0) {		// Child exited normally
+		exitStatusCode = WEXITSTATUS(exitMethod);
+		killedBySignal = false;
+		killedByExit = true;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   setOptions - the set builtin, lists or changes shell options
+ * SYNOPSIS
+ *   setOptions(char** argumentArray)
+ * DESCRIPTION
+ *   "set -o" on its own lists every option and whether it's on. "set -o name" turns an option on and "set +o name" turns it off.
+ *   The options live in the shellOptions table so new ones only need an entry there. Returns 1 for a bad option, otherwise 0.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int setOptions(char** argumentArray) {
+
+	if(argumentArray[1] == NULL || (strcmp(argumentArray[1], "-o\0") == 0 && argumentArray[2] == NULL)) {
+
+		for(int index = 0; shellOptions[index].name != NULL; index++) {
+			printf("%-10s %s\n", shellOptions[index].name, *shellOptions[index].value ? "on" : "off");
+		}
+
+		fflush(stdout);
+		return 0;
+	}
+
+	bool turnOn = (strcmp(argumentArray[1], "-o\0") == 0);
+
+	if((!turnOn && strcmp(argumentArray[1], "+o\0") != 0) || argumentArray[2] == NULL) {
+		printf("usage: set [-o|+o] [option]\n");
+		fflush(stdout);
+		return 1;
+	}
+
+	for(int index = 0; shellOptions[index].name != NULL; index++) {
+
+		if(strcmp(argumentArray[2], shellOptions[index].name) == 0) {
+			*shellOptions[index].value = turnOn;
+			return 0;
+		}
+	}
+
+	printf("set: %s: invalid option name\n", argumentArray[2]);
+	fflush(stdout);
+	return 1;
+}
+
+
+
+/*
+ * NAME
+ *   readInputLine - read the next line of commands from a script, a pipe or the terminal
+ * SYNOPSIS
+ *   readInputLine(struct inputReader* reader, char** line)
+ * DESCRIPTION
+ *   Hands back the next line with its newline removed, pointing into the reader's buffer. Input is read in large chunks and the same
+ *   buffer is reused for the whole run, so a script with thousands of lines costs a handful of read() calls and no per-line
+ *   allocation. At a terminal with the line editor on, each line comes from lineEditor() instead of read(). The line stays valid
+ *   until the next call. Returns 1 when a line was read, 0 at end of input, and -1 if a signal interrupted the read so the caller
+ *   can show the prompt again.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int readInputLine(struct inputReader* reader, char** line) {
+
+	size_t searchFrom = reader->start;		// Bytes before this have already been checked for a newline
+
+	while(1) {
+
+		char* newline = memchr(reader->buffer + searchFrom, '\n', reader->end - searchFrom);
+
+		if(newline != NULL) {
+
+			*newline = '\0';
+			*line = reader->buffer + reader->start;
+			reader->start = (newline - reader->buffer) + 1;
+			return 1;
+		}
+
+		if(reader->atEOF) {
+
+			if(reader->start == reader->end) {
+				return 0;
+			}
+
+			reader->buffer[reader->end] = '\0';		// Last line had no newline
+			*line = reader->buffer + reader->start;
+			reader->start = reader->end;
+			return 1;
+		}
+
+
+		// Need more input, first slide the partial line to the front of the buffer
+
+		if(reader->start > 0) {
+
+			memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+			reader->end = reader->end - reader->start;
+			reader->start = 0;
+		}
+
+		searchFrom = reader->end;
+
+		if(reader->capacity - reader->end < READ_CHUNK_SIZE) {		// Long line, make room for another chunk
+
+			reader->capacity = reader->capacity * 2;
+			reader->buffer = realloc(reader->buffer, reader->capacity);
+
+			if(reader->buffer == NULL) {
+				perror("Major problem growing the input buffer!\n");
+				exit(1);
+			}
+		}
+
+		ssize_t numCharsRead;
+
+		if(lineEditor != NULL && lineEditing && reader == shellInput && reader->fd == STDIN_FILENO) {
+			numCharsRead = lineEditor(reader);		// Adds a whole edited line and its newline, or 0 for ^D
+		}
+
+		else {
+			waitForInput(reader->fd);
+
+			if(shutdownSignal != 0) {		// Same as running out of input
+				return 0;
+			}
+
+			numCharsRead = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);	// Leave room for a '\0'
+		}
+
+		if(numCharsRead == -1 && errno == EINTR) {	// If signal interrupted, get ready to ask for input again
+			return -1;
+		}
+
+		else if(numCharsRead <= 0) {
+			reader->atEOF = true;
+		}
+
+		else {
+			reader->end = reader->end + numCharsRead;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   reserveStages - make sure the pipeline stage array can hold a pipeline
+ * SYNOPSIS
+ *   reserveStages(size_t needed)
+ * DESCRIPTION
+ *   Doubles pipelineStages until it has at least needed entries.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void reserveStages(size_t needed) {
+
+	if(needed <= pipelineStageCapacity) {
+		return;
+	}
+
+	size_t newCapacity = (pipelineStageCapacity == 0) ? 16 : pipelineStageCapacity;
+
+	while(newCapacity < needed) {
+		newCapacity = newCapacity * 2;
+	}
+
+	pipelineStages = realloc(pipelineStages, newCapacity * sizeof(struct pipelineStage));
+
+	if(pipelineStages == NULL) {
+		perror("Major problem growing the pipeline!\n");
+		exit(1);
+	}
+
+	pipelineStageCapacity = newCapacity;
+}
+
+
+
+// Collects a here-string in a small buffer and moves it to a memfd once it outgrows a pipe
+
+struct heredocWriter {
+	char buffer[HEREDOC_PIPE_LIMIT];
+	size_t used;
+	int memfd;			// -1 while the body still fits in buffer
+};
+
+
+
+/*
+ * NAME
+ *   writeHeredoc - add text to a here-string
+ * SYNOPSIS
+ *   writeHeredoc(struct heredocWriter* writer, char* text, size_t length)
+ * DESCRIPTION
+ *   Buffers the text while the body fits in a pipe. Past that the buffer is flushed to a new memfd and everything after is written
+ *   straight into it from where it was read.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void writeHeredoc(struct heredocWriter* writer, char* text, size_t length) {
+
+	if(writer->memfd == -1 && writer->used + length <= HEREDOC_PIPE_LIMIT) {
+		memcpy(writer->buffer + writer->used, text, length);
+		writer->used = writer->used + length;
+		return;
+	}
+
+	if(writer->memfd == -1) {
+
+		writer->memfd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+
+		if(writer->memfd == -1 || write(writer->memfd, writer->buffer, writer->used) != (ssize_t)writer->used) {
+			perror("Major problem staging a heredoc!\n");
+			exit(1);
+		}
+	}
+
+	if(write(writer->memfd, text, length) != (ssize_t)length) {
+		perror("Major problem staging a heredoc!\n");
+		exit(1);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   addHeredoc - record the descriptor staged for a << or <<< operator
+ * SYNOPSIS
+ *   addHeredoc(char* operatorToken, int bodyFD)
+ * DESCRIPTION
+ *   findHeredoc() hands it to the redirection, closeHeredocs() closes it once the line has run.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void addHeredoc(char* operatorToken, int bodyFD) {
+
+	if(heredocCount == heredocCapacity) {
+
+		heredocCapacity = (heredocCapacity == 0) ? 4 : heredocCapacity * 2;
+		heredocs = realloc(heredocs, heredocCapacity * sizeof(struct heredoc));
+
+		if(heredocs == NULL) {
+			perror("Major problem growing the heredoc list!\n");
+			exit(1);
+		}
+	}
+
+	heredocs[heredocCount].operatorToken = operatorToken;
+	heredocs[heredocCount].fd = bodyFD;
+	heredocCount++;
+}
+
+
+
+/*
+ * NAME
+ *   finishHeredoc - turn a here-string into a descriptor to read it from
+ * SYNOPSIS
+ *   finishHeredoc(struct heredocWriter* writer, char* operatorToken)
+ * DESCRIPTION
+ *   A memfd is rewound to the start. A small body is written to a new pipe whose write end is closed straight away, so the reader
+ *   sees end of file after the body. Either way the descriptor is close-on-exec and recorded for the operator token with
+ *   addHeredoc().
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void finishHeredoc(struct heredocWriter* writer, char* operatorToken) {
+
+	int bodyFD = writer->memfd;
+
+	if(bodyFD != -1) {
+		lseek(bodyFD, 0, SEEK_SET);
+	}
+
+	else {
+
+		int pipeFDs[2];
+
+		if(pipe2(pipeFDs, O_CLOEXEC) == -1 || write(pipeFDs[1], writer->buffer, writer->used) != (ssize_t)writer->used) {
+			perror("Major problem staging a heredoc!\n");
+			exit(1);
+		}
+
+		close(pipeFDs[1]);
+		bodyFD = pipeFDs[0];
+	}
+
+	addHeredoc(operatorToken, bodyFD);
+}
+
+
+
+/*
+ * NAME
+ *   closeHeredocs - close the bodies staged for the line that just ran
+ * SYNOPSIS
+ *   closeHeredocs()
+ * DESCRIPTION
+ *   The children have their own copy on stdin by now, so the shell's can go.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void closeHeredocs() {
+
+	for(size_t index = 0; index < heredocCount; index++) {
+		close(heredocs[index].fd);
+	}
+
+	heredocCount = 0;
+}
+
+
+
+/*
+ * NAME
+ *   splitPipeline - split a lexed command into pipeline stages
+ * SYNOPSIS
+ *   splitPipeline(char** argumentArray, bool* isOperator, int lastIndex)
+ * DESCRIPTION
+ *   Replaces each | operator with the NULL that ends a stage and pulls every stage's redirections out into lineRedirections, once
+ *   for the whole line. Reports a command too long for exec, an empty stage, a stage that's only redirections or a bad redirection
+ *   and returns -1, otherwise returns the number of stages.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int splitPipeline(char** argumentArray, bool* isOperator, int lastIndex) {
+
+	size_t argumentBytes = (lastIndex + 2) * sizeof(char*) + lexerArena.used + expansionArena.used;	// Roughly what exec will need
+
+	if(lastIndex >= 0 && argumentBytes > (size_t)argumentByteLimit) {
+		printf("%s: argument list too long\n", argumentArray[0]);
+		fflush(stdout);
+		return -1;
+	}
+
+	reserveStages(lastIndex + 2);		// Can't be more stages than tokens
+
+	int stageCount = 0;
+	int stageStart = 0;
+	bool pipelineValid = (lastIndex >= 0);
+
+	lineRedirectionCount = 0;
+
+	for(int index = 0; index <= lastIndex + 1 && pipelineValid; index++) {
+
+		if(index == lastIndex + 1 || (isOperator[index] && strcmp(argumentArray[index], "|\0") == 0)) {
+
+			argumentArray[index] = NULL;
+
+			if(index == stageStart) {	// Nothing on one side of the |
+				pipelineValid = false;
+			}
+
+			else if(!findRedirections(argumentArray, isOperator, stageStart, index - 1, &pipelineStages[stageCount])) {
+				return -1;		// Already reported
+			}
+
+			else if(pipelineStages[stageCount].arguments[0] == NULL) {
+				printf("syntax error: redirection without a command\n");
+				fflush(stdout);
+				return -1;
+			}
+
+			else {
+				stageCount++;
+			}
+
+			stageStart = index + 1;
+		}
+	}
+
+	if(!pipelineValid) {
+		printf("syntax error near |\n");
+		fflush(stdout);
+		return -1;
+	}
+
+	return stageCount;
+}
+
+
+
+// Syntax trees
+//
+// A command is lexed once and parsed once into a tree of small nodes kept in one array: simple commands, which are just a range
+// of the lexed tokens, ! and the && || lists, if, while, until, for, { } groups and function definitions. A command spread over
+// several lines is collected first, so a whole if or while is parsed together. Running a loop walks the same nodes every time
+// around and the only work per simple command is expandWords() filling in the $ expansions the lexer marked, which skips words
+// that have none, so nothing is lexed or tokenized again. The tree for a line points into the lexer arena and is reused for the
+// next line. A function's tree is copied out of it once when the function is defined and shared by every call.
+
+#define NODE_COMMAND 0		// Tokens firstToken to firstToken + tokenCount - 1, a pipeline with an optional & on the end
+#define NODE_AND 1		// child[0] && child[1]
+#define NODE_OR 2		// child[0] || child[1]
+#define NODE_NOT 3		// ! child[0]
+#define NODE_IF 4		// if child[0]; then child[1]; else child[2], which is another NODE_IF for elif, or -1
+#define NODE_WHILE 5		// while child[0]; do child[1]; done
+#define NODE_UNTIL 6		// until child[0]; do child[1]; done
+#define NODE_FOR 7		// for the name at firstToken in the tokenCount words from child[0], -1 for "$@"; do child[1]; done
+#define NODE_GROUP 8		// { child[0]; }
+#define NODE_FUNCTION 9		// Defines the name, tokenCount characters of the word at firstToken, with the group child[0] as its body
+#define NODE_REDIRECT 10	// Runs the compound command child[0] with the redirections in tokens firstToken on
+
+struct syntaxNode {
+	int kind;
+	int next;			// Next command of the list this one is in, -1 at the end
+	int child[3];
+	int firstToken;
+	int tokenCount;
+};
+
+struct heredocBody {
+	int tokenIndex;			// The << it was read for
+	size_t offset;			// Where it starts in the tree's bodyText
+	size_t length;
+	int memfd;			// A body too big for a pipe, staged the first time it runs, -1 until then
+};
+
+struct syntaxTree {
+	char** words;			// The lexed tokens, with their expansions still marked
+	bool* isOperator;
+	unsigned char* wordFlags;
+	int tokenCount;
+	char* text;			// What words point into
+	size_t textLength;
+	struct syntaxNode* nodes;
+	int nodeCount;
+	int nodeCapacity;
+	struct heredocBody* bodies;
+	int bodyCount;
+	int bodyCapacity;
+	struct tokenArena bodyText;
+	int useCount;			// Functions and running calls holding a copied tree, it's freed when this drops to 0
+	struct syntaxTree* retainedCopy;	// Copy of the line's tree shared by every function the line defines
+};
+
+struct syntaxTree lineTree = {0};	// The line being run, its words live in commandArguments and the lexer arena
+
+#define PARSE_DONE 0
+#define PARSE_INCOMPLETE 1		// Ran out of tokens in the middle of a command, another line is needed
+#define PARSE_ERROR 2			// Already reported
+
+struct treeParser {
+	struct syntaxTree* tree;
+	int position;			// Next token to look at
+	int status;
+	bool backgrounded;		// The command just parsed ended with &, which also separates it from the next one
+};
+
+
+// Defined functions, in a chained hash table keyed by name
+
+#define FUNCTION_BUCKETS 64		// Power of two
+#define FUNCTION_DEPTH_LIMIT 1000	// Calls deep enough to be runaway recursion, stopped before the stack runs out
+
+struct shellFunction {
+	char* name;
+	struct syntaxTree* tree;	// Copied tree the body is in
+	int body;
+	struct shellFunction* next;	// Next function in the same bucket
+};
+
+struct shellFunction* functionBuckets[FUNCTION_BUCKETS];
+int functionCount = 0;
+
+
+// How far break, continue and return still have to unwind
+
+int loopDepth = 0;			// Loops running right now in the current function, what break and continue can reach
+int loopExits = 0;			// Loops that break or continue hasn't left yet
+bool loopContinues = false;		// The last loop left by loopExits goes around again instead of stopping
+int functionDepth = 0;
+bool functionReturning = false;
+int functionReturnValue = 0;
+bool lineInterrupted = false;		// A foreground command was killed by SIGINT, the rest of the line is skipped
+
+
+
+/*
+ * NAME
+ *   loadLineTree - point the line's tree at what the lexer produced
+ * SYNOPSIS
+ *   loadLineTree()
+ * DESCRIPTION
+ *   Called after every lexCommandLine() into commandArguments, since the vector and the arena can move as they grow.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void loadLineTree() {
+
+	lineTree.words = commandArguments.items;
+	lineTree.isOperator = commandArguments.isOperator;
+	lineTree.wordFlags = commandArguments.wordFlags;
+	lineTree.tokenCount = (int)commandArguments.count;
+	lineTree.text = lexerArena.text;
+	lineTree.textLength = lexerArena.used;
+}
+
+
+
+/*
+ * NAME
+ *   readHeredocBodies - read the body of every << from firstToken on
+ * SYNOPSIS
+ *   readHeredocBodies(struct syntaxTree* tree, int firstToken)
+ * DESCRIPTION
+ *   A heredoc's body is every following input line up to one that is exactly the word after <<, read from the same place as the
+ *   commands (a "> " prompt is shown at a terminal) and kept in the tree's bodyText. Bodies are read in the order they appear,
+ *   right after the line they're on. Reports a << with no word after it and returns false.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool readHeredocBodies(struct syntaxTree* tree, int firstToken) {
+
+	for(int index = firstToken; index < tree->tokenCount; index++) {
+
+		if(!tree->isOperator[index] || strcmp(skipDescriptor(tree->words[index]), "<<\0") != 0) {		// 3<<END reads the same way
+			continue;
+		}
+
+		if(index + 1 == tree->tokenCount || tree->isOperator[index + 1]) {
+			printf("syntax error near %s\n", tree->words[index]);
+			fflush(stdout);
+			return false;
+		}
+
+		if(tree->bodyCount == tree->bodyCapacity) {
+
+			tree->bodyCapacity = (tree->bodyCapacity == 0) ? 4 : tree->bodyCapacity * 2;
+			tree->bodies = realloc(tree->bodies, tree->bodyCapacity * sizeof(struct heredocBody));
+
+			if(tree->bodies == NULL) {
+				perror("Major problem growing the heredoc list!\n");
+				exit(1);
+			}
+		}
+
+		struct heredocBody* body = &tree->bodies[tree->bodyCount];
+		tree->bodyCount++;
+
+		body->tokenIndex = index;
+		body->offset = tree->bodyText.used;
+		body->memfd = -1;
+
+		char* delimiter = tree->words[index + 1];
+		char* line;
+		int lineStatus = 1;
+
+		while(1) {
+
+			if(interactiveMode) {
+				showPrompt("> ");
+			}
+
+			while((lineStatus = readInputLine(shellInput, &line)) == -1) {
+				// Interrupted, try again
+			}
+
+			if(lineStatus == 0 || strcmp(line, delimiter) == 0) {
+				break;
+			}
+
+			arenaPutString(&tree->bodyText, line, strlen(line));
+			arenaPut(&tree->bodyText, '\n');
+		}
+
+		if(lineStatus == 0) {
+			printf("warning: heredoc ended by end of input, wanted %s\n", delimiter);
+			fflush(stdout);
+		}
+
+		body->length = tree->bodyText.used - body->offset;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   stageHeredocBody - give a << the descriptor its body is read from
+ * SYNOPSIS
+ *   stageHeredocBody(struct syntaxTree* tree, int tokenIndex, char* operatorToken)
+ * DESCRIPTION
+ *   A body that fits in a pipe is written into one straight from bodyText. A bigger one is copied into the body's memfd the first
+ *   time, and every run opens that again through /proc/self/fd, which gives it an offset of its own at the start of the body
+ *   without copying anything. The descriptor is recorded for operatorToken with addHeredoc().
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void stageHeredocBody(struct syntaxTree* tree, int tokenIndex, char* operatorToken) {
+
+	struct heredocBody* body = NULL;
+
+	for(int index = 0; index < tree->bodyCount && body == NULL; index++) {
+
+		if(tree->bodies[index].tokenIndex == tokenIndex) {
+			body = &tree->bodies[index];
+		}
+	}
+
+	char* text = (body != NULL) ? tree->bodyText.text + body->offset : NULL;
+	size_t length = (body != NULL) ? body->length : 0;
+	int bodyFD;
+
+	if(length <= HEREDOC_PIPE_LIMIT) {
+
+		int pipeFDs[2];
+
+		if(pipe2(pipeFDs, O_CLOEXEC) == -1 || (length > 0 && write(pipeFDs[1], text, length) != (ssize_t)length)) {
+			perror("Major problem staging a heredoc!\n");
+			exit(1);
+		}
+
+		close(pipeFDs[1]);
+		bodyFD = pipeFDs[0];
+	}
+
+	else {
+
+		if(body->memfd == -1) {
+
+			body->memfd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+
+			if(body->memfd == -1 || !writeFully(body->memfd, text, length)) {
+				perror("Major problem staging a heredoc!\n");
+				exit(1);
+			}
+		}
+
+		char memfdPath[48];
+		snprintf(memfdPath, sizeof(memfdPath), "/proc/self/fd/%d", body->memfd);
+		bodyFD = open(memfdPath, O_RDONLY | O_CLOEXEC);
+
+		if(bodyFD == -1) {
+			perror("Major problem staging a heredoc!\n");
+			exit(1);
+		}
+	}
+
+	addHeredoc(operatorToken, bodyFD);
+}
+
+
+
+/*
+ * NAME
+ *   closeHeredocBodies - close the memfds a tree's bodies were staged in
+ * SYNOPSIS
+ *   closeHeredocBodies(struct syntaxTree* tree)
+ * DESCRIPTION
+ *   For when the tree is done with, after its line has run or the last function using a copy has gone.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void closeHeredocBodies(struct syntaxTree* tree) {
+
+	for(int index = 0; index < tree->bodyCount; index++) {
+
+		if(tree->bodies[index].memfd != -1) {
+			close(tree->bodies[index].memfd);
+			tree->bodies[index].memfd = -1;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   addNode - add an empty node to a tree
+ * SYNOPSIS
+ *   addNode(struct syntaxTree* tree, int kind)
+ * DESCRIPTION
+ *   Returns the new node's index. Nodes are only ever referred to by index since the array moves when it grows.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int addNode(struct syntaxTree* tree, int kind) {
+
+	if(tree->nodeCount == tree->nodeCapacity) {
+
+		tree->nodeCapacity = (tree->nodeCapacity == 0) ? 64 : tree->nodeCapacity * 2;
+		tree->nodes = realloc(tree->nodes, tree->nodeCapacity * sizeof(struct syntaxNode));
+
+		if(tree->nodes == NULL) {
+			perror("Major problem growing the syntax tree!\n");
+			exit(1);
+		}
+	}
+
+	struct syntaxNode* node = &tree->nodes[tree->nodeCount];
+
+	node->kind = kind;
+	node->next = -1;
+	node->child[0] = -1;
+	node->child[1] = -1;
+	node->child[2] = -1;
+	node->firstToken = -1;
+	node->tokenCount = 0;
+
+	tree->nodeCount++;
+
+	return tree->nodeCount - 1;
+}
+
+
+
+/*
+ * NAME
+ *   isReservedWord - whether the token at index is the reserved word given
+ * SYNOPSIS
+ *   isReservedWord(struct syntaxTree* tree, int index, char* word)
+ * DESCRIPTION
+ *   Only a word with no quoting, escapes or expansions counts, so "if" and \if are ordinary words.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline bool isReservedWord(struct syntaxTree* tree, int index, char* word) {
+
+	return index < tree->tokenCount && !tree->isOperator[index] && !(tree->wordFlags[index] & WORD_ESCAPED) &&
+			strcmp(tree->words[index], word) == 0;
+}
+
+
+
+/*
+ * NAME
+ *   isOperatorToken - whether the token at index is the operator given
+ * SYNOPSIS
+ *   isOperatorToken(struct syntaxTree* tree, int index, char* operator)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline bool isOperatorToken(struct syntaxTree* tree, int index, char* operator) {
+
+	return index < tree->tokenCount && tree->isOperator[index] && strcmp(tree->words[index], operator) == 0;
+}
+
+
+
+/*
+ * NAME
+ *   syntaxError - report the token the parser couldn't use
+ * SYNOPSIS
+ *   syntaxError(struct treeParser* parser)
+ * DESCRIPTION
+ *   Running out of tokens isn't an error yet, it means the command goes on to the next line.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void syntaxError(struct treeParser* parser) {
+
+	if(parser->position >= parser->tree->tokenCount) {
+		parser->status = PARSE_INCOMPLETE;
+		return;
+	}
+
+	char* token = parser->tree->words[parser->position];
+
+	printf("syntax error near %s\n", (strcmp(token, "\n\0") == 0) ? "newline" : token);
+	fflush(stdout);
+	parser->status = PARSE_ERROR;
+}
+
+
+
+/*
+ * NAME
+ *   expectWord - step over a reserved word that has to come next
+ * SYNOPSIS
+ *   expectWord(struct treeParser* parser, char* word)
+ * DESCRIPTION
+ *   Returns false after syntaxError() if it isn't there.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool expectWord(struct treeParser* parser, char* word) {
+
+	if(!isReservedWord(parser->tree, parser->position, word)) {
+		syntaxError(parser);
+		return false;
+	}
+
+	parser->position++;
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   atTerminator - whether the parser is at one of the reserved words that end the current list
+ * SYNOPSIS
+ *   atTerminator(struct treeParser* parser, char** terminators)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool atTerminator(struct treeParser* parser, char** terminators) {
+
+	for(int index = 0; terminators != NULL && terminators[index] != NULL; index++) {
+
+		if(isReservedWord(parser->tree, parser->position, terminators[index])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+/*
+ * NAME
+ *   functionName - the name a function definition starts with
+ * SYNOPSIS
+ *   functionName(struct syntaxTree* tree, int index)
+ * DESCRIPTION
+ *   Recognizes "name()" as one word and "name ()" as two. Returns the length of the name, or 0 if the tokens at index don't
+ *   start a definition.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t functionName(struct syntaxTree* tree, int index) {
+
+	if(index >= tree->tokenCount || tree->isOperator[index] || (tree->wordFlags[index] & WORD_ESCAPED)) {
+		return 0;
+	}
+
+	char* word = tree->words[index];
+	size_t length = strlen(word);
+
+	if(length > 2 && strcmp(word + length - 2, "()") == 0 && isVariableName(word, length - 2)) {
+		return length - 2;
+	}
+
+	if(isReservedWord(tree, index + 1, "()") && isVariableName(word, length)) {
+		return length;
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   parseSimpleCommand - the node for a pipeline of simple commands
+ * SYNOPSIS
+ *   parseSimpleCommand(struct treeParser* parser)
+ * DESCRIPTION
+ *   Takes every token up to the next ; newline && || or &, and the & too if there is one. The words are left exactly as the
+ *   lexer made them, they're only expanded and split into stages when the command runs. A | at the end of the input means the
+ *   pipeline continues on the next line.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int parseSimpleCommand(struct treeParser* parser) {
+
+	struct syntaxTree* tree = parser->tree;
+	int firstToken = parser->position;
+
+	while(parser->position < tree->tokenCount && !isOperatorToken(tree, parser->position, ";\0") &&
+			!isOperatorToken(tree, parser->position, "\n\0") && !isOperatorToken(tree, parser->position, "&&\0") &&
+			!isOperatorToken(tree, parser->position, "||\0") && !isOperatorToken(tree, parser->position, "&\0")) {
+		parser->position++;
+	}
+
+	if(parser->position == tree->tokenCount && isOperatorToken(tree, parser->position - 1, "|\0")) {
+		parser->status = PARSE_INCOMPLETE;
+		return -1;
+	}
+
+	if(isOperatorToken(tree, parser->position, "&\0")) {
+		parser->position++;
+		parser->backgrounded = true;
+	}
+
+	int node = addNode(tree, NODE_COMMAND);
+
+	tree->nodes[node].firstToken = firstToken;
+	tree->nodes[node].tokenCount = parser->position - firstToken;
+
+	return node;
+}
+
+
+
+/*
+ * NAME
+ *   parseRedirections - take the redirections after a compound command
+ * SYNOPSIS
+ *   parseRedirections(struct treeParser* parser, int commandNode)
+ * DESCRIPTION
+ *   Like "done < file" or "} > file 2>&1". Returns commandNode itself if there are none, or a NODE_REDIRECT around it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int parseRedirections(struct treeParser* parser, int commandNode) {
+
+	struct syntaxTree* tree = parser->tree;
+	int firstToken = parser->position;
+
+	while(parser->position < tree->tokenCount && tree->isOperator[parser->position]) {
+
+		char* operator = skipDescriptor(tree->words[parser->position]);
+
+		if(operator[0] != '<' && operator[0] != '>' && strncmp(operator, "&>", 2) != 0) {
+			break;
+		}
+
+		parser->position++;
+
+		if(parser->position == tree->tokenCount || tree->isOperator[parser->position]) {
+			syntaxError(parser);
+			return -1;
+		}
+
+		parser->position++;
+	}
+
+	if(parser->position == firstToken) {
+		return commandNode;
+	}
+
+	int redirectNode = addNode(tree, NODE_REDIRECT);
+
+	tree->nodes[redirectNode].child[0] = commandNode;
+	tree->nodes[redirectNode].firstToken = firstToken;
+	tree->nodes[redirectNode].tokenCount = parser->position - firstToken;
+
+	return redirectNode;
+}
+
+
+
+/*
+ * NAME
+ *   parseCommandList - parse a list of commands into linked nodes
+ * SYNOPSIS
+ *   parseCommandList(struct treeParser* parser, char** terminators)
+ * DESCRIPTION
+ *   Commands in the list are separated by ; newlines or &, and each one is a chain of pipelines joined by && and ||, which
+ *   group from the left, optionally behind a !. A pipeline is either a simple command or one of the compound commands: if,
+ *   elif, else, fi; while or until, do, done; for name [in words], do, done; { list; }; and "name() { list; }" or "function
+ *   name { list; }" definitions. Redirections can follow any compound command. The lists inside those are parsed by calling
+ *   this again with the reserved words that can end them. A terminator is only looked for where a command could start, so
+ *   "echo done" is a simple command. Returns the index of the first node of the list, linked through next, or -1 for an empty
+ *   list or with parser->status set if it couldn't be parsed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int parseCommandList(struct treeParser* parser, char** terminators) {
+
+	static char* thenWords[] = {"then", NULL};
+	static char* elseWords[] = {"elif", "else", "fi", NULL};
+	static char* fiWords[] = {"fi", NULL};
+	static char* doWords[] = {"do", NULL};
+	static char* doneWords[] = {"done", NULL};
+	static char* braceWords[] = {"}", NULL};
+	static char* reservedWords[] = {"then", "elif", "else", "fi", "do", "done", "}", "in", NULL};	// Can't start a command
+
+	struct syntaxTree* tree = parser->tree;
+	int firstNode = -1;
+	int lastNode = -1;
+
+	while(1) {
+
+		while(isOperatorToken(tree, parser->position, "\n\0")) {
+			parser->position++;
+		}
+
+		if(parser->position == tree->tokenCount) {
+
+			if(terminators != NULL) {		// Still inside a compound command
+				parser->status = PARSE_INCOMPLETE;
+				return -1;
+			}
+
+			return firstNode;
+		}
+
+		if(atTerminator(parser, terminators)) {
+			return firstNode;
+		}
+
+
+		int andOrNode = -1;
+		int joinKind = NODE_AND;		// How the next pipeline joins onto andOrNode
+
+		while(1) {
+
+			bool negated = isReservedWord(tree, parser->position, "!");
+			int commandNode = -1;
+			size_t nameLength = 0;
+
+			parser->position = parser->position + negated;
+			parser->backgrounded = false;
+
+			if(parser->position == tree->tokenCount || atTerminator(parser, reservedWords) ||
+					isOperatorToken(tree, parser->position, ";\0") || isOperatorToken(tree, parser->position, "\n\0") ||
+					isOperatorToken(tree, parser->position, "&&\0") || isOperatorToken(tree, parser->position, "||\0") ||
+					isOperatorToken(tree, parser->position, "&\0") || isOperatorToken(tree, parser->position, "|\0")) {
+
+				syntaxError(parser);
+				return -1;
+			}
+
+			else if(isReservedWord(tree, parser->position, "if")) {
+
+				commandNode = addNode(tree, NODE_IF);
+				int ifNode = commandNode;
+
+				while(1) {		// Once for the if and once for each elif
+
+					parser->position++;
+
+					int condition = parseCommandList(parser, thenWords);
+
+					if(condition == -1 || !expectWord(parser, "then")) {
+						if(parser->status == PARSE_DONE) {
+							syntaxError(parser);		// An empty list
+						}
+						return -1;
+					}
+
+					int body = parseCommandList(parser, elseWords);
+
+					if(body == -1) {
+						if(parser->status == PARSE_DONE) {
+							syntaxError(parser);		// An empty list
+						}
+						return -1;
+					}
+
+					tree->nodes[ifNode].child[0] = condition;
+					tree->nodes[ifNode].child[1] = body;
+
+					if(isReservedWord(tree, parser->position, "elif")) {
+						int elifNode = addNode(tree, NODE_IF);
+						tree->nodes[ifNode].child[2] = elifNode;
+						ifNode = elifNode;
+						continue;
+					}
+
+					if(isReservedWord(tree, parser->position, "else")) {
+
+						parser->position++;
+
+						int elseBody = parseCommandList(parser, fiWords);
+
+						if(elseBody == -1) {
+							if(parser->status == PARSE_DONE) {
+								syntaxError(parser);		// An empty list
+							}
+							return -1;
+						}
+
+						tree->nodes[ifNode].child[2] = elseBody;
+					}
+
+					if(!expectWord(parser, "fi")) {
+						return -1;
+					}
+
+					break;
+				}
+			}
+
+			else if(isReservedWord(tree, parser->position, "while") || isReservedWord(tree, parser->position, "until")) {
+
+				commandNode = addNode(tree, isReservedWord(tree, parser->position, "while") ? NODE_WHILE : NODE_UNTIL);
+				parser->position++;
+
+				int condition = parseCommandList(parser, doWords);
+
+				if(condition == -1 || !expectWord(parser, "do")) {
+					if(parser->status == PARSE_DONE) {
+						syntaxError(parser);		// An empty list
+					}
+					return -1;
+				}
+
+				int body = parseCommandList(parser, doneWords);
+
+				if(body == -1 || !expectWord(parser, "done")) {
+					if(parser->status == PARSE_DONE) {
+						syntaxError(parser);		// An empty list
+					}
+					return -1;
+				}
+
+				tree->nodes[commandNode].child[0] = condition;
+				tree->nodes[commandNode].child[1] = body;
+			}
+
+			else if(isReservedWord(tree, parser->position, "for")) {
+
+				commandNode = addNode(tree, NODE_FOR);
+				parser->position++;
+
+				int nameIndex = parser->position;
+
+				if(nameIndex == tree->tokenCount) {
+					parser->status = PARSE_INCOMPLETE;
+					return -1;
+				}
+
+				if((tree->isOperator[nameIndex] || (tree->wordFlags[nameIndex] & WORD_ESCAPED) ||
+						!isVariableName(tree->words[nameIndex], strlen(tree->words[nameIndex])))) {
+
+					printf("for: %s is not a valid name\n", tree->isOperator[nameIndex] ? "an operator" : tree->words[nameIndex]);
+					fflush(stdout);
+					parser->status = PARSE_ERROR;
+					return -1;
+				}
+
+				parser->position++;
+
+				while(isOperatorToken(tree, parser->position, "\n\0")) {
+					parser->position++;
+				}
+
+				tree->nodes[commandNode].firstToken = nameIndex;
+				tree->nodes[commandNode].tokenCount = -1;		// No in, loop over "$@"
+
+				if(isReservedWord(tree, parser->position, "in")) {
+
+					parser->position++;
+
+					int firstWord = parser->position;
+
+					while(parser->position < tree->tokenCount && !tree->isOperator[parser->position]) {
+						parser->position++;
+					}
+
+					tree->nodes[commandNode].child[0] = firstWord;
+					tree->nodes[commandNode].tokenCount = parser->position - firstWord;
+
+					if(!isOperatorToken(tree, parser->position, ";\0") && !isOperatorToken(tree, parser->position, "\n\0")) {
+						syntaxError(parser);
+						return -1;
+					}
+				}
+
+				if(isOperatorToken(tree, parser->position, ";\0")) {
+					parser->position++;
+				}
+
+				while(isOperatorToken(tree, parser->position, "\n\0")) {
+					parser->position++;
+				}
+
+				if(!expectWord(parser, "do")) {
+					return -1;
+				}
+
+				int body = parseCommandList(parser, doneWords);
+
+				if(body == -1 || !expectWord(parser, "done")) {
+					if(parser->status == PARSE_DONE) {
+						syntaxError(parser);		// An empty list
+					}
+					return -1;
+				}
+
+				tree->nodes[commandNode].child[1] = body;
+			}
+
+			else if(isReservedWord(tree, parser->position, "{") || isReservedWord(tree, parser->position, "function") ||
+					(nameLength = functionName(tree, parser->position)) > 0) {
+
+				int nameIndex = -1;
+
+				if(isReservedWord(tree, parser->position, "function")) {
+
+					parser->position++;
+					nameLength = functionName(tree, parser->position);
+
+					if(nameLength == 0 && parser->position < tree->tokenCount && !tree->isOperator[parser->position] &&
+							isVariableName(tree->words[parser->position], strlen(tree->words[parser->position]))) {
+						nameLength = strlen(tree->words[parser->position]);		// function name { ... } needs no ()
+					}
+
+					if(nameLength == 0) {
+						syntaxError(parser);
+						return -1;
+					}
+				}
+
+				if(nameLength > 0) {		// A definition, skip to the {
+
+					nameIndex = parser->position;
+					parser->position++;		// The name, or name() as one word
+
+					if(strlen(tree->words[nameIndex]) == nameLength && isReservedWord(tree, parser->position, "()")) {
+						parser->position++;
+					}
+
+					while(isOperatorToken(tree, parser->position, "\n\0")) {
+						parser->position++;
+					}
+
+					if(!isReservedWord(tree, parser->position, "{")) {
+						if(parser->position < tree->tokenCount) {
+							printf("syntax error: a function body has to be a { } group\n");
+							fflush(stdout);
+							parser->status = PARSE_ERROR;
+						}
+
+						else {
+							parser->status = PARSE_INCOMPLETE;
+						}
+
+						return -1;
+					}
+				}
+
+				commandNode = addNode(tree, NODE_GROUP);
+				parser->position++;
+
+				int body = parseCommandList(parser, braceWords);
+
+				if(body == -1 || !expectWord(parser, "}")) {
+					if(parser->status == PARSE_DONE) {
+						syntaxError(parser);		// An empty list
+					}
+					return -1;
+				}
+
+				tree->nodes[commandNode].child[0] = body;
+				commandNode = parseRedirections(parser, commandNode);		// Part of the body for a function, applied on every call
+
+				if(commandNode != -1 && nameIndex != -1) {
+					int groupNode = commandNode;
+					commandNode = addNode(tree, NODE_FUNCTION);
+					tree->nodes[commandNode].firstToken = nameIndex;
+					tree->nodes[commandNode].tokenCount = (int)nameLength;
+					tree->nodes[commandNode].child[0] = groupNode;
+				}
+			}
+
+			else {
+				commandNode = parseSimpleCommand(parser);
+			}
+
+			if(commandNode != -1 && tree->nodes[commandNode].kind != NODE_COMMAND && tree->nodes[commandNode].kind != NODE_FUNCTION &&
+					tree->nodes[commandNode].kind != NODE_REDIRECT) {
+				commandNode = parseRedirections(parser, commandNode);
+			}
+
+			if(commandNode == -1) {
+				return -1;
+			}
+
+
+			if(negated) {
+				int notNode = addNode(tree, NODE_NOT);
+				tree->nodes[notNode].child[0] = commandNode;
+				commandNode = notNode;
+			}
+
+			if(andOrNode == -1) {
+				andOrNode = commandNode;
+			}
+
+			else {
+				int joinNode = addNode(tree, joinKind);
+				tree->nodes[joinNode].child[0] = andOrNode;
+				tree->nodes[joinNode].child[1] = commandNode;
+				andOrNode = joinNode;
+			}
+
+			if(parser->backgrounded || (!isOperatorToken(tree, parser->position, "&&\0") && !isOperatorToken(tree, parser->position, "||\0"))) {
+				break;
+			}
+
+			joinKind = isOperatorToken(tree, parser->position, "&&\0") ? NODE_AND : NODE_OR;
+			parser->position++;
+
+			while(isOperatorToken(tree, parser->position, "\n\0")) {
+				parser->position++;
+			}
+		}
+
+
+		if(lastNode == -1) {
+			firstNode = andOrNode;
+		}
+
+		else {
+			tree->nodes[lastNode].next = andOrNode;
+		}
+
+		lastNode = andOrNode;
+
+		if(parser->backgrounded) {		// The & already separated it
+			continue;
+		}
+
+		if(isOperatorToken(tree, parser->position, ";\0") || isOperatorToken(tree, parser->position, "\n\0")) {
+			parser->position++;
+			continue;
+		}
+
+		if(parser->position < tree->tokenCount && !atTerminator(parser, terminators)) {		// Like "fi echo"
+			syntaxError(parser);
+			return -1;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   parseTree - parse every token of a tree
+ * SYNOPSIS
+ *   parseTree(struct syntaxTree* tree, int* rootNode)
+ * DESCRIPTION
+ *   Throws away any nodes from an earlier try, so a command that needed another line is parsed again from the start once the
+ *   line is added. Sets rootNode to the first command, -1 if there's nothing to run, and returns PARSE_DONE, PARSE_INCOMPLETE or
+ *   PARSE_ERROR.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int parseTree(struct syntaxTree* tree, int* rootNode) {
+
+	struct treeParser parser;
+
+	parser.tree = tree;
+	parser.position = 0;
+	parser.status = PARSE_DONE;
+	parser.backgrounded = false;
+
+	tree->nodeCount = 0;
+	*rootNode = parseCommandList(&parser, NULL);
+
+	return parser.status;
+}
+
+
+
+/*
+ * NAME
+ *   copyTree - copy a tree out of the lexer arena so it outlives the line
+ * SYNOPSIS
+ *   copyTree(struct syntaxTree* tree)
+ * DESCRIPTION
+ *   The copy has the same tokens, nodes and heredoc bodies at the same indexes, so node numbers carry over. Its useCount starts
+ *   at 0 for the caller to raise.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct syntaxTree* copyTree(struct syntaxTree* tree) {
+
+	struct syntaxTree* copy = calloc(1, sizeof(struct syntaxTree));
+
+	if(copy == NULL) {
+		perror("Major problem copying a syntax tree!\n");
+		exit(1);
+	}
+
+	copy->tokenCount = tree->tokenCount;
+	copy->textLength = tree->textLength;
+	copy->nodeCount = tree->nodeCount;
+	copy->nodeCapacity = tree->nodeCount;
+	copy->bodyCount = tree->bodyCount;
+	copy->bodyCapacity = tree->bodyCount;
+
+	copy->text = malloc(tree->textLength + 1);
+	copy->words = malloc((tree->tokenCount + 1) * sizeof(char*));
+	copy->isOperator = malloc(tree->tokenCount + 1);
+	copy->wordFlags = malloc(tree->tokenCount + 1);
+	copy->nodes = malloc(tree->nodeCount * sizeof(struct syntaxNode) + 1);
+	copy->bodies = malloc(tree->bodyCount * sizeof(struct heredocBody) + 1);
+	copy->bodyText.text = malloc(tree->bodyText.used + 1);
+	copy->bodyText.used = tree->bodyText.used;
+	copy->bodyText.capacity = tree->bodyText.used + 1;
+
+	if(copy->text == NULL || copy->words == NULL || copy->isOperator == NULL || copy->wordFlags == NULL || copy->nodes == NULL ||
+			copy->bodies == NULL || copy->bodyText.text == NULL) {
+		perror("Major problem copying a syntax tree!\n");
+		exit(1);
+	}
+
+	memcpy(copy->text, tree->text, tree->textLength);
+	memcpy(copy->isOperator, tree->isOperator, tree->tokenCount);
+	memcpy(copy->wordFlags, tree->wordFlags, tree->tokenCount);
+	memcpy(copy->nodes, tree->nodes, tree->nodeCount * sizeof(struct syntaxNode));
+	if(tree->bodyCount > 0) {		// Without a heredoc bodies and bodyText may never have been allocated
+		memcpy(copy->bodies, tree->bodies, tree->bodyCount * sizeof(struct heredocBody));
+	}
+
+	if(tree->bodyText.used > 0) {
+		memcpy(copy->bodyText.text, tree->bodyText.text, tree->bodyText.used);
+	}
+
+	for(int index = 0; index < copy->bodyCount; index++) {
+		copy->bodies[index].memfd = -1;		// The copy stages its own
+	}
+
+	for(int index = 0; index < tree->tokenCount; index++) {
+		copy->words[index] = copy->text + (tree->words[index] - tree->text);
+	}
+
+	copy->words[tree->tokenCount] = NULL;
+
+	return copy;
+}
+
+
+
+/*
+ * NAME
+ *   releaseTree - drop one use of a copied tree
+ * SYNOPSIS
+ *   releaseTree(struct syntaxTree* tree)
+ * DESCRIPTION
+ *   Frees it once no function or running call needs it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void releaseTree(struct syntaxTree* tree) {
+
+	tree->useCount--;
+
+	if(tree->useCount > 0) {
+		return;
+	}
+
+	closeHeredocBodies(tree);
+	free(tree->text);
+	free(tree->words);
+	free(tree->isOperator);
+	free(tree->wordFlags);
+	free(tree->nodes);
+	free(tree->bodies);
+	free(tree->bodyText.text);
+	free(tree);
+}
+
+
+
+/*
+ * NAME
+ *   findFunction - look up a defined function by name
+ * SYNOPSIS
+ *   findFunction(char* name)
+ * DESCRIPTION
+ *   Returns NULL if there's no such function, straight away when none are defined.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct shellFunction* findFunction(char* name) {
+
+	if(functionCount == 0) {
+		return NULL;
+	}
+
+	struct shellFunction* function = functionBuckets[hashCommandName(name) & (FUNCTION_BUCKETS - 1)];
+
+	while(function != NULL && strcmp(function->name, name) != 0) {
+		function = function->next;
+	}
+
+	return function;
+}
+
+
+
+/*
+ * NAME
+ *   defineFunction - define or replace a function
+ * SYNOPSIS
+ *   defineFunction(char* name, struct syntaxTree* tree, int body)
+ * DESCRIPTION
+ *   A body in the line's tree is moved to the line's copy, made the first time the line defines a function. A body that's
+ *   already in a copied tree, from a function defining another one, shares it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void defineFunction(char* name, struct syntaxTree* tree, int body) {
+
+	if(tree == &lineTree) {
+
+		if(lineTree.retainedCopy == NULL) {
+			lineTree.retainedCopy = copyTree(&lineTree);
+		}
+
+		tree = lineTree.retainedCopy;
+	}
+
+	tree->useCount++;
+
+	struct shellFunction* function = findFunction(name);
+
+	if(function != NULL) {
+		releaseTree(function->tree);
+	}
+
+	else {
+
+		function = malloc(sizeof(struct shellFunction));
+
+		if(function == NULL) {
+			perror("Major problem defining a function!\n");
+			exit(1);
+		}
+
+		int bucket = hashCommandName(name) & (FUNCTION_BUCKETS - 1);
+
+		function->name = strdup(name);
+		function->next = functionBuckets[bucket];
+		functionBuckets[bucket] = function;
+		functionCount++;
+	}
+
+	function->tree = tree;
+	function->body = body;
+}
+
+
+
+/*
+ * NAME
+ *   removeFunction - forget a function
+ * SYNOPSIS
+ *   removeFunction(char* name)
+ * DESCRIPTION
+ *   Used by unset -f. A call that's running keeps its own hold on the tree. Returns false if there was no such function.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool removeFunction(char* name) {
+
+	struct shellFunction** link = &functionBuckets[hashCommandName(name) & (FUNCTION_BUCKETS - 1)];
+
+	while(*link != NULL && strcmp((*link)->name, name) != 0) {
+		link = &(*link)->next;
+	}
+
+	if(*link == NULL) {
+		return false;
+	}
+
+	struct shellFunction* function = *link;
+	*link = function->next;
+
+	releaseTree(function->tree);
+	free(function->name);
+	free(function);
+	functionCount--;
+
+	return true;
+}
+
+
+
+// Globbing
+//
+// An unquoted * ? or [ is kept in its word behind an EXPANSION_MARK, so a quoted or escaped one, or one that came out of a $
+// expansion, stays literal. When the command runs the word is matched one path component at a time against listings of the
+// directories it walks through, and the sorted matches replace it in commandWords. A word that matches nothing is kept as it was
+// written. Listings are read with getdents64() straight into a big buffer, skipping the stat() per entry and the small reads of
+// readdir(), and are cached until the line is done: a loop or a pipeline that globs the same directory over and over reads it
+// once, and a stat() of the directory before each use notices when its mtime has moved on. Cached names stay put until the end of
+// the line, even after a directory is reread, so a pattern being matched never sees them move. A pattern component made only of
+// literal pieces and *s, like *.log or core.*, is matched with memcmp() and memmem() on the pieces, which glibc does with vector
+// instructions, instead of walking it one character at a time, so a directory of 100000 files takes one pass of those per name.
+
+#define GLOB_READ_SIZE (256 * 1024)		// Bytes of entries asked for in each getdents64()
+#define GLOB_CACHE_LIMIT (64 << 20)		// Past this many bytes of cached names the cache is emptied before the next pattern
+#define GLOB_PATH_LIMIT 4096			// Longest path a match can have, PATH_MAX
+#define GLOB_NAME_LIMIT 255			// Longest name in a directory, NAME_MAX
+
+struct globEntry {
+	size_t offset;			// Name in globNames
+	size_t length;
+	unsigned char type;		// DT_ value from the directory, DT_UNKNOWN if the file system doesn't say
+};
+
+struct globPieces {			// A component like *.log or a*b*c, as the literal pieces between its *s
+	char text[GLOB_NAME_LIMIT];	// The pieces unescaped and run together
+	size_t starts[GLOB_NAME_LIMIT];
+	size_t lengths[GLOB_NAME_LIMIT];
+	int count;
+	bool anchoredStart;		// Doesn't start with a *, so the first piece has to start the name
+	bool anchoredEnd;		// Doesn't end with a *, so the last piece has to end it
+};
+
+struct directoryListing {
+	size_t pathOffset;		// Directory in globNames, "." for the current one
+	bool stale;			// Reread since, and the newer listing is the one to use
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	size_t firstEntry;		// Its names are globEntries[firstEntry] on
+	size_t entryCount;
+};
+
+struct tokenArena globNames = {NULL, 0, 0};		// Every cached name and directory path, each with its '\0'
+struct globEntry* globEntries = NULL;
+size_t globEntryCount = 0;
+size_t globEntryCapacity = 0;
+struct directoryListing* directoryListings = NULL;
+size_t directoryListingCount = 0;
+size_t directoryListingCapacity = 0;
+char* directoryBuffer = NULL;				// getdents64() reads into this, allocated the first time
+
+struct tokenArena globPatternText = {NULL, 0, 0};	// The word being globbed, as expandGlob() takes it
+struct tokenArena globValue = {NULL, 0, 0};		// One $ expansion in it, before it's escaped
+size_t* globMatches = NULL;		// Where each match for the current word starts in expansionArena
+size_t globMatchCount = 0;
+size_t globMatchCapacity = 0;
+
+
+
+/*
+ * NAME
+ *   forgetDirectoryListings - empty the directory listing cache
+ * SYNOPSIS
+ *   forgetDirectoryListings()
+ * DESCRIPTION
+ *   Called once a line has run. The memory is kept for the next line.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void forgetDirectoryListings() {
+
+	globNames.used = 0;
+	globEntryCount = 0;
+	directoryListingCount = 0;
+}
+
+
+
+/*
+ * NAME
+ *   readDirectoryListing - read a directory into the listing cache
+ * SYNOPSIS
+ *   readDirectoryListing(char* path, struct stat* identity)
+ * DESCRIPTION
+ *   Adds a listing of every name in the directory except . and .., in the order the directory hands them out. identity is what
+ *   stat() said about the directory just before. Returns the listing's index, or -1 if the directory can't be read.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+long readDirectoryListing(char* path, struct stat* identity) {
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if(fd == -1) {
+		return -1;
+	}
+
+	if(directoryBuffer == NULL && (directoryBuffer = malloc(GLOB_READ_SIZE)) == NULL) {
+		perror("Major problem allocating the directory buffer!\n");
+		exit(1);
+	}
+
+	if(directoryListingCount == directoryListingCapacity) {
+
+		directoryListingCapacity = (directoryListingCapacity == 0) ? 16 : directoryListingCapacity * 2;
+		directoryListings = realloc(directoryListings, directoryListingCapacity * sizeof(struct directoryListing));
+
+		if(directoryListings == NULL) {
+			perror("Major problem growing the directory listing cache!\n");
+			exit(1);
+		}
+	}
+
+	struct directoryListing* listing = &directoryListings[directoryListingCount];
+
+	listing->pathOffset = globNames.used;
+	arenaPutString(&globNames, path, strlen(path) + 1);
+	listing->stale = false;
+	listing->device = identity->st_dev;
+	listing->inode = identity->st_ino;
+	listing->modified = identity->st_mtim;
+	listing->firstEntry = globEntryCount;
+	listing->entryCount = 0;
+
+	ssize_t bytes;
+
+	while((bytes = getdents64(fd, directoryBuffer, GLOB_READ_SIZE)) > 0) {
+
+		for(ssize_t position = 0; position < bytes; ) {
+
+			struct dirent64* record = (struct dirent64*)(directoryBuffer + position);
+			position += record->d_reclen;
+
+			char* name = record->d_name;
+
+			if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+				continue;
+			}
+
+			if(globEntryCount == globEntryCapacity) {
+
+				globEntryCapacity = (globEntryCapacity == 0) ? 1024 : globEntryCapacity * 2;
+				globEntries = realloc(globEntries, globEntryCapacity * sizeof(struct globEntry));
+
+				if(globEntries == NULL) {
+					perror("Major problem growing the directory listing cache!\n");
+					exit(1);
+				}
+			}
+
+			size_t length = strlen(name);
+
+			globEntries[globEntryCount].offset = globNames.used;
+			globEntries[globEntryCount].length = length;
+			globEntries[globEntryCount].type = record->d_type;
+			globEntryCount++;
+			arenaPutString(&globNames, name, length + 1);
+			listing->entryCount++;
+		}
+	}
+
+	close(fd);
+
+	return (long)directoryListingCount++;
+}
+
+
+
+/*
+ * NAME
+ *   listDirectory - the cached listing of a directory, read if it isn't cached or has changed
+ * SYNOPSIS
+ *   listDirectory(char* path)
+ * DESCRIPTION
+ *   Returns an index into directoryListings rather than a pointer, since reading another directory can move the cache. -1 if the
+ *   directory can't be read.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+long listDirectory(char* path) {
+
+	struct stat identity;
+
+	if(stat(path, &identity) == -1 || !S_ISDIR(identity.st_mode)) {
+		return -1;
+	}
+
+	for(size_t index = 0; index < directoryListingCount; index++) {
+
+		struct directoryListing* listing = &directoryListings[index];
+
+		if(listing->stale || strcmp(globNames.text + listing->pathOffset, path) != 0) {
+			continue;
+		}
+
+		if(listing->device == identity.st_dev && listing->inode == identity.st_ino &&
+				listing->modified.tv_sec == identity.st_mtim.tv_sec && listing->modified.tv_nsec == identity.st_mtim.tv_nsec) {
+			return (long)index;
+		}
+
+		listing->stale = true;		// Its names stay where they are until the line is done
+		break;
+	}
+
+	return readDirectoryListing(path, &identity);
+}
+
+
+
+/*
+ * NAME
+ *   bracketEnd - the ] that closes a [ in a pattern
+ * SYNOPSIS
+ *   bracketEnd(char* bracket)
+ * DESCRIPTION
+ *   A ] straight after the [ or after its ! or ^ is one of the characters, not the end. Returns NULL if nothing closes it before
+ *   the end of the path component, in which case the [ is just a character.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* bracketEnd(char* bracket) {
+
+	char* position = bracket + 1;
+
+	if(*position == '!' || *position == '^') {
+		position++;
+	}
+
+	if(*position == ']') {
+		position++;
+	}
+
+	while(*position != ']') {
+
+		if(*position == '\0' || *position == '/') {
+			return NULL;
+		}
+
+		if(*position == '\\' && position[1] != '\0') {
+			position++;
+		}
+
+		position++;
+	}
+
+	return position;
+}
+
+
+
+/*
+ * NAME
+ *   hasWildcard - whether a pattern has a * ? or [ ] that isn't escaped
+ * SYNOPSIS
+ *   hasWildcard(char* pattern)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool hasWildcard(char* pattern) {
+
+	for(char* position = pattern; *position != '\0'; position++) {
+
+		if(*position == '\\' && position[1] != '\0') {
+			position++;
+		}
+
+		else if(*position == '*' || *position == '?' || (*position == '[' && bracketEnd(position) != NULL)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+/*
+ * NAME
+ *   matchBracket - whether a character is one of the ones a [ ] allows
+ * SYNOPSIS
+ *   matchBracket(char* bracket, char character)
+ * DESCRIPTION
+ *   bracket is a [ that bracketEnd() has found the end of. Handles a leading ! or ^, ranges like a-z and escaped characters.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool matchBracket(char* bracket, char character) {
+
+	char* end = bracketEnd(bracket);
+	char* position = bracket + 1;
+	bool negated = false;
+	bool matched = false;
+
+	if(*position == '!' || *position == '^') {
+		negated = true;
+		position++;
+	}
+
+	while(position < end) {
+
+		if(*position == '\\') {
+			position++;
+		}
+
+		unsigned char low = *position++;
+		unsigned char high = low;
+
+		if(*position == '-' && position + 1 < end) {
+
+			position++;
+
+			if(*position == '\\') {
+				position++;
+			}
+
+			high = *position++;
+		}
+
+		if((unsigned char)character >= low && (unsigned char)character <= high) {
+			matched = true;
+		}
+	}
+
+	return matched != negated;
+}
+
+
+
+/*
+ * NAME
+ *   matchGlob - match a name against one path component of a pattern
+ * SYNOPSIS
+ *   matchGlob(char* pattern, char* name)
+ * DESCRIPTION
+ *   The general matcher, for components with ? or [ ]. Goes back to the last * and lets it take one more character whenever the
+ *   rest fails to match, which is enough for any number of *s and never takes more than length of pattern times length of name.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool matchGlob(char* pattern, char* name) {
+
+	char* starPattern = NULL;		// Just past the last * seen, and where in the name it started taking characters
+	char* starName = NULL;
+
+	while(*name != '\0') {
+
+		char* next = NULL;
+
+		if(*pattern == '*') {
+			starPattern = ++pattern;
+			starName = name;
+			continue;
+		}
+
+		if(*pattern == '?') {
+			next = pattern + 1;
+		}
+
+		else if(*pattern == '[' && bracketEnd(pattern) != NULL) {
+
+			if(matchBracket(pattern, *name)) {
+				next = bracketEnd(pattern) + 1;
+			}
+		}
+
+		else {
+
+			char* literal = (*pattern == '\\' && pattern[1] != '\0') ? pattern + 1 : pattern;
+
+			if(*literal != '\0' && *literal == *name) {
+				next = literal + 1;
+			}
+		}
+
+		if(next != NULL) {
+			pattern = next;
+			name++;
+		}
+
+		else if(starPattern != NULL) {
+			pattern = starPattern;
+			name = ++starName;
+		}
+
+		else {
+			return false;
+		}
+	}
+
+	while(*pattern == '*') {
+		pattern++;
+	}
+
+	return *pattern == '\0';
+}
+
+
+
+/*
+ * NAME
+ *   addGlobMatch - add a path to the matches for the current word
+ * SYNOPSIS
+ *   addGlobMatch(char* path, size_t length)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void addGlobMatch(char* path, size_t length) {
+
+	if(globMatchCount == globMatchCapacity) {
+
+		globMatchCapacity = (globMatchCapacity == 0) ? 256 : globMatchCapacity * 2;
+		globMatches = realloc(globMatches, globMatchCapacity * sizeof(size_t));
+
+		if(globMatches == NULL) {
+			perror("Major problem growing the glob matches!\n");
+			exit(1);
+		}
+	}
+
+	globMatches[globMatchCount++] = expansionArena.used;
+	arenaPutString(&expansionArena, path, length);
+	arenaPut(&expansionArena, '\0');
+}
+
+
+
+/*
+ * NAME
+ *   isDirectoryEntry - whether a matched name is a directory a pattern can go on into
+ * SYNOPSIS
+ *   isDirectoryEntry(unsigned char type, char* path)
+ * DESCRIPTION
+ *   Takes the directory's word for it when it gives one, and only stat()s path for symlinks and file systems that don't say.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool isDirectoryEntry(unsigned char type, char* path) {
+
+	if(type != DT_LNK && type != DT_UNKNOWN) {
+		return type == DT_DIR;
+	}
+
+	struct stat status;
+
+	return stat(path, &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+
+
+/*
+ * NAME
+ *   splitPieces - split a component made of literal pieces and *s
+ * SYNOPSIS
+ *   splitPieces(char* segment, struct globPieces* pieces)
+ * DESCRIPTION
+ *   Returns false if the component has a ? or [ ], or more literal text than a name can hold, and needs matchGlob() instead.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool splitPieces(char* segment, struct globPieces* pieces) {
+
+	size_t textUsed = 0;
+	bool inPiece = false;
+
+	pieces->count = 0;
+	pieces->anchoredStart = (segment[0] != '*');
+	pieces->anchoredEnd = false;
+
+	for(char* position = segment; *position != '\0'; position++) {
+
+		if(*position == '*') {
+			inPiece = false;
+			pieces->anchoredEnd = false;
+			continue;
+		}
+
+		if(*position == '?' || (*position == '[' && bracketEnd(position) != NULL) || textUsed == GLOB_NAME_LIMIT) {
+			return false;
+		}
+
+		if(*position == '\\' && position[1] != '\0') {
+			position++;
+		}
+
+		if(!inPiece) {
+			pieces->starts[pieces->count] = textUsed;
+			pieces->lengths[pieces->count] = 0;
+			pieces->count++;
+			inPiece = true;
+		}
+
+		pieces->text[textUsed++] = *position;
+		pieces->lengths[pieces->count - 1]++;
+		pieces->anchoredEnd = true;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   matchPieces - match a name against a component split by splitPieces()
+ * SYNOPSIS
+ *   matchPieces(struct globPieces* pieces, char* name, size_t length)
+ * DESCRIPTION
+ *   The first piece is compared with the start of the name and the last with its end, and the ones between are found in order
+ *   with memmem(). Taking the first place each piece fits leaves the most room for the ones after it, so there's nothing to
+ *   backtrack.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline bool matchPieces(struct globPieces* pieces, char* name, size_t length) {
+
+	size_t used = 0;		// Bytes of the name the pieces so far have taken
+
+	for(int piece = 0; piece < pieces->count; piece++) {
+
+		char* text = pieces->text + pieces->starts[piece];
+		size_t pieceLength = pieces->lengths[piece];
+
+		if(piece == 0 && pieces->anchoredStart) {
+
+			if(length < pieceLength || memcmp(name, text, pieceLength) != 0) {
+				return false;
+			}
+		}
+
+		else if(piece == pieces->count - 1 && pieces->anchoredEnd) {
+
+			if(length - used < pieceLength || memcmp(name + length - pieceLength, text, pieceLength) != 0) {
+				return false;
+			}
+		}
+
+		else {
+
+			char* found = memmem(name + used, length - used, text, pieceLength);
+
+			if(found == NULL) {
+				return false;
+			}
+
+			used = found - name;
+		}
+
+		used += pieceLength;
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   globDirectory - add every path under a directory that matches the rest of a pattern
+ * SYNOPSIS
+ *   globDirectory(char* path, size_t pathLength, char* pattern)
+ * DESCRIPTION
+ *   path holds pathLength bytes of directory matched so far, ending in / unless it's empty for the current directory, and has
+ *   room for GLOB_PATH_LIMIT bytes. pattern is what's left to match, starting at a component. A component with no wildcards is
+ *   just added to the path, so a/b/x*.c only lists a/b. Otherwise the directory's listing is matched against it: a name starting
+ *   with . only matches a component that starts with a literal ., and a component followed by / only matches directories.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void globDirectory(char* path, size_t pathLength, char* pattern) {
+
+	char* slash = strchr(pattern, '/');
+	size_t segmentLength = (slash == NULL) ? strlen(pattern) : (size_t)(slash - pattern);
+	char* rest = slash;
+	bool directoryOnly = false;		// The component was followed by a /
+
+	while(rest != NULL && *rest == '/') {
+		rest++;
+		directoryOnly = true;
+	}
+
+	if(rest != NULL && *rest == '\0') {
+		rest = NULL;
+	}
+
+	if(pathLength + segmentLength + 2 > GLOB_PATH_LIMIT) {
+		return;
+	}
+
+	char segment[segmentLength + 1];
+
+	memcpy(segment, pattern, segmentLength);
+	segment[segmentLength] = '\0';
+
+	if(!hasWildcard(segment)) {
+
+		size_t length = pathLength;
+
+		for(char* position = segment; *position != '\0'; position++) {
+
+			if(*position == '\\' && position[1] != '\0') {
+				position++;
+			}
+
+			path[length++] = *position;
+		}
+
+		path[length] = '\0';
+
+		struct stat status;
+
+		if(rest != NULL) {
+			path[length] = '/';
+			globDirectory(path, length + 1, rest);
+		}
+
+		else if(directoryOnly && stat(path, &status) == 0 && S_ISDIR(status.st_mode)) {
+			path[length] = '/';
+			addGlobMatch(path, length + 1);
+		}
+
+		else if(!directoryOnly && lstat(path, &status) == 0) {
+			addGlobMatch(path, length);
+		}
+
+		return;
+	}
+
+	path[pathLength] = '\0';
+
+	long listingIndex = listDirectory((pathLength == 0) ? "." : path);
+
+	if(listingIndex == -1) {
+		return;
+	}
+
+	size_t firstEntry = directoryListings[listingIndex].firstEntry;		// Still valid once the cache has moved
+	size_t entryCount = directoryListings[listingIndex].entryCount;
+	bool dotAllowed = (segment[0] == '.' || (segment[0] == '\\' && segment[1] == '.'));
+	struct globPieces pieces;
+	bool simple = splitPieces(segment, &pieces);
+
+	for(size_t index = firstEntry; index < firstEntry + entryCount; index++) {
+
+		struct globEntry entry = globEntries[index];		// Copied, reading a directory further down can move the array
+		char* name = globNames.text + entry.offset;
+
+		if((name[0] == '.' && !dotAllowed) || !(simple ? matchPieces(&pieces, name, entry.length) : matchGlob(segment, name))) {
+			continue;
+		}
+
+		if(pathLength + entry.length + 2 > GLOB_PATH_LIMIT) {
+			continue;
+		}
+
+		memcpy(path + pathLength, name, entry.length);
+		path[pathLength + entry.length] = '\0';
+
+		if(directoryOnly && !isDirectoryEntry(entry.type, path)) {
+			continue;
+		}
+
+		if(rest != NULL) {
+			path[pathLength + entry.length] = '/';
+			globDirectory(path, pathLength + entry.length + 1, rest);
+		}
+
+		else if(directoryOnly) {
+			path[pathLength + entry.length] = '/';
+			addGlobMatch(path, pathLength + entry.length + 1);
+		}
+
+		else {
+			addGlobMatch(path, pathLength + entry.length);
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   compareGlobMatches - qsort() comparison for offsets of matches in expansionArena
+ * SYNOPSIS
+ *   compareGlobMatches(const void* first, const void* second)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int compareGlobMatches(const void* first, const void* second) {
+
+	return strcmp(expansionArena.text + *(size_t*)first, expansionArena.text + *(size_t*)second);
+}
+
+
+
+/*
+ * NAME
+ *   expandGlob - find the paths a pattern matches
+ * SYNOPSIS
+ *   expandGlob(char* pattern)
+ * DESCRIPTION
+ *   pattern has the wildcards that should match bare and every other * ? [ and \ escaped with a \. The matches are added to the
+ *   end of expansionArena, each with its '\0', and their offsets are left in globMatches sorted with strcmp(). Returns how many
+ *   there are.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t expandGlob(char* pattern) {
+
+	unsigned long long globStart = traceClock();
+	char path[GLOB_PATH_LIMIT];
+	size_t pathLength = 0;
+
+	if(globNames.used > GLOB_CACHE_LIMIT) {		// Nothing is pointing into it between patterns
+		forgetDirectoryListings();
+	}
+
+	globMatchCount = 0;
+
+	if(*pattern == '/') {
+		path[pathLength++] = '/';
+	}
+
+	while(*pattern == '/') {
+		pattern++;
+	}
+
+	if(*pattern != '\0') {
+		globDirectory(path, pathLength, pattern);
+	}
+
+	qsort(globMatches, globMatchCount, sizeof(size_t), compareGlobMatches);
+	traceEvent("glob", globStart);
+
+	return globMatchCount;
+}
+
+
+
+/*
+ * NAME
+ *   putEscaped - add text to a pattern so all of it matches literally
+ * SYNOPSIS
+ *   putEscaped(struct tokenArena* arena, char* text, size_t length)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void putEscaped(struct tokenArena* arena, char* text, size_t length) {
+
+	for(size_t index = 0; index < length; index++) {
+
+		if(text[index] == '*' || text[index] == '?' || text[index] == '[' || text[index] == '\\') {
+			arenaPut(arena, '\\');
+		}
+
+		arenaPut(arena, text[index]);
+	}
+}
+
+
+
+/*
+ * NAME
+ *   globPattern - turn a word into the pattern expandGlob() takes
+ * SYNOPSIS
+ *   globPattern(char* text, struct tokenArena* arena)
+ * DESCRIPTION
+ *   Like expandText(), but only the * ? and [ the lexer marked stay bare. Everything else, including whatever the $ expansions
+ *   fill in, is escaped so it only matches itself. The pattern gets its '\0'.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void globPattern(char* text, struct tokenArena* arena) {
+
+	char* mark;
+
+	while((mark = strchr(text, EXPANSION_MARK)) != NULL) {
+
+		putEscaped(arena, text, mark - text);
+
+		if(mark[1] == '$') {
+			globValue.used = 0;
+			text = mark + 1 + expandVariable(mark + 1, &globValue);
+			putEscaped(arena, globValue.text, globValue.used);
+		}
+
+		else if(mark[1] == '*' || mark[1] == '?' || mark[1] == '[') {
+			arenaPut(arena, mark[1]);
+			text = mark + 2;
+		}
+
+		else {		// A \x01 that was in the input
+			putEscaped(arena, mark + 1, 1);
+			text = mark + 2;
+		}
+	}
+
+	putEscaped(arena, text, strlen(text));
+	arenaPut(arena, '\0');
+}
+
+
+
+bool substitutionFields = false;	// Set by expandText() when an unquoted command's output put '\0's between words
+
+
+
+/*
+ * NAME
+ *   expandSubstitution - run the command marked at mark and put its output in an arena
+ * SYNOPSIS
+ *   expandSubstitution(char* mark, struct tokenArena* arena)
+ * DESCRIPTION
+ *   The command is copied out of the word into the line arena, without the doubled marks, and handed to commandSubstituter,
+ *   which reads the output straight into arena. For an unquoted command the output is then split where it is: every run of
+ *   spaces, tabs and newlines becomes one '\0' and substitutionFields is set, so expandWords() can make each piece a word of
+ *   its own without copying any of it. Returns where the word goes on after the command.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* expandSubstitution(char* mark, struct tokenArena* arena) {
+
+	char* end = mark + 2;
+
+	while(end[0] != EXPANSION_MARK || end[1] != ')') {
+		end = end + ((end[0] == EXPANSION_MARK) ? 2 : 1);		// A doubled mark is a \x01 from the command
+	}
+
+	struct lineMark commandStart = lineArenaMark();
+	char* command = lineAllocate(end - mark - 1);
+	size_t length = 0;
+
+	for(char* position = mark + 2; position < end; position++) {
+
+		if(position[0] == EXPANSION_MARK) {
+			position++;
+		}
+
+		command[length++] = *position;
+	}
+
+	command[length] = '\0';
+
+	size_t start = arena->used;
+
+	commandSubstituter(command, arena);
+	lineArenaRelease(commandStart);
+
+	if(mark[1] == '(') {
+
+		size_t used = start;
+		bool separated = false;
+
+		for(size_t offset = start; offset < arena->used; offset++) {
+
+			char character = arena->text[offset];
+
+			if(character != ' ' && character != '\t' && character != '\n') {
+				arena->text[used++] = character;
+				separated = false;
+			}
+
+			else if(!separated) {
+				arena->text[used++] = '\0';
+				separated = true;
+				substitutionFields = true;
+			}
+		}
+
+		arena->used = used;
+	}
+
+	return end + 2;
+}
+
+
+
+/*
+ * NAME
+ *   expandText - copy a word into an arena with its marked expansions filled in
+ * SYNOPSIS
+ *   expandText(char* text, struct tokenArena* arena)
+ * DESCRIPTION
+ *   A marked * ? or [ is copied as it is, for a word that isn't globbed or didn't match anything. A $(command) or `command` is
+ *   replaced by what it printed, through expandSubstitution().
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void expandText(char* text, struct tokenArena* arena) {
+
+	char* mark;
+
+	while((mark = strchr(text, EXPANSION_MARK)) != NULL) {
+
+		arenaPutString(arena, text, mark - text);
+
+		if(mark[1] == '$') {
+			text = mark + 1 + expandVariable(mark + 1, arena);
+		}
+
+		else if(mark[1] == '(' || mark[1] == '"') {
+			text = expandSubstitution(mark, arena);
+		}
+
+		else {		// A \x01 that was in the input
+			arenaPut(arena, mark[1]);
+			text = mark + 2;
+		}
+	}
+
+	arenaPutString(arena, text, strlen(text));
+}
+
+
+
+/*
+ * NAME
+ *   expandWords - the words of a simple command, ready to run
+ * SYNOPSIS
+ *   expandWords(struct syntaxTree* tree, int firstToken, int tokenCount)
+ * DESCRIPTION
+ *   Fills commandWords with the tree's tokens from firstToken on. Words without WORD_EXPANDS are used where they are, so a
+ *   command with no $ in it costs one pointer copy per word. The others are expanded into expansionArena, and an unquoted one
+ *   that comes out empty is dropped. A word with wildcards is replaced by the sorted paths it matches, or kept as written if
+ *   there aren't any. The output of an unquoted $(command) is split into a word for every piece expandText() left between
+ *   '\0's, and a word with a command in it is never globbed. The body of each << is staged by stageHeredocBody(),
+ *   and the word after each <<< once it has been expanded. commandWords can be changed freely by whatever runs the command,
+ *   the tree stays as it is. Returns the number of words, or -1 after reporting a <<< with no word after it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int expandWords(struct syntaxTree* tree, int firstToken, int tokenCount) {
+
+	reserveArguments(&commandWords, tokenCount + 1);
+	expansionArena.used = 0;
+
+	int wordCount = 0;
+	bool hereStrings = false;
+
+	for(int index = firstToken; index < firstToken + tokenCount; index++) {
+
+		char* word = tree->words[index];
+
+		commandWords.isOperator[wordCount] = tree->isOperator[index];
+		commandWords.wordFlags[wordCount] = tree->wordFlags[index];
+
+		if(!(tree->wordFlags[index] & WORD_EXPANDS)) {
+
+			commandWords.items[wordCount] = word;
+			wordCount++;
+
+			if(tree->isOperator[index] && strcmp(skipDescriptor(word), "<<<\0") == 0) {
+				hereStrings = true;
+			}
+
+			else if(tree->isOperator[index] && strcmp(skipDescriptor(word), "<<\0") == 0) {
+				stageHeredocBody(tree, index, word);
+			}
+
+			continue;
+		}
+
+		size_t start = expansionArena.used;
+
+		if((tree->wordFlags[index] & WORD_GLOB) && !(tree->wordFlags[index] & WORD_SUBSTITUTES) && !(index > firstToken && tree->isOperator[index - 1] &&
+				strpbrk(tree->words[index - 1], "<>") != NULL)) {	// A file to redirect to is never globbed
+
+			globPatternText.used = 0;
+			globPattern(word, &globPatternText);
+
+			if(hasWildcard(globPatternText.text) && expandGlob(globPatternText.text) > 0) {
+
+				reserveArguments(&commandWords, wordCount + globMatchCount + (firstToken + tokenCount - index) + 1);
+
+				for(size_t match = 0; match < globMatchCount; match++) {
+					commandWords.items[wordCount] = NULL;
+					commandWords.offsets[wordCount] = globMatches[match];
+					commandWords.isOperator[wordCount] = false;
+					commandWords.wordFlags[wordCount] = tree->wordFlags[index];
+					wordCount++;
+				}
+
+				continue;
+			}
+		}
+
+		substitutionFields = false;
+		expandText(word, &expansionArena);
+
+		if(substitutionFields) {		// Split by an unquoted command's output, each non-empty piece is a word
+
+			size_t end = expansionArena.used;
+			int fieldCount = 1;
+
+			arenaPut(&expansionArena, '\0');
+
+			for(size_t offset = start; offset < end; offset++) {
+				fieldCount += (expansionArena.text[offset] == '\0');
+			}
+
+			reserveArguments(&commandWords, wordCount + fieldCount + (firstToken + tokenCount - index) + 1);
+
+			for(size_t offset = start; offset < end; offset = offset + strlen(expansionArena.text + offset) + 1) {
+
+				if(expansionArena.text[offset] != '\0') {
+					commandWords.items[wordCount] = NULL;
+					commandWords.offsets[wordCount] = offset;
+					commandWords.isOperator[wordCount] = false;
+					commandWords.wordFlags[wordCount] = tree->wordFlags[index];
+					wordCount++;
+				}
+			}
+
+			continue;
+		}
+
+		if(expansionArena.used == start && !(tree->wordFlags[index] & WORD_QUOTED)) {	// Nothing but empty expansions
+			continue;
+		}
+
+		arenaPut(&expansionArena, '\0');
+		commandWords.items[wordCount] = NULL;		// Pointed into the arena below, once it has stopped moving
+		commandWords.offsets[wordCount] = start;
+		wordCount++;
+	}
+
+	for(int index = 0; index < wordCount; index++) {
+
+		if(commandWords.items[index] == NULL) {
+			commandWords.items[index] = expansionArena.text + commandWords.offsets[index];
+		}
+	}
+
+	commandWords.items[wordCount] = NULL;
+	commandWords.count = wordCount;
+
+	for(int index = 0; hereStrings && index < wordCount; index++) {
+
+		if(!commandWords.isOperator[index] || strcmp(skipDescriptor(commandWords.items[index]), "<<<\0") != 0) {
+			continue;
+		}
+
+		if(index + 1 == wordCount || commandWords.isOperator[index + 1]) {
+			printf("syntax error near %s\n", commandWords.items[index]);
+			fflush(stdout);
+			closeHeredocs();
+			return -1;
+		}
+
+		struct heredocWriter writer;
+		writer.used = 0;
+		writer.memfd = -1;
+
+		writeHeredoc(&writer, commandWords.items[index + 1], strlen(commandWords.items[index + 1]));
+		writeHeredoc(&writer, "\n", 1);
+		finishHeredoc(&writer, commandWords.items[index]);
+	}
+
+	return wordCount;
+}
+
+
+
+/*
+ * NAME
+ *   copyWords - copy words into one block that outlives commandWords
+ * SYNOPSIS
+ *   copyWords(char** words, int count, bool lineLifetime)
+ * DESCRIPTION
+ *   For the words of a for loop and the arguments of a function call, which have to stay put while the commands they run reuse
+ *   commandWords. The array is NULL terminated. With lineLifetime it comes from the line arena and goes when the caller's mark is
+ *   released, otherwise it's one malloc() block for the shell's own arguments.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char** copyWords(char** words, int count, bool lineLifetime) {
+
+	size_t bytes = (count + 1) * sizeof(char*);
+
+	for(int index = 0; index < count; index++) {
+		bytes = bytes + strlen(words[index]) + 1;
+	}
+
+	char** copy = lineLifetime ? lineAllocate(bytes) : malloc(bytes);
+
+	if(copy == NULL) {
+		perror("Major problem copying words!\n");
+		exit(1);
+	}
+
+	char* cursor = (char*)(copy + count + 1);
+
+	for(int index = 0; index < count; index++) {
+
+		size_t length = strlen(words[index]) + 1;
+
+		memcpy(cursor, words[index], length);
+		copy[index] = cursor;
+		cursor = cursor + length;
+	}
+
+	copy[count] = NULL;
+
+	return copy;
+}
+
+
+
+// Remote hosts
+//
+// "on HOST command" runs a command on another machine through ssh, and "parallel --hosts a,b,c" spreads a batch over several.
+// Every connection to a host goes through one ssh ControlMaster, started the first time this shell uses the host unless one is
+// already up and kept for REMOTE_PERSIST_SECONDS after its last command, so later jobs only cost a connect to the master's
+// local socket instead of a TCP and authentication handshake. The job in the table is the local ssh client: its exit status is
+// the remote command's and its output comes through it like any other job's, so jobs, wait, fg, kill and set -o collect work
+// unchanged. Only the command's words go to the other host, quoted so they arrive as they were typed, and its redirections and
+// any later pipeline stages stay here, the same as with ssh typed by hand. Given a comma separated list of hosts, the next job
+// goes to the one with the fewest jobs from this shell still running, ties going to the one that has been given fewer so far.
+// A host that can't be reached is passed over for REMOTE_RETRY_SECONDS and its job goes to the next one. SMALLSH_SSH names a
+// different ssh program.
+
+#define REMOTE_PERSIST_SECONDS "600"
+#define REMOTE_RETRY_SECONDS 30		// How long a host that couldn't be reached is left alone
+
+struct argumentVector remoteArguments = {NULL, NULL, NULL, NULL, 0, 0};		// The command as ssh will run it
+struct tokenArena remoteText = {NULL, 0, 0};		// The words that go to the other host, quoted and joined into one
+char* remoteControlPath = NULL;				// ControlPath= option naming where the masters' sockets go
+
+
+
+/*
+ * NAME
+ *   findRemoteHost - look a host up by name, adding it the first time
+ * SYNOPSIS
+ *   findRemoteHost(char* name, size_t length)
+ * DESCRIPTION
+ *   name doesn't have to end after length characters, so entries of a host list can be looked up where they are. Returns the
+ *   host's index in remoteHosts.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int findRemoteHost(char* name, size_t length) {
+
+	for(int host = 0; host < remoteHostCount; host++) {
+
+		if(strlen(remoteHosts[host].name) == length && strncmp(remoteHosts[host].name, name, length) == 0) {
+			return host;
+		}
+	}
+
+	remoteHosts = realloc(remoteHosts, (remoteHostCount + 1) * sizeof(struct remoteHost));
+
+	if(remoteHosts == NULL) {
+		perror("Major problem growing the host table!\n");
+		exit(1);
+	}
+
+	remoteHosts[remoteHostCount].name = strndup(name, length);
+	remoteHosts[remoteHostCount].runningJobs = 0;
+	remoteHosts[remoteHostCount].startedJobs = 0;
+	remoteHosts[remoteHostCount].connected = false;
+	remoteHosts[remoteHostCount].retryAfter = 0;
+	remoteHostCount++;
+
+	return remoteHostCount - 1;
+}
+
+
+
+/*
+ * NAME
+ *   pickRemoteHost - choose where the next job goes
+ * SYNOPSIS
+ *   pickRemoteHost(char* hostList)
+ * DESCRIPTION
+ *   hostList is one host or several separated by commas. Returns the index of the one with the fewest running jobs, then the
+ *   fewest started, then the first listed, or -1 if the list has an empty name in it. A host that couldn't be reached is only
+ *   picked when every host in the list is in the same state.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int pickRemoteHost(char* hostList) {
+
+	int bestHost = -1;
+	char* name = hostList;
+
+	while(1) {
+
+		char* separator = strchr(name, ',');
+		size_t length = (separator != NULL) ? (size_t)(separator - name) : strlen(name);
+
+		if(length == 0) {
+			return -1;
+		}
+
+		int host = findRemoteHost(name, length);
+		bool reachable = (remoteHosts[host].retryAfter <= time(NULL));
+		bool bestReachable = (bestHost != -1 && remoteHosts[bestHost].retryAfter <= time(NULL));
+
+		if(bestHost == -1 || (reachable && !bestReachable) || (reachable == bestReachable &&
+				(remoteHosts[host].runningJobs < remoteHosts[bestHost].runningJobs ||
+				(remoteHosts[host].runningJobs == remoteHosts[bestHost].runningJobs &&
+				remoteHosts[host].startedJobs < remoteHosts[bestHost].startedJobs)))) {
+			bestHost = host;
+		}
+
+		if(separator == NULL) {
+			return bestHost;
+		}
+
+		name = separator + 1;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   sshProgram - the ssh the remote commands go through
+ * SYNOPSIS
+ *   sshProgram()
+ * DESCRIPTION
+ *   SMALLSH_SSH if it's set and not empty, otherwise ssh from PATH.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* sshProgram() {
+
+	char* program = variableValue("SMALLSH_SSH");
+
+	return (program != NULL && program[0] != '\0') ? program : "ssh";
+}
+
+
+
+/*
+ * NAME
+ *   controlPathOption - the ControlPath= option every ssh the shell runs gets
+ * SYNOPSIS
+ *   controlPathOption()
+ * DESCRIPTION
+ *   The first time, makes the socket directory under XDG_RUNTIME_DIR or /tmp, only usable by this user. Sockets in it are
+ *   named by ssh's hash of the host, port and user, so they're shared with other shells of the same user.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* controlPathOption() {
+
+	if(remoteControlPath == NULL) {
+
+		char* runtimeDirectory = variableValue("XDG_RUNTIME_DIR");
+		char socketDirectory[4096];
+
+		snprintf(socketDirectory, sizeof(socketDirectory), "%s/smallsh-ssh-%d", (runtimeDirectory != NULL) ? runtimeDirectory : "/tmp",
+				(int)getuid());
+		mkdir(socketDirectory, 0700);		// Already there from an earlier shell is fine
+
+		size_t optionSize = strlen(socketDirectory) + 32;
+		remoteControlPath = malloc(optionSize);
+
+		if(remoteControlPath == NULL) {
+			perror("Major problem allocating the ssh control path!\n");
+			exit(1);
+		}
+
+		snprintf(remoteControlPath, optionSize, "ControlPath=%s/%%C", socketDirectory);
+	}
+
+	return remoteControlPath;
+}
+
+
+
+/*
+ * NAME
+ *   runSSHControl - run ssh to check on or start a host's master connection, and wait for it
+ * SYNOPSIS
+ *   runSSHControl(int host, bool startIt)
+ * DESCRIPTION
+ *   Without startIt, asks with ssh -O check whether a master for the host is already listening, quietly. With it, starts one
+ *   with ssh -M -N -f, which goes into the background by itself once it's connected and authenticated, so any password prompt or
+ *   connection error shows up right here. Returns true if ssh exited with 0.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool runSSHControl(int host, bool startIt) {
+
+	char* checkArguments[] = {sshProgram(), "-o", controlPathOption(), "-O", "check", "--", remoteHosts[host].name, NULL};
+	char* startArguments[] = {sshProgram(), "-o", controlPathOption(), "-o", "ControlPersist=" REMOTE_PERSIST_SECONDS, "-M", "-N", "-f",
+			"--", remoteHosts[host].name, NULL};
+
+	fflush(stdout);
+
+	pid_t helperPID = fork();
+
+	if(helperPID == -1) {
+		return false;
+	}
+
+	if(helperPID == 0) {
+
+		struct sigaction defaultAction = {0};		// ^C gets through to a hung connection attempt
+		defaultAction.sa_handler = SIG_DFL;
+		sigaction(SIGINT, &defaultAction, NULL);
+		sigprocmask(SIG_SETMASK, &startupSignalMask, NULL);
+
+		if(!startIt) {		// "No ControlPath specified" and the like aren't worth showing
+			int nullFD = open("/dev/null", O_WRONLY | O_CLOEXEC);		// Only the dup2() copy should survive exec
+			dup2(nullFD, STDERR_FILENO);
+		}
+
+		char** arguments = startIt ? startArguments : checkArguments;
+		execvp(arguments[0], arguments);
+		_exit(255);		// What ssh itself exits with when it can't connect
+	}
+
+	int helperExitMethod;
+
+	while(waitpid(helperPID, &helperExitMethod, 0) == -1) {
+
+		if(errno != EINTR) {
+			return false;
+		}
+	}
+
+	return WIFEXITED(helperExitMethod) && WEXITSTATUS(helperExitMethod) == 0;
+}
+
+
+
+/*
+ * NAME
+ *   connectRemoteHost - make sure a host has a master connection before a job goes to it
+ * SYNOPSIS
+ *   connectRemoteHost(int host)
+ * DESCRIPTION
+ *   Once per host, finds the master an earlier command or another shell left running, or starts one. Waiting here for the
+ *   first connection means a batch of jobs for a new host shares one handshake instead of each making its own. Returns false
+ *   if the host can't be reached, after ssh has said why, and then straight away without running ssh until
+ *   REMOTE_RETRY_SECONDS have passed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool connectRemoteHost(int host) {
+
+	if(!remoteHosts[host].connected && remoteHosts[host].retryAfter <= time(NULL)) {
+
+		remoteHosts[host].connected = runSSHControl(host, false) || runSSHControl(host, true);
+
+		if(!remoteHosts[host].connected) {
+			remoteHosts[host].retryAfter = time(NULL) + REMOTE_RETRY_SECONDS;
+		}
+	}
+
+	return remoteHosts[host].connected;
+}
+
+
+
+/*
+ * NAME
+ *   pickConnectedHost - choose where the next job goes and connect to it
+ * SYNOPSIS
+ *   pickConnectedHost(char* hostList)
+ * DESCRIPTION
+ *   Like pickRemoteHost(), but a host that turns out to be unreachable is passed over for the next best one. Returns the host,
+ *   -1 for a list with an empty name in it, or -2 if no host in the list can be reached.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int pickConnectedHost(char* hostList) {
+
+	while(1) {
+
+		int host = pickRemoteHost(hostList);
+
+		if(host == -1) {
+			return -1;
+		}
+
+		if(connectRemoteHost(host)) {
+			return host;
+		}
+
+		if(remoteHosts[host].retryAfter > time(NULL) && pickRemoteHost(hostList) == host) {	// Every host is down
+			return -2;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   remoteCommand - rewrite a command so its first stage runs on a remote host
+ * SYNOPSIS
+ *   remoteCommand(char** words, bool* isOperator, int tokenCount, int host)
+ * DESCRIPTION
+ *   Fills remoteArguments with ssh, its options and the host, then the words of the first pipeline stage as one argument, each
+ *   single quoted unless it's plain, then that stage's redirections and everything from the first | or & on, all unchanged.
+ *   Returns the new number of tokens, or -1 if the stage has no words to send.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int remoteCommand(char** words, bool* isOperator, int tokenCount, int host) {
+
+	char* sshArguments[] = {sshProgram(), "-o", controlPathOption(), "-o", "ControlMaster=auto", "-o",
+			"ControlPersist=" REMOTE_PERSIST_SECONDS, "--", remoteHosts[host].name};
+	int sshCount = sizeof(sshArguments) / sizeof(char*);
+
+	reserveArguments(&remoteArguments, tokenCount + sshCount + 2);
+	remoteText.used = 0;
+
+	int count = 0;
+
+	for(int index = 0; index < sshCount; index++) {
+		remoteArguments.items[count] = sshArguments[index];
+		remoteArguments.isOperator[count] = false;
+		count++;
+	}
+
+	int commandIndex = count;		// Filled in once remoteText has stopped moving
+	int stageEnd = 0;
+	count++;
+
+	while(stageEnd < tokenCount && !(isOperator[stageEnd] && (strcmp(words[stageEnd], "|\0") == 0 || strcmp(words[stageEnd], "&\0") == 0))) {
+		stageEnd++;
+	}
+
+	for(int index = 0; index < stageEnd; index++) {
+
+		char* operator = isOperator[index] ? skipDescriptor(words[index]) : words[index];
+
+		if(isOperator[index] && (operator[0] == '<' || operator[0] == '>' || strncmp(operator, "&>", 2) == 0)) {		// Stays here
+
+			for(int word = index; word <= index + 1 && word < stageEnd; word++) {
+				remoteArguments.items[count] = words[word];
+				remoteArguments.isOperator[count] = isOperator[word];
+				count++;
+			}
+
+			index++;
+			continue;
+		}
+
+		if(remoteText.used > 0) {
+			arenaPut(&remoteText, ' ');
+		}
+
+		bool plain = (words[index][0] != '\0');
+
+		for(char* character = words[index]; *character != '\0' && plain; character++) {
+			plain = (strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./=:,+@%", *character) != NULL);
+		}
+
+		if(plain) {
+			arenaPutString(&remoteText, words[index], strlen(words[index]));
+			continue;
+		}
+
+		arenaPut(&remoteText, '\'');
+
+		for(char* character = words[index]; *character != '\0'; character++) {
+
+			if(*character == '\'') {
+				arenaPutString(&remoteText, "'\\''", 4);		// Close the quotes, an escaped quote, open them again
+			}
+
+			else {
+				arenaPut(&remoteText, *character);
+			}
+		}
+
+		arenaPut(&remoteText, '\'');
+	}
+
+	if(remoteText.used == 0) {
+		return -1;
+	}
+
+	arenaPut(&remoteText, '\0');
+	remoteArguments.items[commandIndex] = remoteText.text;
+	remoteArguments.isOperator[commandIndex] = false;
+
+	for(int index = stageEnd; index < tokenCount; index++) {
+		remoteArguments.items[count] = words[index];
+		remoteArguments.isOperator[count] = isOperator[index];
+		count++;
+	}
+
+	remoteArguments.items[count] = NULL;
+
+	return count;
+}
+
+
+
+/*
+ * NAME
+ *   countRemoteJob - charge a job that was just launched to its host
+ * SYNOPSIS
+ *   countRemoteJob(int leaderSlot, int host)
+ * DESCRIPTION
+ *   recordChildStatus() takes it off again once the whole job has finished. Does nothing for a host of -1, a local job.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void countRemoteJob(int leaderSlot, int host) {
+
+	if(host == -1) {
+		return;
+	}
+
+	jobTable[leaderSlot].remoteHost = host;
+	remoteHosts[host].runningJobs++;
+	remoteHosts[host].startedJobs++;
+}
+
+
+
+/*
+ * NAME
+ *   listRemoteHosts - what on with no command prints
+ * SYNOPSIS
+ *   listRemoteHosts()
+ * DESCRIPTION
+ *   One line per host used so far: how many of its jobs are running, how many were started, and whether its master connection
+ *   is up, or down if the host couldn't be reached lately. Returns 0.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int listRemoteHosts() {
+
+	if(remoteHostCount > 0) {
+		printf("running\tstarted\tconnected\thost\n");
+	}
+
+	for(int host = 0; host < remoteHostCount; host++) {
+		printf("%7d\t%7lu\t%s\t\t%s\n", remoteHosts[host].runningJobs, remoteHosts[host].startedJobs,
+				remoteHosts[host].connected ? "yes" : (remoteHosts[host].retryAfter > time(NULL)) ? "down" : "no", remoteHosts[host].name);
+	}
+
+	fflush(stdout);
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   waitForAnyJob - sleep until reapChildren() has finished at least one job
+ * SYNOPSIS
+ *   waitForAnyJob()
+ * DESCRIPTION
+ *   Used by the parallel builtin to know when a worker is free. The finished jobs are handed to reportFinishedJobs() so they go
+ *   through the same path as any background job. Also returns once SIGHUP or SIGTERM has told the shell to exit.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void waitForAnyJob() {
+
+	while(doneCount == 0 && shutdownSignal == 0) {
+		waitForSignals(-1);
+	}
+
+	reportFinishedJobs();
+}
+
+
+
+/*
+ * NAME
+ *   runParallel - the parallel builtin, runs a list of commands with a bounded number at once
+ * SYNOPSIS
+ *   parallel [-j jobs] [--hosts host,host...] [file]
+ * DESCRIPTION
+ *   Reads one command line at a time from file, or from the shell's own input up to ^D if no file is given, and runs each one
+ *   as a job with at most jobs of them running at once (the number of online CPUs by default, -jN works too). A new job is
+ *   started as soon as any running one finishes. Each line can be a pipeline with redirection, $$ is expanded as usual, and
+ *   stdin comes from /dev/null unless redirected. With --hosts every line runs as if it started with on and the list, so each
+ *   job goes to whichever host has the fewest still running, passing over any that can't be reached, and a job fails only when
+ *   none of them can be. Output goes to the terminal. When every job is done a summary of how many ran, how many failed and
+ *   the throughput is printed. Returns 1 if any job failed, otherwise 0, which is what status reports.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int runParallel(char** argumentArray) {
+
+	static struct argumentVector parallelArguments = {NULL, NULL, NULL, NULL, 0, 0};
+	static struct tokenArena parallelArena = {NULL, 0, 0};
+
+	long maxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+	char* fileName = NULL;
+	char* hostList = NULL;
+	int argumentIndex = 1;
+
+	while(argumentArray[argumentIndex] != NULL) {
+
+		if(strncmp(argumentArray[argumentIndex], "-j", 2) == 0) {
+
+			bool attached = (argumentArray[argumentIndex][2] != '\0');		// -j4 as well as -j 4
+			char* jobCount = attached ? argumentArray[argumentIndex] + 2 : argumentArray[argumentIndex + 1];
+
+			if(jobCount == NULL || atoi(jobCount) <= 0) {
+				printf("parallel: -j needs a positive number of jobs\n");
+				fflush(stdout);
+				free(hostList);
+				return 1;
+			}
+
+			maxRunning = atoi(jobCount);
+			argumentIndex = argumentIndex + (attached ? 1 : 2);
+		}
+
+		else if(strcmp(argumentArray[argumentIndex], "--hosts\0") == 0) {
+
+			if(argumentArray[argumentIndex + 1] == NULL || pickRemoteHost(argumentArray[argumentIndex + 1]) == -1) {
+				printf("parallel: --hosts needs a list of hosts separated by commas\n");
+				fflush(stdout);
+				free(hostList);
+				return 1;
+			}
+
+			free(hostList);
+			hostList = strdup(argumentArray[argumentIndex + 1]);		// Same as the file name, the arena gets reused
+			argumentIndex = argumentIndex + 2;
+		}
+
+		else {
+			break;
+		}
+	}
+
+	if(maxRunning <= 0) {
+		maxRunning = 1;
+	}
+
+	if(argumentArray[argumentIndex] != NULL) {
+		fileName = strdup(argumentArray[argumentIndex]);	// Every line we lex reuses the arena this points into
+	}
+
+
+	struct inputReader fileInput = {0};
+	struct inputReader* input = shellInput;
+
+	if(fileName != NULL) {
+
+		fileInput.fd = open(fileName, O_RDONLY | O_CLOEXEC);
+
+		if(fileInput.fd == -1) {
+			printf("parallel: cannot open %s for input\n", fileName);
+			fflush(stdout);
+			free(fileName);
+			free(hostList);
+			return 1;
+		}
+
+		fileInput.capacity = READ_CHUNK_SIZE * 2;
+		fileInput.buffer = malloc(fileInput.capacity);
+		input = &fileInput;
+	}
+
+	else if(input->fd == -1) {		// Running from -c, the shell isn't reading stdin so we can
+
+		fileInput.fd = STDIN_FILENO;
+		fileInput.capacity = READ_CHUNK_SIZE * 2;
+		fileInput.buffer = malloc(fileInput.capacity);
+		input = &fileInput;
+	}
+
+	if(input->buffer == NULL) {
+		perror("Major problem allocating the parallel input buffer!\n");
+		exit(1);
+	}
+
+
+	struct timespec startTime, endTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	parallelJobsDone = 0;
+	parallelJobsFailed = 0;
+	int jobsStarted = 0;
+	int badLines = 0;		// Lines that couldn't be parsed count as failures
+	struct syntaxTree lineView = {0};	// Just the words of each line, for expandWords()
+	char* line;
+	int lineStatus;
+
+	foregroundRunning = true;		// Hold SIGTSTP messages until we're done, like a foreground job
+
+	while((lineStatus = readInputLine(input, &line)) != 0) {
+
+		if(lineStatus == -1) {		// Interrupted by a signal, try again
+			continue;
+		}
+
+		int tokenCount = lexCommandLine(line, &parallelArguments, &parallelArena, false);	// Not the line tree's arena, that's still running
+
+		if(tokenCount < 0) {
+			badLines++;
+			continue;
+		}
+
+		lineView.words = parallelArguments.items;
+		lineView.isOperator = parallelArguments.isOperator;
+		lineView.wordFlags = parallelArguments.wordFlags;
+		lineView.tokenCount = tokenCount;
+
+		tokenCount = expandWords(&lineView, 0, tokenCount);
+
+		if(tokenCount < 0) {
+			badLines++;
+			continue;
+		}
+
+		if(tokenCount == 0) {		// Blank or comment line
+			continue;
+		}
+
+		int lastIndex = tokenCount - 1;
+
+		if(commandWords.isOperator[lastIndex] && strcmp(commandWords.items[lastIndex], "&\0") == 0) {	// Already in the background
+			commandWords.items[lastIndex] = NULL;
+			lastIndex--;
+		}
+
+		while(jobsStarted - parallelJobsDone >= maxRunning && shutdownSignal == 0) {	// Every worker is busy, wait for one to finish
+			waitForAnyJob();
+		}
+
+		if(shutdownSignal != 0) {		// The jobs already running are shut down with the rest
+			break;
+		}
+
+		char** words = commandWords.items;
+		bool* isOperator = commandWords.isOperator;
+		int remoteHost = -1;
+
+		if(hostList != NULL) {		// Only once a worker is free, so the load is up to date
+
+			remoteHost = pickConnectedHost(hostList);
+			lastIndex = (remoteHost < 0) ? -1 : remoteCommand(words, isOperator, lastIndex + 1, remoteHost) - 1;
+
+			if(lastIndex < 0) {
+				badLines++;
+				continue;
+			}
+
+			words = remoteArguments.items;
+			isOperator = remoteArguments.isOperator;
+		}
+
+		int stageCount = splitPipeline(words, isOperator, lastIndex);
+
+		if(stageCount == -1) {
+			badLines++;
+			continue;
+		}
+
+		int leaderSlot = launchJob(pipelineStages, stageCount, true, false);
+		jobTable[leaderSlot].parallel = true;		// Can't have been reaped yet, that only happens in the event loop
+		countRemoteJob(leaderSlot, remoteHost);
+		jobsStarted++;
+	}
+
+	while(jobsStarted - parallelJobsDone > 0 && shutdownSignal == 0) {
+		waitForAnyJob();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	foregroundRunning = false;
+
+	if(modeMessagePending) {		// SIGTSTP came in while the jobs were running
+		modeMessagePending = false;
+		printModeMessage();
+	}
+
+
+	double elapsedSeconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+	int failedJobs = parallelJobsFailed + badLines;
+
+	printf("parallel: %d jobs, %d failed in %.3fs (%.1f jobs/s)\n", jobsStarted + badLines, failedJobs, elapsedSeconds,
+			elapsedSeconds > 0 ? jobsStarted / elapsedSeconds : 0.0);
+	fflush(stdout);
+
+
+	if(input == shellInput) {		// The ^D only ended the list, at the real end of a script the shell just reads end of file again
+		input->atEOF = false;
+	}
+
+	if(input == &fileInput) {
+		if(fileInput.fd != STDIN_FILENO) {
+			close(fileInput.fd);
+		}
+		free(fileInput.buffer);
+	}
+
+	free(fileName);
+	free(hostList);
+
+	return (failedJobs > 0) ? 1 : 0;		// status reports how the batch went
+}
+
+
+
+// Command history
+//
+// Every line typed at the prompt is appended to the history file (HISTFILE, or ~/.smallsh_history) with one write() and kept in a
+// small ring of recent lines. The file is never read at startup. The first time the history builtin needs it, the file is mapped
+// with mmap() and indexed: where each entry starts, plus a bitmap per block of entries recording which trigrams (runs of three
+// characters) appear in it. A search only scans the blocks whose bitmap has every trigram of the pattern, so most of a big file is
+// skipped without being touched. Later calls only index the entries added since the last one.
+
+#define HISTORY_RING_SIZE 256		// Recent lines kept in memory
+#define HISTORY_BLOCK_ENTRIES 64	// Entries covered by one trigram bitmap
+#define HISTORY_BLOCK_BITS 4096		// Bits per bitmap, a power of two
+
+char* historyRing[HISTORY_RING_SIZE];	// Most recent lines, oldest overwritten first
+size_t historyRingCount = 0;		// Lines ever added this session, the newest is historyRing[(historyRingCount - 1) % HISTORY_RING_SIZE]
+
+int historyFD = -1;			// Opened with O_APPEND, -1 if there's no history file
+char* historyMap = NULL;		// The file mapped read-only, NULL until the builtin first needs it
+size_t historyMappedBytes = 0;
+size_t historyIndexedBytes = 0;		// Everything before this has been indexed
+size_t* historyEntryStarts = NULL;	// Offset of every indexed entry
+size_t historyEntryCount = 0;
+size_t historyEntryCapacity = 0;
+unsigned char* historyBitmaps = NULL;	// HISTORY_BLOCK_BITS / 8 bytes per block
+
+
+
+/*
+ * NAME
+ *   openHistory - open the history file for appending
+ * SYNOPSIS
+ *   openHistory()
+ * DESCRIPTION
+ *   Uses HISTFILE if it's set, otherwise .smallsh_history in HOME. Only opens the file, nothing is read until the history
+ *   builtin asks for it. Without a history file, history only covers the lines in the ring.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void openHistory() {
+
+	char* historyPath = variableValue("HISTFILE");
+	char defaultPath[4096];
+
+	if(historyPath == NULL) {
+
+		char* homeDirectory = variableValue("HOME");
+
+		if(homeDirectory == NULL) {
+			return;
+		}
+
+		snprintf(defaultPath, sizeof(defaultPath), "%s/.smallsh_history", homeDirectory);
+		historyPath = defaultPath;
+	}
+
+	historyFD = open(historyPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+}
+
+
+
+/*
+ * NAME
+ *   addHistory - remember a line the user typed
+ * SYNOPSIS
+ *   addHistory(char* line)
+ * DESCRIPTION
+ *   Puts a copy in the ring and appends the line and a newline to the history file with a single writev(), so it's O(1) no matter
+ *   how big the file is, and lines from several shells sharing the file don't get mixed together.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void addHistory(char* line) {
+
+	size_t ringSlot = historyRingCount % HISTORY_RING_SIZE;
+
+	free(historyRing[ringSlot]);		// NULL until the ring wraps
+	historyRing[ringSlot] = strdup(line);
+	historyRingCount++;
+
+	if(historyFD != -1) {
+
+		static bool failureReported = false;		// Once is enough, the lines are still in the ring
+		struct iovec entry[2] = {{line, strlen(line)}, {"\n", 1}};
+
+		if(writev(historyFD, entry, 2) == -1 && !failureReported) {
+			printf("history: cannot write to the history file: %s\n", strerror(errno));
+			fflush(stdout);
+			failureReported = true;
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   hashTrigram - which bitmap bit a three character run sets
+ * SYNOPSIS
+ *   hashTrigram(unsigned char* text)
+ * DESCRIPTION
+ *   Mixes the three characters starting at text into a bit number below HISTORY_BLOCK_BITS.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline unsigned int hashTrigram(unsigned char* text) {
+
+	unsigned int value = (text[0] << 16) | (text[1] << 8) | text[2];
+
+	return (value * 2654435761u) >> (32 - 12);		// Multiplicative hash, 12 bits for 4096
+}
+
+
+
+/*
+ * NAME
+ *   updateHistoryIndex - bring the history index up to date with the file
+ * SYNOPSIS
+ *   updateHistoryIndex()
+ * DESCRIPTION
+ *   Maps the file the first time, or extends the mapping if other lines were appended since, then indexes every complete entry
+ *   past historyIndexedBytes. Returns false if there's no history file or it couldn't be mapped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool updateHistoryIndex() {
+
+	struct stat fileInfo;
+
+	if(historyFD == -1 || fstat(historyFD, &fileInfo) == -1) {
+		return false;
+	}
+
+	size_t fileBytes = fileInfo.st_size;
+
+	if(fileBytes == historyIndexedBytes) {		// Nothing new
+		return true;
+	}
+
+	if(historyMap == NULL) {
+		historyMap = mmap(NULL, fileBytes, PROT_READ, MAP_SHARED, historyFD, 0);
+	}
+
+	else if(fileBytes > historyMappedBytes) {
+		historyMap = mremap(historyMap, historyMappedBytes, fileBytes, MREMAP_MAYMOVE);
+	}
+
+	if(historyMap == MAP_FAILED) {
+		historyMap = NULL;
+		historyMappedBytes = 0;
+		historyIndexedBytes = 0;
+		historyEntryCount = 0;
+		return false;
+	}
+
+	historyMappedBytes = fileBytes;
+
+
+	// Index every complete entry that's new, a line still being written has no newline yet and waits for the next call
+
+	size_t bitmapBytes = HISTORY_BLOCK_BITS / 8;
+	char* entryStart = historyMap + historyIndexedBytes;
+	char* fileEnd = historyMap + fileBytes;
+	char* newline;
+
+	while(entryStart < fileEnd && (newline = memchr(entryStart, '\n', fileEnd - entryStart)) != NULL) {
+
+		if(historyEntryCount == historyEntryCapacity) {
+
+			size_t oldBlocks = historyEntryCapacity / HISTORY_BLOCK_ENTRIES;
+			historyEntryCapacity = (historyEntryCapacity == 0) ? 4096 : historyEntryCapacity * 2;
+			size_t newBlocks = historyEntryCapacity / HISTORY_BLOCK_ENTRIES;
+
+			historyEntryStarts = realloc(historyEntryStarts, historyEntryCapacity * sizeof(size_t));
+			historyBitmaps = realloc(historyBitmaps, newBlocks * bitmapBytes);
+
+			if(historyEntryStarts == NULL || historyBitmaps == NULL) {
+				perror("Major problem growing the history index!\n");
+				exit(1);
+			}
+
+			memset(historyBitmaps + oldBlocks * bitmapBytes, 0, (newBlocks - oldBlocks) * bitmapBytes);
+		}
+
+		unsigned char* bitmap = historyBitmaps + (historyEntryCount / HISTORY_BLOCK_ENTRIES) * bitmapBytes;
+
+		for(unsigned char* text = (unsigned char*)entryStart; text + 3 <= (unsigned char*)newline; text++) {
+
+			unsigned int bit = hashTrigram(text);
+			bitmap[bit >> 3] |= 1 << (bit & 7);
+		}
+
+		historyEntryStarts[historyEntryCount++] = entryStart - historyMap;
+		entryStart = newline + 1;
+	}
+
+	historyIndexedBytes = entryStart - historyMap;
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   printHistoryEntries - print indexed entries that match a pattern
+ * SYNOPSIS
+ *   printHistoryEntries(char* pattern, bool prefixOnly, size_t firstEntry)
+ * DESCRIPTION
+ *   Prints every entry from firstEntry on that contains pattern (or starts with it if prefixOnly), numbered from 1 in file order.
+ *   A NULL pattern matches everything. Blocks whose trigram bitmap is missing any trigram of the pattern are skipped without
+ *   looking at their entries. Returns how many entries were printed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t printHistoryEntries(char* pattern, bool prefixOnly, size_t firstEntry) {
+
+	size_t patternLength = (pattern != NULL) ? strlen(pattern) : 0;
+	size_t bitmapBytes = HISTORY_BLOCK_BITS / 8;
+	size_t printed = 0;
+
+	unsigned int patternBits[256];		// Trigram bits of the pattern, a long pattern only needs its first few to filter well
+	int patternBitCount = 0;
+
+	for(size_t index = 0; index + 3 <= patternLength && patternBitCount < 256; index++) {
+		patternBits[patternBitCount++] = hashTrigram((unsigned char*)pattern + index);
+	}
+
+	for(size_t block = firstEntry / HISTORY_BLOCK_ENTRIES; block * HISTORY_BLOCK_ENTRIES < historyEntryCount; block++) {
+
+		unsigned char* bitmap = historyBitmaps + block * bitmapBytes;
+		bool candidate = true;
+
+		for(int index = 0; index < patternBitCount && candidate; index++) {
+			candidate = (bitmap[patternBits[index] >> 3] >> (patternBits[index] & 7)) & 1;
+		}
+
+		if(!candidate) {
+			continue;
+		}
+
+		size_t blockEnd = (block + 1) * HISTORY_BLOCK_ENTRIES;
+
+		for(size_t entry = block * HISTORY_BLOCK_ENTRIES; entry < blockEnd && entry < historyEntryCount; entry++) {
+
+			if(entry < firstEntry) {
+				continue;
+			}
+
+			char* text = historyMap + historyEntryStarts[entry];
+			size_t entryEnd = (entry + 1 < historyEntryCount) ? historyEntryStarts[entry + 1] : historyIndexedBytes;
+			size_t length = entryEnd - historyEntryStarts[entry] - 1;		// Without the newline
+
+			bool matches = (pattern == NULL);
+
+			if(!matches && prefixOnly) {
+				matches = (length >= patternLength && memcmp(text, pattern, patternLength) == 0);
+			}
+
+			else if(!matches) {
+				matches = (memmem(text, length, pattern, patternLength) != NULL);
+			}
+
+			if(matches) {
+				printf("%7zu  %.*s\n", entry + 1, (int)length, text);
+				printed++;
+			}
+		}
+	}
+
+	fflush(stdout);
+	return printed;
+}
+
+
+
+/*
+ * NAME
+ *   showHistory - the history builtin
+ * SYNOPSIS
+ *   history [count]
+ *   history -s text
+ *   history -p prefix
+ * DESCRIPTION
+ *   With no arguments prints the last 16 entries, or the last count of them. -s prints every entry containing text and -p every
+ *   entry starting with prefix. Returns 1 if a search found nothing. Without a history file only this session's recent lines in the
+ *   ring can be listed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int showHistory(char** argumentArray) {
+
+	bool searching = (argumentArray[1] != NULL && (strcmp(argumentArray[1], "-s") == 0 || strcmp(argumentArray[1], "-p") == 0));
+	size_t count = 16;
+
+	if(searching && argumentArray[2] == NULL) {
+		printf("usage: history [count] | -s text | -p prefix\n");
+		fflush(stdout);
+		return 1;
+	}
+
+	if(!searching && argumentArray[1] != NULL) {
+
+		char* numberEnd;
+		count = strtoul(argumentArray[1], &numberEnd, 10);
+
+		if(*numberEnd != '\0') {
+			printf("history: %s: numeric argument required\n", argumentArray[1]);
+			fflush(stdout);
+			return 1;
+		}
+	}
+
+
+	if(!updateHistoryIndex()) {		// No file, fall back to the ring
+
+		size_t available = (historyRingCount < HISTORY_RING_SIZE) ? historyRingCount : HISTORY_RING_SIZE;
+		size_t printed = 0;
+
+		for(size_t entry = historyRingCount - available; entry < historyRingCount; entry++) {
+
+			char* line = historyRing[entry % HISTORY_RING_SIZE];
+			bool matches;
+
+			if(searching && argumentArray[1][1] == 'p') {
+				matches = (strncmp(line, argumentArray[2], strlen(argumentArray[2])) == 0);
+			}
+
+			else if(searching) {
+				matches = (strstr(line, argumentArray[2]) != NULL);
+			}
+
+			else {
+				matches = (historyRingCount - entry <= count);
+			}
+
+			if(matches) {
+				printf("%7zu  %s\n", entry + 1, line);
+				printed++;
+			}
+		}
+
+		fflush(stdout);
+		return (searching && printed == 0) ? 1 : 0;
+	}
+
+	if(searching) {
+		return (printHistoryEntries(argumentArray[2], argumentArray[1][1] == 'p', 0) > 0) ? 0 : 1;
+	}
+
+	printHistoryEntries(NULL, false, (historyEntryCount > count) ? historyEntryCount - count : 0);
+	return 0;
+}
+
+
+
+// Built in commands
+//
+// Everything the shell runs without forking. Each one takes the NULL terminated argument array and returns its exit status, and
+// builtinCommands lists them all. Commands like echo and test that also exist as programs are marked utility: they only run in the
+// shell when they're a plain foreground command, so pipelines and background jobs still get a child process like before. The
+// others have no program to fall back on, so a line that puts one in a pipeline or the background is a syntax error.
+
+/*
+ * NAME
+ *   exitShell - the exit builtin
+ * SYNOPSIS
+ *   exitShell(char** argumentArray)
+ * DESCRIPTION
+ *   Ends the read loop, main() then shuts down every job that's still running with shutDownJobs(). Returns the exit value of
+ *   the command before it, so a script that ends with exit ends with that.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int exitShell(char** argumentArray) {
+
+	userTypedExit = true;		// End the read loop
+	return lastExitValue();
+}
+
+
+
+/*
+ * NAME
+ *   changeDirectory - the cd builtin
+ * SYNOPSIS
+ *   changeDirectory(char** argumentArray)
+ * DESCRIPTION
+ *   With no argument changes to HOME. A path starting with / is taken relative to HOME, anything else relative to the current
+ *   directory. Returns 1 if chdir() failed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int changeDirectory(char** argumentArray) {
+
+	char* homeDirectory = variableValue("HOME");		// One hash lookup, no scan of the environment
+
+	if(argumentArray[1] == NULL) {	// User typed cd with no argument
+
+		return (homeDirectory != NULL && chdir(homeDirectory) == 0) ? 0 : 1;	// Change directory to the HOME directory
+	}
+
+
+	if(argumentArray[1][0] == '/') {	// User is supplying an absolute path
+
+		size_t homeLength = (homeDirectory != NULL) ? strlen(homeDirectory) : 0;
+		size_t pathLength = strlen(argumentArray[1]);
+		char pathToOpen[homeLength + pathLength + 1];	// Sized to fit, nothing to clear
+
+		memcpy(pathToOpen, homeDirectory, homeLength);		// new filepath = HOME + user input
+		memcpy(pathToOpen + homeLength, argumentArray[1], pathLength + 1);
+
+		return (chdir(pathToOpen) == 0) ? 0 : 1;
+	}
+
+	return (chdir(argumentArray[1]) == 0) ? 0 : 1;	// User supplied a relative path, which chdir() already resolves against the cwd
+}
+
+
+
+/*
+ * NAME
+ *   showStatus - the status builtin
+ * SYNOPSIS
+ *   showStatus(char** argumentArray)
+ * DESCRIPTION
+ *   Prints the exit value or terminating signal of the last foreground command, or exit value 0 if there hasn't been one.
+ *   "status -v" also prints everything the last foreground job used.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int showStatus(char** argumentArray) {
+
+	if(noForegroundProcessesRun) {		// If run before a foreground process is run, just return exit status 0
+
+		printf("exit value 0\n");
+		fflush(stdout);
+	}
+
+	else {
+		if(killedByExit) {				// We've had a foreground process complete at least once
+
+			printf("exit value %d\n", exitStatusCode);
+			fflush(stdout);
+		}
+
+		else if(killedBySignal) {
+			printf("terminated by signal %d\n", termSignal);
+			fflush(stdout);
+		}
+	}
+
+	if(argumentArray[1] != NULL && strcmp(argumentArray[1], "-v\0") == 0 && !noForegroundProcessesRun) {	// Full accounting too
+
+		printJobUsage(&lastForegroundUsage, true);
+	}
+
+	return 0;
+}
+
+
+
+#define ESCAPE_STOP -1		// What escapeValue() says about \c
+
+/*
+ * NAME
+ *   escapeValue - the character a backslash escape stands for
+ * SYNOPSIS
+ *   escapeValue(char** cursor, bool formatOctal)
+ * DESCRIPTION
+ *   cursor points at the backslash and is left on the last character of the escape. Handles \a \b \f \n \r \t \v \\ and
+ *   octal: \0nnn the way echo and printf's %b write it, or \nnn with one to three digits when formatOctal is set, the way a
+ *   printf format does. An unknown escape stands for the backslash itself, with cursor left on it so the rest prints as it was
+ *   written. Returns the character, or ESCAPE_STOP for \c, which means stop printing altogether.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int escapeValue(char** cursor, bool formatOctal) {
+
+	char* escape = *cursor + 1;
+	char* escapes = "abfnrtv\\";
+	char* meanings = "\a\b\f\n\r\t\v\\";
+	char* match = (*escape != '\0') ? strchr(escapes, *escape) : NULL;
+	int value = '\\';		// Not an escape, the caller prints the backslash and then the rest
+
+	if(match != NULL) {
+		value = (unsigned char)meanings[match - escapes];
+		*cursor = escape;
+	}
+
+	else if(*escape == 'c') {
+		return ESCAPE_STOP;
+	}
+
+	else if(*escape >= '0' && *escape <= '7' && (formatOctal || *escape == '0')) {
+
+		value = 0;
+
+		if(formatOctal) {		// The first digit counts as one of the three
+			escape--;
+		}
+
+		for(int digits = 0; digits < 3 && escape[1] >= '0' && escape[1] <= '7'; digits++) {
+			escape++;
+			value = value * 8 + (*escape - '0');
+		}
+
+		value = value & 0xFF;
+		*cursor = escape;
+	}
+
+	return value;
+}
+
+
+
+/*
+ * NAME
+ *   echoArguments - the echo builtin
+ * SYNOPSIS
+ *   echo [-neE] [arguments...]
+ * DESCRIPTION
+ *   Prints the arguments separated by spaces and followed by a newline. -n leaves off the newline, -e turns on backslash
+ *   escapes and -E turns them off again, the same as /bin/echo. An argument that isn't made only of those letters is printed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int echoArguments(char** argumentArray) {
+
+	bool printNewline = true;
+	bool useEscapes = false;
+	int index = 1;
+
+	for(; argumentArray[index] != NULL && argumentArray[index][0] == '-' && argumentArray[index][1] != '\0'; index++) {
+
+		if(strspn(argumentArray[index] + 1, "neE") != strlen(argumentArray[index] + 1)) {
+			break;		// Something like -x is just text
+		}
+
+		for(char* flag = argumentArray[index] + 1; *flag != '\0'; flag++) {
+
+			if(*flag == 'n') {
+				printNewline = false;
+			}
+
+			else {
+				useEscapes = (*flag == 'e');
+			}
+		}
+	}
+
+	for(bool first = true; argumentArray[index] != NULL; index++, first = false) {
+
+		if(!first) {
+			putchar(' ');
+		}
+
+		if(!useEscapes) {
+			fputs(argumentArray[index], stdout);
+			continue;
+		}
+
+		for(char* cursor = argumentArray[index]; *cursor != '\0'; cursor++) {
+
+			if(*cursor != '\\') {
+				putchar(*cursor);
+			}
+
+			else {
+
+				int value = escapeValue(&cursor, false);
+
+				if(value == ESCAPE_STOP) {		// \c, nothing more gets printed
+					fflush(stdout);
+					return 0;
+				}
+
+				putchar(value);
+			}
+		}
+	}
+
+	if(printNewline) {
+		putchar('\n');
+	}
+
+	fflush(stdout);
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   printFormatted - the printf builtin
+ * SYNOPSIS
+ *   printf format [arguments...]
+ * DESCRIPTION
+ *   Prints format with its backslash escapes and % conversions filled in from the arguments. Supports %d %i %u %o %x %X %c %s %b
+ *   and %%, with the usual flags, width and precision. %b prints its argument with the escapes echo -e knows, and a \c in it
+ *   stops everything. Missing arguments count as empty strings or 0, and if there are more arguments than conversions the format
+ *   is used again until they run out. Returns 1 if a number couldn't be read or a conversion isn't one of those, otherwise 0.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int printFormatted(char** argumentArray) {
+
+	if(argumentArray[1] == NULL) {
+		printf("usage: printf format [arguments]\n");
+		fflush(stdout);
+		return 1;
+	}
+
+	static struct tokenArena escapedArgument = {NULL, 0, 0};		// What %b makes of its argument
+
+	char* format = argumentArray[1];
+	char** nextArgument = argumentArray + 2;
+	int exitStatus = 0;
+	bool usedArgument;
+
+	do {
+
+		usedArgument = false;
+
+		for(char* cursor = format; *cursor != '\0'; cursor++) {
+
+			if(*cursor == '\\') {
+
+				int value = escapeValue(&cursor, true);
+
+				if(value == ESCAPE_STOP) {
+					fflush(stdout);
+					return exitStatus;
+				}
+
+				putchar(value);
+				continue;
+			}
+
+			if(*cursor != '%') {
+				putchar(*cursor);
+				continue;
+			}
+
+			if(cursor[1] == '%') {
+				putchar('%');
+				cursor++;
+				continue;
+			}
+
+
+			// Copy the flags, width and precision so the real printf() can do the formatting
+
+			char conversion[32] = "%";
+			size_t length = 1;
+
+			while(cursor[1] != '\0' && strchr("-+ #0123456789.", cursor[1]) != NULL && length < sizeof(conversion) - 4) {
+				conversion[length++] = *++cursor;
+			}
+
+			char type = *++cursor;
+
+			if(type == '\0') {		// Format ended in the middle of a conversion
+				break;
+			}
+
+			if(strchr("diuoxXcsb", type) == NULL) {
+				printf("printf: %%%c: invalid conversion\n", type);
+				fflush(stdout);
+				return 1;
+			}
+
+			char* argument = "";
+
+			if(*nextArgument != NULL) {
+				argument = *nextArgument++;
+				usedArgument = true;
+			}
+
+			char* numberEnd;
+
+			if(strchr("diuoxX", type) != NULL) {
+
+				long long number = strtoll(argument, &numberEnd, 0);
+
+				if(*numberEnd != '\0') {
+					printf("printf: %s: invalid number\n", argument);
+					exitStatus = 1;
+				}
+
+				conversion[length++] = 'l';
+				conversion[length++] = 'l';
+				conversion[length++] = type;
+				printf(conversion, number);
+			}
+
+			else if(type == 'c' || type == 's') {
+
+				conversion[length++] = 's';
+
+				if(type == 'c') {		// Only the first character
+					char firstCharacter[2] = {argument[0], '\0'};
+					printf(conversion, firstCharacter);
+				}
+
+				else {
+					printf(conversion, argument);
+				}
+			}
+
+			else {		// %b
+
+				bool stopped = false;
+
+				escapedArgument.used = 0;
+
+				for(char* escape = argument; *escape != '\0' && !stopped; escape++) {
+
+					int value = (*escape == '\\') ? escapeValue(&escape, false) : (unsigned char)*escape;
+
+					if(value == ESCAPE_STOP) {
+						stopped = true;
+					}
+
+					else {
+						arenaPut(&escapedArgument, (char)value);
+					}
+				}
+
+				if(length == 1 && escapedArgument.used > 0) {		// No width or precision, so a \0 in it is printed too
+					fwrite(escapedArgument.text, 1, escapedArgument.used, stdout);
+				}
+
+				else if(length > 1) {
+					arenaPut(&escapedArgument, '\0');
+					conversion[length++] = 's';
+					printf(conversion, escapedArgument.text);
+				}
+
+				if(stopped) {
+					fflush(stdout);
+					return exitStatus;
+				}
+			}
+		}
+
+	} while(*nextArgument != NULL && usedArgument);
+
+	fflush(stdout);
+	return exitStatus;
+}
+
+
+
+// State for testExpression() while it works through the arguments
+
+struct testParser {
+	char** tokens;
+	int count;
+	int position;
+	bool syntaxError;
+	bool errorPrinted;		// A more useful message than "syntax error" has already gone out
+};
+
+
+
+/*
+ * NAME
+ *   testPrimary - evaluate one test condition: a unary or binary operator, or a lone string
+ * SYNOPSIS
+ *   testPrimary(struct testParser* parser)
+ * DESCRIPTION
+ *   A binary operator is recognised when it's the second of at least three remaining tokens, so "test -n = -n" compares
+ *   strings the way POSIX says it should. Sets syntaxError for bad integers, ones too big for a long long and missing operands.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool testPrimary(struct testParser* parser) {
+
+	int remaining = parser->count - parser->position;
+	char** tokens = parser->tokens + parser->position;
+
+	if(remaining <= 0) {
+		parser->syntaxError = true;
+		return false;
+	}
+
+	if(remaining >= 3) {
+
+		char* operator = tokens[1];
+		char* binaryOperators[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+		int operatorIndex = 0;
+
+		while(binaryOperators[operatorIndex] != NULL && strcmp(operator, binaryOperators[operatorIndex]) != 0) {
+			operatorIndex++;
+		}
+
+		if(binaryOperators[operatorIndex] != NULL) {
+
+			parser->position += 3;
+
+			if(operatorIndex < 3) {		// String comparison
+				bool same = (strcmp(tokens[0], tokens[2]) == 0);
+				return (operatorIndex < 2) ? same : !same;
+			}
+
+			char* leftEnd;
+			char* rightEnd;
+
+			errno = 0;
+			long long left = strtoll(tokens[0], &leftEnd, 10);
+			bool leftInRange = (errno != ERANGE);
+
+			errno = 0;
+			long long right = strtoll(tokens[2], &rightEnd, 10);
+			bool rightInRange = (errno != ERANGE);
+
+			if(*leftEnd != '\0' || *rightEnd != '\0' || tokens[0][0] == '\0' || tokens[2][0] == '\0') {
+				printf("test: %s: integer expression expected\n", (*leftEnd != '\0' || tokens[0][0] == '\0') ? tokens[0] : tokens[2]);
+				fflush(stdout);
+				parser->syntaxError = true;
+				parser->errorPrinted = true;
+				return false;
+			}
+
+			if(!leftInRange || !rightInRange) {		// strtoll() clamped it, so the comparison would be wrong
+				printf("test: %s: integer expression out of range\n", leftInRange ? tokens[2] : tokens[0]);
+				fflush(stdout);
+				parser->syntaxError = true;
+				parser->errorPrinted = true;
+				return false;
+			}
+
+			switch(operatorIndex) {
+				case 3: return left == right;
+				case 4: return left != right;
+				case 5: return left < right;
+				case 6: return left <= right;
+				case 7: return left > right;
+				default: return left >= right;
+			}
+		}
+	}
+
+	if(remaining >= 2 && tokens[0][0] == '-' && tokens[0][1] != '\0' && tokens[0][2] == '\0' && strchr("nzefdrwxsLhbcpSt", tokens[0][1]) != NULL) {
+
+		char operator = tokens[0][1];
+		char* operand = tokens[1];
+		struct stat fileInfo;
+
+		parser->position += 2;
+
+		switch(operator) {
+			case 'n': return operand[0] != '\0';
+			case 'z': return operand[0] == '\0';
+			case 'r': return access(operand, R_OK) == 0;
+			case 'w': return access(operand, W_OK) == 0;
+			case 'x': return access(operand, X_OK) == 0;
+			case 't': return isatty(atoi(operand));
+		}
+
+		if(operator == 'L' || operator == 'h') {
+			return lstat(operand, &fileInfo) == 0 && S_ISLNK(fileInfo.st_mode);
+		}
+
+		if(stat(operand, &fileInfo) != 0) {
+			return false;
+		}
+
+		switch(operator) {
+			case 'f': return S_ISREG(fileInfo.st_mode);
+			case 'd': return S_ISDIR(fileInfo.st_mode);
+			case 's': return fileInfo.st_size > 0;
+			case 'b': return S_ISBLK(fileInfo.st_mode);
+			case 'c': return S_ISCHR(fileInfo.st_mode);
+			case 'p': return S_ISFIFO(fileInfo.st_mode);
+			case 'S': return S_ISSOCK(fileInfo.st_mode);
+			default: return true;		// -e, it exists
+		}
+	}
+
+	parser->position++;		// A string on its own is true if it isn't empty
+	return tokens[0][0] != '\0';
+}
+
+
+
+/*
+ * NAME
+ *   testExpression - evaluate a test expression
+ * SYNOPSIS
+ *   testExpression(struct testParser* parser, int level)
+ * DESCRIPTION
+ *   Recursive descent with one level per precedence: 0 joins level 1 terms with -o, 1 joins level 2 terms with -a, and 2 handles
+ *   ! and parentheses before handing off to testPrimary(). A token that is the only one left is always treated as a string.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool testExpression(struct testParser* parser, int level) {
+
+	if(level < 2) {
+
+		char* joiner = (level == 0) ? "-o" : "-a";
+		bool result = testExpression(parser, level + 1);
+
+		while(!parser->syntaxError && parser->position < parser->count - 1 && strcmp(parser->tokens[parser->position], joiner) == 0) {
+
+			parser->position++;
+			bool nextResult = testExpression(parser, level + 1);
+			result = (level == 0) ? (result || nextResult) : (result && nextResult);
+		}
+
+		return result;
+	}
+
+	int remaining = parser->count - parser->position;
+
+	if(remaining > 1 && strcmp(parser->tokens[parser->position], "!") == 0) {
+		parser->position++;
+		return !testExpression(parser, 2);
+	}
+
+	if(remaining > 1 && strcmp(parser->tokens[parser->position], "(") == 0) {
+
+		parser->position++;
+		bool result = testExpression(parser, 0);
+
+		if(parser->position >= parser->count || strcmp(parser->tokens[parser->position], ")") != 0) {
+			parser->syntaxError = true;
+			return false;
+		}
+
+		parser->position++;
+		return result;
+	}
+
+	return testPrimary(parser);
+}
+
+
+
+/*
+ * NAME
+ *   testCondition - the test and [ builtins
+ * SYNOPSIS
+ *   test expression
+ *   [ expression ]
+ * DESCRIPTION
+ *   Returns 0 if the expression is true, 1 if it's false and 2 if it couldn't be understood. With no expression the result is
+ *   false. Supports string (= != -n -z), integer (-eq -ne -lt -le -gt -ge) and file (-e -f -d -r -w -x -s -L) tests joined with
+ *   ! -a -o and parentheses. [ needs ] as its last argument. Run status afterwards to see the result.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int testCondition(char** argumentArray) {
+
+	int count = 0;
+
+	while(argumentArray[count + 1] != NULL) {
+		count++;
+	}
+
+	if(strcmp(argumentArray[0], "[") == 0) {
+
+		if(count == 0 || strcmp(argumentArray[count], "]") != 0) {
+			printf("[: missing ]\n");
+			fflush(stdout);
+			return 2;
+		}
+
+		count--;		// Leave the ] out of the expression
+	}
+
+	if(count == 0) {
+		return 1;
+	}
+
+	struct testParser parser = {argumentArray + 1, count, 0, false, false};
+	bool result = testExpression(&parser, 0);
+
+	if(!parser.syntaxError && parser.position != parser.count) {		// Something left over
+		parser.syntaxError = true;
+	}
+
+	if(parser.syntaxError && !parser.errorPrinted) {
+		printf("%s: syntax error\n", argumentArray[0]);
+		fflush(stdout);
+	}
+
+	if(parser.syntaxError) {
+		return 2;
+	}
+
+	return result ? 0 : 1;
+}
+
+
+
+/*
+ * NAME
+ *   trueCommand, falseCommand - the true and false builtins
+ * SYNOPSIS
+ *   true
+ *   false
+ * DESCRIPTION
+ *   Do nothing, successfully or unsuccessfully.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int trueCommand(char** argumentArray) {
+	return 0;
+}
+
+int falseCommand(char** argumentArray) {
+	return 1;
+}
+
+
+
+/*
+ * NAME
+ *   printWorkingDirectory - the pwd builtin
+ * SYNOPSIS
+ *   pwd
+ * DESCRIPTION
+ *   Prints the current directory. Returns 1 if getcwd() fails.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int printWorkingDirectory(char** argumentArray) {
+
+	char directory[4096];
+
+	if(getcwd(directory, sizeof(directory)) == NULL) {
+		printf("pwd: cannot get the current directory\n");
+		fflush(stdout);
+		return 1;
+	}
+
+	printf("%s\n", directory);
+	fflush(stdout);
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   exportVariables - the export builtin
+ * SYNOPSIS
+ *   export [name[=value] ...]
+ * DESCRIPTION
+ *   Marks each variable for the environment of commands the shell runs, setting it first when a value is given. With no names,
+ *   lists the exported variables. Returns 1 if a name isn't valid.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int exportVariables(char** argumentArray) {
+
+	if(argumentArray[1] == NULL) {
+
+		for(int bucket = 0; bucket < variableBucketCount; bucket++) {
+
+			for(struct shellVariable* variable = variableBuckets[bucket]; variable != NULL; variable = variable->next) {
+
+				if(variable->environmentEntry != NULL) {
+					printf("export %s\n", variable->environmentEntry);
+				}
+			}
+		}
+
+		fflush(stdout);
+		return 0;
+	}
+
+	int exitStatus = 0;
+
+	for(int argument = 1; argumentArray[argument] != NULL; argument++) {
+
+		char* equals = strchr(argumentArray[argument], '=');
+		size_t nameLength = (equals != NULL) ? (size_t)(equals - argumentArray[argument]) : strlen(argumentArray[argument]);
+
+		if(!isVariableName(argumentArray[argument], nameLength)) {
+			printf("export: %s: not a valid name\n", argumentArray[argument]);
+			fflush(stdout);
+			exitStatus = 1;
+			continue;
+		}
+
+		char name[nameLength + 1];
+		memcpy(name, argumentArray[argument], nameLength);
+		name[nameLength] = '\0';
+
+		setVariable(name, (equals != NULL) ? equals + 1 : NULL, true);
+	}
+
+	return exitStatus;
+}
+
+
+
+/*
+ * NAME
+ *   unsetVariables - the unset builtin
+ * SYNOPSIS
+ *   unset name ...
+ *   unset -f name ...
+ * DESCRIPTION
+ *   Removes each variable from the shell, and from the environment if it was exported. With -f the names are functions instead.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int unsetVariables(char** argumentArray) {
+
+	bool functions = (argumentArray[1] != NULL && strcmp(argumentArray[1], "-f\0") == 0);
+
+	for(int argument = 1 + functions; argumentArray[argument] != NULL; argument++) {
+
+		if(functions) {
+			removeFunction(argumentArray[argument]);
+		}
+
+		else {
+			unsetVariable(argumentArray[argument]);
+		}
+	}
+
+	return 0;
+}
+
+
+
+// Control flow built ins
+//
+// These only set how far the tree walker has to unwind, runNode() does the rest as it returns.
+
+
+
+/*
+ * NAME
+ *   loopCount - the optional count break and continue take
+ * SYNOPSIS
+ *   loopCount(char** argumentArray)
+ * DESCRIPTION
+ *   Reports a bad count or being used outside a loop and returns 0. A count past the outermost loop means the outermost loop.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int loopCount(char** argumentArray) {
+
+	int count = (argumentArray[1] != NULL) ? atoi(argumentArray[1]) : 1;
+
+	if(count <= 0) {
+		printf("%s: loop count must be a positive number\n", argumentArray[0]);
+		fflush(stdout);
+		return 0;
+	}
+
+	if(loopDepth == 0) {
+		printf("%s: only meaningful in a loop\n", argumentArray[0]);
+		fflush(stdout);
+		return 0;
+	}
+
+	return (count < loopDepth) ? count : loopDepth;
+}
+
+
+
+/*
+ * NAME
+ *   breakLoop - the break builtin
+ * SYNOPSIS
+ *   break [n]
+ * DESCRIPTION
+ *   Leaves the innermost loop, or n of them.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int breakLoop(char** argumentArray) {
+
+	int count = loopCount(argumentArray);
+
+	if(count == 0) {
+		return 1;
+	}
+
+	loopExits = count;
+	loopContinues = false;
+
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   continueLoop - the continue builtin
+ * SYNOPSIS
+ *   continue [n]
+ * DESCRIPTION
+ *   Starts the next time around the innermost loop, or leaves n - 1 loops and goes around the one after.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int continueLoop(char** argumentArray) {
+
+	int count = loopCount(argumentArray);
+
+	if(count == 0) {
+		return 1;
+	}
+
+	loopExits = count;
+	loopContinues = true;
+
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   returnFromFunction - the return builtin
+ * SYNOPSIS
+ *   return [n]
+ * DESCRIPTION
+ *   Ends the function being run, which returns n, or the last exit value if there's no n.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int returnFromFunction(char** argumentArray) {
+
+	if(functionDepth == 0) {
+		printf("return: can only be used in a function\n");
+		fflush(stdout);
+		return 1;
+	}
+
+	functionReturnValue = (argumentArray[1] != NULL) ? atoi(argumentArray[1]) : lastExitValue();
+	functionReturning = true;
+
+	return functionReturnValue;
+}
+
+
+
+// Job control built ins
+//
+// Jobs are named by %n, by %% or %+ for the most recent job, or by the PID of any of their processes. A finished job stays in the
+// table until its done message has been printed, and a background job is remembered after that, so wait can still collect the
+// status of one that ended a while ago.
+
+/*
+ * NAME
+ *   findJob - look up the job a built in was given
+ * SYNOPSIS
+ *   findJob(char* jobSpec, char* builtinName)
+ * DESCRIPTION
+ *   jobSpec is %n, %%, %+, a PID, or NULL for the most recent job. Jobs run by the parallel builtin aren't visible. Returns the
+ *   slot of the job's leader, or prints an error naming builtinName and returns -1.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int findJob(char* jobSpec, char* builtinName) {
+
+	bool current = (jobSpec == NULL || strcmp(jobSpec, "%%") == 0 || strcmp(jobSpec, "%+") == 0 || strcmp(jobSpec, "%") == 0);
+	int foundSlot = -1;
+
+	if(!current && jobSpec[0] != '%') {		// A PID, which can be any stage of the job
+
+		int slot = isDescriptorNumber(jobSpec) ? findJobSlot((pid_t)atoi(jobSpec)) : -1;
+
+		if(slot != -1 && !jobTable[jobTable[slot].leaderSlot].parallel) {
+			foundSlot = jobTable[slot].leaderSlot;
+		}
+	}
+
+	else {
+
+		int jobNumber = current ? -1 : atoi(jobSpec + 1);
+
+		for(int slot = 0; slot < jobTableCapacity; slot++) {
+
+			if(!jobTable[slot].inUse || jobTable[slot].leaderSlot != slot || jobTable[slot].parallel) {
+				continue;
+			}
+
+			if(current && jobTable[slot].runningStages > 0 && (foundSlot == -1 || jobTable[slot].jobNumber > jobTable[foundSlot].jobNumber)) {
+				foundSlot = slot;
+			}
+
+			else if(!current && jobTable[slot].jobNumber == jobNumber) {
+				foundSlot = slot;
+			}
+		}
+	}
+
+	if(foundSlot == -1) {
+
+		if(current) {
+			printf("%s: no current job\n", builtinName);
+		}
+
+		else {
+			printf("%s: %s: no such job\n", builtinName, jobSpec);
+		}
+
+		fflush(stdout);
+	}
+
+	return foundSlot;
+}
+
+
+
+/*
+ * NAME
+ *   jobExitValue - the exit status a job ended, or stopped, with
+ * SYNOPSIS
+ *   jobExitValue(int leaderSlot)
+ * DESCRIPTION
+ *   The last stage's exit value, 128 plus the signal if it was killed, or 128 plus the stop signal if the job is stopped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int jobExitValue(int leaderSlot) {
+
+	int exitMethod = jobTable[jobTable[leaderSlot].lastStage].exitMethod;
+
+	for(int slot = leaderSlot; slot != -1; slot = jobTable[slot].nextStage) {
+
+		if(jobTable[slot].stopped) {
+			return 128 + WSTOPSIG(jobTable[slot].exitMethod);
+		}
+	}
+
+	if(WIFSIGNALED(exitMethod)) {
+		return 128 + WTERMSIG(exitMethod);
+	}
+
+	return WEXITSTATUS(exitMethod);
+}
+
+
+
+/*
+ * NAME
+ *   compareJobNumbers - qsort() order for listing jobs
+ * SYNOPSIS
+ *   compareJobNumbers(const void* first, const void* second)
+ * DESCRIPTION
+ *   Orders leader slots by job number.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int compareJobNumbers(const void* first, const void* second) {
+
+	return jobTable[*(const int*)first].jobNumber - jobTable[*(const int*)second].jobNumber;
+}
+
+
+
+/*
+ * NAME
+ *   showJobOutput - print what a background job has written, for jobs -o
+ * SYNOPSIS
+ *   showJobOutput(char* jobSpec)
+ * DESCRIPTION
+ *   jobSpec is %n, %%, %+, the job's PID, or NULL for the most recent job with collected output. It's looked up among the collected
+ *   outputs rather than the job table, so a job that finished long ago can still be asked for, and when its number has been
+ *   used again since, %n means the newest job to have it. Whatever is waiting in the pipes is read first. What's printed is
+ *   taken out of the ring, and once the job's pipe is closed too the whole entry is gone.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int showJobOutput(char* jobSpec) {
+
+	bool current = (jobSpec == NULL || strcmp(jobSpec, "%%") == 0 || strcmp(jobSpec, "%+") == 0 || strcmp(jobSpec, "%") == 0);
+	int found = -1;
+
+	readJobOutput();
+
+	for(int index = 0; index < jobOutputCapacity; index++) {
+
+		if(!jobOutputs[index].inUse || (found != -1 && jobOutputs[index].serial < jobOutputs[found].serial)) {
+			continue;		// The most recent job wins
+		}
+
+		if(current || (jobSpec[0] == '%' && atoi(jobSpec + 1) == jobOutputs[index].jobNumber) ||
+				(jobSpec[0] != '%' && isDescriptorNumber(jobSpec) && atoi(jobSpec) == (int)jobOutputs[index].pid)) {
+			found = index;
+		}
+	}
+
+	if(found == -1) {
+		printf("jobs: %s: no collected output\n", current ? "current job" : jobSpec);
+		fflush(stdout);
+		return 1;
+	}
+
+	struct jobOutput* output = &jobOutputs[found];
+
+	if(output->dropped > 0) {
+		printf("(%zu earlier bytes dropped)\n", output->dropped);
+	}
+
+	fflush(stdout);
+
+	size_t start = (output->head + JOB_OUTPUT_RING - output->held) % JOB_OUTPUT_RING;
+	size_t firstPart = (start + output->held > JOB_OUTPUT_RING) ? JOB_OUTPUT_RING - start : output->held;
+
+	if(output->held > 0 && (write(STDOUT_FILENO, output->ring + start, firstPart) == -1 ||
+			write(STDOUT_FILENO, output->ring, output->held - firstPart) == -1)) {
+		return 1;
+	}
+
+	output->held = 0;
+	output->dropped = 0;
+
+	if(output->fd == -1) {		// Nothing more can arrive
+		releaseJobOutput(found);
+	}
+
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   listJobs - the jobs builtin
+ * SYNOPSIS
+ *   jobs [-o [job]]
+ * DESCRIPTION
+ *   Lists every job that's still running or stopped, in job number order. Jobs that have finished are left for the usual done
+ *   message. With -o it prints the output collected from one job instead, see showJobOutput().
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int listJobs(char** argumentArray) {
+
+	if(argumentArray[1] != NULL && strcmp(argumentArray[1], "-o") == 0) {
+		return showJobOutput(argumentArray[2]);
+	}
+
+	int* leaderSlots = malloc(jobTableCapacity * sizeof(int));
+	int leaderCount = 0;
+
+	if(leaderSlots == NULL) {
+		perror("Major problem listing jobs!\n");
+		exit(1);
+	}
+
+	for(int slot = 0; slot < jobTableCapacity; slot++) {
+
+		if(jobTable[slot].inUse && jobTable[slot].leaderSlot == slot && !jobTable[slot].parallel && jobTable[slot].runningStages > 0) {
+			leaderSlots[leaderCount] = slot;
+			leaderCount++;
+		}
+	}
+
+	qsort(leaderSlots, leaderCount, sizeof(int), compareJobNumbers);
+
+	for(int index = 0; index < leaderCount; index++) {
+		printJobLine(leaderSlots[index]);
+	}
+
+	free(leaderSlots);
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   foregroundJob - the fg builtin
+ * SYNOPSIS
+ *   fg [job]
+ * DESCRIPTION
+ *   Moves a background or stopped job to the foreground, continuing it if it was stopped, and waits for it just like a command
+ *   typed at the prompt, so status reports how it ended. With no job the most recent one is used.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int foregroundJob(char** argumentArray) {
+
+	int slot = findJob(argumentArray[1], "fg");
+
+	if(slot == -1) {
+		return 1;
+	}
+
+	if(jobTable[slot].runningStages == 0) {
+		printf("fg: %s: job has terminated\n", argumentArray[1]);
+		fflush(stdout);
+		return 1;
+	}
+
+	printf("%s\n", (jobTable[slot].commandText != NULL) ? jobTable[slot].commandText : "");
+	fflush(stdout);
+
+	jobTable[slot].background = false;		// Its status goes to status now, not a done message
+
+	if(jobStopped(slot)) {
+
+		if(jobControl) {		// Give it the terminal before it wakes up and tries to use it
+			tcsetpgrp(STDIN_FILENO, jobTable[slot].pgid);
+		}
+
+		continueJob(slot);
+	}
+
+	recordForegroundStatus(slot, waitForJob(slot));
+	return 0;
+}
+
+
+
+/*
+ * NAME
+ *   backgroundJob - the bg builtin
+ * SYNOPSIS
+ *   bg [job ...]
+ * DESCRIPTION
+ *   Continues each stopped job in the background. With no job the most recent one is used. Returns 1 if a job couldn't be found.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int backgroundJob(char** argumentArray) {
+
+	int exitStatus = 0;
+	int jobCount = 0;
+
+	while(argumentArray[jobCount + 1] != NULL) {
+		jobCount++;
+	}
+
+	for(int index = 0; index < jobCount || index == 0; index++) {		// argumentArray[1] is NULL for the most recent job
+
+		int slot = findJob(argumentArray[index + 1], "bg");
+
+		if(slot == -1) {
+			exitStatus = 1;
+		}
+
+		else if(jobStopped(slot)) {
+			continueJob(slot);
+			printJobLine(slot);
+		}
+	}
+
+	return exitStatus;
+}
+
+
+
+/*
+ * NAME
+ *   findRememberedJob - look up a finished background job that wait hasn't collected yet
+ * SYNOPSIS
+ *   findRememberedJob(char* jobSpec)
+ * DESCRIPTION
+ *   jobSpec is %n or the PID of the job's leader. Returns the job's index in rememberedJobs, or -1 if it isn't remembered.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int findRememberedJob(char* jobSpec) {
+
+	bool byNumber = (jobSpec[0] == '%');
+
+	if(!isDescriptorNumber(byNumber ? jobSpec + 1 : jobSpec)) {
+		return -1;
+	}
+
+	int number = atoi(byNumber ? jobSpec + 1 : jobSpec);
+
+	for(int index = 0; index < REMEMBERED_JOB_COUNT; index++) {
+
+		if(rememberedJobs[index].pid != 0 && (byNumber ? rememberedJobs[index].jobNumber : (int)rememberedJobs[index].pid) == number) {
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+
+
+/*
+ * NAME
+ *   waitForJobs - the wait builtin
+ * SYNOPSIS
+ *   wait [job ...]
+ * DESCRIPTION
+ *   Blocks until each job given has finished or stopped and returns the exit value of the last one, 127 if it doesn't exist. A
+ *   background job that finished and was reported earlier returns its remembered exit value, once. With no job it waits for every
+ *   background job, forgets the remembered ones and returns 0. The shell sleeps on its signal descriptor the whole time, so
+ *   waiting costs nothing and returns the moment the job is reaped, unlike polling with sleep.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int waitForJobs(char** argumentArray) {
+
+	if(argumentArray[1] == NULL) {
+
+		for(int slot = 0; slot < jobTableCapacity; slot++) {		// Slots can't move, nothing is launched or freed in here
+
+			if(!jobTable[slot].inUse || jobTable[slot].leaderSlot != slot || !jobTable[slot].background || jobTable[slot].parallel) {
+				continue;
+			}
+
+			while(jobTable[slot].runningStages > 0 && !jobStopped(slot) && shutdownSignal == 0) {
+				waitForSignals(-1);
+			}
+		}
+
+		memset(rememberedJobs, 0, sizeof(rememberedJobs));
+		return 0;
+	}
+
+	int exitStatus = 0;
+
+	for(int argument = 1; argumentArray[argument] != NULL; argument++) {
+
+		int remembered = findRememberedJob(argumentArray[argument]);
+
+		if(remembered != -1) {		// Its done message has been printed already
+			exitStatus = rememberedJobs[remembered].exitValue;
+			rememberedJobs[remembered].pid = 0;
+			continue;
+		}
+
+		int slot = findJob(argumentArray[argument], "wait");
+
+		if(slot == -1) {
+			exitStatus = 127;
+			continue;
+		}
+
+		while(jobTable[slot].runningStages > 0 && !jobStopped(slot) && shutdownSignal == 0) {
+			waitForSignals(-1);
+		}
+
+		exitStatus = jobExitValue(slot);
+	}
+
+	return exitStatus;
+}
+
+
+
+// Signals kill knows by name
+
+struct signalName {
+	char* name;
+	int number;
+};
+
+struct signalName signalNames[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+	{"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+	{"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH}, {NULL, 0}
+};
+
+
+
+/*
+ * NAME
+ *   parseSignal - turn a signal name or number into a signal number
+ * SYNOPSIS
+ *   parseSignal(char* text)
+ * DESCRIPTION
+ *   Accepts a number, a name like TERM, or a name with the SIG prefix. Returns -1 if text isn't a signal.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int parseSignal(char* text) {
+
+	if(isDescriptorNumber(text)) {
+		return (atoi(text) < NSIG) ? atoi(text) : -1;
+	}
+
+	if(strncmp(text, "SIG", 3) == 0) {
+		text = text + 3;
+	}
+
+	for(int index = 0; signalNames[index].name != NULL; index++) {
+
+		if(strcmp(signalNames[index].name, text) == 0) {
+			return signalNames[index].number;
+		}
+	}
+
+	return -1;
+}
+
+
+
+/*
+ * NAME
+ *   killJobs - the kill builtin
+ * SYNOPSIS
+ *   kill [-s signal | -signal] job|pid ...
+ *   kill -l
+ * DESCRIPTION
+ *   Sends a signal, SIGTERM unless one is named, to each job or process given. A job is signalled through its process group so
+ *   every stage gets it, and a stopped job sent SIGTERM or SIGHUP is continued too so it can act on it. -l lists the signal names.
+ *   Returns 1 if any target couldn't be signalled.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int killJobs(char** argumentArray) {
+
+	int signalNumber = SIGTERM;
+	int argument = 1;
+
+	if(argumentArray[1] != NULL && strcmp(argumentArray[1], "-l") == 0) {
+
+		for(int index = 0; signalNames[index].name != NULL; index++) {
+			printf("%d) SIG%s\n", signalNames[index].number, signalNames[index].name);
+		}
+
+		fflush(stdout);
+		return 0;
+	}
+
+	if(argumentArray[1] != NULL && strcmp(argumentArray[1], "-s") == 0 && argumentArray[2] != NULL) {
+		signalNumber = parseSignal(argumentArray[2]);
+		argument = 3;
+	}
+
+	else if(argumentArray[1] != NULL && argumentArray[1][0] == '-') {
+		signalNumber = parseSignal(argumentArray[1] + 1);
+		argument = 2;
+	}
+
+	if(signalNumber == -1) {
+		printf("kill: %s: invalid signal\n", argumentArray[argument - 1]);
+		fflush(stdout);
+		return 1;
+	}
+
+	if(argumentArray[argument] == NULL) {
+		printf("kill: usage: kill [-s signal | -signal] job|pid ...\n");
+		fflush(stdout);
+		return 1;
+	}
+
+	int exitStatus = 0;
+
+	for(; argumentArray[argument] != NULL; argument++) {
+
+		char* target = argumentArray[argument];
+
+		if(target[0] == '%') {
+
+			int slot = findJob(target, "kill");
+
+			if(slot == -1 || jobTable[slot].runningStages == 0) {
+				exitStatus = 1;
+				continue;
+			}
+
+			signalJob(slot, signalNumber);
+
+			if(jobStopped(slot) && (signalNumber == SIGTERM || signalNumber == SIGHUP)) {
+				continueJob(slot);
+			}
+		}
+
+		else if(!isDescriptorNumber(target) || kill((pid_t)atoi(target), signalNumber) == -1) {
+			printf("kill: %s: %s\n", target, isDescriptorNumber(target) ? strerror(errno) : "not a job or pid");
+			fflush(stdout);
+			exitStatus = 1;
+		}
+	}
+
+	return exitStatus;
+}
+
+
+
+/*
+ * NAME
+ *   forgetJob - take a job out of the job table and leave it running
+ * SYNOPSIS
+ *   forgetJob(int leaderSlot)
+ * DESCRIPTION
+ *   Frees the slot of every stage. When the processes exit later they're still reaped, recordChildStatus() just doesn't know
+ *   them anymore.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void forgetJob(int leaderSlot) {
+
+	if(jobTable[leaderSlot].remoteHost != -1) {		// Its host won't hear about it finishing
+		remoteHosts[jobTable[leaderSlot].remoteHost].runningJobs--;
+		jobTable[leaderSlot].remoteHost = -1;
+	}
+
+	if(jobTable[leaderSlot].countedBackground) {
+		countBackgroundJob(false);
+	}
+
+	for(int slot = leaderSlot; slot != -1; ) {
+		int nextStage = jobTable[slot].nextStage;
+		removeJob(slot);
+		slot = nextStage;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   disownJobs - the disown builtin
+ * SYNOPSIS
+ *   disown [-a] [job ...]
+ * DESCRIPTION
+ *   Takes each job out of the job table, so it isn't listed or reported anymore and keeps running after the shell exits instead
+ *   of being shut down with the rest. With no job the most recent one is used, and -a takes every job. A job that has already
+ *   finished is left for its done message. Returns 1 if a job couldn't be found.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int disownJobs(char** argumentArray) {
+
+	if(argumentArray[1] != NULL && strcmp(argumentArray[1], "-a") == 0) {
+
+		for(int slot = 0; slot < jobTableCapacity; slot++) {
+
+			if(jobTable[slot].inUse && jobTable[slot].leaderSlot == slot && !jobTable[slot].parallel &&
+					jobTable[slot].runningStages > 0) {
+				forgetJob(slot);
+			}
+		}
+
+		return 0;
+	}
+
+	int exitStatus = 0;
+	int jobCount = 0;
+
+	while(argumentArray[jobCount + 1] != NULL) {
+		jobCount++;
+	}
+
+	for(int index = 0; index < jobCount || index == 0; index++) {		// argumentArray[1] is NULL for the most recent job
+
+		int slot = findJob(argumentArray[index + 1], "disown");
+
+		if(slot == -1) {
+			exitStatus = 1;
+		}
+
+		else if(jobTable[slot].runningStages > 0) {
+			forgetJob(slot);
+		}
+	}
+
+	return exitStatus;
+}
+
+
+
+// Shutting down
+//
+// When the shell exits, every job still in the job table gets a chance to end cleanly: each job's process group is sent SIGTERM,
+// or the signal SMALLSH_EXIT_SIGNAL names, with one kill() per job, and the shell sleeps in its event loop for up to
+// SMALLSH_EXIT_GRACE seconds while they exit. It leaves the moment the last one has been reaped, so jobs that go quietly cost a
+// few milliseconds however many there are. Anything still running after that is sent SIGKILL, then reaped as well so init isn't
+// left with the zombies. SMALLSH_EXIT_GRACE=0 skips straight to SIGKILL. Jobs that should outlive the shell are taken out of the
+// table with disown first.
+
+#define EXIT_GRACE_SECONDS 1.0		// Default for SMALLSH_EXIT_GRACE
+#define EXIT_REAP_MILLISECONDS 1000	// Longest the shell waits for SIGKILLed jobs to be reaped
+
+
+
+/*
+ * NAME
+ *   signalRunningJobs - send a signal to every job that's still running
+ * SYNOPSIS
+ *   signalRunningJobs(int signalNumber)
+ * DESCRIPTION
+ *   One signalJob() per job. Stopped jobs are continued too when the signal isn't SIGKILL, otherwise they couldn't act on it.
+ *   Returns how many jobs were signalled.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int signalRunningJobs(int signalNumber) {
+
+	int signalled = 0;
+
+	for(int slot = 0; slot < jobTableCapacity; slot++) {
+
+		if(!jobTable[slot].inUse || jobTable[slot].leaderSlot != slot || jobTable[slot].runningStages == 0) {
+			continue;
+		}
+
+		signalJob(slot, signalNumber);
+
+		if(signalNumber != SIGKILL && jobStopped(slot)) {
+			continueJob(slot);
+		}
+
+		signalled++;
+	}
+
+	return signalled;
+}
+
+
+
+/*
+ * NAME
+ *   waitForFinishedJobs - sleep until some number of jobs have finished or time runs out
+ * SYNOPSIS
+ *   waitForFinishedJobs(int jobCount, long milliseconds)
+ * DESCRIPTION
+ *   Counts the jobs the done queue gains while it waits, which nothing takes off it during shutdown. Their output keeps being
+ *   collected in the meantime.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void waitForFinishedJobs(int jobCount, long milliseconds) {
+
+	struct pollfd pollFDs[3] = {{signalFD, POLLIN, 0}, {zygoteFD, POLLIN, 0}, {jobOutputEpollFD, POLLIN, 0}};
+	struct timespec now;
+	struct timespec deadline;
+	int doneBefore = doneCount;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += milliseconds / 1000;
+	deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while(doneCount - doneBefore < jobCount) {
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		long remaining = (deadline.tv_sec - now.tv_sec) * 1000L + (deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+
+		if(remaining <= 0) {
+			break;
+		}
+
+		pollFDs[1].fd = zygoteFD;
+		pollFDs[2].fd = jobOutputEpollFD;
+
+		if(poll(pollFDs, 3, (heldZygoteEventCount > 0) ? 0 : (int)remaining) == -1 && errno != EINTR) {
+			perror("Major problem waiting for jobs to exit!\n");
+			exit(1);
+		}
+
+		handleSignals();
+	}
+}
+
+
+
+/*
+ * NAME
+ *   shutDownJobs - end every job that's still running before the shell exits
+ * SYNOPSIS
+ *   shutDownJobs()
+ * DESCRIPTION
+ *   Signals the jobs, gives them the grace period, then kills and reaps whatever is left, as described above. A setting that
+ *   isn't a signal or a number of seconds is ignored. Nothing is printed for the jobs that end.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void shutDownJobs() {
+
+	char* signalSetting = variableValue("SMALLSH_EXIT_SIGNAL");
+	char* graceSetting = variableValue("SMALLSH_EXIT_GRACE");
+	int firstSignal = SIGTERM;
+	double graceSeconds = EXIT_GRACE_SECONDS;
+
+	if(signalSetting != NULL && parseSignal(signalSetting) > 0) {
+		firstSignal = parseSignal(signalSetting);
+	}
+
+	if(graceSetting != NULL && graceSetting[0] != '\0') {
+
+		char* numberEnd;
+		double value = strtod(graceSetting, &numberEnd);
+
+		if(*numberEnd == '\0' && value >= 0) {
+			graceSeconds = value;
+		}
+	}
+
+	unsigned long long shutdownStart = traceClock();
+	int running;
+
+	if(graceSeconds > 0 && (running = signalRunningJobs(firstSignal)) > 0) {
+		waitForFinishedJobs(running, (long)(graceSeconds * 1000));
+	}
+
+	if((running = signalRunningJobs(SIGKILL)) > 0) {
+		waitForFinishedJobs(running, EXIT_REAP_MILLISECONDS);
+	}
+
+	traceEvent("shutdown", shutdownStart);
+}
+
+
+
+// Every built in the shell knows about, adding one only needs an entry here
+
+struct builtinCommand {
+	char* name;
+	int (*run)(char** argumentArray);
+	bool utility;			// Also exists as a program, pipelines and background jobs run that instead
+	bool recordsStatus;		// Exit status is what status reports, like a program's. The original built ins only set $?
+};
+
+struct builtinCommand builtinCommands[] = {
+	{"exit", exitShell, false, false},
+	{"cd", changeDirectory, false, false},
+	{"status", showStatus, false, false},
+	{"set", setOptions, false, false},
+	{"hash", hashCommands, false, false},
+	{"parallel", runParallel, false, true},
+	{"echo", echoArguments, true, true},
+	{"printf", printFormatted, true, true},
+	{"test", testCondition, true, true},
+	{"[", testCondition, true, true},
+	{"true", trueCommand, true, true},
+	{":", trueCommand, false, true},
+	{"false", falseCommand, true, true},
+	{"pwd", printWorkingDirectory, true, true},
+	{"history", showHistory, false, false},
+	{"jobs", listJobs, false, false},
+	{"fg", foregroundJob, false, false},
+	{"bg", backgroundJob, false, false},
+	{"wait", waitForJobs, false, true},
+	{"kill", killJobs, false, true},
+	{"disown", disownJobs, false, true},
+	{"export", exportVariables, false, true},
+	{"unset", unsetVariables, false, true},
+	{"break", breakLoop, false, false},
+	{"continue", continueLoop, false, false},
+	{"return", returnFromFunction, false, false},
+	{NULL, NULL, false, false}
+};
+
+#define BUILTIN_BUCKETS 64		// Power of two, a few times the number of built ins so probes stay short
+
+int builtinIndex[BUILTIN_BUCKETS];	// Open addressed index into builtinCommands, -1 for an empty bucket
+
+
+
+/*
+ * NAME
+ *   indexBuiltins - build the hash index over builtinCommands
+ * SYNOPSIS
+ *   indexBuiltins()
+ * DESCRIPTION
+ *   Called once from main(). Uses the same hash as the command path cache with linear probing.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void indexBuiltins() {
+
+	for(int bucket = 0; bucket < BUILTIN_BUCKETS; bucket++) {
+		builtinIndex[bucket] = -1;
+	}
+
+	for(int command = 0; builtinCommands[command].name != NULL; command++) {
+
+		unsigned int bucket = hashCommandName(builtinCommands[command].name) & (BUILTIN_BUCKETS - 1);
+
+		while(builtinIndex[bucket] != -1) {
+			bucket = (bucket + 1) & (BUILTIN_BUCKETS - 1);
+		}
+
+		builtinIndex[bucket] = command;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   findBuiltin - look up a built in by name
+ * SYNOPSIS
+ *   findBuiltin(char* name)
+ * DESCRIPTION
+ *   One hash and usually a single strcmp(). Returns NULL if name isn't a built in.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+struct builtinCommand* findBuiltin(char* name) {
+
+	unsigned int bucket = hashCommandName(name) & (BUILTIN_BUCKETS - 1);
+
+	while(builtinIndex[bucket] != -1) {
+
+		if(strcmp(builtinCommands[builtinIndex[bucket]].name, name) == 0) {
+			return &builtinCommands[builtinIndex[bucket]];
+		}
+
+		bucket = (bucket + 1) & (BUILTIN_BUCKETS - 1);
+	}
+
+	return NULL;
+}
+
+
+
+/*
+ * NAME
+ *   recordExitValue - make an exit value what status and $? report
+ * SYNOPSIS
+ *   recordExitValue(int exitValue)
+ * DESCRIPTION
+ *   For commands that ran inside the shell, as if a program had exited with it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void recordExitValue(int exitValue) {
+
+	noForegroundProcessesRun = false;
+	builtinExitValue = -1;
+	killedByExit = true;
+	killedBySignal = false;
+	exitStatusCode = exitValue;
+}
+
+
+
+/*
+ * NAME
+ *   runBuiltin - run a built in inside the shell with its redirection
+ * SYNOPSIS
+ *   runBuiltin(struct builtinCommand* builtin, char** argumentArray, bool* isOperator, int lastIndex)
+ * DESCRIPTION
+ *   The command's redirections are applied to the shell's own descriptors for as long as the built in runs, then the originals
+ *   are put back, so nothing is forked. The exit status is always what $? says next, it's recorded for status too if the built in
+ *   asks for that, and it's returned.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int runBuiltin(struct builtinCommand* builtin, char** argumentArray, bool* isOperator, int lastIndex) {
+
+	struct pipelineStage stage;
+	int exitStatus = 1;
+
+	lineRedirectionCount = 0;
+
+	if(findRedirections(argumentArray, isOperator, 0, lastIndex, &stage)) {
+
+		fflush(stdout);		// Anything already buffered belongs to the old stdout
+
+		if(applyRedirections(&stage, true)) {
+			exitStatus = builtin->run(stage.arguments);
+		}
+
+		fflush(stdout);
+		restoreRedirections(&stage);
+	}
+
+	if(builtin->recordsStatus) {		// Behave like the program it stands in for
+		recordExitValue(exitStatus);
+	}
+
+	else {		// status still shows the last foreground command, $? agrees with && and ||
+		builtinExitValue = exitStatus;
+	}
+
+	return exitStatus;
+}
+
+
+
+// Line editor
+//
+// At a terminal the shell reads prompt lines itself, with the terminal in raw mode only while a line is being typed, instead of
+// taking whatever the terminal driver hands over. The arrow keys, Home, End and the usual emacs control keys move and edit, up
+// and down walk the history ring, ^C throws the line away and ^Z still toggles foreground-only mode. Tab completes the word
+// under the cursor: the first word of a command from the built ins, the functions and the PATH index, anything else as a file
+// name. When there's nothing more to add every match is listed. The line is drawn with a single write() after each batch of
+// keys, scrolled sideways when it doesn't fit. With set +o edit, or TERM=dumb, lines are read the old way.
+
+#define EDITOR_EDITING 0		// What handleKey() says about the line
+#define EDITOR_DONE 1			// Enter was pressed
+#define EDITOR_EOF 2			// ^D on an empty line
+#define EDITOR_LIST_LIMIT 500		// More matches than this are only counted
+
+struct tokenArena editorLine = {NULL, 0, 0};		// What's been typed so far, without a '\0'
+size_t editorCursor = 0;				// Byte offset of the cursor in editorLine
+struct tokenArena editorSavedLine = {NULL, 0, 0};	// The new line, kept while up and down show older ones
+size_t editorHistoryPosition = 0;			// Ring entry being shown, historyRingCount for the new line
+struct tokenArena editorOutput = {NULL, 0, 0};		// One redraw of the line
+int editorEscapeState = 0;				// 1 after ESC, 2 inside an ESC [ or ESC O sequence
+int editorEscapeNumber = 0;				// Number in the sequence so far, for ESC [ 3 ~ and the like
+unsigned char editorPending[256];			// Keys that came after Enter in the same read(), like the rest of a paste
+size_t editorPendingCount = 0;
+
+struct tokenArena completionText = {NULL, 0, 0};	// Every match for the current Tab, each with its '\0'
+size_t* completionOffsets = NULL;			// Where each match starts in completionText
+char** completionMatches = NULL;			// The same, as pointers once completionText has stopped growing
+size_t completionCount = 0;
+size_t completionCapacity = 0;
+
+char* commandPrefixWords[] = {"if", "then", "else", "elif", "do", "while", "until", "!", "{", "time", "limit", "cache", NULL};
+
+
+
+/*
+ * NAME
+ *   editorColumns - how many terminal columns some text takes
+ * SYNOPSIS
+ *   editorColumns(char* text, size_t length)
+ * DESCRIPTION
+ *   Counts one column for every character, so the bytes that continue a UTF-8 sequence aren't counted.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t editorColumns(char* text, size_t length) {
+
+	size_t columns = 0;
+
+	for(size_t index = 0; index < length; index++) {
+
+		if((text[index] & 0xC0) != 0x80) {
+			columns++;
+		}
+	}
+
+	return columns;
+}
+
+
+
+/*
+ * NAME
+ *   nextCharacter - step over one character of the line being edited
+ * SYNOPSIS
+ *   nextCharacter(size_t position, int direction)
+ * DESCRIPTION
+ *   Returns the offset of the character after position, or before it when direction is negative, keeping UTF-8 sequences whole.
+ *   Stops at either end of the line.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t nextCharacter(size_t position, int direction) {
+
+	if(direction < 0) {
+
+		while(position > 0) {
+
+			position--;
+
+			if((editorLine.text[position] & 0xC0) != 0x80) {
+				break;
+			}
+		}
+
+		return position;
+	}
+
+	while(position < editorLine.used) {
+
+		position++;
+
+		if(position == editorLine.used || (editorLine.text[position] & 0xC0) != 0x80) {
+			break;
+		}
+	}
+
+	return position;
+}
+
+
+
+/*
+ * NAME
+ *   nextWord - find where a word movement ends
+ * SYNOPSIS
+ *   nextWord(size_t position, int direction)
+ * DESCRIPTION
+ *   Skips spaces and then the word after them, backwards when direction is negative. Used by ^W and by ESC b and ESC f.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+size_t nextWord(size_t position, int direction) {
+
+	if(direction < 0) {
+
+		while(position > 0 && editorLine.text[position - 1] == ' ') {
+			position--;
+		}
+
+		while(position > 0 && editorLine.text[position - 1] != ' ') {
+			position--;
+		}
+
+		return position;
+	}
+
+	while(position < editorLine.used && editorLine.text[position] == ' ') {
+		position++;
+	}
+
+	while(position < editorLine.used && editorLine.text[position] != ' ') {
+		position++;
+	}
+
+	return position;
+}
+
+
+
+/*
+ * NAME
+ *   refreshLine - draw the prompt and the line being edited
+ * SYNOPSIS
+ *   refreshLine()
+ * DESCRIPTION
+ *   Redraws the whole terminal line in one write() and puts the cursor back where it belongs. When the line is wider than the
+ *   terminal only the part around the cursor is shown.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void refreshLine() {
+
+	struct winsize terminalSize;
+	size_t width = 80;
+
+	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &terminalSize) == 0 && terminalSize.ws_col > 0) {
+		width = terminalSize.ws_col;
+	}
+
+	size_t promptColumns = editorColumns(promptText, strlen(promptText));
+	size_t cursorColumn = promptColumns + editorColumns(editorLine.text, editorCursor);
+	size_t first = 0;		// First byte shown
+
+	while(cursorColumn >= width && first < editorCursor) {		// Scroll so the cursor is on screen
+		first = nextCharacter(first, 1);
+		cursorColumn--;
+	}
+
+	size_t last = first;		// One past the last byte shown
+	size_t shownColumns = promptColumns;
+
+	while(last < editorLine.used && shownColumns + 1 < width) {
+		last = nextCharacter(last, 1);
+		shownColumns++;
+	}
+
+	char moveCursor[32];
+	int moveLength = snprintf(moveCursor, sizeof(moveCursor), "\x1b[%zuC", cursorColumn);
+
+	editorOutput.used = 0;
+	arenaPut(&editorOutput, '\r');
+	arenaPutString(&editorOutput, promptText, strlen(promptText));
+	arenaPutString(&editorOutput, editorLine.text + first, last - first);
+	arenaPutString(&editorOutput, "\x1b[K\r", 4);		// Clear whatever was left of a longer line, then back to the start
+
+	if(cursorColumn > 0) {
+		arenaPutString(&editorOutput, moveCursor, moveLength);
+	}
+
+	fflush(stdout);
+
+	writeFully(STDOUT_FILENO, editorOutput.text, editorOutput.used);		// If the terminal went away, reading the next key finds out
+}
+
+
+
+/*
+ * NAME
+ *   insertText - put text into the line at the cursor
+ * SYNOPSIS
+ *   insertText(char* text, size_t length)
+ * DESCRIPTION
+ *   The cursor ends up after the new text.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void insertText(char* text, size_t length) {
+
+	size_t tailLength = editorLine.used - editorCursor;
+
+	arenaPutString(&editorLine, text, length);		// Grows the line, the copy at the end is then moved to the cursor
+
+	memmove(editorLine.text + editorCursor + length, editorLine.text + editorCursor, tailLength);
+	memcpy(editorLine.text + editorCursor, text, length);
+	editorCursor = editorCursor + length;
+}
+
+
+
+/*
+ * NAME
+ *   deleteText - remove part of the line
+ * SYNOPSIS
+ *   deleteText(size_t from, size_t to)
+ * DESCRIPTION
+ *   Removes the bytes from from up to to and keeps the cursor on the same character, or at from if it was inside what went.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void deleteText(size_t from, size_t to) {
+
+	if(to <= from) {
+		return;
+	}
+
+	memmove(editorLine.text + from, editorLine.text + to, editorLine.used - to);
+	editorLine.used = editorLine.used - (to - from);
+
+	if(editorCursor >= to) {
+		editorCursor = editorCursor - (to - from);
+	}
+
+	else if(editorCursor > from) {
+		editorCursor = from;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   replaceLine - make the line being edited some other text
+ * SYNOPSIS
+ *   replaceLine(char* text, size_t length)
+ * DESCRIPTION
+ *   Used for walking the history. The cursor goes to the end.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void replaceLine(char* text, size_t length) {
+
+	editorLine.used = 0;
+	editorCursor = 0;
+	insertText(text, length);
+}
+
+
+
+/*
+ * NAME
+ *   stepHistory - show an older or newer line from the history ring
+ * SYNOPSIS
+ *   stepHistory(int direction)
+ * DESCRIPTION
+ *   Up (direction -1) goes back one line, down (1) forward one, and going forward past the newest line brings back what was
+ *   being typed. Only lines still in the ring can be reached.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void stepHistory(int direction) {
+
+	size_t oldest = (historyRingCount > HISTORY_RING_SIZE) ? historyRingCount - HISTORY_RING_SIZE : 0;
+
+	if(direction < 0) {
+
+		if(editorHistoryPosition <= oldest) {
+			return;
+		}
+
+		if(editorHistoryPosition == historyRingCount) {		// Leaving the new line, keep it for coming back
+			editorSavedLine.used = 0;
+			arenaPutString(&editorSavedLine, editorLine.text, editorLine.used);
+		}
+
+		editorHistoryPosition--;
+	}
+
+	else {
+
+		if(editorHistoryPosition >= historyRingCount) {
+			return;
+		}
+
+		editorHistoryPosition++;
+	}
+
+	if(editorHistoryPosition == historyRingCount) {
+		replaceLine(editorSavedLine.text, editorSavedLine.used);
+	}
+
+	else {
+		char* entry = historyRing[editorHistoryPosition % HISTORY_RING_SIZE];
+		replaceLine(entry, strlen(entry));
+	}
+}
+
+
+
+/*
+ * NAME
+ *   addCompletion - remember one match for the word being completed
+ * SYNOPSIS
+ *   addCompletion(char* name, size_t length, bool directory)
+ * DESCRIPTION
+ *   Directories get a / on the end, so completing one leaves the cursor ready for the next part of the path.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void addCompletion(char* name, size_t length, bool directory) {
+
+	if(completionCount == completionCapacity) {
+
+		completionCapacity = (completionCapacity == 0) ? 256 : completionCapacity * 2;
+		completionOffsets = realloc(completionOffsets, completionCapacity * sizeof(size_t));
+		completionMatches = realloc(completionMatches, completionCapacity * sizeof(char*));
+
+		if(completionOffsets == NULL || completionMatches == NULL) {
+			perror("Major problem growing the completion list!\n");
+			exit(1);
+		}
+	}
+
+	completionOffsets[completionCount] = completionText.used;
+	completionCount++;
+
+	arenaPutString(&completionText, name, length);
+
+	if(directory) {
+		arenaPut(&completionText, '/');
+	}
+
+	arenaPut(&completionText, '\0');
+}
+
+
+
+/*
+ * NAME
+ *   completeCommand - collect the commands a word could be the start of
+ * SYNOPSIS
+ *   completeCommand(char* prefix, size_t prefixLength)
+ * DESCRIPTION
+ *   Built ins, functions and every name in the PATH index starting with prefix. The index is brought up to date first, which
+ *   only rereads PATH directories that changed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void completeCommand(char* prefix, size_t prefixLength) {
+
+	for(int command = 0; builtinCommands[command].name != NULL; command++) {
+
+		if(strncmp(builtinCommands[command].name, prefix, prefixLength) == 0) {
+			addCompletion(builtinCommands[command].name, strlen(builtinCommands[command].name), false);
+		}
+	}
+
+	for(int bucket = 0; bucket < FUNCTION_BUCKETS; bucket++) {
+
+		for(struct shellFunction* function = functionBuckets[bucket]; function != NULL; function = function->next) {
+
+			if(strncmp(function->name, prefix, prefixLength) == 0) {
+				addCompletion(function->name, strlen(function->name), false);
+			}
+		}
+	}
+
+	refreshPathIndex();
+
+	for(int index = 0; index < pathDirectoryCount; index++) {
+
+		struct pathDirectory* directory = &pathDirectories[index];
+
+		for(size_t position = firstIndexedName(directory, prefix); position < directory->nameCount; position++) {
+
+			if(strncmp(directory->names[position], prefix, prefixLength) != 0) {
+				break;
+			}
+
+			addCompletion(directory->names[position], strlen(directory->names[position]), false);
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   completeFile - collect the file names a word could be the start of
+ * SYNOPSIS
+ *   completeFile(char* word, size_t directoryLength)
+ * DESCRIPTION
+ *   The first directoryLength characters of word, up to and including its last /, name the directory to look in, the current
+ *   one when there are none, and the rest is the prefix. Names starting with a dot only match a prefix that does too.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void completeFile(char* word, size_t directoryLength) {
+
+	char directoryPath[4096];
+	char* prefix = word + directoryLength;
+	size_t prefixLength = strlen(prefix);
+
+	if(directoryLength == 0) {
+		snprintf(directoryPath, sizeof(directoryPath), ".");
+	}
+
+	else {
+		snprintf(directoryPath, sizeof(directoryPath), "%.*s", (int)directoryLength, word);
+	}
+
+	DIR* stream = opendir(directoryPath);
+
+	if(stream == NULL) {
+		return;
+	}
+
+	struct dirent* entry;
+
+	while((entry = readdir(stream)) != NULL) {
+
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || (entry->d_name[0] == '.' && prefix[0] != '.')) {
+			continue;
+		}
+
+		if(strncmp(entry->d_name, prefix, prefixLength) != 0) {
+			continue;
+		}
+
+		bool directory = (entry->d_type == DT_DIR);
+		struct stat fileInfo;
+
+		if((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && fstatat(dirfd(stream), entry->d_name, &fileInfo, 0) == 0) {
+			directory = S_ISDIR(fileInfo.st_mode);		// Only matches pay for a stat(), and only when readdir() can't tell
+		}
+
+		addCompletion(entry->d_name, strlen(entry->d_name), directory);
+	}
+
+	closedir(stream);
+}
+
+
+
+/*
+ * NAME
+ *   listCompletions - print every match under the line being edited
+ * SYNOPSIS
+ *   listCompletions()
+ * DESCRIPTION
+ *   Lays the matches out in columns down the screen like ls does, then draws the prompt and the line again below them. More
+ *   than EDITOR_LIST_LIMIT matches are only counted.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void listCompletions() {
+
+	struct winsize terminalSize;
+	size_t width = 80;
+	size_t widest = 0;
+
+	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &terminalSize) == 0 && terminalSize.ws_col > 0) {
+		width = terminalSize.ws_col;
+	}
+
+	printf("\n");
+
+	if(completionCount > EDITOR_LIST_LIMIT) {
+		printf("%zu possibilities\n", completionCount);
+	}
+
+	else {
+
+		for(size_t index = 0; index < completionCount; index++) {
+
+			size_t columns = editorColumns(completionMatches[index], strlen(completionMatches[index]));
+
+			if(columns > widest) {
+				widest = columns;
+			}
+		}
+
+		size_t perRow = width / (widest + 2);
+
+		if(perRow == 0) {
+			perRow = 1;
+		}
+
+		size_t rows = (completionCount + perRow - 1) / perRow;
+
+		for(size_t row = 0; row < rows; row++) {
+
+			for(size_t index = row; index < completionCount; index = index + rows) {
+
+				char* match = completionMatches[index];
+				size_t padding = (index + rows < completionCount) ? widest + 2 - editorColumns(match, strlen(match)) : 0;
+
+				printf("%s%*s", match, (int)padding, "");
+			}
+
+			printf("\n");
+		}
+	}
+
+	refreshLine();
+}
+
+
+
+/*
+ * NAME
+ *   completeWord - what Tab does
+ * SYNOPSIS
+ *   completeWord()
+ * DESCRIPTION
+ *   Works out where the word under the cursor starts, following quotes and backslashes the way the lexer will, and whether it's
+ *   in command position: first on the line or after |, &, ; or (, or after a reserved word, a prefix like time or limit, or an
+ *   assignment. Words there without a / are completed as commands, everything else as file names. The word is then replaced with
+ *   the longest prefix all the matches share, escaped with backslashes where the lexer needs it, and a single match gets a space
+ *   after it. When there's nothing to add the matches are listed instead, and with none at all the terminal beeps.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void completeWord() {
+
+	unsigned long long completeStart = traceClock();
+	size_t wordStart = 0;
+	bool commandPosition = true;
+	char quote = '\0';
+
+	for(size_t index = 0; index < editorCursor; index++) {
+
+		char character = editorLine.text[index];
+
+		if(quote != '\0') {
+
+			if(character == quote) {
+				quote = '\0';
+			}
+
+			continue;
+		}
+
+		if(character == '\\') {
+			index++;
+			continue;
+		}
+
+		if(character == '\'' || character == '"') {
+			quote = character;
+			continue;
+		}
+
+		if(character != ' ' && character != '\t' && strchr("|&;()<>", character) == NULL) {
+			continue;
+		}
+
+		if(index > wordStart && commandPosition) {		// A word just ended, see if the next one is still a command
+
+			bool keepsPosition = (memchr(editorLine.text + wordStart, '=', index - wordStart) != NULL);
+
+			for(int word = 0; commandPrefixWords[word] != NULL && !keepsPosition; word++) {
+
+				keepsPosition = (strlen(commandPrefixWords[word]) == index - wordStart &&
+						strncmp(editorLine.text + wordStart, commandPrefixWords[word], index - wordStart) == 0);
+			}
+
+			commandPosition = keepsPosition;
+		}
+
+		if(character == '<' || character == '>') {		// A file name comes next
+			commandPosition = false;
+		}
+
+		else if(character != ' ' && character != '\t') {
+			commandPosition = true;
+		}
+
+		wordStart = index + 1;
+	}
+
+
+	// The word as the command will see it, without its quotes and backslashes
+
+	char word[4096];
+	size_t wordLength = 0;
+
+	for(size_t index = wordStart; index < editorCursor; index++) {
+
+		char character = editorLine.text[index];
+
+		if(character == '\'' || character == '"') {
+			continue;
+		}
+
+		if(character == '\\' && index + 1 < editorCursor) {
+			index++;
+			character = editorLine.text[index];
+		}
+
+		else if(character == '$' || wordLength == sizeof(word) - 1) {		// No telling what an expansion will be
+
+			printf("\a");
+			fflush(stdout);
+			return;
+		}
+
+		word[wordLength] = character;
+		wordLength++;
+	}
+
+	word[wordLength] = '\0';
+
+	completionText.used = 0;
+	completionCount = 0;
+
+	char* lastSlash = strrchr(word, '/');
+	size_t directoryLength = (lastSlash != NULL) ? (size_t)(lastSlash - word) + 1 : 0;
+
+	if(commandPosition && lastSlash == NULL) {
+		completeCommand(word, wordLength);
+	}
+
+	else {
+		completeFile(word, directoryLength);
+	}
+
+	for(size_t index = 0; index < completionCount; index++) {
+		completionMatches[index] = completionText.text + completionOffsets[index];
+	}
+
+	qsort(completionMatches, completionCount, sizeof(char*), compareNames);
+
+	size_t uniqueCount = 0;		// A program in two PATH directories, or a built in that's also a program, is listed once
+
+	for(size_t index = 0; index < completionCount; index++) {
+
+		if(uniqueCount == 0 || strcmp(completionMatches[uniqueCount - 1], completionMatches[index]) != 0) {
+			completionMatches[uniqueCount] = completionMatches[index];
+			uniqueCount++;
+		}
+	}
+
+	completionCount = uniqueCount;
+
+	if(completionCount == 0) {
+
+		printf("\a");
+		fflush(stdout);
+		traceEvent("complete", completeStart);
+		return;
+	}
+
+	char* first = completionMatches[0];		// Sorted, so what the first and last share every match shares
+	char* last = completionMatches[completionCount - 1];
+	size_t prefixLength = wordLength - directoryLength;
+	size_t commonLength = 0;
+
+	while(first[commonLength] != '\0' && first[commonLength] == last[commonLength]) {
+		commonLength++;
+	}
+
+	while(commonLength > prefixLength && (first[commonLength] & 0xC0) == 0x80) {		// Only whole characters
+		commonLength--;
+	}
+
+	if(completionCount > 1 && commonLength <= prefixLength) {
+
+		listCompletions();
+		traceEvent("complete", completeStart);
+		return;
+	}
+
+	deleteText(wordStart, editorCursor);
+
+	for(size_t index = 0; index < directoryLength + commonLength; index++) {
+
+		char character = (index < directoryLength) ? word[index] : first[index - directoryLength];
+
+		if(strchr(" \t\\'\"$|&;()<>*?[#", character) != NULL) {
+			insertText("\\", 1);
+		}
+
+		insertText(&character, 1);
+	}
+
+	if(completionCount == 1 && (commonLength == 0 || first[commonLength - 1] != '/')) {
+		insertText(" ", 1);
+	}
+
+	traceEvent("complete", completeStart);
+}
+
+
+
+/*
+ * NAME
+ *   handleKey - act on one byte typed at the prompt
+ * SYNOPSIS
+ *   handleKey(unsigned char key)
+ * DESCRIPTION
+ *   Edits the line for printable characters and control keys, and follows ESC [ and ESC O sequences for the arrow, Home, End
+ *   and Delete keys across calls. Returns EDITOR_DONE for Enter, EDITOR_EOF for ^D on an empty line and EDITOR_EDITING for
+ *   everything else.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int handleKey(unsigned char key) {
+
+	if(editorEscapeState == 1) {		// Just had ESC
+
+		editorEscapeState = (key == '[' || key == 'O') ? 2 : 0;
+		editorEscapeNumber = 0;
+
+		if(key == 'b' || key == 'f') {
+			editorCursor = nextWord(editorCursor, (key == 'b') ? -1 : 1);
+		}
+
+		return EDITOR_EDITING;
+	}
+
+	if(editorEscapeState == 2) {
+
+		if(key >= '0' && key <= '9') {
+			editorEscapeNumber = editorEscapeNumber * 10 + (key - '0');
+			return EDITOR_EDITING;
+		}
+
+		if(key == ';') {		// Modifiers, like ESC [ 1 ; 5 C for ^Right, move the same way
+			editorEscapeNumber = 0;
+			return EDITOR_EDITING;
+		}
+
+		editorEscapeState = 0;
+
+		if(key == 'A') {
+			stepHistory(-1);
+		}
+
+		else if(key == 'B') {
+			stepHistory(1);
+		}
+
+		else if(key == 'C') {
+			editorCursor = nextCharacter(editorCursor, 1);
+		}
+
+		else if(key == 'D') {
+			editorCursor = nextCharacter(editorCursor, -1);
+		}
+
+		else if(key == 'H' || (key == '~' && (editorEscapeNumber == 1 || editorEscapeNumber == 7))) {
+			editorCursor = 0;
+		}
+
+		else if(key == 'F' || (key == '~' && (editorEscapeNumber == 4 || editorEscapeNumber == 8))) {
+			editorCursor = editorLine.used;
+		}
+
+		else if(key == '~' && editorEscapeNumber == 3) {
+			deleteText(editorCursor, nextCharacter(editorCursor, 1));
+		}
+
+		return EDITOR_EDITING;
+	}
+
+	switch(key) {
+
+		case '\r':
+		case '\n':
+			return EDITOR_DONE;
+
+		case 4:		// ^D
+			if(editorLine.used == 0) {
+				return EDITOR_EOF;
+			}
+
+			deleteText(editorCursor, nextCharacter(editorCursor, 1));
+			break;
+
+		case 127:	// Backspace
+		case 8:		// ^H
+			deleteText(nextCharacter(editorCursor, -1), editorCursor);
+			break;
+
+		case 1:		// ^A
+			editorCursor = 0;
+			break;
+
+		case 5:		// ^E
+			editorCursor = editorLine.used;
+			break;
+
+		case 2:		// ^B
+			editorCursor = nextCharacter(editorCursor, -1);
+			break;
+
+		case 6:		// ^F
+			editorCursor = nextCharacter(editorCursor, 1);
+			break;
+
+		case 11:	// ^K
+			deleteText(editorCursor, editorLine.used);
+			break;
+
+		case 21:	// ^U
+			deleteText(0, editorCursor);
+			break;
+
+		case 23:	// ^W
+			deleteText(nextWord(editorCursor, -1), editorCursor);
+			break;
+
+		case 16:	// ^P
+			stepHistory(-1);
+			break;
+
+		case 14:	// ^N
+			stepHistory(1);
+			break;
+
+		case 12:	// ^L
+			printf("\x1b[H\x1b[2J");
+			break;
+
+		case 3:		// ^C, start over on a new line
+			editorCursor = editorLine.used;
+			refreshLine();
+			printf("^C\n");
+			editorLine.used = 0;
+			editorCursor = 0;
+			editorHistoryPosition = historyRingCount;
+			break;
+
+		case 26:	// ^Z, the signal descriptor picks it up like it would from the terminal
+			kill(getpid(), SIGTSTP);
+			break;
+
+		case 9:		// Tab
+			completeWord();
+			break;
+
+		case 27:	// ESC
+			editorEscapeState = 1;
+			break;
+
+		default:
+			if(key >= 32) {
+				insertText((char*)&key, 1);
+			}
+	}
+
+	return EDITOR_EDITING;
+}
+
+
+
+/*
+ * NAME
+ *   editLine - read one line from the terminal with the line editor
+ * SYNOPSIS
+ *   editLine(struct inputReader* reader)
+ * DESCRIPTION
+ *   Called by readInputLine() in place of read() once main() has set it as lineEditor, after the prompt has been printed. Puts
+ *   the terminal in raw mode, handles keys until Enter, puts the terminal back the way it was, and appends the line and a newline
+ *   to the reader's buffer, so the rest of the shell sees exactly what a read() would have given it. Keys typed or pasted after
+ *   the Enter are kept for the next line. Messages about background jobs are printed above the line, which is then drawn again.
+ *   Returns the number of bytes added, or 0 at ^D on an empty line.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int editLine(struct inputReader* reader) {
+
+	struct termios savedModes;
+
+	if(tcgetattr(STDIN_FILENO, &savedModes) == -1) {		// Not a terminal after all
+		waitForInput(STDIN_FILENO);
+		return (shutdownSignal != 0) ? 0 : read(STDIN_FILENO, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+	}
+
+	struct termios rawModes = savedModes;
+	rawModes.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	rawModes.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);		// ^C and ^Z come in as keys, output still turns \n into \r\n
+	rawModes.c_cc[VMIN] = 1;
+	rawModes.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &rawModes);
+
+	editorLine.used = 0;
+	editorCursor = 0;
+	editorHistoryPosition = historyRingCount;
+	editorEscapeState = 0;
+
+	unsigned char keys[sizeof(editorPending)];
+	int lineState = EDITOR_EDITING;
+
+	fflush(stdout);
+
+	if(indexedPATH == NULL) {		// The user is still reading the prompt, a better time than the first Tab
+		refreshPathIndex();
+	}
+
+	while(lineState == EDITOR_EDITING) {
+
+		size_t keyCount = editorPendingCount;
+
+		if(keyCount > 0) {
+			memcpy(keys, editorPending, keyCount);
+			editorPendingCount = 0;
+		}
+
+		else {
+
+			editorWaiting = true;
+			bool lineCleared = waitForInput(STDIN_FILENO);
+			editorWaiting = false;
+
+			if(shutdownSignal != 0) {
+				lineState = EDITOR_EOF;
+				break;
+			}
+
+			if(lineCleared) {
+				refreshLine();
+				continue;
+			}
+
+			ssize_t numCharsRead = read(STDIN_FILENO, keys, sizeof(keys));
+
+			if(numCharsRead == -1 && errno == EINTR) {
+				continue;
+			}
+
+			if(numCharsRead <= 0) {
+				lineState = EDITOR_EOF;
+				break;
+			}
+
+			keyCount = numCharsRead;
+		}
+
+		size_t index = 0;
+
+		while(index < keyCount && lineState == EDITOR_EDITING) {
+			lineState = handleKey(keys[index]);
+			index++;
+		}
+
+		memcpy(editorPending, keys + index, keyCount - index);
+		editorPendingCount = keyCount - index;
+
+		if(lineState == EDITOR_DONE) {
+			editorCursor = editorLine.used;		// Leave the whole line on the screen
+		}
+
+		refreshLine();
+	}
+
+	printf("\n");
+	fflush(stdout);
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &savedModes);
+
+	if(lineState == EDITOR_EOF) {
+		return 0;
+	}
+
+	while(reader->capacity - reader->end - 1 < editorLine.used + 1) {		// Still room for the '\0' readInputLine() may add
+
+		reader->capacity = reader->capacity * 2;
+		reader->buffer = realloc(reader->buffer, reader->capacity);
+
+		if(reader->buffer == NULL) {
+			perror("Major problem growing the input buffer!\n");
+			exit(1);
+		}
+	}
+
+	memcpy(reader->buffer + reader->end, editorLine.text, editorLine.used);
+	reader->buffer[reader->end + editorLine.used] = '\n';
+
+	return (int)editorLine.used + 1;
+}
+
+
+
+// Output cache
+//
+// "cache command ..." runs a deterministic command once and replays its stdout and exit status from then on without forking.
+// Entries are keyed by a hash of everything the output could depend on: the working directory, each stage's arguments and
+// redirections, the program each stage resolves to and any argument or input file that exists, by device, inode, size and
+// mtime, so editing an input or upgrading the program is a miss. "cache env=LANG,TZ command" adds those variables to the key.
+// Each entry is one file in SMALLSH_CACHE_DIR (default ~/.cache/smallsh) holding a header, the full key, which is compared on
+// every hit so a hash collision can never replay the wrong output, and the output itself. A hit streams it out with sendfile(),
+// and a miss copies the output out as the command writes it. Either way the redirection files are opened once, by the shell.
+// A file's mtime is when its entry was last used, and after every new entry the least recently used ones are removed until the
+// directory fits in SMALLSH_CACHE_SIZE bytes (64 MB by default). Background jobs, lines with heredocs and built ins run normally.
+
+#define CACHE_MAGIC "smlcach1"
+
+struct cacheHeader {
+	char magic[8];
+	int exitStatus;
+	unsigned int keyLength;		// The key follows the header, then the output
+};
+
+struct tokenArena cacheKey = {NULL, 0, 0};	// Key of the command being looked up, rebuilt for every cached command
+char* cacheEnvironmentNames = NULL;		// From cache env=..., comma separated
+char cacheDirectory[4096] = "";			// Worked out the first time cache is used
+long long cacheSizeLimit = 64LL << 20;
+
+
+
+/*
+ * NAME
+ *   appendCacheKey - add bytes to the key being built
+ * SYNOPSIS
+ *   appendCacheKey(void* bytes, size_t length)
+ * DESCRIPTION
+ *   Grows cacheKey as needed and appends length bytes.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void appendCacheKey(void* bytes, size_t length) {
+
+	if(cacheKey.used + length > cacheKey.capacity) {
+
+		size_t newCapacity = (cacheKey.capacity == 0) ? 4096 : cacheKey.capacity;
+
+		while(cacheKey.used + length > newCapacity) {
+			newCapacity = newCapacity * 2;
+		}
+
+		cacheKey.text = realloc(cacheKey.text, newCapacity);
+		if(cacheKey.text == NULL) {
+			perror("Major problem growing the cache key!\n");
+			exit(1);
+		}
+
+		cacheKey.capacity = newCapacity;
+	}
+
+	memcpy(cacheKey.text + cacheKey.used, bytes, length);
+	cacheKey.used += length;
+}
+
+
+
+/*
+ * NAME
+ *   appendFileIdentity - add what identifies a version of a file to the key
+ * SYNOPSIS
+ *   appendFileIdentity(char* path)
+ * DESCRIPTION
+ *   Adds the device, inode, size and nanosecond mtime of path if it's a regular file, or nothing if it isn't one.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void appendFileIdentity(char* path) {
+
+	struct stat fileInfo;
+
+	if(path == NULL || stat(path, &fileInfo) == -1 || !S_ISREG(fileInfo.st_mode)) {
+		return;
+	}
+
+	long long identity[5] = {(long long)fileInfo.st_dev, (long long)fileInfo.st_ino, (long long)fileInfo.st_size,
+			(long long)fileInfo.st_mtim.tv_sec, (long long)fileInfo.st_mtim.tv_nsec};
+
+	appendCacheKey("F", 1);
+	appendCacheKey(identity, sizeof(identity));
+}
+
+
+
+/*
+ * NAME
+ *   buildCacheKey - work out the key of a pipeline
+ * SYNOPSIS
+ *   buildCacheKey(struct pipelineStage* stages, int stageCount)
+ * DESCRIPTION
+ *   Fills cacheKey with the working directory, the selected environment variables and, for every stage, its resolved program,
+ *   arguments and redirections, with the identity of each of those that names a file. Returns false if the working directory
+ *   can't be found, since then nothing about the command can be trusted to be the same.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool buildCacheKey(struct pipelineStage* stages, int stageCount) {
+
+	char directory[4096];
+
+	if(getcwd(directory, sizeof(directory)) == NULL) {
+		return false;
+	}
+
+	cacheKey.used = 0;
+	appendCacheKey(directory, strlen(directory) + 1);
+
+	for(char* name = cacheEnvironmentNames; name != NULL && *name != '\0'; ) {
+
+		size_t nameLength = strcspn(name, ",");
+		char variableName[256];
+
+		snprintf(variableName, sizeof(variableName), "%.*s", (int)nameLength, name);
+		char* value = variableValue(variableName);
+
+		appendCacheKey(variableName, strlen(variableName) + 1);
+		appendCacheKey((value != NULL) ? value : "", (value != NULL) ? strlen(value) + 1 : 0);
+		appendCacheKey((value != NULL) ? "=" : "-", 1);
+
+		name = name + nameLength + (name[nameLength] == ',');
+	}
+
+	for(int stage = 0; stage < stageCount; stage++) {
+
+		appendCacheKey("|", 1);
+		appendFileIdentity(lookupCommandPath(stages[stage].arguments[0]));
+
+		for(char** argument = stages[stage].arguments; *argument != NULL; argument++) {
+			appendCacheKey(*argument, strlen(*argument) + 1);
+			appendFileIdentity(*argument);
+		}
+
+		for(size_t index = 0; index < stages[stage].redirectionCount; index++) {
+
+			struct redirection* redirection = &lineRedirections[stages[stage].firstRedirection + index];
+			int shape[4] = {redirection->fd, redirection->kind, redirection->flags, redirection->sourceFD};
+
+			appendCacheKey(shape, sizeof(shape));
+
+			if(redirection->fileName != NULL) {
+				appendCacheKey(redirection->fileName, strlen(redirection->fileName) + 1);
+				appendFileIdentity(redirection->fileName);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   openCacheDirectory - find or create the cache directory
+ * SYNOPSIS
+ *   openCacheDirectory()
+ * DESCRIPTION
+ *   Uses SMALLSH_CACHE_DIR, then XDG_CACHE_HOME/smallsh, then HOME/.cache/smallsh, creating it if needed, and reads the size
+ *   limit from SMALLSH_CACHE_SIZE. Returns a descriptor for the directory, or -1 if there's nowhere to keep a cache.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int openCacheDirectory() {
+
+	if(cacheDirectory[0] == '\0') {
+
+		char* directory = variableValue("SMALLSH_CACHE_DIR");
+		char* sizeSetting = variableValue("SMALLSH_CACHE_SIZE");
+
+		if(directory != NULL) {
+			snprintf(cacheDirectory, sizeof(cacheDirectory), "%s", directory);
+		}
+
+		else if(variableValue("XDG_CACHE_HOME") != NULL) {
+			snprintf(cacheDirectory, sizeof(cacheDirectory), "%s/smallsh", variableValue("XDG_CACHE_HOME"));
+		}
+
+		else if(variableValue("HOME") != NULL) {
+			char parent[4000];		// Leaves room for /smallsh
+			snprintf(parent, sizeof(parent), "%s/.cache", variableValue("HOME"));
+			mkdir(parent, 0700);
+			snprintf(cacheDirectory, sizeof(cacheDirectory), "%s/smallsh", parent);
+		}
+
+		else {
+			return -1;
+		}
+
+		if(sizeSetting != NULL && atoll(sizeSetting) > 0) {
+			cacheSizeLimit = atoll(sizeSetting);
+		}
+
+		mkdir(cacheDirectory, 0700);
+	}
+
+	return open(cacheDirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+
+
+/*
+ * NAME
+ *   copyCachedOutput - send the output part of an entry to a descriptor
+ * SYNOPSIS
+ *   copyCachedOutput(int entryFD, off_t offset, int outputFD)
+ * DESCRIPTION
+ *   Copies from offset to the end of the entry with sendfile(), so the bytes never pass through the shell. Falls back to read()
+ *   and write() for a destination sendfile() won't take. outputFD of -1 means the command's stdout was closed, so nothing is sent.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void copyCachedOutput(int entryFD, off_t offset, int outputFD) {
+
+	struct stat entryInfo;
+
+	if(outputFD == -1 || fstat(entryFD, &entryInfo) == -1) {
+		return;
+	}
+
+	fflush(stdout);		// Keep anything the shell printed before the replay in order
+
+	while(offset < entryInfo.st_size) {
+
+		ssize_t sent = sendfile(outputFD, entryFD, &offset, entryInfo.st_size - offset);
+
+		if(sent > 0) {
+			continue;
+		}
+
+		if(sent == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if(sent == -1 && (errno == EINVAL || errno == ENOSYS)) {		// Destination can't take sendfile()
+
+			char buffer[65536];
+			ssize_t bytesRead;
+
+			while((bytesRead = pread(entryFD, buffer, sizeof(buffer), offset)) > 0) {
+
+				if(write(outputFD, buffer, bytesRead) != bytesRead) {
+					return;
+				}
+
+				offset += bytesRead;
+			}
+		}
+
+		return;
+	}
+}
+
+
+
+/*
+ * NAME
+ *   closeCacheRedirections - close what openCacheRedirections() opened
+ * SYNOPSIS
+ *   closeCacheRedirections(int* openedFDs, size_t redirectionCount)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void closeCacheRedirections(int* openedFDs, size_t redirectionCount) {
+
+	for(size_t index = 0; index < redirectionCount; index++) {
+
+		if(openedFDs[index] != -1) {
+			close(openedFDs[index]);
+		}
+	}
+}
+
+
+
+/*
+ * NAME
+ *   openCacheRedirections - open a cached command's redirection files in the shell
+ * SYNOPSIS
+ *   openCacheRedirections(struct pipelineStage* stage, int* openedFDs, int* outputFD)
+ * DESCRIPTION
+ *   Opens every file the last stage redirects to, in the order written, and turns each of those redirections into a dup of the
+ *   shell's descriptor, so the command and a replay share one open file the way the command's own descriptors would. Nothing is
+ *   opened twice, so cache cmd >out 2>&1 truncates out once and the replay writes after what the command wrote to stderr.
+ *   openedFDs gets the descriptor opened for each redirection, -1 for the others, and outputFD the shell's descriptor the
+ *   command's stdout ends up at, -1 if it's closed. Returns false with nothing left open if a file can't be opened, so the
+ *   command can run normally and report it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool openCacheRedirections(struct pipelineStage* stage, int* openedFDs, int* outputFD) {
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+
+		openedFDs[index] = -1;
+
+		if(redirection->kind != REDIRECT_OPEN) {
+			continue;
+		}
+
+		openedFDs[index] = open(redirection->fileName, redirection->flags | O_CLOEXEC, 0777);
+
+		if(openedFDs[index] == -1) {
+			closeCacheRedirections(openedFDs, index);
+			return false;
+		}
+	}
+
+
+	// Everything is open, only now change the list, following where each of the command's low descriptors ends up
+
+	int commandFDs[10];
+
+	for(int fd = 0; fd < 10; fd++) {
+		commandFDs[fd] = fd;
+	}
+
+	for(size_t index = 0; index < stage->redirectionCount; index++) {
+
+		struct redirection* redirection = &lineRedirections[stage->firstRedirection + index];
+		int shellFD = -1;
+
+		if(redirection->kind == REDIRECT_OPEN) {
+			redirection->kind = REDIRECT_DUP;
+			redirection->sourceFD = openedFDs[index];
+			shellFD = openedFDs[index];
+		}
+
+		else if(redirection->kind == REDIRECT_DUP) {
+			shellFD = (redirection->sourceFD < 10) ? commandFDs[redirection->sourceFD] : redirection->sourceFD;
+		}
+
+		if(redirection->fd < 10) {
+			commandFDs[redirection->fd] = shellFD;
+		}
+	}
+
+	*outputFD = commandFDs[1];
+	return true;
+}
+
+
+
+// One file in the cache directory, as seen by evictCacheEntries()
+
+struct cacheEntry {
+	char name[24];
+	long long lastUsed;		// Nanoseconds
+	long long size;
+};
+
+
+
+/*
+ * NAME
+ *   compareCacheEntries - qsort() order for eviction, least recently used first
+ * SYNOPSIS
+ *   compareCacheEntries(const void* first, const void* second)
+ * DESCRIPTION
+ *   Orders entries by their mtime, which is bumped on every hit.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int compareCacheEntries(const void* first, const void* second) {
+
+	long long firstUsed = ((const struct cacheEntry*)first)->lastUsed;
+	long long secondUsed = ((const struct cacheEntry*)second)->lastUsed;
+
+	return (firstUsed > secondUsed) - (firstUsed < secondUsed);
+}
+
+
+
+/*
+ * NAME
+ *   evictCacheEntries - shrink the cache directory to its size limit
+ * SYNOPSIS
+ *   evictCacheEntries(int directoryFD)
+ * DESCRIPTION
+ *   Adds up the size of every entry and removes the least recently used ones until the total fits in cacheSizeLimit. Only run
+ *   after a new entry is stored, so hits never pay for it. Other shells sharing the directory are fine, an entry that's already
+ *   gone is just skipped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void evictCacheEntries(int directoryFD) {
+
+	DIR* directory = fdopendir(dup(directoryFD));
+
+	if(directory == NULL) {
+		return;
+	}
+
+	struct cacheEntry* entries = NULL;
+	size_t entryCount = 0;
+	size_t entryCapacity = 0;
+	long long totalSize = 0;
+	struct dirent* directoryEntry;
+
+	while((directoryEntry = readdir(directory)) != NULL) {
+
+		struct stat entryInfo;
+
+		if(directoryEntry->d_name[0] == '.' || strlen(directoryEntry->d_name) >= sizeof(entries[0].name) ||
+				fstatat(directoryFD, directoryEntry->d_name, &entryInfo, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(entryInfo.st_mode)) {
+			continue;
+		}
+
+		if(entryCount == entryCapacity) {
+
+			entryCapacity = (entryCapacity == 0) ? 64 : entryCapacity * 2;
+			entries = realloc(entries, entryCapacity * sizeof(struct cacheEntry));
+
+			if(entries == NULL) {
+				perror("Major problem listing the cache!\n");
+				exit(1);
+			}
+		}
+
+		snprintf(entries[entryCount].name, sizeof(entries[entryCount].name), "%s", directoryEntry->d_name);
+		entries[entryCount].lastUsed = (long long)entryInfo.st_mtim.tv_sec * 1000000000LL + entryInfo.st_mtim.tv_nsec;
+		entries[entryCount].size = (long long)entryInfo.st_size;
+		totalSize += entries[entryCount].size;
+		entryCount++;
+	}
+
+	closedir(directory);
+
+	if(totalSize > cacheSizeLimit) {
+
+		qsort(entries, entryCount, sizeof(struct cacheEntry), compareCacheEntries);
+
+		for(size_t index = 0; index < entryCount && totalSize > cacheSizeLimit; index++) {
+
+			unlinkat(directoryFD, entries[index].name, 0);
+			totalSize -= entries[index].size;
+		}
+	}
+
+	free(entries);
+}
+
+
+
+/*
+ * NAME
+ *   runCachedJob - run a foreground pipeline through the output cache
+ * SYNOPSIS
+ *   runCachedJob(struct pipelineStage* stages, int stageCount, bool timeCommand, char* commandText)
+ * DESCRIPTION
+ *   The last stage's redirection files are opened first, by openCacheRedirections(). On a hit the stored output is replayed into
+ *   the descriptor the command's stdout would have been and the stored exit status recorded, and nothing is forked. On a miss the
+ *   pipeline is launched with the last stage's stdout sent through the cache tee, which copies it out and into an unnamed O_TMPFILE
+ *   in the cache directory as it arrives. If the command exited rather than being killed or stopped the capture is linked into
+ *   place as the new entry. Returns false without running anything if there's no usable cache directory or a redirection file
+ *   can't be opened, so the caller can run the pipeline normally. commandText is the line, for jobs if the command gets stopped.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool runCachedJob(struct pipelineStage* stages, int stageCount, bool timeCommand, char* commandText) {
+
+	if(!buildCacheKey(stages, stageCount)) {
+		return false;
+	}
+
+	unsigned long long keyHash = 14695981039346656037ULL;		// 64 bit FNV-1a, the same hash hashCommandName() uses at 32
+
+	for(size_t index = 0; index < cacheKey.used; index++) {
+		keyHash = (keyHash ^ (unsigned char)cacheKey.text[index]) * 1099511628211ULL;
+	}
+
+	char entryName[24];
+	snprintf(entryName, sizeof(entryName), "%016llx", keyHash);
+
+	int directoryFD = openCacheDirectory();
+
+	if(directoryFD == -1) {
+		return false;
+	}
+
+	struct pipelineStage* lastStage = &stages[stageCount - 1];
+	int openedFDs[lastStage->redirectionCount + 1];
+	int outputFD;
+
+	if(!openCacheRedirections(lastStage, openedFDs, &outputFD)) {
+		close(directoryFD);
+		return false;
+	}
+
+	struct cacheHeader header;
+	int entryFD = openat(directoryFD, entryName, O_RDONLY | O_CLOEXEC);
+
+	if(entryFD != -1 && pread(entryFD, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, CACHE_MAGIC, 8) == 0 &&
+			header.keyLength == cacheKey.used) {
+
+		char* storedKey = malloc(header.keyLength + 1);
+
+		if(storedKey != NULL && pread(entryFD, storedKey, header.keyLength, sizeof(header)) == (ssize_t)header.keyLength &&
+				memcmp(storedKey, cacheKey.text, header.keyLength) == 0) {
+
+			free(storedKey);
+			futimens(entryFD, NULL);		// Most recently used now
+			copyCachedOutput(entryFD, sizeof(header) + header.keyLength, outputFD);
+			closeCacheRedirections(openedFDs, lastStage->redirectionCount);
+			close(entryFD);
+			close(directoryFD);
+
+			memset(&lastForegroundUsage, 0, sizeof(lastForegroundUsage));
+			noForegroundProcessesRun = false;
+			builtinExitValue = -1;
+			exitStatusCode = header.exitStatus;
+			killedByExit = true;
+			killedBySignal = false;
+
+			if(timeCommand) {
+				printJobUsage(&lastForegroundUsage, false);
+			}
+
+			return true;
+		}
+
+		free(storedKey);
+	}
+
+	if(entryFD != -1) {
+		close(entryFD);
+	}
+
+
+	// Miss, run it with stdout going through the shell into a new entry
+
+	// A cached command that was stopped still has the tee, so this one runs uncached
+
+	size_t userRedirections = lastStage->redirectionCount;
+	int captureFD = (cacheTeeFD == -1) ? openat(directoryFD, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600) : -1;
+	int teeFDs[2] = {-1, -1};
+
+	memcpy(header.magic, CACHE_MAGIC, 8);
+	header.exitStatus = 0;
+	header.keyLength = cacheKey.used;
+
+	if(captureFD == -1 || write(captureFD, &header, sizeof(header)) != sizeof(header) ||
+			write(captureFD, cacheKey.text, cacheKey.used) != (ssize_t)cacheKey.used || pipe2(teeFDs, O_CLOEXEC) == -1) {
+
+		if(captureFD != -1) {
+			close(captureFD);
+		}
+
+		closeCacheRedirections(openedFDs, userRedirections);
+		close(directoryFD);
+		return false;
+	}
+
+	fcntl(teeFDs[0], F_SETFL, O_NONBLOCK);
+	cacheTeeFD = teeFDs[0];
+	cacheTeeOutputFD = (outputFD == -1) ? -1 : fcntl(outputFD, F_DUPFD_CLOEXEC, 3);
+	cacheTeeCaptureFD = captureFD;
+
+	addRedirection(1, REDIRECT_DUP, 0, NULL, teeFDs[1]);		// The last stage's run is at the end of the list, so this extends it
+	lastStage->redirectionCount++;
+
+	int leaderSlot = launchJob(stages, stageCount, false, false);
+	setJobCommand(leaderSlot, commandText);
+
+	close(teeFDs[1]);		// The command has its copies now, so end of file means it's done writing
+	closeCacheRedirections(openedFDs, userRedirections);
+
+	int exitMethod = waitForJob(leaderSlot);
+	bool captured = false;
+
+	if(WIFSTOPPED(exitMethod)) {		// The rest of its output still goes out from the prompt, but it isn't stored
+		cacheTeeCaptureFD = -1;
+	}
+
+	else {
+		pumpCacheTee(true);		// Whatever it wrote right before exiting, anything still writing is cut off
+		captured = (cacheTeeCaptureFD == captureFD);
+		cacheTeeCaptureFD = -1;
+
+		if(cacheTeeFD != -1) {
+			closeCacheTee();
+		}
+	}
+
+	if(WIFEXITED(exitMethod) && captured) {
+
+		char temporaryName[40];
+		char capturePath[64];
+
+		header.exitStatus = WEXITSTATUS(exitMethod);
+		snprintf(temporaryName, sizeof(temporaryName), ".%s.%d", entryName, (int)getpid());
+		snprintf(capturePath, sizeof(capturePath), "/proc/self/fd/%d", captureFD);
+
+		if(pwrite(captureFD, &header, sizeof(header), 0) == sizeof(header) &&
+				linkat(AT_FDCWD, capturePath, directoryFD, temporaryName, AT_SYMLINK_FOLLOW) == 0) {
+
+			if(renameat(directoryFD, temporaryName, directoryFD, entryName) == -1) {		// Replaces an entry another shell just stored
+				unlinkat(directoryFD, temporaryName, 0);
+			}
+
+			evictCacheEntries(directoryFD);
+		}
+	}
+
+	close(captureFD);
+	close(directoryFD);
+
+	if(timeCommand && !WIFSTOPPED(exitMethod)) {
+		printJobUsage(&lastForegroundUsage, false);
+	}
+
+	recordForegroundStatus(leaderSlot, exitMethod);
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   joinWords - the words of a command as one line of text
+ * SYNOPSIS
+ *   joinWords(char** words, int count)
+ * DESCRIPTION
+ *   What jobs and fg show for a job. The text is in a buffer that's reused by the next call.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+char* joinWords(char** words, int count) {
+
+	static struct tokenArena joined = {NULL, 0, 0};
+
+	joined.used = 0;
+
+	for(int index = 0; index < count; index++) {
+
+		if(index > 0) {
+			arenaPut(&joined, ' ');
+		}
+
+		arenaPutString(&joined, words[index], strlen(words[index]));
+	}
+
+	arenaPut(&joined, '\0');
+
+	return joined.text;
+}
+
+
+
+/*
+ * NAME
+ *   runSimpleCommand - run one expanded pipeline
+ * SYNOPSIS
+ *   runSimpleCommand(char** argumentArray, bool* isOperator, int tokenCount)
+ * DESCRIPTION
+ *   Gets the words of a simple command from expandWords(), with any heredoc bodies already staged. A line of nothing but
+ *   NAME=value words sets shell variables. Otherwise it checks to see if user asked for a built in command (one lookup in
+ *   builtinCommands), and if not, the command is launched as a job in either foreground or background mode (if & is last
+ *   argument). Foreground jobs are waited for, and whether they exited or were killed by a signal is stored for later retrieval
+ *   by the status command. A leading time keyword reports what the command used once it finishes, for background jobs that
+ *   happens when the job's done message is printed. Timing a built in reports the shell's own usage while it ran. limit and cache
+ *   prefixes are handled here too. Returns the command's exit value for if, while, && and ||: a built in's own, a foreground
+ *   job's as $? has it, 0 for a background job, 1 if the command couldn't be run and 2 for a built in other than a utility in a
+ *   pipeline or the background.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int runSimpleCommand(char** argumentArray, bool* isOperator, int tokenCount) {
+
+	int lastIndex;		// Used to check for the presence of & in entered command
+	int exitValue = 0;
+
+	unsigned long long dispatchStart = traceClock();
+
+	char* commandText = joinWords(argumentArray, tokenCount);	// Before the prefixes come off and the stages get split
+
+
+	int assignmentCount = 0;		// NAME=value words at the start of the line
+
+	while(assignmentCount < tokenCount && !isOperator[assignmentCount] && strchr(argumentArray[assignmentCount], '=') != NULL &&
+			isVariableName(argumentArray[assignmentCount], strchr(argumentArray[assignmentCount], '=') - argumentArray[assignmentCount])) {
+		assignmentCount++;
+	}
+
+	if(assignmentCount > 0 && assignmentCount == tokenCount) {		// The whole line is assignments, set them in the shell
+
+		for(int index = 0; index < assignmentCount; index++) {
+
+			size_t nameLength = strchr(argumentArray[index], '=') - argumentArray[index];
+			char name[nameLength + 1];		// The word can't be split in place, it may be the tree's own token
+
+			memcpy(name, argumentArray[index], nameLength);
+			name[nameLength] = '\0';
+			setVariable(name, argumentArray[index] + nameLength + 1, false);
+		}
+
+		closeHeredocs();
+		return 0;
+	}
+
+
+	bool timeCommand = false;		// time keyword in front of the command
+	bool launchedJob = false;
+	struct timespec builtinStart;
+	struct rusage builtinUsageBefore;
+
+	if(tokenCount > 1 && !isOperator[0] && strcmp(argumentArray[0], "time\0") == 0 && !isOperator[1]) {
+
+		timeCommand = true;
+		argumentArray++;		// Drop the keyword, the rest of the line is the command
+		isOperator++;
+		tokenCount--;
+
+		clock_gettime(CLOCK_MONOTONIC, &builtinStart);
+		getrusage(RUSAGE_SELF, &builtinUsageBefore);
+	}
+
+
+	clearLaunchLimits();
+	bool cacheCommand = false;		// cache keyword, look the output up before running anything
+
+	if(!isOperator[0] && strcmp(argumentArray[0], "limit\0") == 0) {		// Limits for whatever the rest of the line launches
+
+		int settingCount = parseLaunchLimits(argumentArray + 1, isOperator + 1, tokenCount - 1);
+
+		if(settingCount == -1) {		// Already reported
+			closeHeredocs();
+			recordExitValue(1);
+			return 1;
+		}
+
+		argumentArray = argumentArray + settingCount + 1;
+		isOperator = isOperator + settingCount + 1;
+		tokenCount = tokenCount - settingCount - 1;
+
+		if(tokenCount == 0 || isOperator[0]) {
+			printf("limit: usage: limit [cpu=N] [as=N] [nofile=N] [nproc=N] [cgroup=dir] command\n");
+			fflush(stdout);
+			closeHeredocs();
+			return 1;
+		}
+	}
+
+
+	if(!isOperator[0] && strcmp(argumentArray[0], "cache\0") == 0) {
+
+		cacheCommand = true;
+		cacheEnvironmentNames = NULL;
+		argumentArray++;
+		isOperator++;
+		tokenCount--;
+
+		if(tokenCount > 0 && !isOperator[0] && strncmp(argumentArray[0], "env=", 4) == 0) {		// Variables the output depends on
+			cacheEnvironmentNames = argumentArray[0] + 4;
+			argumentArray++;
+			isOperator++;
+			tokenCount--;
+		}
+
+		if(tokenCount == 0 || isOperator[0]) {
+			printf("cache: usage: cache [env=NAME,...] command\n");
+			fflush(stdout);
+			closeHeredocs();
+			return 1;
+		}
+	}
+
+
+	int remoteHost = -1;		// on HOST, the command's words run there through ssh
+
+	if(!isOperator[0] && strcmp(argumentArray[0], "on\0") == 0) {
+
+		if(tokenCount == 1) {
+			closeHeredocs();
+			return listRemoteHosts();
+		}
+
+		int commandCount = tokenCount - 2;		// What comes after the host list
+
+		remoteHost = isOperator[1] ? -1 : pickRemoteHost(argumentArray[1]);
+		tokenCount = (remoteHost == -1) ? -1 : remoteCommand(argumentArray + 2, isOperator + 2, commandCount, remoteHost);
+
+		if(tokenCount == -1) {
+			printf("on: usage: on host[,host...] command\n");
+			fflush(stdout);
+			closeHeredocs();
+			recordExitValue(1);
+			return 1;
+		}
+
+		int connectedHost = pickConnectedHost(argumentArray[1]);		// The words were checked first, so a typo costs no ssh
+
+		if(connectedHost < 0) {		// ssh already said why
+			closeHeredocs();
+			recordExitValue(255);		// As if ssh had been run by hand
+			return 255;
+		}
+
+		if(connectedHost != remoteHost) {		// The first pick was down
+			remoteHost = connectedHost;
+			tokenCount = remoteCommand(argumentArray + 2, isOperator + 2, commandCount, remoteHost);
+		}
+
+		argumentArray = remoteArguments.items;
+		isOperator = remoteArguments.isOperator;
+	}
+
+
+	struct builtinCommand* builtin = (isOperator[0] || remoteHost != -1) ? NULL : findBuiltin(argumentArray[0]);	// One lookup instead of a strcmp() per built in
+	lastIndex = tokenCount - 1;		// The lexer already knows where the array ends
+
+	if(builtin != NULL && launchLimitsActive && builtin->run != runParallel) {		// Limits are for children, not the shell
+
+		if(!builtin->utility) {
+			printf("limit: %s is a built in\n", argumentArray[0]);
+			fflush(stdout);
+			closeHeredocs();
+			return 1;
+		}
+
+		builtin = NULL;		// Run the program instead
+	}
+
+	if(builtin != NULL) {		// Only a plain foreground command runs in the shell
+
+		bool runsInBackground = isOperator[lastIndex] && strcmp(argumentArray[lastIndex], "&\0") == 0;
+
+		for(int index = 0; index <= lastIndex; index++) {
+
+			if(isOperator[index] && strcmp(argumentArray[index], "|\0") == 0) {
+				builtin = NULL;		// Part of a pipeline
+			}
+		}
+
+		if(runsInBackground && !turnOffBackground) {
+			builtin = NULL;
+		}
+
+		else if(runsInBackground) {		// Foreground-only mode, the & is ignored
+			argumentArray[lastIndex] = NULL;
+			lastIndex = lastIndex - 1;
+		}
+	}
+
+
+	if(builtin != NULL) {
+
+		countMetric(METRIC_BUILTINS, 1);
+		exitValue = runBuiltin(builtin, argumentArray, isOperator, lastIndex);
+	}
+
+	else {		// We need to create a child process
+
+		launchedJob = true;
+		traceEvent("dispatch", dispatchStart);		// Time spent ruling out the built ins
+
+
+		bool isBackground = false;
+
+		if(isOperator[lastIndex] && strcmp(argumentArray[lastIndex], "&\0") == 0) {	// Find and remove the &, it only counts if background commands are allowed
+
+			isBackground = !turnOffBackground;
+			argumentArray[lastIndex] = NULL;
+			lastIndex = lastIndex - 1;
+		}
+
+
+		int stageCount = splitPipeline(argumentArray, isOperator, lastIndex);
+
+		if(stageCount == -1) {		// Already reported
+			closeHeredocs();
+			return 1;
+		}
+
+		struct pipelineStage* stages = pipelineStages;	// Filled in by splitPipeline()
+
+		for(int stage = 0; stage < stageCount && (stageCount > 1 || isBackground); stage++) {
+
+			struct builtinCommand* stageBuiltin = findBuiltin(stages[stage].arguments[0]);
+
+			if(stageBuiltin != NULL && !stageBuiltin->utility) {		// There's no program to run instead
+				printf("syntax error: %s is a built in, it can't be %s\n", stages[stage].arguments[0],
+						(stageCount > 1) ? "part of a pipeline" : "run in the background");
+				fflush(stdout);
+				closeHeredocs();
+				recordExitValue(2);
+				return 2;
+			}
+		}
+
+		if(cacheCommand && !isBackground && heredocCount == 0 && runCachedJob(stages, stageCount, timeCommand, commandText)) {
+			exitValue = lastExitValue();		// Replayed from the cache, or run and stored
+		}
+
+		else if(isBackground) {		// Run the command in background mode, will NOT wait for it immediately
+
+			int leaderSlot = launchJob(stages, stageCount, true, true);
+			jobTable[leaderSlot].timed = timeCommand;	// Reported along with the done message
+			countRemoteJob(leaderSlot, remoteHost);
+			setJobCommand(leaderSlot, commandText);
+			lastBackgroundPID = jobTable[leaderSlot].pid;
+			printf("background pid is %d\n", (int)jobTable[leaderSlot].pid);
+			fflush(stdout);
+		}
+
+
+		else {					// Run the command in foreground mode
+
+			int leaderSlot = launchJob(stages, stageCount, false, false);
+
+			setJobCommand(leaderSlot, commandText);	// For jobs and fg if it gets stopped
+			countRemoteJob(leaderSlot, remoteHost);
+
+			unsigned long long waitStart = traceClock();
+
+			int exitMethod = waitForJob(leaderSlot);	// Parent waits here until the job is done or stopped
+
+			traceEvent("wait", waitStart);
+
+			if(timeCommand && !WIFSTOPPED(exitMethod)) {
+				printJobUsage(&lastForegroundUsage, false);
+			}
+
+			recordForegroundStatus(leaderSlot, exitMethod);
+			exitValue = lastExitValue();
+
+			if(WIFSIGNALED(exitMethod) && WTERMSIG(exitMethod) == SIGINT) {		// ^C stops a loop or a list along with the command
+				lineInterrupted = true;
+			}
+		}
+
+	}
+
+
+	closeHeredocs();
+
+	if(!launchedJob) {
+		traceEvent("builtin", dispatchStart);		// Finding the built in and running it
+	}
+
+	if(timeCommand && !launchedJob) {		// Timed a built in, it ran inside the shell itself
+
+		struct timespec builtinEnd;
+		struct rusage builtinUsageAfter;
+		struct jobUsage builtinUsage;
+
+		clock_gettime(CLOCK_MONOTONIC, &builtinEnd);
+		getrusage(RUSAGE_SELF, &builtinUsageAfter);
+
+		builtinUsage.wallSeconds = (builtinEnd.tv_sec - builtinStart.tv_sec) + (builtinEnd.tv_nsec - builtinStart.tv_nsec) / 1e9;
+		builtinUsage.usage = builtinUsageAfter;
+		timersub(&builtinUsageAfter.ru_utime, &builtinUsageBefore.ru_utime, &builtinUsage.usage.ru_utime);
+		timersub(&builtinUsageAfter.ru_stime, &builtinUsageBefore.ru_stime, &builtinUsage.usage.ru_stime);
+		builtinUsage.usage.ru_nvcsw -= builtinUsageBefore.ru_nvcsw;
+		builtinUsage.usage.ru_nivcsw -= builtinUsageBefore.ru_nivcsw;
+
+		printJobUsage(&builtinUsage, false);
+	}
+
+	return exitValue;
+}
+
+
+
+// Redirections applied to the shell itself for a function call or a compound command, kept so they can be undone
+
+struct shellRedirections {
+	struct pipelineStage stage;		// The command's words and redirections
+	struct redirection* redirections;	// Copy of the redirections, whatever runs in between reuses lineRedirections
+	struct lineMark mark;			// Line arena from before the copy, released by restoreShell()
+};
+
+
+
+/*
+ * NAME
+ *   redirectShell - apply the redirections in commandWords to the shell's own descriptors
+ * SYNOPSIS
+ *   redirectShell(int wordCount, struct shellRedirections* saved)
+ * DESCRIPTION
+ *   Same as a built in's redirections, except they have to stay in place while other commands run, so the saved descriptors
+ *   are copied out of lineRedirections into the line arena. The remaining words are left in saved->stage.arguments. Returns
+ *   false after reporting a redirection that couldn't be made, with nothing changed.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool redirectShell(int wordCount, struct shellRedirections* saved) {
+
+	lineRedirectionCount = 0;
+	saved->redirections = NULL;
+	saved->mark = lineArenaMark();
+
+	if(!findRedirections(commandWords.items, commandWords.isOperator, 0, wordCount - 1, &saved->stage)) {
+		closeHeredocs();
+		return false;
+	}
+
+	fflush(stdout);		// Anything already buffered belongs to the old stdout
+
+	if(!applyRedirections(&saved->stage, true)) {
+		restoreRedirections(&saved->stage);
+		closeHeredocs();
+		return false;
+	}
+
+	closeHeredocs();		// Already copied onto the descriptors they're for
+
+	if(saved->stage.redirectionCount > 0) {
+
+		saved->redirections = lineAllocate(saved->stage.redirectionCount * sizeof(struct redirection));
+		memcpy(saved->redirections, lineRedirections + saved->stage.firstRedirection, saved->stage.redirectionCount * sizeof(struct redirection));
+	}
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   restoreShell - undo redirectShell()
+ * SYNOPSIS
+ *   restoreShell(struct shellRedirections* saved)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void restoreShell(struct shellRedirections* saved) {
+
+	fflush(stdout);
+
+	if(saved->stage.redirectionCount > 0) {		// Put the saved descriptors back where restoreRedirections() looks for them
+
+		memcpy(lineRedirections, saved->redirections, saved->stage.redirectionCount * sizeof(struct redirection));
+		saved->stage.firstRedirection = 0;
+		restoreRedirections(&saved->stage);
+	}
+
+	lineArenaRelease(saved->mark);		// The copy, and anything allocated after it while the shell was redirected
+}
+
+
+
+// What a function call changes, so it can all be put back when the call returns
+
+struct functionCall {
+	struct shellRedirections redirected;
+	char** savedParameters;
+	int savedCount;
+	int savedLoopDepth;
+	struct syntaxTree* tree;		// Held for as long as the body runs
+};
+
+
+
+/*
+ * NAME
+ *   startFunctionCall - set up for running a function's body
+ * SYNOPSIS
+ *   startFunctionCall(struct shellFunction* function, int wordCount, struct functionCall* call)
+ * DESCRIPTION
+ *   The call's words are in commandWords. Its redirections are applied to the shell for the whole body and the rest of the words
+ *   become $1 and up. break and continue can't reach loops outside the function. A function can't be part of a pipeline or run
+ *   in the background since there's no separate process to run it in, or nest more than FUNCTION_DEPTH_LIMIT calls deep. Returns
+ *   false after reporting why the call can't be made.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool startFunctionCall(struct shellFunction* function, int wordCount, struct functionCall* call) {
+
+	if(functionDepth >= FUNCTION_DEPTH_LIMIT) {
+		printf("%s: functions nested too deeply\n", commandWords.items[0]);
+		fflush(stdout);
+		closeHeredocs();
+		return false;
+	}
+
+	for(int index = 0; index < wordCount; index++) {
+
+		if(commandWords.isOperator[index] && (strcmp(commandWords.items[index], "|\0") == 0 || strcmp(commandWords.items[index], "&\0") == 0)) {
+			printf("%s: a function can't be part of a pipeline or a background job\n", commandWords.items[0]);
+			fflush(stdout);
+			closeHeredocs();
+			return false;
+		}
+	}
+
+	if(!redirectShell(wordCount, &call->redirected)) {
+		return false;
+	}
+
+	char** arguments = call->redirected.stage.arguments + 1;
+	int argumentCount = 0;
+
+	while(arguments[argumentCount] != NULL) {
+		argumentCount++;
+	}
+
+	call->savedParameters = positionalParameters;
+	call->savedCount = positionalCount;
+	positionalParameters = copyWords(arguments, argumentCount, true);		// Goes when restoreShell() releases the line arena
+	positionalCount = argumentCount;
+
+	call->savedLoopDepth = loopDepth;
+	loopDepth = 0;
+	functionDepth++;
+
+	call->tree = function->tree;
+	call->tree->useCount++;		// The function could be redefined while it runs
+
+	return true;
+}
+
+
+
+/*
+ * NAME
+ *   finishFunctionCall - undo what startFunctionCall() did
+ * SYNOPSIS
+ *   finishFunctionCall(struct functionCall* call)
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void finishFunctionCall(struct functionCall* call) {
+
+	releaseTree(call->tree);
+
+	functionDepth--;
+	loopDepth = call->savedLoopDepth;
+
+	positionalParameters = call->savedParameters;		// The copy was made after the redirections, so restoreShell() frees it
+	positionalCount = call->savedCount;
+
+	restoreShell(&call->redirected);
+}
+
+
+
+/*
+ * NAME
+ *   unwinding - whether break, continue, return, exit or ^C means the current list has to stop
+ * SYNOPSIS
+ *   unwinding()
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+static inline bool unwinding() {
+
+	return userTypedExit || lineInterrupted || loopExits > 0 || functionReturning;
+}
+
+
+
+/*
+ * NAME
+ *   leaveLoop - whether a loop stops after its condition or body ran
+ * SYNOPSIS
+ *   leaveLoop()
+ * DESCRIPTION
+ *   Takes the loop off whatever break or continue is unwinding, and returns false for the loop a continue goes around again.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool leaveLoop() {
+
+	if(loopExits > 0) {
+
+		loopExits--;
+
+		if(loopExits == 0 && loopContinues) {
+			loopContinues = false;
+			return false;
+		}
+
+		return true;
+	}
+
+	return unwinding();
+}
+
+
+
+/*
+ * NAME
+ *   runNode - run a list of commands straight from a syntax tree
+ * SYNOPSIS
+ *   runNode(struct syntaxTree* tree, int node)
+ * DESCRIPTION
+ *   Runs node and everything after it in its list, stopping early if unwinding() says so. A simple command has its words
+ *   filled in by expandWords() and runs as a function call if the first word names one, otherwise through runSimpleCommand(),
+ *   using the same built in lookup and launch path as ever. && and || look at the exit value of their left side, if, while and
+ *   until at the exit value of their condition list, and for sets its variable to each word in turn, expanded once before the
+ *   first time around. Redirections on a compound command are applied to the shell while it runs. Loops and calls go back into
+ *   this function for their lists, and loop bodies run from the same nodes every time. Returns the exit value of the last
+ *   command that ran, which for a function is what return gave it.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+int runNode(struct syntaxTree* tree, int node) {
+
+	int exitValue = 0;
+
+	while(node != -1 && !unwinding()) {
+
+		struct syntaxNode* current = &tree->nodes[node];		// Nodes never move once the tree is parsed
+
+		if(current->kind == NODE_COMMAND) {
+
+			int wordCount = expandWords(tree, current->firstToken, current->tokenCount);
+			struct shellFunction* function = (wordCount > 0 && !commandWords.isOperator[0]) ? findFunction(commandWords.items[0]) : NULL;
+
+			if(wordCount == 0) {		// Every word expanded to nothing
+				exitValue = 0;
+			}
+
+			else if(wordCount < 0) {		// A syntax error, already reported
+				exitValue = 2;
+				recordExitValue(exitValue);
+			}
+
+			else if(function != NULL) {
+
+				struct functionCall call;
+				int body = function->body;
+
+				exitValue = 1;
+
+				if(startFunctionCall(function, wordCount, &call)) {
+
+					exitValue = runNode(call.tree, body);
+
+					if(functionReturning) {
+						functionReturning = false;
+						exitValue = functionReturnValue;
+					}
+
+					finishFunctionCall(&call);
+				}
+
+				recordExitValue(exitValue);
+			}
+
+			else {
+				exitValue = runSimpleCommand(commandWords.items, commandWords.isOperator, wordCount);
+			}
+		}
+
+		else if(current->kind == NODE_AND || current->kind == NODE_OR) {
+
+			exitValue = runNode(tree, current->child[0]);
+
+			if(!unwinding() && (exitValue == 0) == (current->kind == NODE_AND)) {
+				exitValue = runNode(tree, current->child[1]);
+			}
+		}
+
+		else if(current->kind == NODE_NOT) {
+			exitValue = (runNode(tree, current->child[0]) == 0) ? 1 : 0;
+		}
+
+		else if(current->kind == NODE_IF) {
+
+			int conditionValue = runNode(tree, current->child[0]);
+
+			exitValue = 0;		// When no branch runs
+
+			if(!unwinding() && conditionValue == 0) {
+				exitValue = runNode(tree, current->child[1]);
+			}
+
+			else if(!unwinding() && current->child[2] != -1) {
+				exitValue = runNode(tree, current->child[2]);
+			}
+		}
+
+		else if(current->kind == NODE_WHILE || current->kind == NODE_UNTIL) {
+
+			exitValue = 0;
+			loopDepth++;
+
+			while(1) {
+
+				int conditionValue = runNode(tree, current->child[0]);
+
+				if(leaveLoop() || (conditionValue == 0) != (current->kind == NODE_WHILE)) {
+					break;
+				}
+
+				exitValue = runNode(tree, current->child[1]);
+
+				if(leaveLoop()) {
+					break;
+				}
+			}
+
+			loopDepth--;
+		}
+
+		else if(current->kind == NODE_FOR) {
+
+			char** values = NULL;
+			int valueCount = positionalCount;
+			struct lineMark mark = lineArenaMark();
+
+			if(current->tokenCount == -1) {
+				values = copyWords(positionalParameters, positionalCount, true);
+			}
+
+			else if((valueCount = expandWords(tree, current->child[0], current->tokenCount)) >= 0) {
+				values = copyWords(commandWords.items, valueCount, true);		// The body reuses commandWords
+			}
+
+			exitValue = (values == NULL) ? 1 : 0;
+			loopDepth++;
+
+			for(int index = 0; index < valueCount && values != NULL; index++) {
+
+				setVariable(tree->words[current->firstToken], values[index], false);
+				exitValue = runNode(tree, current->child[1]);
+
+				if(leaveLoop()) {
+					break;
+				}
+			}
+
+			loopDepth--;
+			lineArenaRelease(mark);
+		}
+
+		else if(current->kind == NODE_GROUP) {
+			exitValue = runNode(tree, current->child[0]);
+		}
+
+		else if(current->kind == NODE_REDIRECT) {
+
+			int wordCount = expandWords(tree, current->firstToken, current->tokenCount);
+			struct shellRedirections redirected;
+
+			exitValue = 1;
+
+			if(wordCount > 0 && redirectShell(wordCount, &redirected)) {
+				exitValue = runNode(tree, current->child[0]);
+				restoreShell(&redirected);
+			}
+		}
+
+		else if(current->kind == NODE_FUNCTION) {
+
+			char name[current->tokenCount + 1];		// The token may still have the () on the end
+
+			memcpy(name, tree->words[current->firstToken], current->tokenCount);
+			name[current->tokenCount] = '\0';
+
+			defineFunction(name, tree, current->child[0]);
+			exitValue = 0;
+		}
+
+		if(current->kind == NODE_NOT || current->kind == NODE_IF || current->kind == NODE_WHILE || current->kind == NODE_UNTIL ||
+				current->kind == NODE_FOR) {
+			recordExitValue(exitValue);		// What $? is after the whole compound command
+		}
+
+		node = current->next;
+	}
+
+	return exitValue;
+}
+
+
+
+/*
+ * NAME
+ *   runCommandLine - run one line of user input
+ * SYNOPSIS
+ *   runCommandLine(char* userInputFixed)
+ * DESCRIPTION
+ *   The string is sent to lexCommandLine() which splits it into tokens, and the heredoc bodies that follow it are read. If
+ *   parseTree() finds the command isn't finished, like an if without its fi or a line ending in &&, the next line is read (with
+ *   a "> " prompt at a terminal) and added to the same tokens until it is. Blank and comment lines run nothing. The tree is then
+ *   run by runNode(), the line arena is released back to where it was, and whatever break, continue or ^C left unfinished is
+ *   cleared for the next line. A syntax error anywhere along the way leaves 2 as the exit value, like in other shells.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void runCommandLine(char* userInputFixed) {
+
+	unsigned long long lexStart = traceClock();
+
+	int tokenCount = lexCommandLine(userInputFixed, &commandArguments, &lexerArena, false);	// Tokenize in one pass
+
+	traceEvent("lex", lexStart);
+
+	if(tokenCount < 0) {		// A syntax error that's already been reported
+		recordExitValue(2);
+		return;
+	}
+
+	if(tokenCount == 0) {		// Blank line or comment line
+		return;
+	}
+
+	unsigned long long parseStart = traceClock();
+
+	lineTree.bodyCount = 0;
+	lineTree.bodyText.used = 0;
+	lineTree.retainedCopy = NULL;
+	loadLineTree();
+
+	int rootNode = -1;
+	int parseStatus;
+	int firstNewToken = 0;
+
+	while(1) {
+
+		if(!readHeredocBodies(&lineTree, firstNewToken)) {		// Bodies come next in the input, after the line they're on
+			recordExitValue(2);
+			return;
+		}
+
+		parseStatus = parseTree(&lineTree, &rootNode);
+
+		if(parseStatus != PARSE_INCOMPLETE) {
+			break;
+		}
+
+		char* line;
+		int lineStatus;
+
+		if(interactiveMode) {
+			showPrompt("> ");
+		}
+
+		while((lineStatus = readInputLine(shellInput, &line)) == -1) {
+			// Interrupted, try again
+		}
+
+		if(lineStatus == 0) {
+			printf("syntax error: unexpected end of input\n");
+			fflush(stdout);
+			recordExitValue(2);
+			return;
+		}
+
+		firstNewToken = (int)commandArguments.count;
+
+		if(lexCommandLine(line, &commandArguments, &lexerArena, true) < 0) {
+			recordExitValue(2);
+			return;
+		}
+
+		loadLineTree();
+	}
+
+	traceEvent("parse", parseStart);
+
+	if(parseStatus == PARSE_ERROR) {		// Already reported
+		recordExitValue(2);
+		return;
+	}
+
+	struct lineMark lineStart = lineArenaMark();
+
+	runNode(&lineTree, rootNode);
+	closeHeredocBodies(&lineTree);		// Functions the line defined have copies of their own
+
+	lineArenaRelease(lineStart);		// Everything the line allocated, in one step
+	traceLineArena();
+	forgetDirectoryListings();
+
+	loopExits = 0;
+	loopContinues = false;
+	lineInterrupted = false;
+}
+
+
+
+// Command substitution
+//
+// $(command) and `command` are replaced by what the command prints, less its trailing newlines. When the command is nothing
+// but one of the utility built ins, like echo, printf or pwd, it runs right here: its stdout is pointed at a memfd for as long as
+// it runs and the memfd is read back, so there's no fork at all. Anything else runs in a copy of the shell, forked with a pipe
+// as its stdout and reading the line like any other, while the shell reads everything it prints straight into the expansion
+// arena. Either way the output is copied once, from the kernel into the arena, and an unquoted substitution is split into words
+// right there. $? is the command's exit value afterwards.
+
+struct argumentVector substitutionArguments = {NULL, NULL, NULL, NULL, 0, 0};	// A command that might run in the shell
+struct tokenArena substitutionArena = {NULL, 0, 0};		// Its tokens
+struct tokenArena substitutionText = {NULL, 0, 0};		// Its words once their $ expansions are filled in
+int substitutionCaptureFD = -1;					// memfd a built in prints to, kept for the next one
+
+
+
+/*
+ * NAME
+ *   substituteBuiltin - run a command substitution that's a single built in inside the shell
+ * SYNOPSIS
+ *   substituteBuiltin(char* command, struct tokenArena* output)
+ * DESCRIPTION
+ *   Only takes a command that's one utility built in with plain words, the same ones a pipeline would run as programs, and no
+ *   function by the same name. Operators, wildcards and nested commands all go to a copy of the shell instead. The words are
+ *   lexed and expanded into this section's own buffers, since commandWords and the expansion arena are still being filled.
+ *   Returns false without running anything if the command doesn't qualify.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+bool substituteBuiltin(char* command, struct tokenArena* output) {
+
+	int tokenCount = lexCommandLine(command, &substitutionArguments, &substitutionArena, false);
+
+	if(tokenCount <= 0 || (substitutionArguments.wordFlags[0] & WORD_EXPANDS)) {
+		return false;
+	}
+
+	for(int index = 0; index < tokenCount; index++) {
+
+		if(substitutionArguments.isOperator[index] || (substitutionArguments.wordFlags[index] & (WORD_GLOB | WORD_SUBSTITUTES))) {
+			return false;
+		}
+	}
+
+	char** words = substitutionArguments.items;
+	struct builtinCommand* builtin = findBuiltin(words[0]);
+
+	if(builtin == NULL || !builtin->utility || findFunction(words[0]) != NULL) {
+		return false;
+	}
+
+	if(substitutionCaptureFD == -1) {
+		substitutionCaptureFD = memfd_create("smallsh-substitution", MFD_CLOEXEC);
+	}
+
+	else {
+		ftruncate(substitutionCaptureFD, 0);
+		lseek(substitutionCaptureFD, 0, SEEK_SET);
+	}
+
+	fflush(stdout);		// Anything already buffered belongs to the real stdout
+
+	int savedStdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+
+	if(substitutionCaptureFD == -1 || savedStdout == -1) {
+
+		if(savedStdout != -1) {
+			close(savedStdout);
+		}
+
+		return false;
+	}
+
+	int wordCount = 0;
+
+	substitutionText.used = 0;
+
+	for(int index = 0; index < tokenCount; index++) {
+
+		size_t start = substitutionText.used;
+
+		if(!(substitutionArguments.wordFlags[index] & WORD_EXPANDS)) {
+			words[wordCount++] = words[index];
+			continue;
+		}
+
+		expandText(words[index], &substitutionText);
+
+		if(substitutionText.used == start && !(substitutionArguments.wordFlags[index] & WORD_QUOTED)) {
+			continue;
+		}
+
+		arenaPut(&substitutionText, '\0');
+		words[wordCount] = NULL;		// Pointed into the text below, once it has stopped moving
+		substitutionArguments.offsets[wordCount++] = start;
+	}
+
+	for(int index = 0; index < wordCount; index++) {
+
+		if(words[index] == NULL) {
+			words[index] = substitutionText.text + substitutionArguments.offsets[index];
+		}
+	}
 
+	words[wordCount] = NULL;
 
-// Global variables were needed so the SIGTSTP signal handler could properly check for exit status of the previous foreground command
+	countMetric(METRIC_BUILTINS, 1);
+	dup2(substitutionCaptureFD, STDOUT_FILENO);
 
-bool turnOffBackground = false;		// Global variable will be used by SIGTSTP handler to turn background mode on/off
-pid_t currentForegroundPID;		// Used by SIGTSTP handler to make sure shell waits for currently running foreground process to finish
-int foreChildExitMethod = -5;
+	int exitValue = builtin->run(words);
+
+	fflush(stdout);
+	dup2(savedStdout, STDOUT_FILENO);
+	close(savedStdout);
+	recordExitValue(exitValue);
+
+	off_t size = lseek(substitutionCaptureFD, 0, SEEK_CUR);
+
+	arenaReserve(output, size);
+
+	for(off_t offset = 0; offset < size; ) {
+
+		ssize_t bytesRead = pread(substitutionCaptureFD, output->text + output->used, size - offset, offset);
+
+		if(bytesRead <= 0) {
+			break;
+		}
+
+		output->used += bytesRead;
+		offset += bytesRead;
+	}
+
+	return true;
+}
 
 
-// SIGTSTP signal handler
 
 /*
  * NAME
- *   catchSIGTSTP - a signal handler for SIGTSTP
+ *   enterSubstitutionShell - turn a forked copy of the shell into one that runs a command substitution
  * SYNOPSIS
- *   catchSIGTSTP(int signo) assigned to SIGTSTP via sigaction()
+ *   enterSubstitutionShell()
  * DESCRIPTION
- *   A signal handler used when the parent process receives a SIGTSTP signal. It controls whether background commands are acknowledged.
- *   The first time it is called, background command functionality is turned off and everything is treated as a foreground command.
- *   When another SIGTSTP is sent, background command functionality is turned on again. The appropriate text messages are displayed to
- *   the user as well.
+ *   The jobs in the table belong to the shell, not to this process, so they're forgotten without touching the metrics the shell
+ *   still keeps for them, and whatever they had queued is dropped. Commands are started here rather than by the zygote, and
+ *   output of background jobs gets a poller of its own, since the shell's is shared with it. There's no job control, like any
+ *   other shell's subshell.
  * AUTHOR
  *   Written by Michael Childress
 */
 
+void enterSubstitutionShell() {
 
-void catchSIGTSTP(int signo) {
+	for(int slot = 0; slot < jobTableCapacity; slot++) {
 
-	waitpid(currentForegroundPID, &foreChildExitMethod, 0);
+		if(jobTable[slot].inUse && jobTable[slot].leaderSlot == slot) {
+			jobTable[slot].countedBackground = false;
+			jobTable[slot].remoteHost = -1;
+			forgetJob(slot);
+		}
+	}
 
-	if(turnOffBackground) {		// If background is currently turned off, turn it on again
+	doneCount = 0;
+	heldZygoteEventCount = 0;
+	metricsServerPID = 0;		// The shell's to stop, not ours
 
-		turnOffBackground = false;
-		char* message = "\nExiting foreground-only mode\n";
-		write(STDOUT_FILENO, message, 30);
+	if(zygoteFD != -1) {
+		close(zygoteFD);
+		zygoteFD = -1;
 	}
 
-	else {		// Background is currently on, so turn it off
+	if(jobOutputEpollFD != -1) {
+		close(jobOutputEpollFD);
+		jobOutputEpollFD = -1;
+	}
 
-		turnOffBackground = true;
-		char* message = "\nEntering foreground-only mode (& is now ignored)\n";
-		write(STDOUT_FILENO, message, 50);
+	if(cacheTeeFD != -1) {		// A stopped cached command's output is still the parent's to copy
+		closeCacheTee();
 	}
 
+	jobControl = false;
+	interactiveMode = false;
 }
 
 
 
 /*
  * NAME
- *   tryToRunCommand - attempts to run user entered command using execvp()
+ *   forkSubstitution - run a command substitution in a copy of the shell
  * SYNOPSIS
- *   tryToRunCommand(char** argumentArray, bool isBackground)
+ *   forkSubstitution(char* command, struct tokenArena* output)
  * DESCRIPTION
- *   This function is called by the child process immediately after it's created to try and run execvp() on the user entered command.
- *   If the command is a background one, the trailing & is removed. The function then checks for any necessary I/O redirection, and
- *   makes these changes accordingly. execvp() is called and if this fails, the function prints an error message and returns -1.
+ *   The child runs the command as a line of its own and exits with its exit value. The shell reads the pipe into output as
+ *   the child writes it, growing the arena ahead of each read so nothing is staged anywhere else, then waits for the child.
  * AUTHOR
  *   Written by Michael Childress
 */
 
-// This gets called by the child process immediately after it's created to try and run exec()
+void forkSubstitution(char* command, struct tokenArena* output) {
 
-int tryToRunCommand(char** argumentArray, bool isBackground) {
+	int pipeFDs[2];
 
+	if(pipe2(pipeFDs, O_CLOEXEC) == -1) {
+		printf("command substitution: cannot make a pipe\n");
+		fflush(stdout);
+		recordExitValue(1);
+		return;
+	}
 
-	int execvpStatus;
-	int lastIndex;
+	fflush(stdout);		// Or the child would print it again
 
-	int inputFD;
-	int outputFD;
-	int dup2Result;
+	pid_t childPID = fork();
 
-	bool inputRedirected = false;		// These bools make sure that background processes get sent to /dev/null if not redirected
-	bool outputRedirected = false;
+	if(childPID == -1) {
+		countMetric(METRIC_FORK_FAILURES, 1);
+		close(pipeFDs[0]);
+		close(pipeFDs[1]);
+		printf("command substitution: cannot fork\n");
+		fflush(stdout);
+		recordExitValue(1);
+		return;
+	}
 
-	int devNullIn;		// File descriptor for /dev/null if we have to open that for a background process
-	int devNullOut;
+	if(childPID == 0) {
 
-	// Check for any I/O redirection in the argument array
-	
-	// Find last array position
-	
-	for(int index = 0; index < 512; index++) {
+		dup2(pipeFDs[1], STDOUT_FILENO);
+		close(pipeFDs[0]);
+		close(pipeFDs[1]);
 
-		if(argumentArray[index] != NULL) {
-			lastIndex = index;
-		}
+		enterSubstitutionShell();
+		runCommandLine(command);		// command is in the line arena, which runCommandLine() only uses past its own mark
 
+		fflush(stdout);
+		_exit(lastExitValue());		// Nothing of the shell's, like its job log buffer, gets flushed a second time
 	}
 
+	close(pipeFDs[1]);
+	countMetric(METRIC_EXTERNALS, 1);
 
-	if(isBackground) {	// Remove the & and send lastIndex back one position because & no longer present
+	while(1) {
 
-		argumentArray[lastIndex] = NULL;
-		lastIndex = lastIndex - 1;
-	}
+		arenaReserve(output, 65536);
 
-	// Check for redirection in the last two arguments of the array
-	
-	if(lastIndex >= 1) {
+		ssize_t bytesRead = read(pipeFDs[0], output->text + output->used, output->capacity - output->used);
 
-		if(strcmp(argumentArray[lastIndex - 1], "<\0") == 0) {		// Last arguments are input redirection
+		if(bytesRead > 0) {
+			output->used += bytesRead;
+		}
 
-			inputFD = open(argumentArray[lastIndex], O_RDONLY);
-			if(inputFD == -1) {printf("cannot open %s for input\n", argumentArray[lastIndex]); fflush(stdout); return -1;}
-			dup2(inputFD, 0);					// Redirect stdin to this file to read from
-			argumentArray[lastIndex] = NULL;
-			argumentArray[lastIndex - 1] = NULL;			// < and fileName are not included in execvp call
-			
-			inputRedirected = true;
+		else if(bytesRead == 0 || errno != EINTR) {
+			break;
 		}
+	}
 
+	close(pipeFDs[0]);
 
-		else if(strcmp(argumentArray[lastIndex - 1], ">\0") == 0) {	// Last arguments are output redirection
+	int childExitMethod = 0;
 
-			outputFD = open(argumentArray[lastIndex], O_WRONLY | O_CREAT | O_TRUNC, 0777);
-			if(outputFD == -1) {printf("cannot open %s for output\n", argumentArray[lastIndex]); fflush(stdout); return -1;}
-			dup2(outputFD, 1);					// Redirect stdout to this file to write to
-			argumentArray[lastIndex] = NULL;
-			argumentArray[lastIndex - 1] = NULL;
+	while(waitpid(childPID, &childExitMethod, 0) == -1 && errno == EINTR) {
+		// reapChildren() only uses WNOHANG, so nothing else takes this child
+	}
 
-			outputRedirected = true;
-		}
+	recordExitValue(WIFSIGNALED(childExitMethod) ? 128 + WTERMSIG(childExitMethod) : WEXITSTATUS(childExitMethod));
+}
 
-	}
 
-	if(lastIndex >= 3) {
 
-		if(strcmp(argumentArray[lastIndex - 3], "<\0") == 0) {		// Second to last arguments are input redirection
+/*
+ * NAME
+ *   substituteCommand - append what a command prints to an arena
+ * SYNOPSIS
+ *   substituteCommand(char* command, struct tokenArena* output)
+ * DESCRIPTION
+ *   What commandSubstituter points at, for expandText(). Runs the command with substituteBuiltin() if it can and
+ *   forkSubstitution() otherwise, then takes the trailing newlines off the output and any '\0' out of it, since a word can't
+ *   hold one. The time it took goes to the trace.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
+
+void substituteCommand(char* command, struct tokenArena* output) {
+
+	unsigned long long substitutionStart = traceClock();
+	size_t start = output->used;
 
-			inputFD = open(argumentArray[lastIndex - 2], O_RDONLY);
-			if(inputFD == -1) {printf("cannot open %s for input\n", argumentArray[lastIndex - 2]); fflush(stdout); return -1;}
-			dup2(inputFD, 0);
-			argumentArray[lastIndex - 2] = NULL;
-			argumentArray[lastIndex - 3] = NULL;
+	if(!substituteBuiltin(command, output)) {
+		forkSubstitution(command, output);
+	}
 
-			inputRedirected = true;
-		}
+	char* nullByte = memchr(output->text + start, '\0', output->used - start);
 
-	
-		else if(strcmp(argumentArray[lastIndex - 3], ">\0") == 0) {	// Second to last arguments are output redirection
+	if(nullByte != NULL) {
+
+		size_t used = nullByte - output->text;
 
-			outputFD = open(argumentArray[lastIndex - 2], O_WRONLY | O_CREAT | O_TRUNC, 0777);
-			if(outputFD == -1) {printf("cannot open %s for output\n", argumentArray[lastIndex - 2]); fflush(stdout); return -1;}
-			dup2(outputFD, 1);
-			argumentArray[lastIndex - 2] = NULL;
-			argumentArray[lastIndex - 3] = NULL;
+		for(size_t offset = used; offset < output->used; offset++) {
 
-			outputRedirected = true;
+			if(output->text[offset] != '\0') {
+				output->text[used++] = output->text[offset];
+			}
 		}
 
+		output->used = used;
 	}
 
-	
-	// Make sure background process does not point to terminal if not redirected by user
-	
-	if(isBackground && !inputRedirected) {		// Get stdin from /dev/null so command isn't waiting on terminal input
+	while(output->used > start && output->text[output->used - 1] == '\n') {
+		output->used--;
+	}
 
-		devNullIn = open("/dev/null", O_RDONLY);
-		if(devNullIn == -1) {printf("cannot open /dev/null for input\n"); fflush(stdout); return -1;}
-		dup2(devNullIn, 0);
+	traceEvent("substitute", substitutionStart);
+}
 
-	}
 
-	if(isBackground && !outputRedirected) {		// Send stdout to /dev/null so it doesn't appear on the terminal
 
-		devNullOut = open("/dev/null", O_WRONLY);
-		if(devNullOut == -1) {printf("cannot open /dev/null for output\n"); fflush(stdout); return -1;}
-		dup2(devNullOut, 1);
-	}
+// Metrics export
+//
+// SMALLSH_METRICS=file writes the metrics in Prometheus' text format to file when the shell exits, and after a command line
+// whenever the last write is at least a second old, through a temporary file and rename() so a collector never reads half of
+// it. SMALLSH_METRICS=unix:path serves them on a Unix socket instead, the current text to every connection. The socket is
+// served by a small process forked at startup that only reads the shared block, so a scrape never waits on a command the shell
+// is running, and it's killed as soon as the shell is gone.
 
+#define METRICS_TEXT_SIZE 8192		// Room for every series with some to spare
+#define METRICS_FILE_INTERVAL 1		// Seconds between writes of the metrics file
 
-	execvpStatus = execvp(argumentArray[0], argumentArray);	
+char* metricsFilePath = NULL;
+char* metricsSocketPath = NULL;
+time_t metricsWrittenAt = 0;
 
-	// If this line gets reached, then the exec process failed
-	
-	printf("%s: no such file or directory\n", argumentArray[0]);
-	fflush(stdout);
-	return -1;
+struct metricSeries {
+	char* family;			// Starts a family with HELP and TYPE lines, NULL for another series of the family above
+	char* type;
+	char* help;
+	char* labels;			// NULL ends the list
+	int metric;
+};
 
-}
+struct metricSeries metricSeries[] = {
+	{"smallsh_command_lines_total", "counter", "Command lines the shell has run.", "", METRIC_COMMAND_LINES},
+	{"smallsh_commands_total", "counter", "Commands run by the shell itself, and processes launched for the others.",
+			"{kind=\"builtin\"}", METRIC_BUILTINS},
+	{NULL, NULL, NULL, "{kind=\"external\"}", METRIC_EXTERNALS},
+	{"smallsh_launch_failures_total", "counter", "Commands that couldn't be started, by the step that failed.", "{reason=\"fork\"}",
+			METRIC_FORK_FAILURES},
+	{NULL, NULL, NULL, "{reason=\"exec\"}", METRIC_EXEC_FAILURES},
+	{"smallsh_path_cache_lookups_total", "counter", "Command path cache lookups, by result.", "{result=\"hit\"}", METRIC_PATH_HITS},
+	{NULL, NULL, NULL, "{result=\"miss\"}", METRIC_PATH_MISSES},
+	{"smallsh_background_jobs", "gauge", "Background jobs running now.", "", METRIC_BACKGROUND_JOBS},
+	{"smallsh_background_jobs_peak", "gauge", "Most background jobs that have been running at once.", "", METRIC_BACKGROUND_PEAK},
+	{NULL, NULL, NULL, NULL, 0}
+};
 
 
 
 /*
  * NAME
- *   dollarsToPID - convert an instance of $$ in a string into the process id of the shell
+ *   formatMetrics - write the metrics out in Prometheus' text format
  * SYNOPSIS
- *   dollarsToPID(char* inputString)
+ *   formatMetrics(char* text, size_t size)
  * DESCRIPTION
- *   This function is called after every user input to make sure any $$ gets changed to the process ID of the shell before the string is
- *   tokenized.
+ *   Reads each counter once with an atomic load. The histogram's buckets are stored separately and added up here, since
+ *   Prometheus buckets count everything at or below their bound. Returns the length of the text.
  * AUTHOR
  *   Written by Michael Childress
 */
 
-// Scans the user input and converts any $$ to the PID of the shell process
-
-char* dollarsToPID(char* inputString) {
-
-	char correctedString[2048];
-	memset(correctedString, '\0', sizeof(correctedString));
-
-	char PIDAsString[50];
-
-	int processID = getpid();
-
-	sprintf(PIDAsString, "%d", processID);
-
-	char* token;
-
-	bool stringNeededCorrecting = false;
+size_t formatMetrics(char* text, size_t size) {
 
+	size_t length = 0;
 
+	for(int index = 0; metricSeries[index].labels != NULL && length < size; index++) {
 
-	for(int position = 0; position < strlen(inputString); position++) {
+		struct metricSeries* series = &metricSeries[index];
+		char* family = series->family;
 
-		if(inputString[position] == '$' && position+1 < strlen(inputString) && inputString[position+1] == '$') {
+		for(int earlier = index; family == NULL; earlier--) {
+			family = metricSeries[earlier - 1].family;
+		}
 
-			token = strtok(inputString, "$");
+		if(series->family != NULL) {
+			length += snprintf(text + length, size - length, "# HELP %s %s\n# TYPE %s %s\n", family, series->help, family,
+					series->type);
+		}
 
-			strcat(correctedString, token);		// Everything up to the $$
+		if(length < size) {
+			length += snprintf(text + length, size - length, "%s%s %llu\n", family, series->labels,
+					__atomic_load_n(&metrics[series->metric], __ATOMIC_RELAXED));
+		}
+	}
 
-			strcat(correctedString, PIDAsString);
+	unsigned long long cumulative = 0;
 
-			token = strtok(NULL, "$");		// Remove second dollar sign
+	if(length < size) {
+		length += snprintf(text + length, size - length, "# HELP smallsh_reap_latency_seconds Time from launching a job to reaping "
+				"its last process.\n# TYPE smallsh_reap_latency_seconds histogram\n");
+	}
 
-		
-			if(token != NULL) {
-				strcat(correctedString, token); // Rest of string
-			}
+	for(int bucket = 0; bucket <= REAP_BUCKET_COUNT && length < size; bucket++) {
 
+		cumulative += __atomic_load_n(&metrics[METRIC_REAP_BUCKETS + bucket], __ATOMIC_RELAXED);
 
-			stringNeededCorrecting = true;		// Make sure to return the corrected string
+		if(bucket < REAP_BUCKET_COUNT) {
+			length += snprintf(text + length, size - length, "smallsh_reap_latency_seconds_bucket{le=\"%g\"} %llu\n",
+					reapBucketBounds[bucket] / 1e9, cumulative);
 		}
 
+		else {
+			length += snprintf(text + length, size - length, "smallsh_reap_latency_seconds_bucket{le=\"+Inf\"} %llu\n", cumulative);
+		}
 	}
 
-	
-	if(stringNeededCorrecting) {
-
-		inputString = correctedString;
-		return inputString;
+	if(length < size) {
+		length += snprintf(text + length, size - length, "smallsh_reap_latency_seconds_sum %.9f\nsmallsh_reap_latency_seconds_count %llu\n",
+				__atomic_load_n(&metrics[METRIC_REAP_NANOSECONDS], __ATOMIC_RELAXED) / 1e9,
+				__atomic_load_n(&metrics[METRIC_REAPED], __ATOMIC_RELAXED));
 	}
 
-	else {
-		return inputString;
-	}
+	return (length < size) ? length : size - 1;
 }
 
 
 
 /*
  * NAME
- *   main - the main function of the smallsh program
+ *   writeMetricsFile - replace the metrics file with the current metrics
  * SYNOPSIS
- *   Called immediately when program begins
+ *   writeMetricsFile()
  * DESCRIPTION
- *   Asks for user input in a do while loop that continues until user types exit on the command line. It begins by checking for any
- *   background processes that are ready to be terminated. After user types their input into the command prompt, the string is sent to
- *   dollarsToPID() to change any $$ to the process ID of the shell. The input is then tokenized and put in an argument array.
- *   It checks to see if user asked for a built in command, entered a blank line, or a comment line (beginning with #), and if none of
- *   those are triggered, a child process is forked in either foreground or background mode(if & is last argument), and the child sends 
- *   the argument array to the tryToRunCommand() function to run execvp(). Child processes are cleaned up by the parent when they are 
- *   finished. It then checks to see if the process exited or was killed by a signal and stores this information for later retrieval by 
- *   the status command. Before the program terminates, any remaining children are cleaned up.
+ *   Writes path.tmp and renames it over the file. A file that can't be written is skipped, much like a trace line.
  * AUTHOR
  *   Written by Michael Childress
 */
 
-int main() {
+void writeMetricsFile() {
 
+	char text[METRICS_TEXT_SIZE];
+	char temporaryPath[strlen(metricsFilePath) + 5];
+	size_t length = formatMetrics(text, sizeof(text));
 
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", metricsFilePath);
+	metricsWrittenAt = time(NULL);
 
-	int inputPositionToFill;
-	char* argumentArray[512];		// Will be able to support 1 command + 512 arguments
-	bool userTypedExit = false;
+	int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 
-	int foreGroundProcessResult;		// If value stays 0, then the foreground process worked. If it becomes -1, then it didn't
+	if(fd == -1) {
+		return;
+	}
 
-	char* userInput = NULL;		// User input allows for total command length of 2048 characters
-	char* userInputFixed = NULL;
-	size_t bufferSize = 2048;
+	bool written = (write(fd, text, length) == (ssize_t)length);
 
-	int exitStatusCode;	// Will hold exit status code of terminated foreground child
-	bool noForegroundProcessesRun = true;	// Will get set to false once one foreground process is run. controls the activity of status command
-	int termSignal;		// Will hold signal number that terminated foreground child
+	close(fd);
 
-	char* token;
+	if(!written || rename(temporaryPath, metricsFilePath) == -1) {
+		unlink(temporaryPath);
+	}
+}
 
-	char* filePathToken;
 
-	char* HOME = "HOME";	// To change the current working directory to HOME
 
-	char filePath[2048];	// This will be used to check if the first character entered in cd command is a / which would mean absolute filepath
-	char pathToOpen[2048];	// Will contain the complete file path to send to chdir()
+/*
+ * NAME
+ *   serveMetrics - the metrics server's main loop
+ * SYNOPSIS
+ *   serveMetrics(int listenFD)
+ * DESCRIPTION
+ *   Answers each connection with the current text and closes it. Never returns, the server is killed and reaped when the shell
+ *   exits, or killed by the kernel if the shell dies first.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
 
-	pid_t childPid = -5;		// Process ID of any spawned child process
-	int childExitMethod = -5;	// Will contain details about what terminated the child
+void serveMetrics(int listenFD) {
 
-	memset(filePath, '\0', sizeof(filePath));	// make sure we have a clean string
-	memset(pathToOpen, '\0', sizeof(pathToOpen));
+	char text[METRICS_TEXT_SIZE];
 
-	char firstArgument[2048];	// This will be used to scan the first user argument's first character to make sure it isn't #
-	memset(firstArgument, '\0', sizeof(firstArgument));
+	while(1) {
 
-	int lastIndex;		// Used to check for the presence of & in entered command
+		int connectionFD = accept4(listenFD, NULL, NULL, SOCK_CLOEXEC);
 
+		if(connectionFD == -1) {
+			continue;		// EINTR, or a client that went away before it was accepted
+		}
 
-	int backgroundChildExitMethod = -5;
-	pid_t backgroundPIDs[200];	// This will store PIDs of background processes that are waiting to finish
+		size_t length = formatMetrics(text, sizeof(text));
 
-	for(int nullIndex = 0; nullIndex < 200; nullIndex++) {
+		send(connectionFD, text, length, MSG_NOSIGNAL);		// A client that hung up early just misses this one
 
-		backgroundPIDs[nullIndex] = -5;		// Stuff a bogus value in each position of the PID array
+		close(connectionFD);
 	}
+}
 
-	int nextOpenPosition = 0;	// Will increment as we add processes to the array. Once 199 is reached it will loop back to 0
-	pid_t backgroundChildPID = -5;
-
-	pid_t dummyPID = -5;	// Used to check if a background process has actually completed after each loop
-
-	int backgroundExitStatusCode;
-	int backgroundTermSignal;
-
-	int numCharsEntered = -5;	// Tracks how many characters getline receives (prevents issues with signal interruption)
 
 
-	// Prepare the parent process to ignore SIGINT
-	
-	struct sigaction SIGINT_action = {0};
-	SIGINT_action.sa_handler = SIG_IGN;
-	sigaction(SIGINT, &SIGINT_action, NULL);
+/*
+ * NAME
+ *   startMetrics - turn metrics on for SMALLSH_METRICS
+ * SYNOPSIS
+ *   startMetrics(char* setting)
+ * DESCRIPTION
+ *   Maps the shared block, then either remembers the file to write or binds the socket and forks the server for it. Called from
+ *   main() before the zygote or any command is started, so every child shares the block. If the socket can't be set up the
+ *   metrics are still counted, only nothing reads them.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
 
-	bool killedByExit = false;		// These bools are used by the signal command to know whether to print the exit status or signal number
-	bool killedBySignal = false;
+void startMetrics(char* setting) {
 
+	metrics = mmap(NULL, METRIC_SLOTS * sizeof(unsigned long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-	struct sigaction SIGTSTP_action = {0};
-	SIGTSTP_action.sa_handler = catchSIGTSTP;
-	sigfillset(&SIGTSTP_action.sa_mask);
-	SIGTSTP_action.sa_flags = 0;
-	sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+	if(metrics == MAP_FAILED) {
+		printf("cannot set up metrics\n");
+		fflush(stdout);
+		metrics = NULL;
+		return;
+	}
 
+	if(strncmp(setting, "unix:", 5) != 0) {
+		metricsFilePath = strdup(setting);
+		return;
+	}
 
-	do {
+	struct sockaddr_un address = {0};
+	int listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-		for(int index=0; index < 512; index++) {
+	address.sun_family = AF_UNIX;
 
-			argumentArray[index] = NULL;		// Reset the argument array before each command is entered
+	if(listenFD == -1 || strlen(setting + 5) >= sizeof(address.sun_path)) {
+		printf("cannot serve metrics on %s\n", setting + 5);
+		fflush(stdout);
 
+		if(listenFD != -1) {
+			close(listenFD);
 		}
 
+		return;
+	}
 
-		// Check for any background children ready to be cleaned up
-		for(int reaperIndex = 0; reaperIndex < 200; reaperIndex++) {
-
-			if(backgroundPIDs[reaperIndex] != -5) {
-				dummyPID = waitpid(backgroundPIDs[reaperIndex], &backgroundChildExitMethod, WNOHANG);
+	strcpy(address.sun_path, setting + 5);
+	unlink(address.sun_path);		// Left behind by a shell that was killed
 
-				if(dummyPID != 0) {		
+	if(bind(listenFD, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listenFD, 16) == -1) {
+		printf("cannot serve metrics on %s\n", address.sun_path);
+		fflush(stdout);
+		close(listenFD);
+		return;
+	}
 
-					if(WIFEXITED(backgroundChildExitMethod) != 0) {
+	pid_t shellPID = getpid();
+	pid_t serverPID = fork();
 
-						backgroundExitStatusCode = WEXITSTATUS(backgroundChildExitMethod);
-						printf("background pid %d is done: exit value %d\n", (int)backgroundPIDs[reaperIndex], backgroundExitStatusCode);
-						fflush(stdout);
-					
-						backgroundPIDs[reaperIndex] = -5;	// No longer an active PID
-					}
+	if(serverPID == 0) {
 
-					if(WIFSIGNALED(backgroundChildExitMethod) != 0) {
-						backgroundTermSignal = WTERMSIG(backgroundChildExitMethod);
-						printf("background pid %d is done: terminated by signal %d\n", (int)backgroundPIDs[reaperIndex], backgroundTermSignal);
-						fflush(stdout);
-						backgroundPIDs[reaperIndex] = -5;
-					}
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
 
-					
-			
-					backgroundChildExitMethod = 0;
-				}
-			}
+		if(getppid() != shellPID) {		// The shell was gone before the line above
+			_exit(0);
 		}
 
-		
-		while(1) {
-
-			printf(": ");		// Display the prompt to the user
-			fflush(stdout);		// Flush the buffer to ensure text is printed
-
-			userInput = NULL;
-			bufferSize = 0;
-
-			numCharsEntered = getline(&userInput, &bufferSize, stdin);	// Get the input from the user
+		close(signalFD);
+		sigprocmask(SIG_SETMASK, &startupSignalMask, NULL);	// So SIGTERM and SIGHUP stop it instead of piling up
+		prctl(PR_SET_NAME, "smallsh-metrics");
+		serveMetrics(listenFD);
+	}
 
-			if(numCharsEntered == -1) {	// If signal interrupted, get ready to ask for input again
-				clearerr(stdin);
-			}
+	close(listenFD);
 
-			else {
-				break;
-			}
-			
-		}
+	if(serverPID == -1) {
+		printf("cannot serve metrics on %s\n", address.sun_path);
+		fflush(stdout);
+		unlink(address.sun_path);
+		return;
+	}
 
-		token = strtok(userInput, "\n");
-		userInputFixed = token;	
+	metricsServerPID = serverPID;
+	metricsSocketPath = strdup(address.sun_path);
+}
 
-		if(userInputFixed == NULL) {			// User typed blank line just start a new loop
-			memset(firstArgument, '\0', sizeof(firstArgument));
-			free(userInput);	// Free dynamic memory used by getline
-			continue;
-		}
 
-		userInputFixed = dollarsToPID(userInputFixed);	// Check for and expand any $$ to the shell PID
-		
 
-		token = strtok(userInputFixed, " ");		// Grab the first word entered on the command line
+/*
+ * NAME
+ *   main - the main function of the smallsh program
+ * SYNOPSIS
+ *   smallsh
+ *   smallsh -c command [name [argument ...]]
+ *   smallsh script [argument ...]
+ * DESCRIPTION
+ *   With no arguments, asks for user input in a loop that continues until user types exit on the command line or input runs
+ *   out. Each time around it begins by reporting any background processes that have finished, then reads a line and hands it
+ *   to runCommandLine(). The ": " prompt is only shown when stdin is a terminal, so piped input and scripts run without a
+ *   prompt or a flush per line. "-c command" runs the given string instead, and a file name runs that file as a script, with
+ *   any arguments after it as $1 and up. Before the program terminates, any remaining children are shut down by
+ *   shutDownJobs(). Scripts and -c return the status of the last foreground command, and a shell told to exit by SIGHUP or
+ *   SIGTERM returns 128 plus the signal.
+ * AUTHOR
+ *   Written by Michael Childress
+*/
 
+int main(int argc, char* argv[]) {
 
-		argumentArray[0] = token;
+	char* userInputFixed = NULL;
+	int lineStatus;		// Tracks whether readInputLine got a line (prevents issues with signal interruption)
 
+	char* commandString = NULL;	// Set when run as smallsh -c command
 
-		inputPositionToFill = 1;	// Index in the argument array starts filling at 1 because we've already read in position 0
-	
-		while(token != NULL) {		// Read in remaining words
+	struct inputReader reader = {0};
+	reader.fd = STDIN_FILENO;
 
-			token = strtok(NULL, " ");
-			if(inputPositionToFill <= 511) {	// User can enter at most 512 arguments
 
-				argumentArray[inputPositionToFill] = token;
+	sigset_t shellSignals;		// Read from the signal descriptor instead of being delivered
+	sigemptyset(&shellSignals);
+	sigaddset(&shellSignals, SIGCHLD);
+	sigaddset(&shellSignals, SIGTSTP);
+	sigaddset(&shellSignals, SIGHUP);
+	sigaddset(&shellSignals, SIGTERM);
 
-				inputPositionToFill++;
-			}
-		}
+	char* pipeSizeSetting = getenv("SMALLSH_PIPESIZE");	// Opt-in larger pipe buffers for high-throughput pipelines
 
+	if(pipeSizeSetting != NULL) {
+		pipeBufferSize = atoi(pipeSizeSetting);
+	}
 
+	char* launcherSetting = getenv("SMALLSH_LAUNCHER");	// Choose the launch backend, "spawn", "zygote" or the default "fork"
 
-		strcpy(firstArgument, argumentArray[0]);	// Later used to check for # at the beginning of the line
+	if(launcherSetting != NULL && strcmp(launcherSetting, "spawn") == 0) {
+		useSpawnLauncher = true;
+	}
 
+	char* jobLogSetting = getenv("SMALLSH_JOB_LOG");	// One log for the output of every background job
 
-		if(strcmp(argumentArray[0], "exit\0") == 0) {	// User typed in exit as their chosen command
+	if(jobLogSetting != NULL && jobLogSetting[0] != '\0') {
 
+		jobLogFD = open(jobLogSetting, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
 
-			userTypedExit = true;		// End the while loop
+		if(jobLogFD == -1) {
+			printf("cannot open %s for the job log\n", jobLogSetting);
+			fflush(stdout);
 		}
 
-		else if(strcmp(argumentArray[0], "cd\0") == 0 && argumentArray[1] == NULL) {	// User typed cd with no argument
-
-			chdir(getenv(HOME));	// Change directory to the HOME directory	
-
+		else {
+			collectOutput = true;
 		}
+	}
 
+	char* traceSetting = getenv("SMALLSH_TRACE");	// A descriptor number to write trace lines to, or a file to append them to
 
-		else if(strcmp(argumentArray[0], "cd\0") == 0 && argumentArray[1] != NULL) {	// User typed cd with one argument
-
+	if(traceSetting != NULL && traceSetting[0] != '\0') {
 
-			strcpy(filePath, argumentArray[1]);
+		char* numberEnd;
+		long traceNumber = strtol(traceSetting, &numberEnd, 10);
 
-			if(filePath[0] == '/') {	// User is supplying an absolute path
+		if(*numberEnd == '\0' && traceNumber >= 0) {
+			traceFD = (int)traceNumber;
+		}
 
-				
-				strcat(pathToOpen, getenv(HOME));			// new filepath = HOME + user input
-				strcat(pathToOpen, filePath);
+		else {
+			traceFD = open(traceSetting, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		}
 
-				filePathToken = strtok(pathToOpen, "\n");	// Need to remove the \n at the end of the string
+		if(traceFD == -1) {
+			printf("cannot open %s for tracing\n", traceSetting);
+			fflush(stdout);
+			traceFD = STDERR_FILENO;
+		}
 
-				chdir(filePathToken);
+		else {
+			traceEnabled = true;
+		}
+	}
 
-			}
 
+	shellPIDLength = snprintf(shellPIDString, sizeof(shellPIDString), "%d", (int)getpid());	// What $$ expands to
 
-			else {		// User supplied a relative path
+	argumentByteLimit = sysconf(_SC_ARG_MAX);
 
-				getcwd(pathToOpen, (size_t)sizeof(pathToOpen));		// new filepath = cwd/userInput
-				strcat(pathToOpen, "/");
-				strcat(pathToOpen, filePath);
+	if(argumentByteLimit <= 0) {
+		argumentByteLimit = 131072;		// POSIX doesn't promise an answer, fall back to the traditional Linux value
+	}
 
-				filePathToken = strtok(pathToOpen, "\n");	// Need to remove the \n at the end of the string
 
-				chdir(filePathToken);				
+	// Work out where commands are coming from
 
-			}
+	if(argc >= 3 && strcmp(argv[1], "-c") == 0) {		// The string is the whole input, already read
 
-			memset(filePath, '\0', sizeof(filePath));
-			memset(pathToOpen, '\0', sizeof(pathToOpen));
+		commandString = argv[2];
+		reader.fd = -1;
+		reader.atEOF = true;
 
+		if(argc >= 4) {		// smallsh -c command name arguments, like sh
+			shellName = argv[3];
+			positionalParameters = copyWords(argv + 4, argc - 4, false);
+			positionalCount = argc - 4;
 		}
+	}
 
-		
+	else if(argc >= 2) {
 
-		else if(strcmp(argumentArray[0], "#\0") == 0 || strcmp(argumentArray[0], "#\n") == 0 || firstArgument[0] == '#') {	// Comment line
-			// Do nothing
-		}
+		shellName = argv[1];
+		positionalParameters = copyWords(argv + 2, argc - 2, false);		// The script's arguments are $1 and up
+		positionalCount = argc - 2;
 
+		reader.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
 
+		if(reader.fd == -1) {
+			printf("cannot open %s for input\n", argv[1]);
+			fflush(stdout);
+			return 1;
+		}
+	}
 
-		else if(strcmp(argumentArray[0], "status\0") == 0) {		// User wants the status command
+	interactiveMode = (commandString == NULL && argc < 2 && isatty(STDIN_FILENO));
 
-			if(noForegroundProcessesRun) {		// If run before a foreground process is run, just return exit status 0
+	shellInput = &reader;		// Heredoc bodies and parallel with no file keep reading from here
 
-				printf("exit value 0\n");
-				fflush(stdout);
-			}
+	importEnvironment();		// Before anything looks a variable up
+	openHistory();		// Just the open(), scripts can search the history but only the prompt adds to it
 
-			else {
-				if(killedByExit) {				// We've had a foreground process complete at least once
+	reader.capacity = (commandString != NULL) ? strlen(commandString) + 1 : READ_CHUNK_SIZE * 2;
+	reader.buffer = malloc(reader.capacity);
 
-					printf("exit value %d\n", exitStatusCode);
-					fflush(stdout);
-				}
+	if(reader.buffer == NULL) {
+		perror("Major problem allocating the input buffer!\n");
+		exit(1);
+	}
 
-				else if(killedBySignal) {
-					printf("terminated by signal %d\n", termSignal);
-					fflush(stdout);
-				}
-			}
-		}
+	if(commandString != NULL) {
+		reader.end = reader.capacity - 1;
+		memcpy(reader.buffer, commandString, reader.end);
+	}
 
-		else {		// We need to create a child process
 
-			// Find last array position
+	// Prepare the parent process to ignore SIGINT
 	
-			for(int index = 0; index < 512; index++) {
-
-				if(argumentArray[index] != NULL) {
-					lastIndex = index;
-				}
-
-			}
-
-
-			if(turnOffBackground) {		// Find and remove the & if background commands are currently not allowed
+	struct sigaction SIGINT_action = {0};
+	SIGINT_action.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &SIGINT_action, NULL);
 
-				if(strcmp(argumentArray[lastIndex], "&\0") == 0) {
-					argumentArray[lastIndex] = NULL;
-					lastIndex = lastIndex - 1;
-				}			
 
-			}
+	// SIGCHLD and SIGTSTP are handled by the event loop, reap children as soon as they finish instead of polling for them
 
-			
-			if(strcmp(argumentArray[lastIndex], "&\0") == 0) {	// Run the command in background mode
+	sigprocmask(SIG_BLOCK, &shellSignals, &startupSignalMask);
+	signalFD = signalfd(-1, &shellSignals, SFD_NONBLOCK | SFD_CLOEXEC);
 
-				backgroundChildPID = fork();	// Will NOT wait for child immediately
-				
-				if(backgroundChildPID == -1) {
-					perror("Major problem creating background child!\n");
-					exit(1);
-				}
+	if(signalFD == -1) {
+		perror("Major problem creating the signal descriptor!\n");
+		exit(1);
+	}
 
-				else if(backgroundChildPID == 0) {	// We are in the child process
+	if(interactiveMode && tcgetpgrp(STDIN_FILENO) == getpgrp()) {		// We own the terminal, so jobs can take turns with it
 
-					SIGTSTP_action.sa_handler = SIG_IGN;	// Background children should ignore SIGTSTP
-					sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-					tryToRunCommand(argumentArray, true);		// Will try to call execvp. True means it's background
-					exit(1);	// Only reached if there was a problem
-				}
+		jobControl = true;
+		shellPGID = getpgrp();
+		tcgetattr(STDIN_FILENO, &shellTerminalModes);
 
-				else {		// We are in the parent process
-					printf("background pid is %d\n", backgroundChildPID);
-					fflush(stdout);
-					backgroundPIDs[nextOpenPosition] = backgroundChildPID;		// Store the child PID for later use
-	
+		struct sigaction ignoreAction = {0};		// Taking the terminal back from a job happens while the shell is in the background
+		ignoreAction.sa_handler = SIG_IGN;
+		sigaction(SIGTTOU, &ignoreAction, NULL);
+		sigaction(SIGTTIN, &ignoreAction, NULL);
+	}
 
-					if(nextOpenPosition == 199) {
-						nextOpenPosition = 0;
-					}
+	stalePathReports = mmap(NULL, sizeof(unsigned long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);	// Before any child
 
-					else {
-						nextOpenPosition++;
+	if(stalePathReports == MAP_FAILED) {		// The cache still works, a moved command just keeps paying for a failed execv()
+		stalePathReports = NULL;
+	}
 
-					}
-				}
+	char* metricsSetting = getenv("SMALLSH_METRICS");	// A file to write metrics to, or unix:path for a socket to serve them on
 
-			}
+	if(metricsSetting != NULL && metricsSetting[0] != '\0') {		// Before the zygote, which has to share the block
+		startMetrics(metricsSetting);
+	}
 
+	if(launcherSetting != NULL && strcmp(launcherSetting, "zygote") == 0) {		// Before the shell has grown, and with its signals
+		startZygote();
+	}
 
-			else {					// Run the command in foreground mode
+	growJobTable();					// Start with a small table so reaping always has somewhere to look
+	indexBuiltins();
+	commandSubstituter = substituteCommand;		// expandText() comes before everything a substitution can run
 
-				childPid = fork();
+	char* terminalType = getenv("TERM");
 
-				if(childPid == -1) {
-					perror("Major problem creating child!\n");
-					exit(1);
-				}	
+	if(jobControl && terminalType != NULL && strcmp(terminalType, "dumb") != 0) {		// Raw mode needs the terminal to ourselves
+		lineEditor = editLine;
+		lineEditing = true;
+	}
 
 
-				else if(childPid == 0) {	// We are in the child process
-	
-					SIGINT_action.sa_handler = SIG_DFL;	// Foreground process must be terminated by SIGINT
-					sigaction(SIGINT, &SIGINT_action, NULL);
+	do {
 
-					SIGTSTP_action.sa_handler = SIG_IGN;	// Foreground children should ignore SIGTSTP
-					sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+		// Report any background children that finished while a foreground job was running
+		reportFinishedJobs();
 
+		
+		while(1) {
 
-					tryToRunCommand(argumentArray, false);		// Will try to call execvp. False means it's foreground
-					exit(1);	// Only reached if there was a problem
-				}
+			if(interactiveMode) {
+				showPrompt(": ");		// Display the prompt to the user
+			}
 
-				else {		// We are in the parent process
+			unsigned long long readStart = traceClock();
 
-					currentForegroundPID = childPid;	// In case SIGTSTP handler need to wait for it
-					waitpid(childPid, &foreChildExitMethod, 0);		// Parent waits here until child is done
-					noForegroundProcessesRun = false;		
+			lineStatus = readInputLine(&reader, &userInputFixed);	// Get the input from the user
 
-	
-					if(WIFSIGNALED(foreChildExitMethod) != 0) {		// A signal killed the child
-						termSignal = WTERMSIG(foreChildExitMethod);
-						printf("terminated by signal %d\n", termSignal);
-						fflush(stdout);
-						killedBySignal = true;
-						killedByExit = false;
-					}
-	
-					if(WIFEXITED(foreChildExitMethod) != 0) {		// Child exited normally
-						exitStatusCode = WEXITSTATUS(foreChildExitMethod);
-						killedBySignal = false;
-						killedByExit = true;
+			traceEvent("read", readStart);
 
-					}
+			if(lineStatus != -1) {	// If signal interrupted, get ready to ask for input again
+				break;
+			}
+			
+		}
 
-				}
+		if(lineStatus == 0) {		// Out of input, same as typing exit
+			break;
+		}
 
-			}
+		if(userInputFixed[0] == '\0') {		// User typed blank line just start a new loop
+			continue;
+		}
 
+		if(interactiveMode) {		// Only what the user typed goes in the history, not scripts
+			addHistory(userInputFixed);
 		}
 
-		
+		runCommandLine(userInputFixed);
 
-		// Make sure to free dynamic memory used by user input each time this point reached
+		if(metrics != NULL) {
 
-		memset(firstArgument, '\0', sizeof(firstArgument));
+			countMetric(METRIC_COMMAND_LINES, 1);
 
-		free(userInput);	// Free dynamic memory used by getline
+			if(metricsFilePath != NULL && time(NULL) - metricsWrittenAt >= METRICS_FILE_INTERVAL) {
+				writeMetricsFile();
+			}
+		}
 	
 	}while(userTypedExit == false);		// Once user types exit our shell should quit
 
@@ -675,18 +14741,38 @@ int main() {
 
 
 
-	// Need to terminate all active child processes
-	
-	for(int reaperIndex = 0; reaperIndex < 200; reaperIndex++) {
+	shutDownJobs();		// Need to terminate all active child processes
+
+	readJobOutput();		// Whatever background jobs have written, up to their last words, still goes in the log
+
+	if(jobLogFD != -1) {
+		flushJobLog();
+	}
 
-		if(backgroundPIDs[reaperIndex] != -5) {
+	if(metricsFilePath != NULL) {		// With the jobs that were just shut down
+		writeMetricsFile();
+	}
+
+	if(metricsServerPID != 0) {		// Don't leave it for init to reap
 
-			kill(backgroundPIDs[reaperIndex], SIGKILL);		// Kill all background processes before exiting
+		kill(metricsServerPID, SIGKILL);
 
+		while(waitpid(metricsServerPID, NULL, 0) == -1 && errno == EINTR) {
+			continue;
 		}
+	}
 
+	if(metricsSocketPath != NULL) {
+		unlink(metricsSocketPath);
 	}
 
+	if(shutdownSignal != 0) {
+		return 128 + shutdownSignal;
+	}
 
-	return 0;
+	if(interactiveMode) {
+		return 0;
+	}
+
+	return lastExitValue();
 }
@@ -0,0 +1,2 @@
+# A line with a syntax error leaves 2 as the exit value, so a script ending on one exits with it
+false; fi